@@ -32,9 +32,11 @@
 #include <fuse.h>
 #include <libgen.h>
 #include <limits.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
@@ -45,6 +47,15 @@
 #include "fp_table.h"
 #include "metafile.h"
 #include "chunk_store.h"
+#include "chunk_cache.h"
+#include "fingerprint.h"
+#include "cdc.h"
+#include "compress.h"
+#include "chunk_pack.h"
+#include "fp_cache.h"
+#include "fp_bloom.h"
+#include "sparse_index.h"
+#include "op_stats.h"
 // -add by yyang.
 
 // Report errors to logfile and give -errno to caller
@@ -74,6 +85,1303 @@ static void bb_fullpath(char fpath[PATH_MAX], const char *path)
 	    BB_DATA->rootdir, path, fpath);
 }
 
+// the chunks a request dedupes.  New chunks are queued to be written with
+// one write_chunks(), one entry per store chunk they take.  With a weak
+// fingerprint the chunks that were found are queued too, they are compared
+// with the store once the new chunks are written.
+struct chunk_batch {
+	unsigned int *new_ids;
+	const char **new_bufs;
+	unsigned int num_new;
+
+	struct meta_data **found_md;
+	const char **found_data;
+	unsigned int *found_len;
+	unsigned int num_found;
+};
+
+// room for num_chunks chunks taking num_ids store chunks in total
+static void batch_init(struct chunk_batch *b, unsigned int num_chunks, unsigned int num_ids)
+{
+	b->new_ids = (unsigned int *)malloc(sizeof(unsigned int) * num_ids);
+	b->new_bufs = (const char **)malloc(sizeof(char *) * num_ids);
+	b->num_new = 0;
+	b->found_md = (struct meta_data **)malloc(sizeof(struct meta_data *) * num_chunks);
+	b->found_data = (const char **)malloc(sizeof(char *) * num_chunks);
+	b->found_len = (unsigned int *)malloc(sizeof(unsigned int) * num_chunks);
+	b->num_found = 0;
+}
+
+static void batch_free(struct chunk_batch *b)
+{
+	free(b->new_ids);
+	free(b->new_bufs);
+	free(b->found_md);
+	free(b->found_data);
+	free(b->found_len);
+}
+
+// dedupe one chunk of data with fingerprint hash: look it up in the
+// fingerprint table and point its meta record at the chunk.  The last
+// store chunk of a new chunk is written whole, so data must be readable up
+// to the next CHUNK_SIZE boundary after len.
+static int dedupe_fp(unsigned int *hash, const char *data, unsigned int len,
+			struct meta_data *md, struct chunk_batch *b)
+{
+	enum search_stat s_ret;
+	fp_record rec;
+	unsigned int i;
+
+	// search the hash table
+	s_ret = search_fp_chunks(hash, chunk_count(len), &rec);
+
+	switch (s_ret) {
+		case REC_FOUND:
+			log_msg("[=Dedup_FS=] [Found] <%08X%08X%08X%08X%08X> : <%u>\n",
+					hash[0], hash[1], hash[2], hash[3], hash[4],
+					rec.chunk_idx);
+
+			if (fp_engine_weak()) {
+				b->found_md[b->num_found] = md;
+				b->found_data[b->num_found] = data;
+				b->found_len[b->num_found] = len;
+				b->num_found += 1;
+			}
+			break;
+		case REC_ADDED:
+			log_msg("[=Dedup_FS=] [Added] <%08X%08X%08X%08X%08X> : <%u>\n",
+					hash[0], hash[1], hash[2], hash[3], hash[4],
+					rec.chunk_idx);
+
+			for (i = 0; i < chunk_count(len); i ++) {
+				b->new_ids[b->num_new] = rec.chunk_idx + i;
+				b->new_bufs[b->num_new] = data + i * CHUNK_SIZE;
+				b->num_new += 1;
+			}
+			break;
+		case REC_ERROR:
+		default:
+			log_error("[=Dedup_FS=] [Error] <%08X%08X%08X%08X%08X>\n",
+					hash[0], hash[1], hash[2], hash[3], hash[4]);
+			return -1;
+	}
+
+	// update the meta data
+	memcpy(md->fp, hash, sizeof(md->fp));
+	md->chunk_id = rec.chunk_idx;
+	return 1;
+}
+
+// point md at no chunk, it keeps its size and reads as zeros
+static void set_hole(struct meta_data *md)
+{
+	memset(md->fp, 0, sizeof(md->fp));
+	md->chunk_id = META_HOLE;
+}
+
+// the same for a chunk that is not hashed yet, a chunk of zeros becomes
+// a hole without going near the index or the store
+static int dedupe_chunk(const char *data, unsigned int len, struct meta_data *md,
+			struct chunk_batch *b)
+{
+	unsigned int hash[FP_WORDS];
+
+	if (is_zero(data, len)) {
+		set_hole(md);
+		return 1;
+	}
+	if (calc_hash((char *)data, len, hash) < 0)
+		return -1;
+	return dedupe_fp(hash, data, len, md, b);
+}
+
+// a weak fingerprint is no proof, compare the chunk that was found with
+// data.  On a collision the chunk is looked up again under a fingerprint
+// derived from the first one, until one holds data or is new.
+#define MAX_FP_PROBES 16
+
+static int verify_chunk(const char *data, unsigned int len, struct meta_data *md)
+{
+	unsigned int num = chunk_count(len);
+	unsigned int fp4 = md->fp[4];
+	unsigned int *ids;
+	char **bufs;
+	char *buf;
+	enum search_stat s_ret;
+	fp_record rec;
+	unsigned int i, probe;
+	int retstat = -1;
+
+	buf = (char *)malloc((size_t)num * CHUNK_SIZE);
+	ids = (unsigned int *)malloc(sizeof(unsigned int) * num);
+	bufs = (char **)malloc(sizeof(char *) * num);
+
+	for (probe = 1; probe <= MAX_FP_PROBES; probe ++) {
+		for (i = 0; i < num; i ++) {
+			ids[i] = md->chunk_id + i;
+			bufs[i] = buf + i * CHUNK_SIZE;
+		}
+		if (read_chunks(ids, bufs, num) < 0)
+			break;
+		if (memcmp(buf, data, len) == 0) {
+			retstat = 1;
+			break;
+		}
+
+		log_warn("[=Dedup_FS=] [Collision] <%08X%08X%08X%08X%08X> : <%u>\n",
+				md->fp[0], md->fp[1], md->fp[2], md->fp[3], md->fp[4],
+				md->chunk_id);
+
+		// the lookup took a reference on a chunk that is not ours
+		release_fp(md->fp, md->chunk_id);
+		md->fp[4] = fp4 ^ (probe * 0x9E3779B9);
+		s_ret = search_fp_chunks(md->fp, num, &rec);
+		if (s_ret == REC_ERROR)
+			break;
+		md->chunk_id = rec.chunk_idx;
+
+		// a new chunk is written right away, nothing of ours is pending
+		// while the next one is read
+		if (s_ret == REC_ADDED) {
+			for (i = 0; i < num; i ++) {
+				ids[i] = rec.chunk_idx + i;
+				bufs[i] = (char *)data + i * CHUNK_SIZE;
+			}
+			retstat = write_chunks(ids, (const char **)bufs, num) < 0 ? -1 : 1;
+			break;
+		}
+	}
+
+	free(buf);
+	free(ids);
+	free(bufs);
+	return retstat;
+}
+
+// drop the reference md holds on its chunk, once md is gone or points
+// at another chunk
+static void release_chunk(struct meta_data *md)
+{
+	if (!meta_is_hole(md) && release_fp(md->fp, md->chunk_id) < 0)
+		log_error("[=Dedup_FS=] [Error] release <%08X%08X%08X%08X%08X>\n",
+				md->fp[0], md->fp[1], md->fp[2], md->fp[3], md->fp[4]);
+}
+
+// open a meta file and attach it to the in-memory records of the file,
+// the records of every open of a file must go through them
+static int open_meta(const char *fpath, int flags)
+{
+	int fd, err;
+
+	fd = open(fpath, flags);
+	if (fd >= 0 && meta_open(fd, fpath) < 0) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+// write the records changed through fd back and close it
+static int close_meta(int fd)
+{
+	int retstat;
+
+	retstat = meta_close(fd);
+	if (close(fd) < 0 || retstat < 0)
+		return -1;
+	return 0;
+}
+
+// release the chunks of the records from index to the end of the meta file
+#define RELEASE_BATCH 1024
+
+static int release_records(int fd, unsigned int index)
+{
+	struct meta_data *md;
+	int num, got, i;
+
+	num = meta_count(fd);
+	if (num < 0)
+		return -EIO;
+
+	md = (struct meta_data *)malloc(sizeof(struct meta_data) * RELEASE_BATCH);
+	for (; (int)index < num; index += got) {
+		got = meta_read_range(index, num - index < RELEASE_BATCH ? num - index : RELEASE_BATCH, fd, md);
+		if (got <= 0)
+			break;
+		for (i = 0; i < got; i ++)
+			release_chunk(&md[i]);
+	}
+	free(md);
+
+	return (int)index < num ? -EIO : 0;
+}
+
+// a file whose chunks go when fpath is unlinked or renamed over, the meta
+// records are read through the fd after the name is gone.  -1 if fpath
+// is not the last link to a regular file
+static int open_last_link(const char *fpath)
+{
+	struct stat st;
+
+	if (lstat(fpath, &st) < 0 || !S_ISREG(st.st_mode) || st.st_nlink != 1)
+		return -1;
+	return open_meta(fpath, O_RDONLY);
+}
+
+// write the new chunks of the batch and check the ones that were found.
+// new chunks are pending until they are written, so the found ones are
+// read only after that
+static int flush_batch(struct chunk_batch *b)
+{
+	unsigned int i;
+	int retstat = 1;
+
+	if (write_chunks(b->new_ids, b->new_bufs, b->num_new) < 0)
+		retstat = -1;
+	b->num_new = 0;
+
+	for (i = 0; i < b->num_found; i ++) {
+		if (verify_chunk(b->found_data[i], b->found_len[i], b->found_md[i]) < 0)
+			retstat = -1;
+	}
+	b->num_found = 0;
+
+	return retstat;
+}
+
+// queue the store chunks of the record md to be read into buf,
+// returns how many there are
+static unsigned int record_chunks(struct meta_data *md, char *buf,
+			unsigned int *ids, char **bufs)
+{
+	unsigned int i, num = chunk_count(md->size);
+
+	for (i = 0; i < num; i ++) {
+		ids[i] = md->chunk_id + i;
+		bufs[i] = buf + i * CHUNK_SIZE;
+	}
+	return num;
+}
+
+// cut the chunk of md down to its first keep bytes.  With fixed chunks
+// the rest is zeroed rather than just hidden by md->size, so growing the
+// file again reads zeros as it should.  md takes a reference on the new
+// chunk, the caller releases the old one once md is written.
+static int truncate_chunk(struct meta_data *md, unsigned int keep)
+{
+	unsigned int num = chunk_count(md->size);
+	struct chunk_batch batch;
+	unsigned int *ids;
+	char **bufs;
+	char *data;
+	int retstat = 0;
+
+	data = (char *)malloc((size_t)num * CHUNK_SIZE);
+	ids = (unsigned int *)malloc(sizeof(unsigned int) * num);
+	bufs = (char **)malloc(sizeof(char *) * num);
+	batch_init(&batch, 1, num);
+
+	record_chunks(md, data, ids, bufs);
+	if (read_chunks(ids, bufs, num) < 0) {
+		retstat = -EIO;
+		goto out;
+	}
+
+	if (BB_DATA->chunking == CHUNK_CDC) {
+		retstat = dedupe_chunk(data, keep, md, &batch);
+	} else {
+		memset(data + keep, 0, CHUNK_SIZE - keep);
+		retstat = dedupe_chunk(data, CHUNK_SIZE, md, &batch);
+	}
+	if (flush_batch(&batch) < 0 && retstat >= 0) {
+		release_chunk(md);
+		retstat = -1;
+	}
+	if (retstat < 0) {
+		retstat = -EIO;
+		goto out;
+	}
+
+	md->size = keep;
+	retstat = 0;
+
+out:
+	free(data);
+	free(ids);
+	free(bufs);
+	batch_free(&batch);
+	return retstat;
+}
+
+// a chunk of the file to store with store_chunks(): the bytes lo .. hi of
+// data are new, the rest is taken from the old chunk unless whole is set
+struct store_req {
+	unsigned int index;
+	unsigned int lo, hi;
+	int whole;
+	char *data;
+};
+
+// store the chunks of the fixed chunking file fd that reqs ask for, in
+// ascending order of index.  The records of each run of chunks are read
+// and written back with one call, the old data of all partial chunks is
+// read before the first lookup and every chunk is hashed once.  Called
+// with the meta lock held exclusively
+static int store_chunks(int fd, struct store_req *reqs, unsigned int num)
+{
+	struct meta_data *md, *old_md;
+	const char **data;
+	unsigned int *lens, *hashes, *old_ids, *hashed;
+	char **old_bufs;
+	char *old;
+	struct chunk_batch batch;
+	struct store_req *r;
+	unsigned int i, run, num_old, num_hash, num_done;
+	int got, retstat = 0;
+
+	if (num == 0)
+		return 0;
+
+	md = (struct meta_data *)malloc(sizeof(struct meta_data) * num);
+	old_md = (struct meta_data *)malloc(sizeof(struct meta_data) * num);
+	data = (const char **)malloc(sizeof(char *) * num);
+	lens = (unsigned int *)malloc(sizeof(unsigned int) * num);
+	hashes = (unsigned int *)malloc(sizeof(unsigned int) * FP_WORDS * num);
+	old_ids = (unsigned int *)malloc(sizeof(unsigned int) * num);
+	old_bufs = (char **)malloc(sizeof(char *) * num);
+	hashed = (unsigned int *)malloc(sizeof(unsigned int) * num);
+	old = alloc_chunk_buf(num);
+	batch_init(&batch, num, num);
+
+	for (i = 0; i < num; i += run) {
+		for (run = 1; i + run < num && reqs[i + run].index == reqs[i].index + run; run ++)
+			;
+		got = meta_read_range(reqs[i].index, run, fd, md + i);
+		if (got < 0) {
+			retstat = -EIO;
+			goto out;
+		}
+		// past the end of the file
+		memset(md + i + got, 0, sizeof(struct meta_data) * (run - got));
+	}
+	// the chunks they point at now are released once md is written
+	memcpy(old_md, md, sizeof(struct meta_data) * num);
+
+	// all reads are done before the first search_fp, a chunk we add
+	// is pending until we write it and must not be waited on by us
+	num_old = 0;
+	for (i = 0; i < num; i ++) {
+		r = &reqs[i];
+		if (r->whole || (r->lo == 0 && r->hi == CHUNK_SIZE) || meta_is_hole(&md[i]))
+			continue;
+		old_ids[num_old] = md[i].chunk_id;
+		old_bufs[num_old] = old + i * CHUNK_SIZE;
+		num_old ++;
+	}
+	if (read_chunks(old_ids, old_bufs, num_old) < 0) {
+		retstat = -EIO;
+		goto out;
+	}
+
+	num_hash = 0;
+	for (i = 0; i < num; i ++) {
+		r = &reqs[i];
+		if (!r->whole) {
+			if (meta_is_hole(&md[i]))
+				memset(old + i * CHUNK_SIZE, 0, CHUNK_SIZE);
+			memcpy(r->data, old + i * CHUNK_SIZE, r->lo);
+			memcpy(r->data + r->hi, old + i * CHUNK_SIZE + r->hi, CHUNK_SIZE - r->hi);
+		}
+
+		// a hole keeps its size, the chunk may have been grown by truncate
+		if (md[i].size < r->hi)
+			md[i].size = r->hi;
+		md[i].offset = (off_t)r->index * CHUNK_SIZE;
+
+		// a chunk of zeros is a hole, it is not hashed or stored
+		if (is_zero(r->data, CHUNK_SIZE)) {
+			set_hole(&md[i]);
+			continue;
+		}
+		hashed[num_hash] = i;
+		data[num_hash] = r->data;
+		lens[num_hash] = CHUNK_SIZE;
+		num_hash ++;
+	}
+
+	// hash all chunks together, then look them up.  A chunk without a
+	// fingerprint fails the write, none of them is looked up
+	if (calc_hashes(data, lens, hashes, num_hash) < 0) {
+		retstat = -EIO;
+		num_hash = 0;
+	}
+	// a sparse index looks them up in the champions of the write
+	sparse_segment(hashes, num_hash);
+
+	for (num_done = 0; num_done < num_hash; num_done ++) {
+		if (dedupe_fp(&hashes[num_done * FP_WORDS], data[num_done], CHUNK_SIZE,
+					&md[hashed[num_done]], &batch) < 0) {
+			retstat = -EIO;
+			break;
+		}
+	}
+
+	// the chunks added so far are pending, write them even on error
+	if (flush_batch(&batch) < 0)
+		retstat = -EIO;
+
+	// update the meta data
+	for (i = 0; retstat == 0 && i < num; i += run) {
+		for (run = 1; i + run < num && reqs[i + run].index == reqs[i].index + run; run ++)
+			;
+		if (meta_write_range(reqs[i].index, run, fd, md + i) < 0)
+			retstat = -EIO;
+	}
+
+	// drop the references the file no longer holds
+	if (retstat == 0) {
+		for (i = 0; i < num; i ++)
+			release_chunk(&old_md[i]);
+	} else {
+		for (i = 0; i < num_done; i ++)
+			release_chunk(&md[hashed[i]]);
+	}
+
+out:
+	free(md);
+	free(old_md);
+	free(data);
+	free(lens);
+	free(hashes);
+	free(old_ids);
+	free(old_bufs);
+	free(hashed);
+	free_chunk_buf(old);
+	batch_free(&batch);
+	return retstat;
+}
+
+/*
+* write buffer
+*
+* with fixed chunking, a chunk written in pieces is held in the buffer of
+* its file until the pieces cover it, or until the file is flushed, so it
+* is hashed and stored once rather than once per piece.  The buffer hangs
+* off the recipe of the file (meta_wb()) and is guarded by the meta lock.
+* Every open of the file shares it, reads lay its chunks over the records.
+*/
+#define WB_CHUNKS 64
+
+// the bytes lo .. hi of data were written.  When a write left a gap the
+// old data of the chunk was read in, then all of data is good
+typedef struct wb_chunk {
+	unsigned int index;
+	unsigned int lo, hi;
+	int whole;
+	char data[CHUNK_SIZE];
+} wb_chunk;
+
+typedef struct write_buf {
+	unsigned int num;
+	wb_chunk *chunks[WB_CHUNKS];
+} write_buf;
+
+static wb_chunk *wb_find(write_buf *b, unsigned int index)
+{
+	unsigned int i;
+
+	for (i = 0; i < b->num; i ++) {
+		if (b->chunks[i]->index == index)
+			return b->chunks[i];
+	}
+	return NULL;
+}
+
+static void wb_remove(write_buf *b, wb_chunk *c)
+{
+	unsigned int i;
+
+	for (i = 0; b->chunks[i] != c; i ++)
+		;
+	b->chunks[i] = b->chunks[-- b->num];
+	free(c);
+}
+
+// the buffer goes once it is empty, so a file without one has nothing
+// buffered and getattr sees the records alone
+static void wb_done(struct meta_wb *wb)
+{
+	write_buf *b = (write_buf *)wb->data;
+
+	if (b != NULL && b->num == 0) {
+		free(b);
+		wb->data = NULL;
+		wb->end = 0;
+	}
+}
+
+// put len bytes of src at off in c.  A piece apart from the ones there
+// has the old data of the chunk read in first, to fill the gap
+static int wb_put(int fd, wb_chunk *c, const char *src, unsigned int off, unsigned int len)
+{
+	struct meta_data md;
+	unsigned int id;
+	char *buf;
+
+	if (c->lo == c->hi) {
+		c->lo = off;
+		c->hi = off + len;
+	} else if (!c->whole && (off > c->hi || off + len < c->lo)) {
+		buf = alloc_chunk_buf(1);
+		memset(buf, 0, CHUNK_SIZE);
+		if (meta_read(c->index, fd, &md) == sizeof(md) && !meta_is_hole(&md)) {
+			id = md.chunk_id;
+			if (read_chunks(&id, &buf, 1) < 0) {
+				free_chunk_buf(buf);
+				return -1;
+			}
+		}
+		memcpy(c->data, buf, c->lo);
+		memcpy(c->data + c->hi, buf + c->hi, CHUNK_SIZE - c->hi);
+		free_chunk_buf(buf);
+		c->whole = 1;
+	}
+
+	memcpy(c->data + off, src, len);
+	if (off < c->lo)
+		c->lo = off;
+	if (off + len > c->hi)
+		c->hi = off + len;
+	return 1;
+}
+
+static int wb_cmp(const void *a, const void *b)
+{
+	unsigned int x = (*(wb_chunk **)a)->index, y = (*(wb_chunk **)b)->index;
+
+	return x < y ? -1 : x > y;
+}
+
+// store every chunk in the buffer of fd and empty it, called with the
+// meta lock held exclusively.  The chunks go even if storing them failed
+static int wb_flush_locked(int fd)
+{
+	struct meta_wb *wb = meta_wb(fd);
+	write_buf *b;
+	struct store_req *reqs;
+	unsigned int i;
+	int retstat;
+
+	if (wb == NULL || wb->data == NULL)
+		return 0;
+	b = (write_buf *)wb->data;
+
+	qsort(b->chunks, b->num, sizeof(wb_chunk *), wb_cmp);
+	reqs = (struct store_req *)malloc(sizeof(struct store_req) * b->num);
+	for (i = 0; i < b->num; i ++) {
+		reqs[i].index = b->chunks[i]->index;
+		reqs[i].lo = b->chunks[i]->lo;
+		reqs[i].hi = b->chunks[i]->hi;
+		reqs[i].whole = b->chunks[i]->whole;
+		reqs[i].data = b->chunks[i]->data;
+	}
+	retstat = store_chunks(fd, reqs, b->num);
+	free(reqs);
+
+	for (i = 0; i < b->num; i ++)
+		free(b->chunks[i]);
+	b->num = 0;
+	wb_done(wb);
+
+	if (retstat < 0)
+		log_error("[=Dedup_FS=] [Error] write back of fd %d\n", fd);
+	return retstat;
+}
+
+static int wb_flush(int fd)
+{
+	int lock, retstat;
+
+	lock = meta_lock(fd, 1);
+	retstat = wb_flush_locked(fd);
+	meta_unlock(lock);
+	return retstat;
+}
+
+// throw the buffer of a file that is gone away, called with the meta
+// lock held exclusively
+static void wb_drop(int fd)
+{
+	struct meta_wb *wb = meta_wb(fd);
+	write_buf *b;
+	unsigned int i;
+
+	if (wb == NULL || wb->data == NULL)
+		return;
+	b = (write_buf *)wb->data;
+	for (i = 0; i < b->num; i ++)
+		free(b->chunks[i]);
+	b->num = 0;
+	wb_done(wb);
+}
+
+// lay the buffered chunks from chunk first on over the num chunks of buf,
+// called with the meta lock held
+static void wb_read(int fd, unsigned int first, unsigned int num, char *buf)
+{
+	struct meta_wb *wb = meta_wb(fd);
+	write_buf *b;
+	wb_chunk *c;
+	unsigned int i;
+
+	if (wb == NULL || wb->data == NULL)
+		return;
+	b = (write_buf *)wb->data;
+	for (i = 0; i < b->num; i ++) {
+		c = b->chunks[i];
+		if (c->index >= first && c->index - first < num)
+			memcpy(buf + (size_t)(c->index - first) * CHUNK_SIZE + c->lo,
+					c->data + c->lo, c->hi - c->lo);
+	}
+}
+
+// whether chunk index of fd has data in the buffer, called with the meta
+// lock held
+static int wb_holds(int fd, unsigned int index)
+{
+	struct meta_wb *wb = meta_wb(fd);
+
+	return wb != NULL && wb->data != NULL && wb_find((write_buf *)wb->data, index) != NULL;
+}
+
+// release all chunks of a file that is gone, and close it
+static void release_file(int fd)
+{
+	int lock;
+
+	lock = meta_lock(fd, 1);
+	wb_drop(fd);
+	if (release_records(fd, 0) < 0)
+		log_error("[=Dedup_FS=] [Error] release of fd %d\n", fd);
+	meta_unlock(lock);
+	close_meta(fd);
+}
+
+/*
+* content-defined chunking
+*
+* a file has one record per chunk and a record holds the offset of its
+* chunk, so the records of a range are found by binary search.  Holes are
+* records without a chunk, they are split at CDC_HOLE_MAX to fit in size.
+*
+* A write that changes the number of chunks does not move every record
+* after it: fewer chunks leave empty records (holes of size 0) in their
+* place and more chunks take the empty records among the CDC_WINDOW records
+* that follow, only the records up to the last one taken move.  When there
+* are too few, all of the records after the write move and an empty record
+* goes in front of every CDC_GAP-th of them for the next writes.
+*/
+#define CDC_HOLE_MAX 0x40000000
+#define CDC_WINDOW 4096
+#define CDC_GAP 16
+
+// fill md with hole records for len bytes at offset, returns how many
+static unsigned int cdc_holes(struct meta_data *md, off_t offset, off_t len)
+{
+	unsigned int num = 0;
+
+	while (len > 0) {
+		memset(&md[num], 0, sizeof(struct meta_data));
+		md[num].chunk_id = META_HOLE;
+		md[num].offset = offset;
+		md[num].size = len < CDC_HOLE_MAX ? len : CDC_HOLE_MAX;
+		offset += md[num].size;
+		len -= md[num].size;
+		num ++;
+	}
+	return num;
+}
+
+// fill md with num empty records at offset, returns num
+static unsigned int cdc_empty(struct meta_data *md, off_t offset, unsigned int num)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; i ++) {
+		memset(&md[i], 0, sizeof(struct meta_data));
+		md[i].chunk_id = META_HOLE;
+		md[i].offset = offset;
+	}
+	return num;
+}
+
+// copy the num records at src to md without their empty records, with an
+// empty record in front of every gap-th one when gap is not 0.  returns
+// how many md holds
+static unsigned int cdc_compact(struct meta_data *md, const struct meta_data *src,
+		unsigned int num, unsigned int gap)
+{
+	unsigned int i, n = 0, kept = 0;
+
+	for (i = 0; i < num; i ++) {
+		if (src[i].size == 0)
+			continue;
+		if (gap != 0 && kept ++ % gap == 0)
+			n += cdc_empty(md + n, src[i].offset, 1);
+		md[n ++] = src[i];
+	}
+	return n;
+}
+
+// the size of the file is where its last record ends
+static int cdc_eof(int fd, unsigned int num, off_t *eof)
+{
+	struct meta_data md;
+
+	*eof = 0;
+	if (num == 0)
+		return 1;
+	if (meta_read(num - 1, fd, &md) != sizeof(md))
+		return -1;
+
+	*eof = md.offset + md.size;
+	return 1;
+}
+
+static int read_cdc(int fd, char *buf, size_t size, off_t offset)
+{
+	struct meta_data *md = NULL;
+	unsigned int *ids = NULL;
+	char **bufs = NULL;
+	char *data = NULL;
+	int num, first, last, num_md, i;
+	unsigned int num_ids;
+	off_t eof, from, to;
+	char *p, *out;
+	int retstat = 0;
+	int lock;
+
+	lock = meta_lock(fd, 0);
+
+	num = meta_count(fd);
+	if (num < 0 || cdc_eof(fd, num, &eof) < 0) {
+		retstat = -EIO;
+		goto out;
+	}
+
+	// clip the read at the end of the file
+	if (offset >= eof)
+		goto out;
+	if (offset + size > eof)
+		size = eof - offset;
+
+	first = meta_find(offset, num, fd);
+	last = meta_find(offset + size - 1, num, fd);
+	if (first < 0 || last < 0) {
+		retstat = -EIO;
+		goto out;
+	}
+
+	num_md = last - first + 1;
+	md = (struct meta_data *)malloc(sizeof(struct meta_data) * num_md);
+	if (meta_read_range(first, num_md, fd, md) != num_md) {
+		retstat = -EIO;
+		goto out;
+	}
+
+	for (num_ids = 0, i = 0; i < num_md; i ++) {
+		if (!meta_is_hole(&md[i]))
+			num_ids += chunk_count(md[i].size);
+	}
+	data = alloc_chunk_buf(num_ids);
+	ids = (unsigned int *)malloc(sizeof(unsigned int) * num_ids);
+	bufs = (char **)malloc(sizeof(char *) * num_ids);
+
+	// the chunks of one record are consecutive in the store and are read
+	// with one request
+	for (p = data, num_ids = 0, i = 0; i < num_md; i ++) {
+		if (meta_is_hole(&md[i]))
+			continue;
+		num_ids += record_chunks(&md[i], p, ids + num_ids, bufs + num_ids);
+		p += chunk_count(md[i].size) * CHUNK_SIZE;
+	}
+	if (read_chunks(ids, bufs, num_ids) < 0) {
+		retstat = -EIO;
+		goto out;
+	}
+
+	for (p = data, out = buf, i = 0; i < num_md; i ++) {
+		from = offset > md[i].offset ? offset - md[i].offset : 0;
+		to = offset + size < md[i].offset + md[i].size ? offset + size - md[i].offset : md[i].size;
+
+		if (meta_is_hole(&md[i])) {
+			memset(out, 0, to - from);
+		} else {
+			memcpy(out, p + from, to - from);
+			p += chunk_count(md[i].size) * CHUNK_SIZE;
+		}
+		out += to - from;
+	}
+	retstat = size;
+
+out:
+	meta_unlock(lock);
+	free(md);
+	free_chunk_buf(data);
+	free(ids);
+	free(bufs);
+	return retstat;
+}
+
+// the write is merged with the rest of the chunks it touches and that
+// range is chunked again.  An append also takes the last chunk of the
+// file, it only ended there because the file did.  Holes are not chunked,
+// the parts of a hole around the write stay holes.
+static int write_cdc(int fd, const char *buf, size_t size, off_t offset)
+{
+	struct meta_data *old = NULL, *md = NULL, *tail_md = NULL;
+	unsigned int *ids = NULL;
+	char **bufs = NULL;
+	struct chunk_batch batch;
+	char *region = NULL, *old_data = NULL, *head, *tail;
+	const char **chunk_data = NULL;
+	unsigned int *chunk_len = NULL, *hashes = NULL, *hashed = NULL;
+	int num, first, stop, num_old, num_md, max_md, first_chunk, num_chunks, num_hash, num_done, num_tail, num_empty, i;
+	unsigned int num_ids, len;
+	char *p;
+	off_t eof, end, rstart, rend, dstart, dend, pos;
+	struct meta_data *ml;
+	int retstat = 0;
+	int lock;
+
+	end = offset + size;
+	memset(&batch, 0, sizeof(batch));
+
+	lock = meta_lock(fd, 1);
+
+	num = meta_count(fd);
+	if (num < 0 || cdc_eof(fd, num, &eof) < 0) {
+		retstat = -EIO;
+		goto out;
+	}
+
+	// the records first..stop-1 are replaced
+	if (offset < eof)
+		first = meta_find(offset, num, fd);
+	else if (offset == eof && num > 0)
+		first = num - 1;
+	else
+		first = num;
+	stop = end < eof ? meta_find(end - 1, num, fd) + 1 : num;
+	if (first < 0 || (stop < 1 && num > 0)) {
+		retstat = -EIO;
+		goto out;
+	}
+
+	num_old = stop - first;
+	old = (struct meta_data *)malloc(sizeof(struct meta_data) * (num_old + 1));
+	if (meta_read_range(first, num_old, fd, old) != num_old) {
+		retstat = -EIO;
+		goto out;
+	}
+
+	// the bytes [rstart, rend) are rewritten, [dstart, dend) of them are data
+	rstart = num_old ? old[0].offset : eof;
+	ml = num_old ? &old[num_old - 1] : NULL;
+	rend = num_old && ml->offset + ml->size > end ? ml->offset + ml->size : end;
+	dstart = num_old && !meta_is_hole(&old[0]) ? rstart : offset;
+	dend = num_old && !meta_is_hole(ml) ? rend : end;
+
+	region = (char *)malloc(dend - dstart + CHUNK_SIZE);
+	memset(region + (dend - dstart), 0, CHUNK_SIZE);
+
+	// the old data around the write, all reads are done before the first
+	// search_fp, a chunk we add is pending until we write it
+	head = tail = NULL;
+	if (dstart < offset || end < dend) {
+		// at most two chunks, of CDC_MAX_LIMIT each
+		num_ids = 2 * chunk_count(CDC_MAX_LIMIT);
+		old_data = (char *)malloc((size_t)num_ids * CHUNK_SIZE);
+		ids = (unsigned int *)malloc(sizeof(unsigned int) * num_ids);
+		bufs = (char **)malloc(sizeof(char *) * num_ids);
+
+		num_ids = 0;
+		if (dstart < offset) {
+			head = old_data;
+			num_ids += record_chunks(&old[0], head, ids, bufs);
+		}
+		if (end < dend) {
+			if (ml == &old[0] && head != NULL) {
+				tail = head;
+			} else {
+				tail = old_data + num_ids * CHUNK_SIZE;
+				num_ids += record_chunks(ml, tail, ids + num_ids, bufs + num_ids);
+			}
+		}
+		if (read_chunks(ids, bufs, num_ids) < 0) {
+			retstat = -EIO;
+			goto out;
+		}
+	}
+
+	if (head != NULL)
+		memcpy(region, head, offset - dstart);
+	memcpy(region + (offset - dstart), buf, size);
+	if (tail != NULL)
+		memcpy(region + (end - dstart), tail + (end - ml->offset), dend - end);
+
+	// new records: hole in front, chunks, hole behind, then the records
+	// after the write that move, with empty ones among them
+	max_md = (offset - rstart) / CDC_HOLE_MAX + 1
+		+ (dend - dstart) / cdc_min_size() + 1
+		+ (rend - end) / CDC_HOLE_MAX + 1
+		+ (num - stop) + (num - stop) / CDC_GAP + 1;
+	// or as many as it replaces, empty ones among them
+	if (max_md < num_old)
+		max_md = num_old;
+	md = (struct meta_data *)malloc(sizeof(struct meta_data) * max_md);
+	batch_init(&batch, max_md, chunk_count(dend - dstart) + max_md);
+
+	num_md = cdc_holes(md, rstart, dstart - rstart);
+	first_chunk = num_md;
+	for (pos = dstart; pos < dend; pos += len) {
+		len = cdc_next(region + (pos - dstart), dend - pos);
+
+		memset(&md[num_md], 0, sizeof(struct meta_data));
+		md[num_md].offset = pos;
+		md[num_md].size = len;
+		num_md ++;
+	}
+
+	// hash all chunks together, then look them up
+	num_chunks = num_md - first_chunk;
+	chunk_data = (const char **)malloc(sizeof(char *) * num_chunks);
+	chunk_len = (unsigned int *)malloc(sizeof(unsigned int) * num_chunks);
+	hashes = (unsigned int *)malloc(sizeof(unsigned int) * FP_WORDS * num_chunks);
+	hashed = (unsigned int *)malloc(sizeof(unsigned int) * num_chunks);
+	num_hash = 0;
+	for (i = 0; i < num_chunks; i ++) {
+		p = region + (md[first_chunk + i].offset - dstart);
+		// a chunk of zeros is a hole, it is not hashed or stored
+		if (is_zero(p, md[first_chunk + i].size)) {
+			set_hole(&md[first_chunk + i]);
+			continue;
+		}
+		hashed[num_hash] = first_chunk + i;
+		chunk_data[num_hash] = p;
+		chunk_len[num_hash] = md[first_chunk + i].size;
+		num_hash ++;
+	}
+	if (calc_hashes(chunk_data, chunk_len, hashes, num_hash) < 0) {
+		retstat = -EIO;
+		num_hash = 0;
+	}
+	sparse_segment(hashes, num_hash);
+
+	for (num_done = 0; num_done < num_hash; num_done ++) {
+		if (dedupe_fp(&hashes[num_done * FP_WORDS], chunk_data[num_done], chunk_len[num_done],
+					&md[hashed[num_done]], &batch) < 0) {
+			retstat = -EIO;
+			break;
+		}
+	}
+	num_md += cdc_holes(md + num_md, dend, rend - dend);
+
+	// the chunks added so far are pending, write them even on error
+	if (flush_batch(&batch) < 0)
+		retstat = -EIO;
+	if (retstat < 0)
+		goto release;
+
+	// update the meta data, the record at stop starts at rend
+	if (num_md < num_old && stop < num) {
+		num_md += cdc_empty(md + num_md, rend, num_old - num_md);
+	} else if (num_md > num_old && stop < num) {
+		num_tail = num - stop < CDC_WINDOW ? num - stop : CDC_WINDOW;
+		tail_md = (struct meta_data *)malloc(sizeof(struct meta_data) * (num - stop));
+		if (meta_read_range(stop, num_tail, fd, tail_md) != num_tail) {
+			retstat = -EIO;
+			goto release;
+		}
+		for (num_empty = 0, i = 0; i < num_tail && num_empty < num_md - num_old; i ++) {
+			if (tail_md[i].size == 0)
+				num_empty ++;
+		}
+		if (num_empty == num_md - num_old || num_tail == num - stop) {
+			// the records up to the last empty one taken move
+			num_md += cdc_compact(md + num_md, tail_md, i, 0);
+			stop += i;
+		} else {
+			if (meta_read_range(stop + num_tail, num - stop - num_tail, fd, tail_md + num_tail)
+					!= num - stop - num_tail) {
+				retstat = -EIO;
+				goto release;
+			}
+			num_md += cdc_compact(md + num_md, tail_md, num - stop, CDC_GAP);
+			stop = num;
+		}
+	}
+	if (meta_write_range(first, num_md, fd, md) < 0
+			|| (first + num_md < stop && meta_del(first + num_md, fd) < 0)) {
+		retstat = -EIO;
+		goto release;
+	}
+
+	retstat = size;
+
+release:
+	// drop the references of the replaced records, or of the new ones if
+	// they did not make it to the meta file
+	if (retstat < 0) {
+		for (i = 0; i < num_done; i ++)
+			release_chunk(&md[hashed[i]]);
+	} else {
+		for (i = 0; i < num_old; i ++)
+			release_chunk(&old[i]);
+	}
+
+out:
+	meta_unlock(lock);
+	free(old);
+	free(md);
+	free(tail_md);
+	free(ids);
+	free(bufs);
+	batch_free(&batch);
+	free(chunk_data);
+	free(chunk_len);
+	free(hashes);
+	free(hashed);
+	free(region);
+	free(old_data);
+	return retstat;
+}
+
+// cut or grow a file to newsize, the caller holds the meta lock
+static int truncate_cdc(int fd, off_t newsize)
+{
+	struct meta_data md, old;
+	struct meta_data *holes;
+	int num, num_holes, last;
+	off_t eof;
+	int retstat = 0;
+
+	num = meta_count(fd);
+	if (num < 0 || cdc_eof(fd, num, &eof) < 0)
+		return -EIO;
+
+	// growing the file, the new part is a hole
+	if (newsize >= eof) {
+		holes = (struct meta_data *)malloc(sizeof(struct meta_data) * ((newsize - eof) / CDC_HOLE_MAX + 1));
+		num_holes = cdc_holes(holes, eof, newsize - eof);
+		if (num_holes > 0 && meta_write_range(num, num_holes, fd, holes) < 0)
+			retstat = -EIO;
+		free(holes);
+		return retstat;
+	}
+
+	last = meta_find(newsize - 1, num, fd);
+	if (last < 0 || meta_read(last, fd, &md) != sizeof(md))
+		return -EIO;
+	old = md;
+
+	if (newsize - md.offset < md.size) {
+		if (meta_is_hole(&md))
+			md.size = newsize - md.offset;
+		else
+			retstat = truncate_chunk(&md, newsize - md.offset);
+
+		if (retstat == 0 && meta_write(last, fd, &md) < 0) {
+			release_chunk(&md);
+			retstat = -EIO;
+		} else if (retstat == 0) {
+			release_chunk(&old);
+		}
+	}
+
+	// delete all the following chunks.
+	if (retstat == 0)
+		retstat = release_records(fd, last + 1);
+	if (retstat == 0 && meta_del(last + 1, fd) < 0)
+		retstat = -EIO;
+
+	return retstat;
+}
+
+// the stats of the mount are read from files of a directory that is not
+// in the root dir and not listed in /: STATS_TEXT as text, STATS_JSON as
+// JSON.  They are made when they are opened, a read sees that snapshot
+#define STATS_DIR "/.dedupe"
+#define STATS_TEXT STATS_DIR "/stats"
+#define STATS_JSON STATS_DIR "/stats.json"
+
+struct stats_file {
+	char *text;
+	size_t len;
+};
+
+static int is_stats_dir(const char *path)
+{
+	return strcmp(path, STATS_DIR) == 0;
+}
+
+static int is_stats_file(const char *path)
+{
+	return strcmp(path, STATS_TEXT) == 0 || strcmp(path, STATS_JSON) == 0;
+}
+
+// the files are read only and have no size, they are read with direct_io
+// up to the end of the snapshot
+static int stats_getattr(const char *path, struct stat *statbuf)
+{
+	memset(statbuf, 0, sizeof(*statbuf));
+	if (is_stats_dir(path)) {
+		statbuf->st_mode = S_IFDIR | 0555;
+		statbuf->st_nlink = 2;
+	} else {
+		statbuf->st_mode = S_IFREG | 0444;
+		statbuf->st_nlink = 1;
+	}
+	statbuf->st_uid = getuid();
+	statbuf->st_gid = getgid();
+	statbuf->st_atime = statbuf->st_mtime = statbuf->st_ctime = time(NULL);
+	return 0;
+}
+
+static double hit_rate(unsigned long long hits, unsigned long long misses)
+{
+	return hits + misses ? (double)hits / (hits + misses) : 0.0;
+}
+
+// the dedupe ratio is of the store chunks the files point at to the ones
+// stored.  Packed chunks take their compressed size
+static char *render_stats(int json, size_t *len)
+{
+	struct stats_out out;
+	struct index_stats is;
+	struct gc_stats gs;
+	struct cache_stats cs;
+	struct fp_cache_stats fs;
+	struct fp_bloom_stats bs;
+	struct sparse_stats ss;
+	struct pack_stats ps;
+	unsigned long long logical, physical;
+
+	get_index_stats(&is);
+	get_gc_stats(&gs);
+	get_cache_stats(&cs);
+	get_fp_cache_stats(&fs);
+	get_fp_bloom_stats(&bs);
+	get_sparse_stats(&ss);
+	get_pack_stats(&ps);
+
+	logical = is.ref_chunks * CHUNK_SIZE;
+	physical = is.stored_chunks * CHUNK_SIZE;
+	if (ps.chunks <= is.stored_chunks)
+		physical = (is.stored_chunks - ps.chunks) * CHUNK_SIZE + ps.bytes;
+
+	stats_begin(&out, json);
+	stats_section(&out, "dedupe");
+	stats_u64(&out, "logical_bytes", logical);
+	stats_u64(&out, "physical_bytes", physical);
+	stats_double(&out, "ratio", physical ? (double)logical / physical : 0.0);
+
+	stats_section(&out, "index");
+	stats_u64(&out, "records", is.records);
+	stats_u64(&out, "stored_chunks", is.stored_chunks);
+	stats_u64(&out, "ref_chunks", is.ref_chunks);
+	stats_u64(&out, "bytes", is.bytes);
+	stats_u64(&out, "dead_records", gs.dead_records);
+	stats_u64(&out, "gc_passes", gs.passes);
+	stats_u64(&out, "gc_freed_records", gs.freed_records);
+	stats_u64(&out, "gc_freed_bytes", gs.freed_bytes);
+
+	stats_section(&out, "chunk_cache");
+	stats_u64(&out, "hits", cs.hits);
+	stats_u64(&out, "misses", cs.misses);
+	stats_double(&out, "hit_rate", hit_rate(cs.hits, cs.misses));
+	stats_u64(&out, "evictions", cs.evictions);
+	stats_u64(&out, "chunks", cs.chunks);
+	stats_u64(&out, "max_chunks", cs.max_chunks);
+
+	stats_section(&out, "fp_cache");
+	stats_u64(&out, "hits", fs.hits);
+	stats_u64(&out, "misses", fs.misses);
+	stats_double(&out, "hit_rate", hit_rate(fs.hits, fs.misses));
+	stats_u64(&out, "stale", fs.stale);
+	stats_u64(&out, "prefetches", fs.prefetches);
+	stats_u64(&out, "entries", fs.entries);
+
+	stats_section(&out, "bloom");
+	stats_u64(&out, "checks", bs.checks);
+	stats_u64(&out, "negatives", bs.negatives);
+	stats_u64(&out, "false_positives", bs.false_positives);
+	stats_u64(&out, "keys", bs.keys);
+	stats_u64(&out, "bytes", bs.bytes);
+
+	if (sparse_index_enabled()) {
+		stats_section(&out, "sparse");
+		stats_u64(&out, "segments", ss.segments);
+		stats_u64(&out, "lookups", ss.lookups);
+		stats_u64(&out, "hits", ss.hits);
+		stats_double(&out, "hit_rate", hit_rate(ss.hits, ss.lookups - ss.hits));
+		stats_u64(&out, "champions", ss.champions);
+		stats_u64(&out, "hooks", ss.hooks);
+		stats_u64(&out, "bytes", ss.bytes);
+	}
+
+	stats_section(&out, "pack");
+	stats_u64(&out, "chunks", ps.chunks);
+	stats_u64(&out, "bytes", ps.bytes);
+	stats_u64(&out, "tail", ps.tail);
+
+	op_stats_report(&out);
+	return stats_finish(&out, len);
+}
+
+static int stats_open(const char *path, struct fuse_file_info *fi)
+{
+	struct stats_file *f;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+
+	f = (struct stats_file *)malloc(sizeof(struct stats_file));
+	if (f == NULL)
+		return -ENOMEM;
+	f->text = render_stats(strcmp(path, STATS_JSON) == 0, &f->len);
+	if (f->text == NULL) {
+		free(f);
+		return -ENOMEM;
+	}
+	fi->fh = (uintptr_t) f;
+	fi->direct_io = 1;
+	return 0;
+}
+
+static int stats_read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct stats_file *f = (struct stats_file *) (uintptr_t) fi->fh;
+
+	if (offset >= f->len)
+		return 0;
+	if (offset + size > f->len)
+		size = f->len - offset;
+	memcpy(buf, f->text + offset, size);
+	return size;
+}
+
+static void stats_release(struct fuse_file_info *fi)
+{
+	struct stats_file *f = (struct stats_file *) (uintptr_t) fi->fh;
+
+	free(f->text);
+	free(f);
+}
+
 ///////////////////////////////////////////////////////////
 //
 // Prototypes for all these functions, and the C-style comments,
@@ -89,85 +1397,59 @@ int bb_getattr(const char *path, struct stat *statbuf)
 {
     int retstat = 0;
     char fpath[PATH_MAX];
-  	DIR *dirp;
 
     log_msg("\nbb_getattr(path=\"%s\", statbuf=0x%08x)\n",
 	  path, statbuf);
+    if (is_stats_dir(path) || is_stats_file(path))
+	return stats_getattr(path, statbuf);
     bb_fullpath(fpath, path);
     
     retstat = lstat(fpath, statbuf);
     if (retstat != 0)
-		retstat = bb_error("bb_getattr lstat");
-    
-    log_stat(statbuf);
-
-		dirp = opendir(fpath);
-		if(dirp != NULL)
-			return retstat;
+	return bb_error("bb_getattr lstat");
 
     // +add by yyang.
-    // TODO 
-    // call a get_file_size method in metafile.h
-    // and then update the struct.
-		// NOTE:
-		// 	- the size we get from fstat is the size of the metafile, we need to calculate the acutal data chunks from the metafile
-		
-		unsigned int sz=0;
-		unsigned int blks=0;
-		struct meta_data meta;
-		int i = 0;
-	
-		int fd = open(fpath, O_RDWR);
-		if (fd < 0){
-
-			//printf("Error open file: [%s]\n", fpath);
-			return retstat;
-		}
-
-		printf("full path: %s\n", fpath);
-		while (meta_read(i, fd, &meta)) {
-			printf("%d\n", i);
-			sz += meta.size;
-			blks += CHUNK_SIZE / 512;
-			i ++;
-		}
-	
-		statbuf->st_size = sz;
-		statbuf->st_blksize = CHUNK_SIZE;
-		statbuf->st_blocks = blks;
+    // NOTE:
+    // 	- the size we get from lstat is the size of the metafile, the
+    // 	  size of the data comes from the metafile
+    if (S_ISREG(statbuf->st_mode)) {
+	if (meta_stat(fpath, statbuf) < 0)
+	    return bb_error("bb_getattr meta_stat");
+	statbuf->st_blksize = CHUNK_SIZE;
+    }
     // -add by yyang.
 
+    log_stat(statbuf);
+
     return retstat;
 }
 
 int bb_fgetattr_dedupe(const char *path, struct stat *statbuf, struct fuse_file_info *fi)
 {
     int retstat = 0;
+    char fpath[PATH_MAX];
     
     log_msg("\nbb_fgetattr(path=\"%s\", statbuf=0x%08x, fi=0x%08x)\n",
 	    path, statbuf, fi);
     log_fi(fi);
+    // fi->fh of a stats file is its text, not an fd
+    if (is_stats_file(path))
+	return stats_getattr(path, statbuf);
+    bb_fullpath(fpath, path);
     
     retstat = fstat(fi->fh, statbuf);
-    // NOTE:
-		// 	- the size we get from fstat is the size of the metafile, we need to calculate the acutal data chunks from the metafile
-		unsigned int sz;
-		unsigned int blks;
-		struct meta_data meta;
-		int i = 0;
-		
-		while (meta_read(i, fi->fh, &meta)) {
-			sz += meta.size;
-			blks += CHUNK_SIZE / 512;
-			i ++;
-		}
-
-		statbuf->st_size = sz;
-		statbuf->st_blksize = CHUNK_SIZE;
-		statbuf->st_blocks = blks;
+    if (retstat < 0)
+	return bb_error("bb_fgetattr fstat");
 
-		if (retstat < 0)
-		retstat = bb_error("bb_fgetattr fstat");
+    // NOTE:
+    // 	- the size we get from fstat is the size of the metafile, the
+    // 	  size of the data comes from the metafile.  An open file has
+    // 	  its records in memory, so this works after an unlink too
+    if (S_ISREG(statbuf->st_mode)) {
+	if (meta_stat(fpath, statbuf) < 0)
+	    return bb_error("bb_fgetattr meta_stat");
+	statbuf->st_blksize = CHUNK_SIZE;
+    }
     
     log_stat(statbuf);
     
@@ -274,10 +1556,18 @@ int bb_unlink(const char *path)
     log_msg("bb_unlink(path=\"%s\")\n",
 	    path);
     bb_fullpath(fpath, path);
+
+    int fd;
+    fd = open_last_link(fpath);
     
     retstat = unlink(fpath);
     if (retstat < 0)
 	retstat = bb_error("bb_unlink unlink");
+
+    if (fd >= 0 && retstat == 0)
+	release_file(fd);
+    else if (fd >= 0)
+	close_meta(fd);
     
     return retstat;
 }
@@ -332,10 +1622,22 @@ int bb_rename(const char *path, const char *newpath)
 	    path, newpath);
     bb_fullpath(fpath, path);
     bb_fullpath(fnewpath, newpath);
+
+    // a file renamed over is gone, unless it is the file itself
+    struct stat st, newst;
+    int fd = -1;
+    if (lstat(fpath, &st) == 0 && lstat(fnewpath, &newst) == 0
+	    && (st.st_dev != newst.st_dev || st.st_ino != newst.st_ino))
+	fd = open_last_link(fnewpath);
     
     retstat = rename(fpath, fnewpath);
     if (retstat < 0)
 	retstat = bb_error("bb_rename rename");
+
+    if (fd >= 0 && retstat == 0)
+	release_file(fd);
+    else if (fd >= 0)
+	close_meta(fd);
     
     return retstat;
 }
@@ -413,30 +1715,69 @@ int bb_truncate(const char *path, off_t newsize)
          3. delete all the following chunks.
     */
     int fd;
-    fd = open(fpath,O_RDWR);   
+    fd = open_meta(fpath, O_RDWR);
+    if (fd < 0)
+	return bb_error("bb_truncate open");
+
+    int lock;
+    lock = meta_lock(fd, 1);
+
+    // the buffered chunks are stored before the records are cut
+    if (wb_flush_locked(fd) < 0) {
+	retstat = -EIO;
+    } else if (newsize == 0) {
+	retstat = release_records(fd, 0);
+	if (retstat == 0)
+	    retstat = meta_del(0, fd);
+    } else if (BB_DATA->chunking == CHUNK_CDC) {
+	retstat = truncate_cdc(fd, newsize);
+    } else {
+	// deal with the last live chunk. read -> modify ->write.
+	unsigned int last_chunk;
+	unsigned int last_size;
+	struct meta_data metadata, old;
+
+	last_chunk = (newsize - 1) / CHUNK_SIZE;
+	last_size = newsize - (off_t)last_chunk * CHUNK_SIZE;
+
+	memset(&old, 0, sizeof(old));
+	if (meta_read(last_chunk, fd, &metadata) == sizeof(metadata) && !meta_is_hole(&metadata)) {
+	    if (last_size < metadata.size) {
+		old = metadata;
+		retstat = truncate_chunk(&metadata, last_size);
+	    } else {
+		metadata.size = last_size;
+	    }
+	} else {
+	    // growing the file, or cutting inside a hole
+	    memset(&metadata, 0, sizeof(metadata));
+	    metadata.chunk_id = META_HOLE;
+	    metadata.size = last_size;
+	    metadata.offset = (off_t)last_chunk * CHUNK_SIZE;
+	}
 
-    // deal with the last live chunk. read -> modify ->write.
-    int last_chunk;
-    last_chunk = newsize / CHUNK_SIZE;
-    
-    struct meta_data metadata;
-    meta_read(last_chunk,fd,&metadata);
-    metadata.size = newsize % CHUNK_SIZE;
-    meta_write(last_chunk,fd,&metadata);
-    
-    // delete all the following chunks.
-    int i;
-    i=last_chunk+1; 
-    while(meta_read(i,fd,&metadata))
-    {
-        meta_del(i,fd);
-        i++;
+	// old is the chunk truncate_chunk replaced, if any
+	if (retstat == 0 && meta_write(last_chunk, fd, &metadata) < 0) {
+	    if (!meta_is_hole(&old))
+		release_chunk(&metadata);
+	    retstat = -EIO;
+	} else if (retstat == 0) {
+	    release_chunk(&old);
+	}
+
+	// delete all the following chunks.
+	if (retstat == 0)
+	    retstat = release_records(fd, last_chunk + 1);
+	if (retstat == 0 && meta_del(last_chunk + 1, fd) < 0)
+	    retstat = -EIO;
     }
-    close(fd);
+    meta_unlock(lock);
+    if (close_meta(fd) < 0 && retstat == 0)
+	retstat = -EIO;
     // -add by yyang.
 
     if (retstat < 0)
-	bb_error("bb_truncate truncate");
+	log_error("    ERROR bb_truncate truncate: %d\n", retstat);
     
     return retstat;
 }
@@ -477,9 +1818,12 @@ int bb_open(const char *path, struct fuse_file_info *fi)
     
     log_msg("\nbb_open(path\"%s\", fi=0x%08x)\n",
 	    path, fi);
+    if (is_stats_file(path))
+	return stats_open(path, fi);
     bb_fullpath(fpath, path);
     
-    fd = open(fpath, fi->flags);
+    // the records of the file are read once here and kept in memory
+    fd = open_meta(fpath, fi->flags);
     if (fd < 0)
 	retstat = bb_error("bb_open open");
     
@@ -498,6 +1842,44 @@ void gen_chunk_id(size_t size, off_t offset, int *start, int *end)
 
 // -add by yyang
 
+// the records of the num_chunk chunks from offset on, num_chunk + 1 of
+// them fit in meta_buf, the one past tells whether the file ends inside
+// the read.  size is clipped at the end of the file, the write buffer may
+// hold data past the last record.  Returns the chunks the clipped read
+// covers, their records past the last one are holes, or -1.  Called with
+// the meta lock held
+static int read_records(int fd, size_t *size, off_t offset, unsigned int num_chunk,
+			struct meta_data *meta_buf)
+{
+    unsigned int start_chunk = offset / CHUNK_SIZE;
+    struct meta_wb *wb = meta_wb(fd);
+    off_t eof;
+    int got;
+
+    // read the fingerprinters of all chunks in the meta file with one pread.
+    got = meta_read_range(start_chunk, num_chunk + 1, fd, meta_buf);
+    if (got < 0)
+	return -1;
+
+    if (got <= num_chunk) {
+	eof = got ? (off_t)(start_chunk + got - 1) * CHUNK_SIZE + meta_buf[got - 1].size : 0;
+	if (wb != NULL && wb->end > eof)
+	    eof = wb->end;
+	if (offset >= eof)
+	    *size = 0;
+	else if (offset + *size > eof)
+	    *size = eof - offset;
+    }
+    if (*size == 0)
+	return 0;
+
+    num_chunk = (offset + *size - 1) / CHUNK_SIZE - start_chunk + 1;
+    // chunks with no record yet read as holes
+    if (got < num_chunk)
+	memset(meta_buf + got, 0, sizeof(struct meta_data) * (num_chunk - got));
+    return num_chunk;
+}
+
 /** Read data from an open file
  *
  * Read should return exactly the number of bytes requested except
@@ -522,7 +1904,12 @@ int bb_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_
 	    path, buf, size, offset, fi);
     // no need to get fpath on this one, since I work from fi->fh not the path
     log_fi(fi);
+    if (is_stats_file(path))
+	return stats_read(buf, size, offset, fi);
    
+    if (BB_DATA->chunking == CHUNK_CDC)
+	return read_cdc(fi->fh, buf, size, offset);
+
     // +add by yyang.
     unsigned int start_chunk;
     unsigned int end_chunk;
@@ -530,387 +1917,408 @@ int bb_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_
     gen_chunk_id(size, offset, &start_chunk, &end_chunk);
     num_chunk = end_chunk - start_chunk +1;
 
-    struct meta_data meta_buf;
-    char *chunk_buf = (char *)malloc(sizeof(char) * CHUNK_SIZE * num_chunk);
+    // one extra record tells whether the file ends inside this read
+    struct meta_data *meta_buf = (struct meta_data *)malloc(sizeof(struct meta_data) * (num_chunk + 1));
+    char *chunk_buf = alloc_chunk_buf(num_chunk);
+    unsigned int *chunk_ids = (unsigned int *)malloc(sizeof(unsigned int) * num_chunk);
+    char **chunk_bufs = (char **)malloc(sizeof(char *) * num_chunk);
+    unsigned int num_read = 0;
+    int got;
+
+    int lock;
+    lock = meta_lock(fi->fh, 0);
+
+    got = read_records(fi->fh, &size, offset, num_chunk, meta_buf);
+    if (got < 0) {
+	retstat = -EIO;
+	goto out;
+    }
+    if (size == 0)
+	goto out;
+    num_chunk = got;
 
     int i;
     for(i=0;i<num_chunk;i++)
     {
-	// initialize the memory space to zero.
-	memset(&meta_buf,0,sizeof(struct meta_data));
-        
-	// read the fingerprinter in the meta file. and store it in the meta_buf struct.
-	meta_read(start_chunk+i,fi->fh,&meta_buf);
-
-	// get the chunk id in the chunk store, by search the finger printer.
-        struct fp_record *pfp_record;
-//	pfp_record =(struct fp_record*)malloc(sizeof(struct fp_record));
-
-	enum search_stat stat;
-	stat = search_fp(&(meta_buf.fp[0]), &pfp_record);
-
-	if(stat)
-	{
-	    printf("Error in the bb_read file. the finger printer to read is not existed.");	
-	    return -1;
+	// the meta file already knows where the chunk lives, searching the
+	// fingerprint table here would insert the fingerprint of any chunk
+	// that is not there into the persistent index.
+	if (meta_is_hole(&meta_buf[i])) {
+	    memset(chunk_buf+i*CHUNK_SIZE, 0, CHUNK_SIZE);
+	    continue;
 	}
-	// read the whole chunk and put this chunk to chunk_buf.
-        read_chunk(pfp_record->chunk_idx,chunk_buf+i*CHUNK_SIZE);
-				//printf("[READ] ")
+	chunk_ids[num_read] = meta_buf[i].chunk_id;
+	chunk_bufs[num_read] = chunk_buf+i*CHUNK_SIZE;
+	num_read++;
     }
 
-    strncpy(buf,chunk_buf+offset%CHUNK_SIZE,size);
-   
-    free(chunk_buf);
-    
+    // read the whole chunks and put them to chunk_buf, chunks that sit
+    // next to each other in the chunk store are read with one request,
+    // and with io_uring all requests are in flight together.
+    if (read_chunks(chunk_ids, chunk_bufs, num_read) < 0) {
+	retstat = -EIO;
+	goto out;
+    }
+
+    wb_read(fi->fh, start_chunk, num_chunk, chunk_buf);
+
+    memcpy(buf,chunk_buf+offset%CHUNK_SIZE,size);
     retstat = size;
+
+out:
+    meta_unlock(lock);
+    free(meta_buf);
+    free_chunk_buf(chunk_buf);
+    free(chunk_ids);
+    free(chunk_bufs);
+    
     // -add by yyang.
     return retstat;
 }
 
-/** Write data to an open file
+// read into one buffer with bb_read(), for the reads read_buf has no
+// ranges of the store for
+static int read_buf_copy(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+			struct fuse_file_info *fi)
+{
+    struct fuse_bufvec *bufv;
+    char *mem;
+    int ret;
+
+    bufv = (struct fuse_bufvec *)malloc(sizeof(struct fuse_bufvec));
+    mem = (char *)malloc(size ? size : 1);
+    if (bufv == NULL || mem == NULL) {
+	free(bufv);
+	free(mem);
+	return -ENOMEM;
+    }
+
+    ret = bb_read(path, mem, size, offset, fi);
+    if (ret < 0) {
+	free(bufv);
+	free(mem);
+	return ret;
+    }
+    *bufv = (struct fuse_bufvec)FUSE_BUFVEC_INIT(ret);
+    bufv->buf[0].mem = mem;
+    *bufp = bufv;
+    return 0;
+}
+
+/** Store data from an open file in a buffer
  *
- * Write should return exactly the number of bytes requested
- * except on error.  An exception to this is when the 'direct_io'
- * mount option is specified (see read operation).
+ * The chunks that are in the store as they are go back as ranges of the
+ * store fd, one for every run of them that is contiguous there, and
+ * libfuse copies or splices them to the kernel itself.  Holes, chunks
+ * with data in the write buffer, packed chunks and the ones still in
+ * an open container are read into memory like bb_read() does, one
+ * buffer for every run of them.
  *
- * Changed in version 2.2
+ * The ranges are copied after this returns and the meta lock is gone.
+ * The thread pins their chunks before it lets go of the lock, the
+ * collector frees none of them until the thread is back for its next
+ * read and the reply is out (see chunk_store_pin()).
  */
-// As  with read(), the documentation above is inconsistent with the
-// documentation for the write() system call.
-/*
-int bb_write(const char *path, const char *buf, size_t size, off_t offset,
-	     struct fuse_file_info *fi)
+int bb_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+		struct fuse_file_info *fi)
 {
-    int retstat = 0;
-    
-    log_msg("\nbb_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
-	    path, buf, size, offset, fi
-	    );
-    // no need to get fpath on this one, since I work from fi->fh not the path
-    log_fi(fi);
-
-    // +add by yyang.
-    unsigned int start_chunk;
-    unsigned int end_chunk;
-    unsigned int num_chunk;
-    gen_chunk_id(size, offset, &start_chunk, &end_chunk);
-    num_chunk = end_chunk - start_chunk +1;
-
-    // read the corresponding chunks and update the write to these chunks.
-    struct meta_data meta_buf;
-    char *chunk_buf = (char *)malloc(sizeof(char) * CHUNK_SIZE * num_chunk);
-
-    int i;
-    for(i=0;i<num_chunk;i++)
-    {
-	// initialize the memory space to zero.
-	memset(meta_buf,0,sizeof(struct meta_data));
-        
-	// read the fingerprinter in the meta file. and store it in the meta_buf struct.
-	meta_read(start_chunk+i,fi->fh,&meta_buf);
-
-	// get the chunk id in the chunk store, by search the finger printer.
-        struct fp_record *pfp_record;
-	pfp_record =(struct fp_record*)malloc(sizeof(struct fp_record));
-
-	enum search_stat stat;
-	stat = search_fp(&(meta_buf->fd[0]), &pfp_record);
-
-	if(stat)
-	{
-	    printf("Error in the bb_read file. the finger printer to read is not existed.");	
-	    return -1;
-	}
-	// read the whole chunk and put this chunk to chunk_buf.
-        // TODO read the chunk from chunk store, the read function is wrong.
-	// TODO
-
-        // 
+    struct fuse_bufvec *bufv = NULL;
+    struct fuse_buf *b;
+    struct meta_data *meta_buf;
+    unsigned int start_chunk = offset / CHUNK_SIZE, num_chunk, i, j, lo, hi;
+    unsigned int *first, *runs, *chunk_ids, num_read = 0;
+    char **chunk_bufs, *mem;
+    off_t *locs, pos;
+    int lock, fd = -1, got, retstat = 0;
+
+    log_msg("\nbb_read_buf(path=\"%s\", size=%d, offset=%lld, fi=0x%08x)\n",
+	    path, size, offset, fi);
+
+    // the reply to the last read of this thread is sent
+    chunk_store_unpin();
+    if (is_stats_file(path) || BB_DATA->chunking == CHUNK_CDC || size == 0)
+	return read_buf_copy(path, bufp, size, offset, fi);
+
+    num_chunk = (offset + size - 1) / CHUNK_SIZE - start_chunk + 1;
+    meta_buf = (struct meta_data *)malloc(sizeof(struct meta_data) * (num_chunk + 1));
+    locs = (off_t *)malloc(sizeof(off_t) * num_chunk);
+    first = (unsigned int *)malloc(sizeof(unsigned int) * num_chunk * 3);
+    runs = first + num_chunk;
+    chunk_ids = runs + num_chunk;
+    chunk_bufs = (char **)malloc(sizeof(char *) * num_chunk);
+
+    lock = meta_lock(fi->fh, 0);
+    got = read_records(fi->fh, &size, offset, num_chunk, meta_buf);
+    if (got < 0) {
+	retstat = -EIO;
+	goto out;
     }
-    
-    strncpy(chunk_buf+offset%CHUNK_SIZE,buf,size);
-   
-    //write the resulting chunks to file.
-    for(i=0;i<num_chunk;i++)
-    {
-	    
+    num_chunk = got;
+
+    // a buffer for every chunk at most.  Buffer i starts at chunk first[i]
+    // and spans runs[i] chunks
+    bufv = (struct fuse_bufvec *)calloc(1, sizeof(struct fuse_bufvec)
+	    + sizeof(struct fuse_buf) * (num_chunk ? num_chunk - 1 : 0));
+    if (bufv == NULL) {
+	retstat = -ENOMEM;
+	goto out;
     }
 
-    free(chunk_buf);
-    
-    retstat = size;
-    // -add by yyang.
-
-
-
-
-
-    retstat = pwrite(fi->fh, buf, size, offset);
-    if (retstat < 0)
-	retstat = bb_error("bb_write pwrite");
-    
-    return retstat;
-}
-*/
-
-/* Hao Luo */
-int partial_write(unsigned int c, unsigned int byte_offset, unsigned int bytes_to_write, char *data, int fd) {
-	// partial write
-	// 	- when the data to write is not the whole chunk, we will perform the read-modify-write operation
-	int old_chunk, new_chunk;
-	struct meta_data md;
-	char data_to_write[CHUNK_SIZE];
-	unsigned int hash[5];
-	enum search_stat s_ret;
-	fp_record *rec;
-
-	if (meta_read(c, fd, &md) != 0) {
-		old_chunk = md.chunk_id;
-	} else {
-		old_chunk = -1;
+    for (i = 0; i < num_chunk; i ++) {
+	locs[i] = -1;
+	if (!meta_is_hole(&meta_buf[i]) && !wb_holds(fi->fh, start_chunk + i)) {
+	    got = chunk_store_fd(meta_buf[i].chunk_id, &pos);
+	    if (got >= 0) {
+		fd = got;
+		locs[i] = pos;
+	    }
 	}
 
-	memset(data_to_write, 0, CHUNK_SIZE);
-
-	// prepare the data
-	if (old_chunk != -1 && bytes_to_write != CHUNK_SIZE) {
-		// read the old data
-		read_chunk(old_chunk, data);
+	lo = i == 0 ? offset % CHUNK_SIZE : 0;
+	hi = i == num_chunk - 1 ? (offset + size - 1) % CHUNK_SIZE + 1 : CHUNK_SIZE;
+	b = bufv->count > 0 ? &bufv->buf[bufv->count - 1] : NULL;
+	if (b != NULL && (locs[i] >= 0
+		? (b->flags & FUSE_BUF_IS_FD) && b->pos + (off_t)b->size == locs[i] + lo
+		: !(b->flags & FUSE_BUF_IS_FD))) {
+	    b->size += hi - lo;
+	    runs[bufv->count - 1] ++;
+	    continue;
 	}
 
-	// overwrite with the new data
-	memcpy(data_to_write + byte_offset, data, bytes_to_write);
+	b = &bufv->buf[bufv->count];
+	first[bufv->count] = i;
+	runs[bufv->count] = 1;
+	bufv->count ++;
+	b->size = hi - lo;
+	if (locs[i] >= 0) {
+	    b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	    b->fd = fd;
+	    b->pos = locs[i] + lo;
+	}
+    }
 
-	// calculate the hash
-	calc_hash(data_to_write, CHUNK_SIZE, hash);
+    for (i = 0; i < bufv->count; i ++) {
+	b = &bufv->buf[i];
+	if ((b->flags & FUSE_BUF_IS_FD) && chunk_store_pin(b->pos / CHUNK_SIZE,
+		    (b->pos + b->size - 1) / CHUNK_SIZE - b->pos / CHUNK_SIZE + 1) < 0) {
+	    retstat = -ENOMEM;
+	    goto out;
+	}
+    }
 
-	// search the hash table
-	s_ret = search_fp(hash, &rec);
+    // the memory buffers hold whole chunks until the data is in, the
+    // chunks of all of them are read with one read_chunks()
+    for (i = 0; i < bufv->count; i ++) {
+	b = &bufv->buf[i];
+	if (b->flags & FUSE_BUF_IS_FD)
+	    continue;
+	mem = (char *)malloc((size_t)runs[i] * CHUNK_SIZE);
+	if (mem == NULL) {
+	    retstat = -ENOMEM;
+	    goto out;
+	}
+	b->mem = mem;
+	for (j = 0; j < runs[i]; j ++) {
+	    if (meta_is_hole(&meta_buf[first[i] + j])) {
+		memset(mem + (size_t)j * CHUNK_SIZE, 0, CHUNK_SIZE);
+		continue;
+	    }
+	    chunk_ids[num_read] = meta_buf[first[i] + j].chunk_id;
+	    chunk_bufs[num_read] = mem + (size_t)j * CHUNK_SIZE;
+	    num_read ++;
+	}
+    }
+    if (read_chunks(chunk_ids, chunk_bufs, num_read) < 0) {
+	retstat = -EIO;
+	goto out;
+    }
 
-	switch (s_ret) {
-		case REC_FOUND:
-			md.chunk_id = rec->chunk_idx;
-			md.size = bytes_to_write;
-			log_msg("[=Dedup_FS=] [Found] <%08X%08X%08X%08X%08X> : <%u>\n",
-					hash[0],
-					hash[1],
-					hash[2],
-					hash[3],
-					hash[4],
-					rec->chunk_idx);
-			printf("[=Dedup_FS=] [Added] <%08X%08X%08X%08X%08X> : <%u>\n",
-					hash[0],
-					hash[1],
-					hash[2],
-					hash[3],
-					hash[4],
-					rec->chunk_idx);
+    for (i = 0; i < bufv->count; i ++) {
+	b = &bufv->buf[i];
+	if (b->flags & FUSE_BUF_IS_FD)
+	    continue;
+	wb_read(fi->fh, start_chunk + first[i], runs[i], b->mem);
+	if (first[i] == 0 && offset % CHUNK_SIZE)
+	    memmove(b->mem, (char *)b->mem + offset % CHUNK_SIZE, b->size);
+    }
 
-			break;
-		case REC_ADDED:
-			md.chunk_id = rec->chunk_idx;
-			md.size = bytes_to_write;
-			log_msg("[=Dedup_FS=] [Added] <%08X%08X%08X%08X%08X> : <%u>\n",
-					hash[0],
-					hash[1],
-					hash[2],
-					hash[3],
-					hash[4],
-					rec->chunk_idx);
-			printf("[=Dedup_FS=] [Added] <%08X%08X%08X%08X%08X> : <%u>\n",
-					hash[0],
-					hash[1],
-					hash[2],
-					hash[3],
-					hash[4],
-					rec->chunk_idx);
-
-
-			write_chunk(rec->chunk_idx, data_to_write);
-			break;
-		case REC_ERROR:
-			break;
-		default:
-			break;
+out:
+    meta_unlock(lock);
+    if (retstat == 0) {
+	*bufp = bufv;
+    } else if (bufv != NULL) {
+	for (i = 0; i < bufv->count; i ++) {
+	    if (!(bufv->buf[i].flags & FUSE_BUF_IS_FD))
+		free(bufv->buf[i].mem);
 	}
-
-	// update the meta data
-	meta_write(c, fd, &md);
-	return 1;
+	free(bufv);
+    }
+    free(meta_buf);
+    free(locs);
+    free(first);
+    free(chunk_bufs);
+    return retstat;
 }
 
-
+/** Write data to an open file
+ *
+ * Write should return exactly the number of bytes requested
+ * except on error.  An exception to this is when the 'direct_io'
+ * mount option is specified (see read operation).
+ *
+ * Changed in version 2.2
+ */
+// As  with read(), the documentation above is inconsistent with the
+// documentation for the write() system call.
+//
+// Logic flow of the write operation
+// 	- a chunk the write covers is stored straight from buf, unless
+// 	  the write buffer holds pieces of it
+// 	- the pieces of the partial first and last chunk go to the write
+// 	  buffer, a chunk is stored once its pieces cover it
+// 	- without a write buffer the old data of the partial chunks is
+// 	  read and they are stored right away
+// 	- all chunks to store are hashed together and written to the
+// 	  store with one write_chunks(), their records with one pwrite
 int bb_write_dedupe(const char *path, const char *buf, size_t size, off_t offset,
 	     struct fuse_file_info *fi)
 {
 	int retstat = 0;
 	
-	unsigned int remain_bytes, num_bytes_to_write, byte_offset;
-	unsigned int chunk_idx, c;
-	char *data;
-	unsigned int bytes_to_write;
-	int retval;
+	unsigned int remain_bytes, byte_offset, bytes_to_write;
+	unsigned int c, num_chunk, num_req, i;
+	struct store_req *reqs;
+	wb_chunk **full;
+	unsigned int num_full;
+	struct meta_wb *wb;
+	write_buf *b = NULL;
+	wb_chunk *wc;
+	char *partial;
+	const char *src;
+	int lock;
+
+	if (size == 0)
+		return 0;
+
+	if (BB_DATA->chunking == CHUNK_CDC)
+		return write_cdc(fi->fh, buf, size, offset);
 
-	retval = 0;
-	remain_bytes = size;
 	c = offset / CHUNK_SIZE;
-	byte_offset = offset % CHUNK_SIZE;
-	data = buf;
+	num_chunk = (offset + size - 1) / CHUNK_SIZE - c + 1;
+
+	reqs = (struct store_req *)malloc(sizeof(struct store_req) * num_chunk);
+	full = (wb_chunk **)malloc(sizeof(wb_chunk *) * num_chunk);
+	// only the first and the last chunk can be partial
+	partial = (char *)malloc(2 * CHUNK_SIZE);
+	num_req = 0;
+	num_full = 0;
+
+	// the read-modify-write of a chunk must not interleave with
+	// another writer of the same file
+	lock = meta_lock(fi->fh, 1);
+
+	wb = meta_wb(fi->fh);
+	// room for the partial first and last chunk
+	if (wb != NULL && wb->data != NULL && ((write_buf *)wb->data)->num + 2 > WB_CHUNKS
+			&& wb_flush_locked(fi->fh) < 0) {
+		retstat = -EIO;
+		goto out;
+	}
+	if (wb != NULL && wb->data == NULL)
+		wb->data = calloc(1, sizeof(write_buf));
+	b = wb != NULL ? (write_buf *)wb->data : NULL;
 
-	while (remain_bytes != 0) {
-		if ((byte_offset + remain_bytes) < CHUNK_SIZE) {
+	remain_bytes = size;
+	byte_offset = offset % CHUNK_SIZE;
+	src = buf;
+	for (i = 0; i < num_chunk; i ++) {
+		bytes_to_write = CHUNK_SIZE - byte_offset;
+		if (bytes_to_write > remain_bytes)
 			bytes_to_write = remain_bytes;
+
+		reqs[num_req].index = c + i;
+		reqs[num_req].lo = byte_offset;
+		reqs[num_req].hi = byte_offset + bytes_to_write;
+		wc = b != NULL ? wb_find(b, c + i) : NULL;
+		if (wc == NULL && bytes_to_write == CHUNK_SIZE) {
+			reqs[num_req].data = (char *)src;
+			reqs[num_req].whole = 1;
+		} else if (b == NULL) {
+			reqs[num_req].data = partial + (i == 0 ? 0 : CHUNK_SIZE);
+			memcpy(reqs[num_req].data + byte_offset, src, bytes_to_write);
+			reqs[num_req].whole = 0;
 		} else {
-			bytes_to_write = CHUNK_SIZE - byte_offset;
+			if (wc == NULL) {
+				wc = (wb_chunk *)calloc(1, sizeof(wb_chunk));
+				if (wc == NULL) {
+					retstat = -ENOMEM;
+					break;
+				}
+				wc->index = c + i;
+				b->chunks[b->num ++] = wc;
+			}
+			if (wb_put(fi->fh, wc, src, byte_offset, bytes_to_write) < 0) {
+				retstat = -EIO;
+				break;
+			}
+			if (wb->end < offset + (off_t)size)
+				wb->end = offset + size;
+
+			// held until the pieces cover the chunk
+			if (wc->lo > 0 || wc->hi < CHUNK_SIZE)
+				goto next;
+			reqs[num_req].data = wc->data;
+			reqs[num_req].lo = 0;
+			reqs[num_req].hi = CHUNK_SIZE;
+			reqs[num_req].whole = 1;
+			full[num_full ++] = wc;
 		}
-	
-		partial_write(c, byte_offset, bytes_to_write, data, fi->fh);
+		num_req ++;
 
-		byte_offset = 0;
+next:
 		remain_bytes -= bytes_to_write;
-		c += 1;
-		data += bytes_to_write;
-		retval += bytes_to_write;
+		byte_offset = 0;
+		src += bytes_to_write;
 	}
 
-	return retval;
+	// on error the covered chunks stay in the buffer for the next flush
+	if (retstat < 0)
+		num_full = 0;
+	else
+		retstat = store_chunks(fi->fh, reqs, num_req);
+	if (retstat == 0)
+		retstat = size;
+
+out:
+	for (i = 0; i < num_full; i ++)
+		wb_remove(b, full[i]);
+	if (wb != NULL)
+		wb_done(wb);
+	meta_unlock(lock);
+	free(reqs);
+	free(full);
+	free(partial);
 
+	return retstat;
 }
 
 
-int bb_write_dedupe_1(const char *path, const char *buf, size_t size, off_t offset,
-	     struct fuse_file_info *fi)
+/** Write contents of buffer to an open file
+ *
+ * The request as libfuse got it from the kernel, always one buffer in
+ * memory since bb_init() does not take splice reads.  The whole chunks in
+ * it are hashed where they are and the new ones are written from it (runs
+ * of them skip the containers, see write_chunks()).
+ */
+int bb_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+		struct fuse_file_info *fi)
 {
-	int retstat = 0;
-    
-  log_msg("\nbb_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n", 
-			path, buf, size, offset, fi);
-  // no need to get fpath on this one, since I work from fi->fh not the path
-  log_fi(fi);
-
-	/** Logic flow of the write operation (Read-Modify-Write fashion)
-	 * 		- read the first and last chunk
-	 * 		- modify these chunks
-	 * 		- calculate the hash value
-	 * 		- search the fingerprint table and get the target chunk index
-	 * 		- write to the chunk store
-	 * 		- modify the metafile
-	 **/
-	char data_to_write[CHUNK_SIZE];
-	int start, end, bytes_to_write;
-	int retval;
-	char *l_ptr;
-	int i;
-	unsigned int hash[5];
-	struct meta_data md;
-	enum search_stat s_ret;
-	fp_record *rec;
-
-/*
-	start = offset / CHUNK_SIZE;
-	end = (offset + size) / CHUNK_SIZE;
-	l_ptr = buf;		// start address of the chunk
-	bytes_to_write = size;
-
-	for (i = start; i <= end; i ++) {
-		memset(data_to_write, 0, CHUNK_SIZE);
-
-		// read meta data of this chunk
-		if (meta_read(i, fi->fh, &md)) {
-		
-		if (i == start) {
-			// copy the old data from chunk store
-			bytes_to_write = CHUNK_SIZE - offset % CHUNK_SIZE;
-			
-			// read data from the chunk store
-			retval = read_chunk(rec->chunk_idx, data_to_write);
-			// fill the rigth hole
-			memcpy(data_to_write + offset % CHUNK_SIZE, l_ptr, bytes_to_write);
-		} else if (i == end) {
-			bytes_to_write = (offset + size) % CHUNK_SIZE;
-
-			retval = read_chunk(rec->chunk_idx, data_to_write);
-
-			// fill the left hole
-			memcpy(data_to_write, l_ptr, bytes_to_write);
-		} else {
-			bytes_to_write = CHUNK_SIZE;
-			memcpy(data_to_write, l_ptr, CHUNK_SIZE);
-		}
-		log_msg("data ready %d\n", i);
-
-		// calculate the sha1 hash fingerprint
-		calc_hash(data_to_write, CHUNK_SIZE, hash);
-		
-		log_msg("hash calculated!\n");
-
-		// search fingerprint
-		s_ret = search_fp(hash, &rec);
-	
-		log_msg("fp table searched!\n");
-		int j;
-		switch (s_ret) {
-			case REC_FOUND:
-				// chunk already in chunk store
-				// we only need to update the metafile
-				
-				for(j = 0; j < 5; j ++) {
-					md.fp[j] = hash[j];
-				}
-				md.chunk_id = rec->chunk_idx;
-				md.size = bytes_to_write;
-				log_msg("[Write]: unique chunk found in chunk store!");
-				log_msg("     <FP>: %08X%08X%08X%08X%08X\n     <Chunk Id> %u",
-						md.fp[0],
-						md.fp[1],
-						md.fp[2],
-						md.fp[3],
-						md.fp[4],
-						rec->chunk_idx);
-				break;
-			case REC_ADDED:
-				// chunk not in chunk store
-				// we need to write it to the chunk store
-				retval =  write_chunk(rec->chunk_idx, data_to_write);
-				if(retval != 1) {
-					fprintf(stderr, "[bb_write_dedupe] failed to write data!\n");
-				}
-
-			  log_msg("[Write]: unique chunk added to chunk store!");
-				log_msg("     <FP>: %08X%08X%08X%08X%08X\n     <Chunk Id> %u",
-						md.fp[0],
-						md.fp[1],
-						md.fp[2],
-						md.fp[3],
-						md.fp[4],
-						rec->chunk_idx);
-
-				break;
-			case REC_ERROR:
-				// error happens
-				log_msg("[Write]: Error!");
-				log_msg("     <FP>: %08X%08X%08X%08X%08X\n",
-						md.fp[0],
-						md.fp[1],
-						md.fp[2],
-						md.fp[3],
-						md.fp[4]);
-
-				fprintf(stderr, "[bb_write_dedupe] failed to search fingerprint store!\n");
-				break;
-			default:
-				break;
-		}
-
-		l_ptr += bytes_to_write;
+    if (buf->count != 1 || buf->idx != 0 || buf->off != 0 || (buf->buf[0].flags & FUSE_BUF_IS_FD)) {
+	log_error("[=Dedup_FS=] [Error] write_buf of %s not in memory\n", path);
+	return -EIO;
+    }
 
-	}
-	} else {
-		// a new line
-			
-	}*/
-	return 1;
+    return bb_write_dedupe(path, (const char *)buf->buf[0].mem, fuse_buf_size(buf), offset, fi);
 }
 
 /** Get file system statistics
@@ -969,6 +2377,17 @@ int bb_flush(const char *path, struct fuse_file_info *fi)
     log_msg("\nbb_flush(path=\"%s\", fi=0x%08x)\n", path, fi);
     // no need to get fpath on this one, since I work from fi->fh not the path
     log_fi(fi);
+    if (is_stats_file(path))
+	return 0;
+
+    // store the buffered chunks, write out the open containers and write
+    // back the records changed in memory
+    if (wb_flush(fi->fh) < 0)
+	retstat = -EIO;
+    if (sync_chunk_store() < 0)
+	retstat = -EIO;
+    if (meta_sync(fi->fh) < 0)
+	retstat = -EIO;
 	
     return retstat;
 }
@@ -995,9 +2414,19 @@ int bb_release(const char *path, struct fuse_file_info *fi)
 	  path, fi);
     log_fi(fi);
 
+    if (is_stats_file(path)) {
+	stats_release(fi);
+	return 0;
+    }
+
     // We need to close the file.  Had we allocated any resources
     // (buffers etc) we'd need to free them here as well.
-    retstat = close(fi->fh);
+    // the chunks still buffered are stored and the records this open
+    // changed are written back first
+    if (wb_flush(fi->fh) < 0 || sync_chunk_store() < 0)
+	retstat = -EIO;
+    if (close_meta(fi->fh) < 0)
+	retstat = -1;
     
     return retstat;
 }
@@ -1017,6 +2446,11 @@ int bb_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 	    path, datasync, fi);
     log_fi(fi);
     
+    if (is_stats_file(path))
+	return 0;
+    if (wb_flush(fi->fh) < 0 || sync_chunk_store() < 0 || meta_sync(fi->fh) < 0)
+	return -EIO;
+
     if (datasync)
 	retstat = fdatasync(fi->fh);
     else
@@ -1119,6 +2553,10 @@ int bb_opendir(const char *path, struct fuse_file_info *fi)
     
     log_msg("\nbb_opendir(path=\"%s\", fi=0x%08x)\n",
 	  path, fi);
+    if (is_stats_dir(path)) {
+	fi->fh = 0;
+	return 0;
+    }
     bb_fullpath(fpath, path);
     
     dp = opendir(fpath);
@@ -1162,6 +2600,13 @@ int bb_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset
     
     log_msg("\nbb_readdir(path=\"%s\", buf=0x%08x, filler=0x%08x, offset=%lld, fi=0x%08x)\n",
 	    path, buf, filler, offset, fi);
+    if (is_stats_dir(path)) {
+	if (filler(buf, ".", NULL, 0) != 0 || filler(buf, "..", NULL, 0) != 0
+		|| filler(buf, STATS_TEXT + sizeof(STATS_DIR), NULL, 0) != 0
+		|| filler(buf, STATS_JSON + sizeof(STATS_DIR), NULL, 0) != 0)
+	    return -ENOMEM;
+	return 0;
+    }
     // once again, no need for fullpath -- but note that I need to cast fi->fh
     dp = (DIR *) (uintptr_t) fi->fh;
 
@@ -1204,6 +2649,9 @@ int bb_releasedir(const char *path, struct fuse_file_info *fi)
 	    path, fi);
     log_fi(fi);
     
+    // the stats dir has no DIR
+    if (is_stats_dir(path))
+	return 0;
     closedir((DIR *) (uintptr_t) fi->fh);
     
     return retstat;
@@ -1250,6 +2698,16 @@ void *bb_init(struct fuse_conn_info *conn)
 {
     
     log_msg("\nbb_init()\n");
+
+    // fuse_main has forked by now, threads started before would be gone
+    log_start();
+    log_info("hashing on %d threads\n", fp_pool_init(BB_DATA->hash_threads) + 1);
+    start_gc(BB_DATA->gc_interval);
+    // the replies to read_buf go to the kernel by splice when it can
+    if (BB_DATA->splice && (conn->capable & FUSE_CAP_SPLICE_WRITE))
+	conn->want |= FUSE_CAP_SPLICE_WRITE;
+    // write_buf takes memory only
+    conn->want &= ~FUSE_CAP_SPLICE_READ;
     
     return BB_DATA;
 }
@@ -1263,7 +2721,44 @@ void *bb_init(struct fuse_conn_info *conn)
  */
 void bb_destroy(void *userdata)
 {
+    struct cache_stats cs;
+    struct pack_stats ps;
+    struct fp_cache_stats fs;
+    struct fp_bloom_stats bs;
+    struct sparse_stats ss;
+
     log_msg("\nbb_destroy(userdata=0x%08x)\n", userdata);
+
+    // the filter goes away with the index, a false positive is a lookup
+    // of a new fingerprint the filter let through
+    get_fp_bloom_stats(&bs);
+    if (bs.checks > 0)
+	log_info("fingerprint filter: %llu checks %llu skipped the index, %llu false positives (%.2f%%), %llu fingerprints in %llu bytes\n",
+		bs.checks, bs.negatives, bs.false_positives,
+		bs.negatives + bs.false_positives ? 100.0 * bs.false_positives / (bs.negatives + bs.false_positives) : 0.0,
+		bs.keys, bs.bytes);
+    // the fingerprint index is mmap'ed, make sure it hits the disk
+    close_fp_table();
+    get_sparse_stats(&ss);
+    if (ss.segments > 0)
+	log_info("sparse index: %llu segments, %llu of %llu hooks found, %llu champions loaded, %llu hooks stored in %llu bytes\n",
+		ss.segments, ss.hits, ss.lookups, ss.champions, ss.hooks, ss.bytes);
+    close_sparse_index();
+    get_pack_stats(&ps);
+    close_chunk_store();
+
+    if (ps.chunks > 0)
+	log_info("chunk pack: %llu chunks in %llu bytes, pack file %llu bytes\n",
+		ps.chunks, ps.bytes, ps.tail);
+    get_cache_stats(&cs);
+    log_info("chunk cache: %llu hits %llu misses %llu evictions\n",
+	    cs.hits, cs.misses, cs.evictions);
+    close_chunk_cache();
+    get_fp_cache_stats(&fs);
+    log_info("fingerprint cache: %llu hits %llu misses %llu stale, %llu containers prefetched with %llu fingerprints\n",
+	    fs.hits, fs.misses, fs.stale, fs.prefetches, fs.entries);
+    close_fp_cache();
+    log_stop();
 }
 
 /**
@@ -1284,6 +2779,8 @@ int bb_access(const char *path, int mask)
    
     log_msg("\nbb_access(path=\"%s\", mask=0%o)\n",
 	    path, mask);
+    if (is_stats_dir(path) || is_stats_file(path))
+	return mask & W_OK ? -EACCES : 0;
     bb_fullpath(fpath, path);
     
     retstat = access(fpath, mask);
@@ -1319,6 +2816,11 @@ int bb_create(const char *path, mode_t mode, struct fuse_file_info *fi)
     fd = creat(fpath, mode);
     if (fd < 0)
 	retstat = bb_error("bb_create creat");
+    else if (meta_open(fd, fpath) < 0) {
+	retstat = bb_error("bb_create meta_open");
+	close(fd);
+	fd = -1;
+    }
     
     fi->fh = fd;
     
@@ -1386,8 +2888,73 @@ int bb_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *f
     return retstat;
 }
 
+// the operations the stats time, bb_oper goes through these
+static int bb_getattr_timed(const char *path, struct stat *statbuf)
+{
+	unsigned long long start = op_start();
+	int ret;
+
+	ret = bb_getattr(path, statbuf);
+	op_done(OP_GETATTR, start, 0);
+	return ret;
+}
+
+static int bb_fgetattr_timed(const char *path, struct stat *statbuf, struct fuse_file_info *fi)
+{
+	unsigned long long start = op_start();
+	int ret;
+
+	ret = bb_fgetattr_dedupe(path, statbuf, fi);
+	op_done(OP_GETATTR, start, 0);
+	return ret;
+}
+
+static int bb_read_timed(const char *path, char *buf, size_t size, off_t offset,
+			struct fuse_file_info *fi)
+{
+	unsigned long long start = op_start();
+	int ret;
+
+	ret = bb_read(path, buf, size, offset, fi);
+	op_done(OP_READ, start, ret > 0 ? ret : 0);
+	return ret;
+}
+
+static int bb_read_buf_timed(const char *path, struct fuse_bufvec **bufp, size_t size,
+			off_t offset, struct fuse_file_info *fi)
+{
+	unsigned long long start = op_start();
+	int ret;
+
+	ret = bb_read_buf(path, bufp, size, offset, fi);
+	op_done(OP_READ, start, ret == 0 ? fuse_buf_size(*bufp) : 0);
+	return ret;
+}
+
+static int bb_write_timed(const char *path, const char *buf, size_t size, off_t offset,
+			struct fuse_file_info *fi)
+{
+	unsigned long long start = op_start();
+	int ret;
+
+	ret = bb_write_dedupe(path, buf, size, offset, fi);
+	op_done(OP_WRITE, start, ret > 0 ? ret : 0);
+	return ret;
+}
+
+static int bb_write_buf_timed(const char *path, struct fuse_bufvec *buf, off_t offset,
+			struct fuse_file_info *fi)
+{
+	unsigned long long start = op_start();
+	int ret;
+
+	ret = bb_write_buf(path, buf, offset, fi);
+	op_done(OP_WRITE, start, ret > 0 ? ret : 0);
+	return ret;
+}
+
 struct fuse_operations bb_oper = {
-  .getattr = bb_getattr,
+  .getattr = bb_getattr_timed,
   .readlink = bb_readlink,
   // no .getdir -- that's deprecated
   .getdir = NULL,
@@ -1403,8 +2970,8 @@ struct fuse_operations bb_oper = {
   .truncate = bb_truncate,
   .utime = bb_utime,
   .open = bb_open,
-  .read = bb_read,
-  .write = bb_write_dedupe,
+  .read = bb_read_timed,
+  .write = bb_write_timed,
   /** Just a placeholder, don't set */ // huh???
   .statfs = bb_statfs,
   .flush = bb_flush,
@@ -1421,14 +2988,88 @@ struct fuse_operations bb_oper = {
   .init = bb_init,
   .destroy = bb_destroy,
   .access = bb_access,
-  .create = bb_create
+  .create = bb_create,
+  .write_buf = bb_write_buf_timed,
+  .read_buf = bb_read_buf_timed,
   //.ftruncate = bb_ftruncate,
-  //.fgetattr = bb_fgetattr
+  .fgetattr = bb_fgetattr_timed
+};
+
+// options of the dedupe layer, given with -o like the mount options
+//	chunking=fixed|cdc	fixed CHUNK_SIZE chunks (default) or content-defined
+//	cdc_min=, cdc_avg=, cdc_max=	chunk sizes for chunking=cdc
+//	fingerprint=auto|sha1|sha256|blake3|xxh3	hash of the chunks, auto keeps
+//		the one of the index or picks the fastest for a new index
+//	hash_threads=N	cores the chunks of a write are hashed on, 0 for all
+//	gc_interval=N	seconds between garbage collection passes, 0 for none
+//	cache_size=N	MB of chunks cached in memory, 0 for none
+//	fp_cache=N	MB of fingerprints prefetched by container, 0 for none
+//	bloom=N	MB of the filter in front of the index, 0 for none
+//	index=full|sparse	search every fingerprint (default) or only the
+//		containers sampled hooks point at
+//	hooks=N	MB of hooks of a sparse index
+//	sample=N	one chunk in 2^N is a hook
+//	compress=none|lz4|zstd	compression of the new unique chunks
+//	compress_level=N	zstd level, 3 if not given
+//	log_level=N	0 errors, 1 warnings, 2 info (default), 3 debug if the
+//		build has it
+//	stats=0|1	time the operations for /.dedupe/stats, on by default
+//	splice=0|1	reads hand fuse ranges of the chunk store to splice to
+//		the kernel, on by default.  0 copies every read through bb_read
+struct bb_options {
+    char *chunking;
+    char *fingerprint;
+    int hash_threads;
+    unsigned int gc_interval;
+    unsigned int cache_size;
+    unsigned int fp_cache;
+    unsigned int bloom;
+    char *index;
+    unsigned int hooks;
+    unsigned int sample;
+    unsigned int cdc_min;
+    unsigned int cdc_avg;
+    unsigned int cdc_max;
+    char *compress;
+    int compress_level;
+    int log_level;
+    int stats;
+    int splice;
+};
+
+#define BB_OPT(t, p) { t, offsetof(struct bb_options, p), 1 }
+
+static struct fuse_opt bb_opts[] = {
+    BB_OPT("chunking=%s", chunking),
+    BB_OPT("fingerprint=%s", fingerprint),
+    BB_OPT("hash_threads=%d", hash_threads),
+    BB_OPT("gc_interval=%u", gc_interval),
+    BB_OPT("cache_size=%u", cache_size),
+    BB_OPT("fp_cache=%u", fp_cache),
+    BB_OPT("bloom=%u", bloom),
+    BB_OPT("index=%s", index),
+    BB_OPT("hooks=%u", hooks),
+    BB_OPT("sample=%u", sample),
+    BB_OPT("cdc_min=%u", cdc_min),
+    BB_OPT("cdc_avg=%u", cdc_avg),
+    BB_OPT("cdc_max=%u", cdc_max),
+    BB_OPT("compress=%s", compress),
+    BB_OPT("compress_level=%d", compress_level),
+    BB_OPT("log_level=%d", log_level),
+    BB_OPT("stats=%d", stats),
+    BB_OPT("splice=%d", splice),
+    FUSE_OPT_END
 };
 
 void bb_usage()
 {
     fprintf(stderr, "usage:  bbfs [FUSE and mount options] rootDir mountPoint\n");
+    fprintf(stderr, "        -o chunking=fixed|cdc,cdc_min=N,cdc_avg=N,cdc_max=N\n");
+    fprintf(stderr, "        -o fingerprint=auto|sha1|sha256|blake3|xxh3,hash_threads=N\n");
+    fprintf(stderr, "        -o gc_interval=SECONDS,cache_size=MB,fp_cache=MB,bloom=MB\n");
+    fprintf(stderr, "        -o index=full|sparse,hooks=MB,sample=N\n");
+    fprintf(stderr, "        -o compress=none|lz4|zstd,compress_level=N\n");
+    fprintf(stderr, "        -o log_level=0|1|2|3,stats=0|1,splice=0|1\n");
     abort();
 }
 
@@ -1436,6 +3077,12 @@ int main(int argc, char *argv[])
 {
     int fuse_stat;
     struct bb_state *bb_data;
+    struct fuse_args args;
+    struct bb_options opts = { NULL, NULL, 0, GC_INTERVAL, CACHE_SIZE_MB, FP_CACHE_MB,
+	FP_BLOOM_MB, NULL, SPARSE_HOOKS_MB, SPARSE_SAMPLE_BITS,
+	CDC_MIN_SIZE, CDC_AVG_SIZE, CDC_MAX_SIZE,
+	NULL, COMP_ZSTD_LEVEL, LOG_INFO, 1, 1 };
+    int engine, comp;
 
     // bbfs doesn't do any access checking on its own (the comment
     // blocks in fuse.h mention some of the functions that need
@@ -1473,18 +3120,68 @@ int main(int argc, char *argv[])
     argc--;
     
     bb_data->logfile = log_open();
+
+    args = (struct fuse_args)FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &opts, bb_opts, NULL) == -1)
+	bb_usage();
+    log_level = opts.log_level;
+    op_stats_enable(opts.stats);
+
+    if (opts.chunking == NULL || strcmp(opts.chunking, "fixed") == 0) {
+	bb_data->chunking = CHUNK_FIXED;
+    } else if (strcmp(opts.chunking, "cdc") == 0) {
+	bb_data->chunking = CHUNK_CDC;
+	if (cdc_init(opts.cdc_min, opts.cdc_avg, opts.cdc_max) != 1)
+	    return -1;
+    } else {
+	bb_usage();
+    }
+
+    engine = fp_engine_id(opts.fingerprint == NULL ? "auto" : opts.fingerprint);
+    if (engine < 0)
+	bb_usage();
+    comp = comp_engine_id(opts.compress == NULL ? "none" : opts.compress);
+    if (comp < 0)
+	bb_usage();
+    if (opts.index != NULL && strcmp(opts.index, "full") != 0 && strcmp(opts.index, "sparse") != 0)
+	bb_usage();
    
     // +add by yyang
-    if(1!=init_fp_table())
+    if(1!=init_fp_table("fp_index"))
     {
 	printf("\nThe return value in init_fp_table() is wrong!\n");
 	return -1;
     }
     // -add by yyang.
-		init_chunk_store("chunk_store");
+    if (engine == 0)
+	engine = index_fingerprint() ? index_fingerprint() : fp_engine_auto();
+    if (fp_engine_init(engine) != 1
+	    || check_index_format(bb_data->chunking, engine) != 1
+	    || init_fp_summary("fp_index.bloom", opts.bloom) != 1)
+	return -1;
+    bb_data->hash_threads = opts.hash_threads;
+    bb_data->gc_interval = opts.gc_interval;
+    bb_data->splice = opts.splice;
+    if (!opts.splice)
+	bb_oper.read_buf = NULL;
+    if (init_chunk_cache(opts.cache_size) != 1
+	    || init_fp_cache(opts.fp_cache) != 1
+	    || comp_engine_init(comp, opts.compress_level) != 1)
+	return -1;
+    // the champions of a sparse index are searched in the fingerprint cache
+    if (opts.index != NULL && strcmp(opts.index, "sparse") == 0) {
+	if (opts.fp_cache == 0) {
+	    fprintf(stderr, "index=sparse needs the fingerprint cache\n");
+	    return -1;
+	}
+	if (init_sparse_index("fp_index.hooks", opts.hooks, opts.sample) != 1)
+	    return -1;
+    }
+    if (init_chunk_store("chunk_store") != 1)
+	return -1;
     // turn over control to fuse
     fprintf(stderr, "about to call fuse_main\n");
-    fuse_stat = fuse_main(argc, argv, &bb_oper, bb_data);
+    fuse_stat = fuse_main(args.argc, args.argv, &bb_oper, bb_data);
     fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
     
     return fuse_stat;
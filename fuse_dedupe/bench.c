@@ -0,0 +1,737 @@
+/* bench.c
+* fuse_dedupe project
+*
+* the bbfs operations driven in process, without a kernel mount.  The
+* callbacks of bb_oper are called directly by BENCH_THREADS_MAX threads at
+* most, the way the FUSE loop would call them, and fuse_get_context() is
+* answered here with the state of the bench mount.  Everything the mount
+* keeps (the index, the store, the meta files in root/) goes to a fresh
+* directory that is removed at the end
+*
+*   bench [-d dir] [-s mb] [-t threads] [-b kb] [-r ratios] [-c] [-f engine]
+*         [-z engine] [-C cache_mb] [-p] [-k] [workload ...]
+*
+*   -d dir      work directory, bench.XXXXXX in the current one if not given
+*   -s mb       MB written or read by each phase, 256 if not given
+*   -t threads  threads issuing requests at the same time, 1 if not given
+*   -b kb       size of a request, 128 KB like the kernel sends them
+*   -r ratios   dedupe ratios of the dedup phases, 2,4,8 if not given
+*   -c          content-defined chunking
+*   -f engine   fingerprint engine, auto if not given
+*   -z engine   compression of the new chunks, none if not given
+*   -C cache_mb chunk cache, CACHE_SIZE_MB if not given
+*   -p          reads copied by bb_read, like -o splice=0, instead of the
+*               buffers of bb_read_buf copied by fuse_buf_copy()
+*   -k          keep the work directory
+*
+* the workloads run in the order given, all of them if none is:
+*
+*   seqwrite    each thread writes a file of its own in order, every chunk new
+*   seqread     the files of seqwrite read back in order
+*   randwrite   requests at random aligned offsets of those files, new chunks
+*   randread    requests at random aligned offsets of those files
+*
+*   what seqread and randread get is checked against what was written there
+*   dedup       for every ratio R a file for each thread, their chunks
+*               repeat a set of 1/R as many distinct ones
+*   overwrite   small unaligned writes over a few MB of one file per thread,
+*               every one of them new data
+*   smallfiles  files of 4 to 64 KB created, written and released, then
+*               looked up and read back
+*
+* For every phase the throughput, the p50 and p99 latency of its requests
+* (a whole file for smallfiles) and, for phases that write, the ratio of
+* the bytes written to the bytes of new chunks stored.  The collector does
+* not run while the phases do, the store only grows.  The latencies of the
+* operations inside bbfs are in /.dedupe/stats of a real mount
+*/
+
+// mkdtemp() and nftw()
+#define _GNU_SOURCE
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fuse.h>
+
+#include "log.h"
+#include "dedupe.h"
+#include "fp_table.h"
+#include "chunk_store.h"
+#include "chunk_cache.h"
+#include "fingerprint.h"
+#include "cdc.h"
+#include "compress.h"
+#include "fp_cache.h"
+#include "fp_bloom.h"
+
+#define BENCH_THREADS_MAX 64
+#define BENCH_RATIOS_MAX 8
+// overwrite rewrites this much of each file, in writes of up to 8 KB
+#define OVERWRITE_SPAN (4 << 20)
+#define OVERWRITE_MAX 8192
+#define SMALL_MIN 4096
+#define SMALL_MAX 65536
+
+extern struct fuse_operations bb_oper;
+
+static struct bb_state bench_state;
+static struct fuse_context bench_context;
+
+// bbfs finds its state here, there is no FUSE loop to set it
+struct fuse_context *fuse_get_context(void)
+{
+	return &bench_context;
+}
+
+struct bench_opts {
+	const char *dir;
+	unsigned long long size;
+	int threads;
+	unsigned int block;
+	unsigned int ratios[BENCH_RATIOS_MAX];
+	int num_ratios;
+	int chunking;
+	const char *fingerprint;
+	const char *compress;
+	unsigned int cache_mb;
+	int copy_reads;
+	int keep;
+};
+
+static struct bench_opts opts;
+
+// one thread of a phase
+struct bench_arg {
+	int id;
+	unsigned int ratio;
+	unsigned long long bytes;
+	unsigned long long *lat;	// ns of each request
+	unsigned int num_lat;
+	unsigned int max_lat;
+	unsigned int seed;
+	int failed;
+};
+
+typedef void (*bench_fn)(struct bench_arg *);
+
+// chunks get their data from a counter, a chunk of a number that was used
+// before dedupes against it
+static unsigned long long next_chunk = 1;
+
+static double now_sec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long long now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long take_chunks(unsigned long long num)
+{
+	return __atomic_fetch_add(&next_chunk, num, __ATOMIC_RELAXED);
+}
+
+// the first len bytes of the data of chunk number id
+static void fill_chunk(char *buf, unsigned long long id, unsigned int len)
+{
+	unsigned long long x = id * 0x9E3779B97F4A7C15ULL + 1;
+	unsigned int i;
+
+	for (i = 0; i < len; i += sizeof(x)) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		memcpy(buf + i, &x, len - i < sizeof(x) ? len - i : sizeof(x));
+	}
+}
+
+// data of consecutive chunks from first on, for a request at a chunk boundary
+static void fill_chunks(char *buf, unsigned long long first, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i += CHUNK_SIZE)
+		fill_chunk(buf + i, first + i / CHUNK_SIZE, len - i < CHUNK_SIZE ? len - i : CHUNK_SIZE);
+}
+
+static void add_lat(struct bench_arg *a, unsigned long long start)
+{
+	unsigned long long *lat;
+
+	if (a->num_lat == a->max_lat) {
+		lat = (unsigned long long *)realloc(a->lat, sizeof(*lat) * (a->max_lat ? a->max_lat * 2 : 1024));
+		if (lat == NULL)
+			return;
+		a->lat = lat;
+		a->max_lat = a->max_lat ? a->max_lat * 2 : 1024;
+	}
+	a->lat[a->num_lat ++] = now_ns() - start;
+}
+
+static int bench_open(const char *path, int flags, struct fuse_file_info *fi)
+{
+	memset(fi, 0, sizeof(*fi));
+	fi->flags = flags;
+	return bb_oper.open(path, fi);
+}
+
+static int bench_create(const char *path, struct fuse_file_info *fi)
+{
+	memset(fi, 0, sizeof(*fi));
+	fi->flags = O_RDWR | O_CREAT;
+	return bb_oper.create(path, 0644, fi);
+}
+
+static void bench_close(const char *path, struct fuse_file_info *fi)
+{
+	bb_oper.flush(path, fi);
+	bb_oper.release(path, fi);
+}
+
+// a read the way libfuse does it: through read_buf when it is there,
+// copying its buffers into buf
+static int bench_read(const char *path, char *buf, size_t size, off_t off,
+		struct fuse_file_info *fi)
+{
+	struct fuse_bufvec *src, dst = FUSE_BUFVEC_INIT(size);
+	unsigned int i;
+	ssize_t ret;
+
+	if (bb_oper.read_buf == NULL)
+		return bb_oper.read(path, buf, size, off, fi);
+
+	ret = bb_oper.read_buf(path, &src, size, off, fi);
+	if (ret < 0)
+		return ret;
+	dst.buf[0].mem = buf;
+	ret = fuse_buf_copy(&dst, src, 0);
+	for (i = 0; i < src->count; i ++) {
+		if (!(src->buf[i].flags & FUSE_BUF_IS_FD))
+			free(src->buf[i].mem);
+	}
+	free(src);
+	return ret;
+}
+
+// a write the way libfuse does it, the request in one buffer of memory
+static int bench_write(const char *path, const char *buf, size_t size, off_t off,
+		struct fuse_file_info *fi)
+{
+	struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+
+	if (bb_oper.write_buf == NULL)
+		return bb_oper.write(path, buf, size, off, fi);
+
+	src.buf[0].mem = (void *)buf;
+	return bb_oper.write_buf(path, &src, off, fi);
+}
+
+static unsigned long long file_size()
+{
+	return opts.size / opts.threads / opts.block * opts.block;
+}
+
+// the first chunk number of every request of the files of run_file, by
+// thread and offset / opts.block.  0 where nothing was written
+static unsigned long long *file_chunks[BENCH_THREADS_MAX];
+
+// the requests of a thread over its file, in order or at random offsets.
+// Writes are new chunks, reads are checked against them
+static void run_file(struct bench_arg *a, int write, int random)
+{
+	unsigned long long size = file_size(), off, start, done, first = 0;
+	unsigned long long *ids;
+	struct fuse_file_info fi;
+	char path[64];
+	char *buf, *want = NULL;
+	int ret;
+
+	sprintf(path, "/seq%d", a->id);
+	buf = (char *)malloc(opts.block);
+	if (write && !random) {
+		free(file_chunks[a->id]);
+		file_chunks[a->id] = (unsigned long long *)calloc(size / opts.block, sizeof(*ids));
+		ret = bench_create(path, &fi);
+	} else {
+		ret = bench_open(path, write ? O_RDWR : O_RDONLY, &fi);
+	}
+	ids = file_chunks[a->id];
+	if (!write)
+		want = (char *)malloc(opts.block);
+	if (ret != 0) {
+		a->failed = 1;
+		free(buf);
+		free(want);
+		return;
+	}
+
+	for (done = 0; done < size; done += opts.block) {
+		off = random ? (unsigned long long)(rand_r(&a->seed) % (size / opts.block)) * opts.block : done;
+		if (write) {
+			first = take_chunks(opts.block / CHUNK_SIZE);
+			fill_chunks(buf, first, opts.block);
+		}
+		start = now_ns();
+		if (write)
+			ret = bench_write(path, buf, opts.block, off, &fi);
+		else
+			ret = bench_read(path, buf, opts.block, off, &fi);
+		add_lat(a, start);
+		if (ret != (int)opts.block) {
+			a->failed = 1;
+			break;
+		}
+		a->bytes += opts.block;
+
+		if (ids == NULL)
+			continue;
+		if (write) {
+			ids[off / opts.block] = first;
+		} else if (ids[off / opts.block] != 0) {
+			fill_chunks(want, ids[off / opts.block], opts.block);
+			if (memcmp(buf, want, opts.block) != 0) {
+				fprintf(stderr, "%s: wrong data read at %llu!\n", path, off);
+				a->failed = 1;
+				break;
+			}
+		}
+	}
+
+	bench_close(path, &fi);
+	free(buf);
+	free(want);
+}
+
+static void run_seqwrite(struct bench_arg *a)
+{
+	run_file(a, 1, 0);
+}
+
+static void run_seqread(struct bench_arg *a)
+{
+	run_file(a, 0, 0);
+}
+
+static void run_randwrite(struct bench_arg *a)
+{
+	run_file(a, 1, 1);
+}
+
+static void run_randread(struct bench_arg *a)
+{
+	run_file(a, 0, 1);
+}
+
+// the chunks of all threads of a dedup phase repeat a set of 1/ratio as
+// many distinct ones, from dedup_base on
+static unsigned long long dedup_base = 0;
+
+static void run_dedup(struct bench_arg *a)
+{
+	unsigned long long size = file_size(), distinct, first, done, start;
+	struct fuse_file_info fi;
+	unsigned int i;
+	char path[64];
+	char *buf;
+	int ret;
+
+	distinct = size * opts.threads / CHUNK_SIZE / a->ratio;
+	if (distinct == 0)
+		distinct = 1;
+	first = size / CHUNK_SIZE * a->id;
+	sprintf(path, "/dedup%u_%d", a->ratio, a->id);
+	if (bench_create(path, &fi) != 0) {
+		a->failed = 1;
+		return;
+	}
+
+	buf = (char *)malloc(opts.block);
+	for (done = 0; done < size; done += opts.block) {
+		for (i = 0; i < opts.block; i += CHUNK_SIZE)
+			fill_chunk(buf + i, dedup_base + (first + (done + i) / CHUNK_SIZE) % distinct, CHUNK_SIZE);
+		start = now_ns();
+		ret = bench_write(path, buf, opts.block, done, &fi);
+		add_lat(a, start);
+		if (ret != (int)opts.block) {
+			a->failed = 1;
+			break;
+		}
+		a->bytes += opts.block;
+	}
+
+	bench_close(path, &fi);
+	free(buf);
+}
+
+// writes that start and end inside chunks, the write buffer and the
+// read-modify-write of chunks are what this costs.  The first write of the
+// span counts in the bytes, not in the latencies
+static void run_overwrite(struct bench_arg *a)
+{
+	unsigned long long size = file_size(), done, start, off;
+	unsigned int span = OVERWRITE_SPAN, len;
+	struct fuse_file_info fi;
+	char path[64];
+	char *buf;
+	int ret;
+
+	sprintf(path, "/over%d", a->id);
+	if (bench_create(path, &fi) != 0) {
+		a->failed = 1;
+		return;
+	}
+	// in requests of the block size, as the kernel sends them.  The
+	// chunks of a request stay pending until it is stored, and one of a
+	// few MB would wait on the pending ones of the other threads
+	buf = (char *)malloc(span);
+	for (off = 0; off < span && !a->failed; off += opts.block) {
+		len = span - off < opts.block ? span - off : opts.block;
+		fill_chunks(buf, take_chunks(len / CHUNK_SIZE), len);
+		if (bench_write(path, buf, len, off, &fi) != (int)len)
+			a->failed = 1;
+		a->bytes += len;
+	}
+
+	for (done = 0; done < size && !a->failed; done += len) {
+		len = 1 + rand_r(&a->seed) % OVERWRITE_MAX;
+		off = rand_r(&a->seed) % (span - len);
+		fill_chunks(buf, take_chunks(len / CHUNK_SIZE + 1), len);
+		start = now_ns();
+		ret = bench_write(path, buf, len, off, &fi);
+		add_lat(a, start);
+		if (ret != (int)len) {
+			a->failed = 1;
+			break;
+		}
+		a->bytes += len;
+	}
+
+	bench_close(path, &fi);
+	free(buf);
+}
+
+// a file is a request here: create, write, release, then getattr, open,
+// read and release
+static void run_smallfiles(struct bench_arg *a)
+{
+	unsigned long long size = file_size(), done, start;
+	struct fuse_file_info fi;
+	struct stat st;
+	unsigned int len, n, i;
+	char path[64];
+	char *buf;
+
+	buf = (char *)malloc(SMALL_MAX);
+	for (done = 0, n = 0; done < size && !a->failed; done += len, n ++) {
+		len = SMALL_MIN + rand_r(&a->seed) % (SMALL_MAX - SMALL_MIN + 1);
+		fill_chunks(buf, take_chunks(len / CHUNK_SIZE + 1), len);
+		sprintf(path, "/small%d_%u", a->id, n);
+		start = now_ns();
+		if (bench_create(path, &fi) != 0) {
+			a->failed = 1;
+			break;
+		}
+		if (bench_write(path, buf, len, 0, &fi) != (int)len)
+			a->failed = 1;
+		bench_close(path, &fi);
+		add_lat(a, start);
+		a->bytes += len;
+	}
+
+	for (i = 0; i < n && !a->failed; i ++) {
+		sprintf(path, "/small%d_%u", a->id, i);
+		start = now_ns();
+		if (bb_oper.getattr(path, &st) != 0 || bench_open(path, O_RDONLY, &fi) != 0) {
+			a->failed = 1;
+			break;
+		}
+		if (bench_read(path, buf, SMALL_MAX, 0, &fi) != st.st_size)
+			a->failed = 1;
+		bb_oper.release(path, &fi);
+		add_lat(a, start);
+	}
+	free(buf);
+}
+
+static int cmp_ull(const void *x, const void *y)
+{
+	unsigned long long a = *(const unsigned long long *)x, b = *(const unsigned long long *)y;
+
+	return a < b ? -1 : a > b;
+}
+
+// a thread of a phase and what it runs
+struct bench_slot {
+	bench_fn fn;
+	struct bench_arg arg;
+};
+
+static void *bench_thread(void *arg)
+{
+	struct bench_slot *slot = (struct bench_slot *)arg;
+
+	slot->fn(&slot->arg);
+	return NULL;
+}
+
+static int run_phase(const char *name, bench_fn fn, unsigned int ratio, int writes)
+{
+	struct bench_slot slots[BENCH_THREADS_MAX];
+	pthread_t tids[BENCH_THREADS_MAX];
+	struct index_stats before, after;
+	unsigned long long bytes = 0, *lat, num = 0, stored;
+	char label[32];
+	double sec;
+	int i, failed = 0;
+
+	get_index_stats(&before);
+	sec = now_sec();
+	for (i = 0; i < opts.threads; i ++) {
+		memset(&slots[i], 0, sizeof(slots[i]));
+		slots[i].fn = fn;
+		slots[i].arg.id = i;
+		slots[i].arg.ratio = ratio;
+		slots[i].arg.seed = i * 7919 + ratio;
+		pthread_create(&tids[i], NULL, bench_thread, &slots[i]);
+	}
+	for (i = 0; i < opts.threads; i ++)
+		pthread_join(tids[i], NULL);
+	sec = now_sec() - sec;
+	get_index_stats(&after);
+
+	for (i = 0; i < opts.threads; i ++) {
+		bytes += slots[i].arg.bytes;
+		num += slots[i].arg.num_lat;
+		failed |= slots[i].arg.failed;
+	}
+	lat = (unsigned long long *)malloc(sizeof(*lat) * (num ? num : 1));
+	for (i = 0, num = 0; i < opts.threads; i ++) {
+		memcpy(lat + num, slots[i].arg.lat, sizeof(*lat) * slots[i].arg.num_lat);
+		num += slots[i].arg.num_lat;
+		free(slots[i].arg.lat);
+	}
+	qsort(lat, num, sizeof(*lat), cmp_ull);
+
+	if (ratio)
+		snprintf(label, sizeof(label), "%s-%ux", name, ratio);
+	else
+		snprintf(label, sizeof(label), "%s", name);
+	printf("%-14s %8.1f MB %8.3f s %9.1f MB/s %9llu req  p50 %9.1f us  p99 %9.1f us",
+			label, bytes / 1048576.0, sec, bytes / 1048576.0 / sec, num,
+			num ? lat[num / 2] / 1e3 : 0.0, num ? lat[num * 99 / 100] / 1e3 : 0.0);
+	stored = (after.stored_chunks - before.stored_chunks) * CHUNK_SIZE;
+	if (writes)
+		printf("  dedupe %6.2fx", stored ? (double)bytes / stored : 0.0);
+	printf("%s\n", failed ? "  FAILED" : "");
+
+	free(lat);
+	return failed ? -1 : 0;
+}
+
+static int mount_bench()
+{
+	struct fuse_conn_info conn;
+	int engine, comp;
+
+	if (mkdir("root", 0755) < 0 && errno != EEXIST) {
+		perror("bench root");
+		return -1;
+	}
+	bench_state.rootdir = realpath("root", NULL);
+	bench_state.logfile = log_open();
+	bench_state.chunking = opts.chunking;
+	bench_state.hash_threads = 0;
+	bench_state.gc_interval = 0;
+	bench_state.splice = !opts.copy_reads;
+	if (opts.copy_reads)
+		bb_oper.read_buf = NULL;
+	bench_context.private_data = &bench_state;
+	bench_context.uid = getuid();
+	bench_context.gid = getgid();
+	bench_context.pid = getpid();
+
+	engine = fp_engine_id(opts.fingerprint);
+	comp = comp_engine_id(opts.compress);
+	if (engine < 0 || comp < 0) {
+		fprintf(stderr, "Unknown engine!\n");
+		return -1;
+	}
+	if (opts.chunking == CHUNK_CDC && cdc_init(CDC_MIN_SIZE, CDC_AVG_SIZE, CDC_MAX_SIZE) != 1)
+		return -1;
+	if (init_fp_table("fp_index") != 1)
+		return -1;
+	if (engine == 0)
+		engine = fp_engine_auto();
+	if (fp_engine_init(engine) != 1
+			|| check_index_format(opts.chunking, engine) != 1
+			|| init_fp_summary("fp_index.bloom", FP_BLOOM_MB) != 1
+			|| init_chunk_cache(opts.cache_mb) != 1
+			|| init_fp_cache(FP_CACHE_MB) != 1
+			|| comp_engine_init(comp, COMP_ZSTD_LEVEL) != 1
+			|| init_chunk_store("chunk_store") != 1)
+		return -1;
+	memset(&conn, 0, sizeof(conn));
+	bb_oper.init(&conn);
+	return 1;
+}
+
+static void umount_bench()
+{
+	bb_oper.destroy(&bench_state);
+	fclose(bench_state.logfile);
+	free(bench_state.rootdir);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	return remove(path);
+}
+
+static int parse_ratios(const char *s)
+{
+	char *end;
+
+	opts.num_ratios = 0;
+	while (*s && opts.num_ratios < BENCH_RATIOS_MAX) {
+		opts.ratios[opts.num_ratios] = strtoul(s, &end, 0);
+		if (end == s || opts.ratios[opts.num_ratios] == 0)
+			return -1;
+		opts.num_ratios ++;
+		s = *end == ',' ? end + 1 : end;
+	}
+	return opts.num_ratios > 0 ? 1 : -1;
+}
+
+static void usage()
+{
+	fprintf(stderr, "usage:  bench [-d dir] [-s mb] [-t threads] [-b kb] [-r ratios] [-c]\n"
+			"              [-f engine] [-z engine] [-C cache_mb] [-p] [-k] [workload ...]\n"
+			"        workloads: seqwrite seqread randwrite randread dedup overwrite smallfiles\n");
+	exit(1);
+}
+
+static const char *all_workloads[] = {
+	"seqwrite", "seqread", "randwrite", "randread", "dedup", "overwrite", "smallfiles", NULL
+};
+
+int main(int argc, char *argv[])
+{
+	char dir[PATH_MAX], cwd[PATH_MAX];
+	const char **workloads;
+	struct index_stats is;
+	int c, i, j, ret = 0;
+
+	opts.size = 256ULL << 20;
+	opts.threads = 1;
+	opts.block = 128 << 10;
+	opts.chunking = CHUNK_FIXED;
+	opts.fingerprint = "auto";
+	opts.compress = "none";
+	opts.cache_mb = CACHE_SIZE_MB;
+	parse_ratios("2,4,8");
+
+	while ((c = getopt(argc, argv, "d:s:t:b:r:cf:z:C:pk")) != -1) {
+		switch (c) {
+		case 'd': opts.dir = optarg; break;
+		case 's': opts.size = strtoull(optarg, NULL, 0) << 20; break;
+		case 't': opts.threads = atoi(optarg); break;
+		case 'b': opts.block = strtoul(optarg, NULL, 0) << 10; break;
+		case 'r': if (parse_ratios(optarg) < 0) usage(); break;
+		case 'c': opts.chunking = CHUNK_CDC; break;
+		case 'f': opts.fingerprint = optarg; break;
+		case 'z': opts.compress = optarg; break;
+		case 'C': opts.cache_mb = strtoul(optarg, NULL, 0); break;
+		case 'p': opts.copy_reads = 1; break;
+		case 'k': opts.keep = 1; break;
+		default: usage();
+		}
+	}
+	if (opts.threads < 1 || opts.threads > BENCH_THREADS_MAX || opts.block < CHUNK_SIZE
+			|| opts.block % CHUNK_SIZE != 0 || file_size() < opts.block)
+		usage();
+	workloads = optind < argc ? (const char **)argv + optind : all_workloads;
+
+	if (opts.dir != NULL) {
+		if (mkdir(opts.dir, 0755) < 0) {
+			perror(opts.dir);
+			return 1;
+		}
+		snprintf(dir, sizeof(dir), "%s", opts.dir);
+	} else {
+		snprintf(dir, sizeof(dir), "bench.XXXXXX");
+		if (mkdtemp(dir) == NULL) {
+			perror("bench dir");
+			return 1;
+		}
+	}
+	if (getcwd(cwd, sizeof(cwd)) == NULL || chdir(dir) < 0) {
+		perror(dir);
+		return 1;
+	}
+
+	if (mount_bench() != 1) {
+		ret = 1;
+		goto out;
+	}
+	printf("bench: %s chunking, %s fingerprints, %s compression, %d threads, %u KB requests, %llu MB a phase\n",
+			opts.chunking == CHUNK_CDC ? "cdc" : "fixed", fp_engine_name(index_fingerprint()),
+			opts.compress, opts.threads, opts.block >> 10, opts.size >> 20);
+
+	for (i = 0; workloads[i] != NULL && ret == 0; i ++) {
+		if (strcmp(workloads[i], "seqwrite") == 0) {
+			ret = run_phase("seqwrite", run_seqwrite, 0, 1);
+		} else if (strcmp(workloads[i], "seqread") == 0) {
+			ret = run_phase("seqread", run_seqread, 0, 0);
+		} else if (strcmp(workloads[i], "randwrite") == 0) {
+			ret = run_phase("randwrite", run_randwrite, 0, 1);
+		} else if (strcmp(workloads[i], "randread") == 0) {
+			ret = run_phase("randread", run_randread, 0, 0);
+		} else if (strcmp(workloads[i], "dedup") == 0) {
+			for (j = 0; j < opts.num_ratios && ret == 0; j ++) {
+				// the chunks of a ratio dedupe only among themselves
+				dedup_base = take_chunks(file_size() * opts.threads / CHUNK_SIZE);
+				ret = run_phase("dedup", run_dedup, opts.ratios[j], 1);
+			}
+		} else if (strcmp(workloads[i], "overwrite") == 0) {
+			ret = run_phase("overwrite", run_overwrite, 0, 1);
+		} else if (strcmp(workloads[i], "smallfiles") == 0) {
+			ret = run_phase("smallfiles", run_smallfiles, 0, 1);
+		} else {
+			fprintf(stderr, "Unknown workload %s!\n", workloads[i]);
+			ret = 1;
+		}
+	}
+
+	get_index_stats(&is);
+	printf("%-14s %llu chunks referenced, %llu stored, dedupe %.2fx\n", "total",
+			is.ref_chunks, is.stored_chunks,
+			is.stored_chunks ? (double)is.ref_chunks / is.stored_chunks : 0.0);
+	umount_bench();
+	for (i = 0; i < BENCH_THREADS_MAX; i ++)
+		free(file_chunks[i]);
+
+out:
+	if (chdir(cwd) < 0)
+		perror(cwd);
+	if (!opts.keep)
+		nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	return ret != 0;
+}
@@ -0,0 +1,174 @@
+/* cdc.c
+* fuse_dedupe project
+*
+* content-defined chunking with a 32-bit gear hash,
+*	h = (h << 1) + gear[byte]
+* so the hash only depends on the last 32 bytes and a boundary stays where
+* it is when data before it is inserted or removed.  The gear values are
+* the murmur3 finalizer of the byte, the plain C kernel looks them up in a
+* table and the AVX-512 one computes them, a gather is slower than that.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "cdc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_CDC_AVX512
+#endif
+
+static unsigned int gear[256];
+
+#define GEAR_SEED 0x9E3779B9
+
+static unsigned int gear_mix(unsigned int x) {
+	x ^= x >> 16;
+	x *= 0x85EBCA6B;
+	x ^= x >> 13;
+	x *= 0xC2B2AE35;
+	x ^= x >> 16;
+	return x;
+}
+
+static unsigned int min_size = CDC_MIN_SIZE;
+static unsigned int avg_size = CDC_AVG_SIZE;
+static unsigned int max_size = CDC_MAX_SIZE;
+// stricter mask below avg_size, looser one above
+static unsigned int mask_s, mask_l;
+
+// scan data[i..end) for a position where (h & mask) == 0, returns the
+// chunk length ending there or 0 if there is none.  h carries over
+typedef unsigned int (*cdc_scan_t)(const unsigned char *, unsigned int, unsigned int,
+		unsigned int, unsigned int *);
+
+static unsigned int scan_c(const unsigned char *p, unsigned int i, unsigned int end,
+		unsigned int mask, unsigned int *hp) {
+	unsigned int h = *hp;
+
+	for (; i < end; i ++) {
+		h = (h << 1) + gear[p[i]];
+		if (!(h & mask))
+			return i + 1;
+	}
+
+	*hp = h;
+	return 0;
+}
+
+#ifdef HAVE_CDC_AVX512
+// sixteen positions at a time.  With g[j] the gear values of the 16 bytes,
+//	h[j] = (h << (j + 1)) + sum over m <= j of g[m] << (j - m)
+// the sum does not depend on h, it is a prefix sum built in four
+// shift-and-add steps, so only (h << 16) + sum[15] is carried from one
+// block to the next and the blocks overlap in the pipeline
+__attribute__((target("avx512f")))
+static unsigned int scan_avx512(const unsigned char *p, unsigned int i, unsigned int end,
+		unsigned int mask, unsigned int *hp) {
+	const __m512i by1 = _mm512_setr_epi32(0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14);
+	const __m512i by2 = _mm512_setr_epi32(0, 0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13);
+	const __m512i by4 = _mm512_setr_epi32(0, 0, 0, 0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11);
+	const __m512i by8 = _mm512_setr_epi32(0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 3, 4, 5, 6, 7);
+	const __m512i carry = _mm512_setr_epi32(1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16);
+	const __m512i vmask = _mm512_set1_epi32(mask);
+	const __m512i seed = _mm512_set1_epi32(GEAR_SEED);
+	const __m512i mul1 = _mm512_set1_epi32(0x85EBCA6B);
+	const __m512i mul2 = _mm512_set1_epi32(0xC2B2AE35);
+	unsigned int h = *hp;
+	__mmask16 hits;
+	__m512i v, t;
+
+	for (; i + 16 <= end; i += 16) {
+		// gear_mix() of the 16 bytes
+		v = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(p + i)));
+		v = _mm512_add_epi32(v, seed);
+		v = _mm512_xor_si512(v, _mm512_srli_epi32(v, 16));
+		v = _mm512_mullo_epi32(v, mul1);
+		v = _mm512_xor_si512(v, _mm512_srli_epi32(v, 13));
+		v = _mm512_mullo_epi32(v, mul2);
+		v = _mm512_xor_si512(v, _mm512_srli_epi32(v, 16));
+
+		v = _mm512_mask_add_epi32(v, 0xFFFE, v, _mm512_slli_epi32(_mm512_permutexvar_epi32(by1, v), 1));
+		v = _mm512_mask_add_epi32(v, 0xFFFC, v, _mm512_slli_epi32(_mm512_permutexvar_epi32(by2, v), 2));
+		v = _mm512_mask_add_epi32(v, 0xFFF0, v, _mm512_slli_epi32(_mm512_permutexvar_epi32(by4, v), 4));
+		v = _mm512_mask_add_epi32(v, 0xFF00, v, _mm512_slli_epi32(_mm512_permutexvar_epi32(by8, v), 8));
+
+		t = _mm512_add_epi32(v, _mm512_sllv_epi32(_mm512_set1_epi32(h), carry));
+		hits = _mm512_testn_epi32_mask(t, vmask);
+		if (hits)
+			return i + __builtin_ctz(hits) + 1;
+
+		h = (h << 16) + _mm_extract_epi32(_mm512_extracti32x4_epi32(v, 3), 3);
+	}
+
+	*hp = h;
+	return scan_c(p, i, end, mask, hp);
+}
+#endif
+
+static cdc_scan_t cdc_scan = scan_c;
+
+// a mask of the top bits of the hash, they depend on the most bytes
+static unsigned int top_bits(unsigned int bits) {
+	return bits >= 32 ? 0xFFFFFFFF : ~(0xFFFFFFFF >> bits);
+}
+
+int cdc_init(unsigned int min, unsigned int avg, unsigned int max) {
+	unsigned int i, bits;
+
+	if (min < 64 || min >= avg || avg >= max || max > CDC_MAX_LIMIT) {
+		fprintf(stderr, "Bad chunk sizes min %u avg %u max %u!\n", min, avg, max);
+		return -1;
+	}
+
+	for (bits = 0; (2u << bits) <= avg; bits ++)
+		;
+	min_size = min;
+	avg_size = 1u << bits;
+	max_size = max;
+	mask_s = top_bits(bits + 2);
+	mask_l = top_bits(bits > 2 ? bits - 2 : 1);
+
+	// the table has to be the same on every mount, or the boundaries of
+	// new data would not line up with what is in the store
+	for (i = 0; i < 256; i ++)
+		gear[i] = gear_mix(i + GEAR_SEED);
+
+	cdc_use_simd(1);
+	return 1;
+}
+
+int cdc_use_simd(int enable) {
+	cdc_scan = scan_c;
+#ifdef HAVE_CDC_AVX512
+	if (enable && __builtin_cpu_supports("avx512f")) {
+		cdc_scan = scan_avx512;
+		return 1;
+	}
+#endif
+	return 0;
+}
+
+unsigned int cdc_min_size() {
+	return min_size;
+}
+
+unsigned int cdc_next(const char *data, unsigned int len) {
+	const unsigned char *p = (const unsigned char *)data;
+	unsigned int n, normal, cut, h = 0;
+
+	if (len <= min_size)
+		return len;
+
+	n = len < max_size ? len : max_size;
+	normal = n < avg_size ? n : avg_size;
+	if (normal < min_size)
+		normal = min_size;
+
+	cut = cdc_scan(p, min_size, normal, mask_s, &h);
+	if (cut == 0)
+		cut = cdc_scan(p, normal, n, mask_l, &h);
+
+	return cut ? cut : n;
+}
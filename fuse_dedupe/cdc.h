@@ -0,0 +1,36 @@
+/* cdc.h
+* fuse_dedupe project
+*
+*/
+
+#ifndef CDC_H_
+#define CDC_H_
+
+// content-defined chunking, FastCDC style: a gear hash rolls over the
+// data and a chunk ends where the top bits of the hash are zero.  Below
+// the average size a stricter mask is used and above it a looser one, so
+// chunk sizes stay close to the average.
+#define CDC_MIN_SIZE 2048
+#define CDC_AVG_SIZE 8192
+#define CDC_MAX_SIZE 65536
+
+// largest max chunk size we accept, a write re-chunks up to two old
+// chunks and all of their store chunks are pending at the same time
+#define CDC_MAX_LIMIT 131072
+
+// set the chunk sizes, avg is rounded down to a power of two.
+// returns 1 on success, -1 if the sizes make no sense
+int cdc_init(unsigned int min_size, unsigned int avg_size, unsigned int max_size);
+
+// length of the chunk at the start of data, len is what is left of it.
+// the chunk is cut at len if no boundary is found before
+unsigned int cdc_next(const char *data, unsigned int len);
+
+// no chunk but the last one of the data is shorter than this
+unsigned int cdc_min_size();
+
+// the hash kernel is vectorized with AVX-512 when the CPU has it, this
+// switches between that and the plain C one, returns 1 if AVX-512 is used
+int cdc_use_simd(int enable);
+
+#endif
@@ -0,0 +1,377 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "chunk_alloc.h"
+
+static int map_fd = -1;
+static chunk_map_header *map_hdr = NULL;
+static unsigned long long *map = NULL;
+static size_t map_len = 0;
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// where the search for the next run starts, it moves on with every run
+static unsigned long long hint = 0;
+// set when no hole in the used part is ALLOC_RUN long, cleared by a free
+static int holes_small = 0;
+// set when no container in the used part is free, cleared by a free
+static int containers_full = 0;
+
+// the run of each thread, runs[] is reset on every mount and a thread
+// picks a new slot when the mount it got its slot in is gone.  A thread
+// that exits gives its slot back.  The chunks left in a run are free in
+// the map, the searches skip them
+typedef struct alloc_run {
+	unsigned long long start;
+	unsigned int left;
+	int in_use;
+} alloc_run;
+
+static alloc_run runs[ALLOC_RUNS_MAX];
+static int runs_num = 0;
+static int map_gen = 0;
+static __thread alloc_run *my_run = NULL;
+static __thread int my_gen = 0;
+static pthread_key_t run_key;
+static pthread_once_t run_key_once = PTHREAD_ONCE_INIT;
+
+#define MAP_WORD_BITS 64
+
+static int test_bit(unsigned long long i) {
+	return (map[i / MAP_WORD_BITS] >> (i % MAP_WORD_BITS)) & 1;
+}
+
+static void set_range(unsigned long long start, unsigned long long num, int used) {
+	unsigned long long i;
+
+	for (i = start; i < start + num; i ++) {
+		if (used)
+			map[i / MAP_WORD_BITS] |= 1ULL << (i % MAP_WORD_BITS);
+		else
+			map[i / MAP_WORD_BITS] &= ~(1ULL << (i % MAP_WORD_BITS));
+	}
+}
+
+// the end of a run of a thread that holds any of the num chunks from
+// start, 0 if none does.  Called with map_lock held
+static unsigned long long reserved_end(unsigned long long start, unsigned long long num) {
+	int i;
+
+	for (i = 0; i < runs_num; i ++) {
+		if (runs[i].left > 0 && runs[i].start < start + num
+				&& start < runs[i].start + runs[i].left)
+			return runs[i].start + runs[i].left;
+	}
+	return 0;
+}
+
+// first free run of at least num chunks in [from, to), whole words are
+// skipped when they are full or empty.  returns CHUNK_MAP_BITS if none
+static unsigned long long find_run(unsigned long long from, unsigned long long to, unsigned int num) {
+	unsigned long long i = from, start = from, len = 0;
+	unsigned long long w;
+
+	while (i < to) {
+		w = map[i / MAP_WORD_BITS];
+		if (i % MAP_WORD_BITS == 0 && i + MAP_WORD_BITS <= to && (w == ~0ULL || w == 0)) {
+			if (w == 0) {
+				if (len == 0)
+					start = i;
+				len += MAP_WORD_BITS;
+				if (len >= num)
+					return start;
+			} else {
+				len = 0;
+			}
+			i += MAP_WORD_BITS;
+			continue;
+		}
+
+		if ((w >> (i % MAP_WORD_BITS)) & 1) {
+			len = 0;
+		} else {
+			if (len == 0)
+				start = i;
+			if (++ len >= num)
+				return start;
+		}
+		i ++;
+	}
+	return CHUNK_MAP_BITS;
+}
+
+// find_run() past the runs of threads
+static unsigned long long find_free_run(unsigned long long from, unsigned long long to, unsigned int num) {
+	unsigned long long start, end;
+
+	while ((start = find_run(from, to, num)) != CHUNK_MAP_BITS
+			&& (end = reserved_end(start, num)) != 0)
+		from = end;
+	return start;
+}
+
+// first free container in [from, to), its chunks are whole words of the
+// map.  returns CHUNK_MAP_BITS if none
+static unsigned long long find_container(unsigned long long from, unsigned long long to) {
+	unsigned long long i, j;
+
+	from = (from + CONTAINER_CHUNKS - 1) / CONTAINER_CHUNKS * CONTAINER_CHUNKS;
+	for (i = from; i + CONTAINER_CHUNKS <= to; i += CONTAINER_CHUNKS) {
+		for (j = 0; j < CONTAINER_CHUNKS / MAP_WORD_BITS; j ++) {
+			if (map[i / MAP_WORD_BITS + j] != 0)
+				break;
+		}
+		if (j == CONTAINER_CHUNKS / MAP_WORD_BITS && reserved_end(i, CONTAINER_CHUNKS) == 0)
+			return i;
+	}
+	return CHUNK_MAP_BITS;
+}
+
+// find a run of want chunks, or of at least need chunks when the holes
+// in the used part are smaller.  Past the end and the runs of threads
+// every chunk is free.  Nothing is marked used.  Called with map_lock
+// held, returns the start and the length in *len
+static unsigned long long take_run(unsigned int want, unsigned int need, unsigned int *len) {
+	unsigned long long end = map_hdr->end, start = CHUNK_MAP_BITS;
+	unsigned int n;
+	int i;
+
+	if (end - map_hdr->used >= need) {
+		if (want == ALLOC_RUN && !containers_full) {
+			start = find_container(hint, end);
+			if (start == CHUNK_MAP_BITS)
+				start = find_container(0, hint);
+			if (start == CHUNK_MAP_BITS)
+				containers_full = 1;
+		}
+		if (start == CHUNK_MAP_BITS && !holes_small) {
+			start = find_free_run(hint, end, want);
+			if (start == CHUNK_MAP_BITS)
+				start = find_free_run(0, hint, want);
+			if (start == CHUNK_MAP_BITS)
+				holes_small = 1;
+		}
+		if (start == CHUNK_MAP_BITS) {
+			start = find_free_run(hint, end, need);
+			if (start == CHUNK_MAP_BITS)
+				start = find_free_run(0, hint, need);
+		}
+	}
+
+	if (start == CHUNK_MAP_BITS) {
+		// runs may reach past the end, the new one starts after them
+		for (i = 0; i < runs_num; i ++) {
+			if (runs[i].left > 0 && runs[i].start + runs[i].left > end)
+				end = runs[i].start + runs[i].left;
+		}
+		if (end + need > CHUNK_MAP_BITS)
+			return CHUNK_MAP_BITS;
+		start = end;
+		// a run past the end stops at a container boundary, so the
+		// next one starts a container
+		if (want == ALLOC_RUN && want - start % CONTAINER_CHUNKS >= need)
+			want -= start % CONTAINER_CHUNKS;
+	}
+
+	// the run ends at the first used or reserved chunk, or at want
+	for (n = need; n < want && start + n < CHUNK_MAP_BITS
+			&& (start + n >= map_hdr->end || !test_bit(start + n))
+			&& reserved_end(start + n, 1) == 0; n ++)
+		;
+	hint = start + n;
+
+	*len = n;
+	return start;
+}
+
+// the num chunks from start are handed out.  Called with map_lock held
+static void mark_used(unsigned long long start, unsigned int num) {
+	set_range(start, num, 1);
+	map_hdr->used += num;
+	if (start + num > map_hdr->end)
+		map_hdr->end = start + num;
+}
+
+static void run_exit(void *arg) {
+	alloc_run *run = (alloc_run *)arg;
+
+	pthread_mutex_lock(&map_lock);
+	// after a remount the slot may be another thread's
+	if (my_gen == map_gen) {
+		if (run->left > 0) {
+			holes_small = 0;
+			containers_full = 0;
+		}
+		run->left = 0;
+		run->in_use = 0;
+	}
+	pthread_mutex_unlock(&map_lock);
+}
+
+static void run_key_init(void) {
+	pthread_key_create(&run_key, run_exit);
+}
+
+// a slot given back by an exited thread, or a new one.  Called with
+// map_lock held
+static alloc_run *get_run(void) {
+	int i;
+
+	for (i = 0; i < runs_num && runs[i].in_use; i ++)
+		;
+	if (i == runs_num) {
+		if (runs_num == ALLOC_RUNS_MAX)
+			return NULL;
+		runs_num ++;
+	}
+	runs[i].left = 0;
+	runs[i].in_use = 1;
+	return &runs[i];
+}
+
+int init_chunk_alloc(const char *path) {
+	struct stat st;
+	char *base;
+
+	map_len = CHUNK_MAP_HDR_SIZE + (size_t)(CHUNK_MAP_BITS / 8 + sizeof(unsigned long long));
+
+	map_fd = open(path, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR | S_IRGRP | S_IWGRP);
+	if (map_fd < 0 || fstat(map_fd, &st) < 0) {
+		fprintf(stderr, "Failed to open chunk map!\n");
+		goto fail;
+	}
+
+	if (st.st_size == 0 && ftruncate(map_fd, map_len) < 0) {
+		fprintf(stderr, "Failed to size chunk map!\n");
+		goto fail;
+	}
+
+	base = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, map_fd, 0);
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "Failed to map chunk map!\n");
+		goto fail;
+	}
+	map_hdr = (chunk_map_header *)base;
+	map = (unsigned long long *)(base + CHUNK_MAP_HDR_SIZE);
+
+	if (st.st_size == 0) {
+		memcpy(map_hdr->magic, CHUNK_MAP_MAGIC, sizeof(map_hdr->magic));
+		map_hdr->version = CHUNK_MAP_VERSION;
+		map_hdr->end = 0;
+		map_hdr->used = 0;
+	} else if (memcmp(map_hdr->magic, CHUNK_MAP_MAGIC, sizeof(map_hdr->magic)) != 0
+			|| map_hdr->version != CHUNK_MAP_VERSION
+			|| (size_t)st.st_size != map_len) {
+		fprintf(stderr, "Chunk map %s does not match this build!\n", path);
+		munmap(base, map_len);
+		map_hdr = NULL;
+		map = NULL;
+		goto fail;
+	}
+
+	hint = map_hdr->end;
+	holes_small = 0;
+	containers_full = 0;
+	runs_num = 0;
+	map_gen ++;
+	return 1;
+
+fail:
+	if (map_fd >= 0)
+		close(map_fd);
+	map_fd = -1;
+	return -1;
+}
+
+int close_chunk_alloc() {
+	if (map_hdr == NULL)
+		return -1;
+
+	pthread_mutex_lock(&map_lock);
+	// what is left of the runs was never marked
+	runs_num = 0;
+	map_gen ++;
+
+	msync(map_hdr, map_len, MS_SYNC);
+	munmap(map_hdr, map_len);
+	close(map_fd);
+	map_hdr = NULL;
+	map = NULL;
+	map_fd = -1;
+	pthread_mutex_unlock(&map_lock);
+
+	return 1;
+}
+
+unsigned int alloc_chunks(unsigned int num) {
+	unsigned long long start;
+	unsigned int len;
+
+	pthread_mutex_lock(&map_lock);
+	if (map_hdr == NULL) {
+		pthread_mutex_unlock(&map_lock);
+		fprintf(stderr, "Chunk map not initilized!\n");
+		return CHUNK_ALLOC_FAIL;
+	}
+
+	if (my_gen != map_gen) {
+		pthread_once(&run_key_once, run_key_init);
+		my_run = get_run();
+		my_gen = map_gen;
+		pthread_setspecific(run_key, my_run);
+	}
+
+	if (my_run != NULL && my_run->left >= num) {
+		start = my_run->start;
+		my_run->start += num;
+		my_run->left -= num;
+		mark_used(start, num);
+		pthread_mutex_unlock(&map_lock);
+		return start;
+	}
+
+	// what is left of the run is too short, give it back
+	if (my_run != NULL && my_run->left > 0) {
+		holes_small = 0;
+		containers_full = 0;
+		my_run->left = 0;
+	}
+
+	start = take_run(my_run != NULL && num < ALLOC_RUN ? ALLOC_RUN : num, num, &len);
+	if (start == CHUNK_MAP_BITS) {
+		pthread_mutex_unlock(&map_lock);
+		fprintf(stderr, "Chunk store is full!\n");
+		return CHUNK_ALLOC_FAIL;
+	}
+
+	mark_used(start, num);
+	if (my_run != NULL) {
+		my_run->start = start + num;
+		my_run->left = len - num;
+	}
+	pthread_mutex_unlock(&map_lock);
+
+	return start;
+}
+
+void free_chunks(unsigned int start, unsigned int num) {
+	pthread_mutex_lock(&map_lock);
+	if (map_hdr != NULL) {
+		set_range(start, num, 0);
+		map_hdr->used -= num;
+		holes_small = 0;
+		containers_full = 0;
+	}
+	pthread_mutex_unlock(&map_lock);
+}
+
+void chunk_alloc_stats(unsigned long long *used, unsigned long long *end) {
+	pthread_mutex_lock(&map_lock);
+	*used = map_hdr != NULL ? map_hdr->used : 0;
+	*end = map_hdr != NULL ? map_hdr->end : 0;
+	pthread_mutex_unlock(&map_lock);
+}
@@ -0,0 +1,54 @@
+#ifndef CHUNK_ALLOC_H_
+#define CHUNK_ALLOC_H_
+
+#include "chunk_container.h"
+
+// free space of the chunk store, one bit per store chunk in a bitmap file
+// next to the store.  The file is mmap'ed like the fingerprint index, it
+// is sparse, so only the part that covers the store takes disk space.
+#define CHUNK_MAP_MAGIC "DDCHMAP"
+#define CHUNK_MAP_VERSION 1
+#define CHUNK_MAP_HDR_SIZE 4096
+
+// chunk ids are 32 bits and 0xFFFFFFFF is META_HOLE
+#define CHUNK_MAP_BITS 0xFFFFFFFFULL
+
+// returned by alloc_chunks() when the store is full
+#define CHUNK_ALLOC_FAIL 0xFFFFFFFF
+
+// a thread takes free chunks ALLOC_RUN at a time and hands them out in
+// order, so the chunks of a file written by one thread follow each other
+// in the store even while other threads write.  A run is a whole free
+// container when there is one, so a thread fills a container of its own.
+// The run is only reserved in memory, a chunk is marked in the bitmap when
+// it is handed out, so a crash loses none of them
+#define ALLOC_RUN CONTAINER_CHUNKS
+
+// most threads with a run of their own, the others allocate directly
+#define ALLOC_RUNS_MAX 64
+
+typedef struct chunk_map_header {
+	char magic[8];
+	unsigned int version;
+	// every chunk at or above end is free
+	unsigned long long end;
+	// chunks in use, the runs of threads count as they are handed out
+	unsigned long long used;
+} chunk_map_header;
+
+// open (or create) the bitmap at path and map it
+int init_chunk_alloc(const char *path);
+
+// drop the runs and unmap the bitmap
+int close_chunk_alloc();
+
+// num consecutive free chunks, the first id or CHUNK_ALLOC_FAIL
+unsigned int alloc_chunks(unsigned int num);
+
+// the num chunks from start are free again
+void free_chunks(unsigned int start, unsigned int num);
+
+// chunks in use and the end of the used part of the store
+void chunk_alloc_stats(unsigned long long *used, unsigned long long *end);
+
+#endif
@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "dedupe.h"
+#include "chunk_cache.h"
+
+#define SEG_PROBATION 0
+#define SEG_PROTECTED 1
+
+typedef struct cache_entry {
+	unsigned int chunk_idx;
+	int seg;
+	struct cache_entry *prev, *next;	// in the list of its segment
+	struct cache_entry *hnext;		// in the hash chain
+	char data[CHUNK_SIZE];
+} cache_entry;
+
+typedef struct cache_list {
+	cache_entry *head, *tail;	// most recently used first
+	unsigned int num;
+} cache_list;
+
+typedef struct cache_shard {
+	pthread_mutex_t lock;
+	cache_entry **table;
+	unsigned int table_mask;
+	cache_list lists[2];
+	unsigned int num, max_num, protected_max;
+	// bumped by every invalidation, a put with an older ticket is dropped
+	unsigned int epoch;
+	unsigned long long hits, misses, evictions;
+} cache_shard;
+
+static cache_shard *shards = NULL;
+
+static cache_shard *shard_of(unsigned int chunk_idx) {
+	return &shards[chunk_idx % CACHE_SHARDS];
+}
+
+static cache_entry **slot_of(cache_shard *s, unsigned int chunk_idx) {
+	return &s->table[(chunk_idx / CACHE_SHARDS) & s->table_mask];
+}
+
+static void list_del(cache_list *l, cache_entry *e) {
+	if (e->prev != NULL)
+		e->prev->next = e->next;
+	else
+		l->head = e->next;
+	if (e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		l->tail = e->prev;
+	l->num --;
+}
+
+static void list_add(cache_list *l, cache_entry *e) {
+	e->prev = NULL;
+	e->next = l->head;
+	if (l->head != NULL)
+		l->head->prev = e;
+	else
+		l->tail = e;
+	l->head = e;
+	l->num ++;
+}
+
+static cache_entry *find_entry(cache_shard *s, unsigned int chunk_idx) {
+	cache_entry *e;
+
+	for (e = *slot_of(s, chunk_idx); e != NULL; e = e->hnext) {
+		if (e->chunk_idx == chunk_idx)
+			return e;
+	}
+	return NULL;
+}
+
+// take e out of the hash chain and its list
+static void unlink_entry(cache_shard *s, cache_entry *e) {
+	cache_entry **p;
+
+	for (p = slot_of(s, e->chunk_idx); *p != e; p = &(*p)->hnext)
+		;
+	*p = e->hnext;
+	list_del(&s->lists[e->seg], e);
+	s->num --;
+}
+
+int init_chunk_cache(unsigned int size_mb) {
+	unsigned long long chunks = (unsigned long long)size_mb * 1024 * 1024 / CHUNK_SIZE;
+	unsigned int per_shard, i;
+	cache_shard *s;
+
+	if (chunks == 0)
+		return 1;
+
+	per_shard = (chunks + CACHE_SHARDS - 1) / CACHE_SHARDS;
+	shards = (cache_shard *)calloc(CACHE_SHARDS, sizeof(cache_shard));
+	if (shards == NULL) {
+		fprintf(stderr, "Failed to allocate chunk cache!\n");
+		return -1;
+	}
+
+	for (i = 0; i < CACHE_SHARDS; i ++) {
+		s = &shards[i];
+		pthread_mutex_init(&s->lock, NULL);
+		s->max_num = per_shard;
+		s->protected_max = (unsigned long long)per_shard * CACHE_PROTECTED / 100;
+		// about one entry per hash chain
+		for (s->table_mask = 1; s->table_mask < per_shard; s->table_mask <<= 1)
+			;
+		s->table = (cache_entry **)calloc(s->table_mask, sizeof(cache_entry *));
+		s->table_mask --;
+		if (s->table == NULL) {
+			fprintf(stderr, "Failed to allocate chunk cache!\n");
+			close_chunk_cache();
+			return -1;
+		}
+	}
+	return 1;
+}
+
+void close_chunk_cache() {
+	cache_entry *e, *next;
+	unsigned int i, j;
+
+	if (shards == NULL)
+		return;
+
+	for (i = 0; i < CACHE_SHARDS; i ++) {
+		for (j = 0; j < 2; j ++) {
+			for (e = shards[i].lists[j].head; e != NULL; e = next) {
+				next = e->next;
+				free(e);
+			}
+		}
+		free(shards[i].table);
+		pthread_mutex_destroy(&shards[i].lock);
+	}
+	free(shards);
+	shards = NULL;
+}
+
+int chunk_cache_get(unsigned int chunk_idx, char *buf, unsigned int *ticket) {
+	cache_shard *s;
+	cache_entry *e, *demoted;
+
+	if (shards == NULL)
+		return 0;
+
+	s = shard_of(chunk_idx);
+	pthread_mutex_lock(&s->lock);
+	e = find_entry(s, chunk_idx);
+	if (e == NULL) {
+		s->misses ++;
+		*ticket = s->epoch;
+		pthread_mutex_unlock(&s->lock);
+		return 0;
+	}
+
+	s->hits ++;
+	list_del(&s->lists[e->seg], e);
+	if (e->seg == SEG_PROBATION) {
+		// a second hit, the chunk is hot.  Make room on the protected
+		// list by moving its coldest chunk back to probation
+		if (s->lists[SEG_PROTECTED].num >= s->protected_max
+				&& s->lists[SEG_PROTECTED].tail != NULL) {
+			demoted = s->lists[SEG_PROTECTED].tail;
+			list_del(&s->lists[SEG_PROTECTED], demoted);
+			demoted->seg = SEG_PROBATION;
+			list_add(&s->lists[SEG_PROBATION], demoted);
+		}
+		e->seg = SEG_PROTECTED;
+	}
+	list_add(&s->lists[e->seg], e);
+	memcpy(buf, e->data, CHUNK_SIZE);
+	pthread_mutex_unlock(&s->lock);
+	return 1;
+}
+
+void chunk_cache_put(unsigned int chunk_idx, const char *buf, unsigned int ticket) {
+	cache_shard *s;
+	cache_entry *e = NULL;
+	cache_entry **slot;
+
+	if (shards == NULL)
+		return;
+
+	s = shard_of(chunk_idx);
+	pthread_mutex_lock(&s->lock);
+	if (s->epoch != ticket || find_entry(s, chunk_idx) != NULL) {
+		pthread_mutex_unlock(&s->lock);
+		return;
+	}
+
+	// reuse the coldest entry when the shard is full
+	if (s->num >= s->max_num) {
+		e = s->lists[SEG_PROBATION].tail;
+		if (e == NULL)
+			e = s->lists[SEG_PROTECTED].tail;
+		unlink_entry(s, e);
+		s->evictions ++;
+	} else {
+		e = (cache_entry *)malloc(sizeof(cache_entry));
+		if (e == NULL) {
+			pthread_mutex_unlock(&s->lock);
+			return;
+		}
+	}
+
+	e->chunk_idx = chunk_idx;
+	e->seg = SEG_PROBATION;
+	memcpy(e->data, buf, CHUNK_SIZE);
+	slot = slot_of(s, chunk_idx);
+	e->hnext = *slot;
+	*slot = e;
+	list_add(&s->lists[SEG_PROBATION], e);
+	s->num ++;
+	pthread_mutex_unlock(&s->lock);
+}
+
+void chunk_cache_invalidate(unsigned int chunk_idx, unsigned int num) {
+	cache_shard *s;
+	cache_entry *e;
+	unsigned int i;
+
+	if (shards == NULL)
+		return;
+
+	for (i = 0; i < num; i ++) {
+		s = shard_of(chunk_idx + i);
+		pthread_mutex_lock(&s->lock);
+		s->epoch ++;
+		e = find_entry(s, chunk_idx + i);
+		if (e != NULL) {
+			unlink_entry(s, e);
+			free(e);
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+void get_cache_stats(struct cache_stats *stats) {
+	unsigned int i;
+
+	memset(stats, 0, sizeof(*stats));
+	if (shards == NULL)
+		return;
+
+	for (i = 0; i < CACHE_SHARDS; i ++) {
+		pthread_mutex_lock(&shards[i].lock);
+		stats->hits += shards[i].hits;
+		stats->misses += shards[i].misses;
+		stats->evictions += shards[i].evictions;
+		stats->chunks += shards[i].num;
+		stats->max_chunks += shards[i].max_num;
+		pthread_mutex_unlock(&shards[i].lock);
+	}
+}
@@ -0,0 +1,47 @@
+#ifndef CHUNK_CACHE_H_
+#define CHUNK_CACHE_H_
+
+// store chunks kept in memory, keyed by chunk id.  A chunk shared by many
+// files is read from the store once and then served from here, by
+// read_chunk() and read_chunks() for bb_read and the read-modify-write of
+// the writes alike.
+//
+// The cache is split in CACHE_SHARDS shards with a lock each.  A shard is
+// a segmented LRU: a chunk comes in on the probation list and moves to the
+// protected list when it is hit again, so a scan of cold chunks only
+// pushes out other cold chunks and not the hot ones.
+#define CACHE_SHARDS 64
+
+// default size in MB, -o cache_size= changes it and 0 turns it off
+#define CACHE_SIZE_MB 64
+
+// share of the cache the protected lists take, in percent
+#define CACHE_PROTECTED 80
+
+struct cache_stats {
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long evictions;
+	unsigned long long chunks;	// chunks in the cache now
+	unsigned long long max_chunks;
+};
+
+// allocate the shards for size_mb MB of chunks, returns 1 on success
+int init_chunk_cache(unsigned int size_mb);
+
+void close_chunk_cache();
+
+// copy chunk_idx into buf and return 1 if it is cached.  Otherwise return
+// 0 and set *ticket, pass it to chunk_cache_put() with the data read
+int chunk_cache_get(unsigned int chunk_idx, char *buf, unsigned int *ticket);
+
+// add a chunk read from the store, it is dropped if the chunk was
+// invalidated since chunk_cache_get() handed out the ticket
+void chunk_cache_put(unsigned int chunk_idx, const char *buf, unsigned int ticket);
+
+// the num chunks from chunk_idx were written or discarded
+void chunk_cache_invalidate(unsigned int chunk_idx, unsigned int num);
+
+void get_cache_stats(struct cache_stats *stats);
+
+#endif
@@ -0,0 +1,410 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dedupe.h"
+#include "chunk_container.h"
+
+#define FILLED_WORDS (CONTAINER_CHUNKS / 64)
+
+// an open container, cid is CONTAINER_NONE while the slot is unused.
+// cid changes with both ctr_lock and lock held, so a reader may look for
+// a container with lock alone
+typedef struct container {
+	unsigned int cid;
+	pthread_mutex_t lock;
+	char *data;
+	container_entry *meta;
+	int meta_dirty;
+	// chunks in data that are not written yet
+	unsigned long long filled[FILLED_WORDS];
+	unsigned int filled_num;
+	// when the container was last written to, the oldest is closed first
+	unsigned long long used;
+	// set under ctr_lock while an opener writes it out, no other one
+	// takes it then
+	int closing;
+} container;
+
+static container ctrs[CONTAINERS_OPEN];
+static pthread_mutex_t ctr_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ctr_closed = PTHREAD_COND_INITIALIZER;
+static unsigned long long ctr_clock = 0;
+
+// chunks in all open containers that are not written yet, none is the
+// common case for readers
+static unsigned int ctr_filled = 0;
+
+static int store = -1;
+static int meta_fd = -1;
+
+// the container the thread wrote to last, written out when it moves on
+static __thread unsigned int my_cid = CONTAINER_NONE;
+
+static off_t meta_offset(unsigned int cid) {
+	return CONTAINER_META_HDR_SIZE + (off_t)cid * CONTAINER_META_SIZE;
+}
+
+int init_containers(const char *path, int store_fd) {
+	char meta_path[PATH_MAX];
+	container_meta_header hdr;
+	ssize_t ret;
+	int i;
+
+	snprintf(meta_path, PATH_MAX, "%s.ctr", path);
+	meta_fd = open(meta_path, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR | S_IRGRP | S_IWGRP);
+	if (meta_fd < 0) {
+		fprintf(stderr, "Failed to open container metadata!\n");
+		return -1;
+	}
+
+	ret = pread(meta_fd, &hdr, sizeof(hdr), 0);
+	if (ret == 0) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, CONTAINER_META_MAGIC, sizeof(hdr.magic));
+		hdr.version = CONTAINER_META_VERSION;
+		hdr.container_chunks = CONTAINER_CHUNKS;
+		if (pwrite(meta_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+			ret = -1;
+	} else if (ret != sizeof(hdr) || memcmp(hdr.magic, CONTAINER_META_MAGIC, sizeof(hdr.magic)) != 0
+			|| hdr.version != CONTAINER_META_VERSION
+			|| hdr.container_chunks != CONTAINER_CHUNKS) {
+		fprintf(stderr, "Container metadata %s does not match this build!\n", meta_path);
+		ret = -1;
+	}
+	if (ret < 0) {
+		close(meta_fd);
+		meta_fd = -1;
+		return -1;
+	}
+
+	for (i = 0; i < CONTAINERS_OPEN; i ++) {
+		memset(&ctrs[i], 0, sizeof(container));
+		ctrs[i].cid = CONTAINER_NONE;
+		pthread_mutex_init(&ctrs[i].lock, NULL);
+	}
+	ctr_filled = 0;
+	store = store_fd;
+	return 1;
+}
+
+// write the chunks of c that are not written yet, one write per run of
+// them, and its metadata if it changed.  Called with c->lock held
+static int seal_locked(container *c) {
+	unsigned int i, n;
+	off_t off;
+	int retval = 1;
+
+	for (i = 0; i < CONTAINER_CHUNKS && c->filled_num > 0; i += n) {
+		n = 0;
+		while (i + n < CONTAINER_CHUNKS && (c->filled[(i + n) / 64] >> ((i + n) % 64) & 1))
+			n ++;
+		if (n == 0) {
+			n = 1;
+			continue;
+		}
+
+		off = ((off_t)c->cid * CONTAINER_CHUNKS + i) * CHUNK_SIZE;
+		if (pwrite(store, c->data + (size_t)i * CHUNK_SIZE, (size_t)n * CHUNK_SIZE, off)
+				!= (ssize_t)n * CHUNK_SIZE) {
+			fprintf(stderr, "Error in writing container!\n");
+			retval = -1;
+		}
+	}
+
+	if (c->meta_dirty) {
+		if (pwrite(meta_fd, c->meta, CONTAINER_META_SIZE, meta_offset(c->cid)) != CONTAINER_META_SIZE) {
+			fprintf(stderr, "Error in writing container metadata!\n");
+			retval = -1;
+		}
+		c->meta_dirty = 0;
+	}
+
+	__atomic_sub_fetch(&ctr_filled, c->filled_num, __ATOMIC_RELEASE);
+	memset(c->filled, 0, sizeof(c->filled));
+	c->filled_num = 0;
+	return retval;
+}
+
+// the open container cid with its lock held, NULL if it is not open
+static container *find_container(unsigned int cid) {
+	int i;
+
+	for (i = 0; i < CONTAINERS_OPEN; i ++) {
+		if (__atomic_load_n(&ctrs[i].cid, __ATOMIC_ACQUIRE) != cid)
+			continue;
+		pthread_mutex_lock(&ctrs[i].lock);
+		if (ctrs[i].cid == cid)
+			return &ctrs[i];
+		pthread_mutex_unlock(&ctrs[i].lock);
+	}
+	return NULL;
+}
+
+// open container cid in a free slot, or in place of the one used least
+// recently.  That one is written out first with ctr_lock dropped, it
+// stays open for its readers and writers until then.  returns it with
+// its lock held
+static container *open_container(unsigned int cid) {
+	container *c, *victim;
+	ssize_t ret;
+	int i;
+
+	pthread_mutex_lock(&ctr_lock);
+	while (1) {
+		c = find_container(cid);
+		if (c != NULL) {
+			pthread_mutex_unlock(&ctr_lock);
+			return c;
+		}
+
+		victim = NULL;
+		for (i = 0; i < CONTAINERS_OPEN; i ++) {
+			if (ctrs[i].closing)
+				continue;
+			if (ctrs[i].cid == CONTAINER_NONE) {
+				victim = &ctrs[i];
+				break;
+			}
+			if (victim == NULL || __atomic_load_n(&ctrs[i].used, __ATOMIC_RELAXED)
+					< __atomic_load_n(&victim->used, __ATOMIC_RELAXED))
+				victim = &ctrs[i];
+		}
+		// every one is being written out by another opener
+		if (victim == NULL) {
+			pthread_cond_wait(&ctr_closed, &ctr_lock);
+			continue;
+		}
+
+		c = victim;
+		pthread_mutex_lock(&c->lock);
+		if (c->cid == CONTAINER_NONE || (c->filled_num == 0 && !c->meta_dirty))
+			break;
+
+		// the next round takes it if nothing was written to it
+		// meanwhile, another one if it is no longer the oldest
+		c->closing = 1;
+		pthread_mutex_unlock(&ctr_lock);
+		if (seal_locked(c) < 0)
+			fprintf(stderr, "Container %u lost data!\n", c->cid);
+		pthread_mutex_unlock(&c->lock);
+		pthread_mutex_lock(&ctr_lock);
+		c->closing = 0;
+		pthread_cond_broadcast(&ctr_closed);
+	}
+
+	if (c->data == NULL) {
+		c->data = (char *)malloc((size_t)CONTAINER_CHUNKS * CHUNK_SIZE);
+		c->meta = (container_entry *)malloc(CONTAINER_META_SIZE);
+		if (c->data == NULL || c->meta == NULL) {
+			free(c->data);
+			free(c->meta);
+			c->data = NULL;
+			c->meta = NULL;
+			__atomic_store_n(&c->cid, CONTAINER_NONE, __ATOMIC_RELEASE);
+			pthread_mutex_unlock(&c->lock);
+			pthread_mutex_unlock(&ctr_lock);
+			return NULL;
+		}
+	}
+
+	// a container that was written before keeps its entries
+	ret = pread(meta_fd, c->meta, CONTAINER_META_SIZE, meta_offset(cid));
+	if (ret < 0)
+		ret = 0;
+	memset((char *)c->meta + ret, 0, CONTAINER_META_SIZE - ret);
+	c->meta_dirty = 0;
+	__atomic_store_n(&c->used, __atomic_add_fetch(&ctr_clock, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	__atomic_store_n(&c->cid, cid, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&ctr_lock);
+	return c;
+}
+
+int close_containers() {
+	int i, retval;
+
+	retval = sync_containers();
+
+	pthread_mutex_lock(&ctr_lock);
+	for (i = 0; i < CONTAINERS_OPEN; i ++) {
+		pthread_mutex_lock(&ctrs[i].lock);
+		free(ctrs[i].data);
+		free(ctrs[i].meta);
+		ctrs[i].data = NULL;
+		ctrs[i].meta = NULL;
+		__atomic_store_n(&ctrs[i].cid, CONTAINER_NONE, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&ctrs[i].lock);
+	}
+	if (meta_fd >= 0)
+		close(meta_fd);
+	meta_fd = -1;
+	store = -1;
+	pthread_mutex_unlock(&ctr_lock);
+	return retval;
+}
+
+void container_add(unsigned int chunk_idx, unsigned int num_chunks, const unsigned int *fp,
+		unsigned int slot) {
+	container_entry *e;
+	container *c;
+
+	if (meta_fd < 0)
+		return;
+
+	c = find_container(container_id(chunk_idx));
+	if (c == NULL)
+		c = open_container(container_id(chunk_idx));
+	if (c == NULL)
+		return;
+
+	e = &c->meta[chunk_idx % CONTAINER_CHUNKS];
+	memcpy(e->fp, fp, sizeof(e->fp));
+	e->num_chunks = num_chunks;
+	e->slot = slot;
+	c->meta_dirty = 1;
+	pthread_mutex_unlock(&c->lock);
+}
+
+int container_write(unsigned int chunk_idx, const char *buf) {
+	unsigned int cid = container_id(chunk_idx);
+	unsigned int slot = chunk_idx % CONTAINER_CHUNKS;
+	container *c;
+
+	if (meta_fd < 0)
+		return 0;
+
+	// the thread moved on, what it left in its last container goes out
+	if (my_cid != cid && my_cid != CONTAINER_NONE) {
+		c = find_container(my_cid);
+		if (c != NULL) {
+			if (c->filled_num > 0 && seal_locked(c) < 0)
+				fprintf(stderr, "Container %u lost data!\n", c->cid);
+			pthread_mutex_unlock(&c->lock);
+		}
+	}
+	my_cid = cid;
+
+	c = find_container(cid);
+	if (c == NULL)
+		c = open_container(cid);
+	if (c == NULL)
+		return 0;
+
+	memcpy(c->data + (size_t)slot * CHUNK_SIZE, buf, CHUNK_SIZE);
+	if (!(c->filled[slot / 64] >> (slot % 64) & 1)) {
+		c->filled[slot / 64] |= 1ULL << (slot % 64);
+		c->filled_num ++;
+		__atomic_add_fetch(&ctr_filled, 1, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&c->used, __atomic_add_fetch(&ctr_clock, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+
+	// the last chunk is in, the container is full
+	if (slot == CONTAINER_CHUNKS - 1 && seal_locked(c) < 0)
+		fprintf(stderr, "Container %u lost data!\n", c->cid);
+	pthread_mutex_unlock(&c->lock);
+	return 1;
+}
+
+int container_read(unsigned int chunk_idx, char *buf) {
+	unsigned int slot = chunk_idx % CONTAINER_CHUNKS;
+	container *c;
+	int found = 0;
+
+	if (__atomic_load_n(&ctr_filled, __ATOMIC_ACQUIRE) == 0)
+		return 0;
+
+	c = find_container(container_id(chunk_idx));
+	if (c == NULL)
+		return 0;
+	if (c->filled[slot / 64] >> (slot % 64) & 1) {
+		if (buf != NULL)
+			memcpy(buf, c->data + (size_t)slot * CHUNK_SIZE, CHUNK_SIZE);
+		found = 1;
+	}
+	pthread_mutex_unlock(&c->lock);
+	return found;
+}
+
+int sync_containers() {
+	int i, retval = 1;
+
+	for (i = 0; i < CONTAINERS_OPEN; i ++) {
+		pthread_mutex_lock(&ctrs[i].lock);
+		if (ctrs[i].cid != CONTAINER_NONE && (ctrs[i].filled_num > 0 || ctrs[i].meta_dirty)
+				&& seal_locked(&ctrs[i]) < 0)
+			retval = -1;
+		pthread_mutex_unlock(&ctrs[i].lock);
+	}
+	return retval;
+}
+
+void container_discard(unsigned int chunk_idx, unsigned int num) {
+	unsigned int cid, slot, n;
+	container *c;
+
+	if (meta_fd < 0)
+		return;
+
+	// a container is not opened or closed while its entries are cleared
+	pthread_mutex_lock(&ctr_lock);
+	while (num > 0) {
+		cid = container_id(chunk_idx);
+		slot = chunk_idx % CONTAINER_CHUNKS;
+		n = CONTAINER_CHUNKS - slot < num ? CONTAINER_CHUNKS - slot : num;
+
+		c = find_container(cid);
+		if (c != NULL) {
+			for (; slot < chunk_idx % CONTAINER_CHUNKS + n; slot ++) {
+				if (c->filled[slot / 64] >> (slot % 64) & 1) {
+					c->filled[slot / 64] &= ~(1ULL << (slot % 64));
+					c->filled_num --;
+					__atomic_sub_fetch(&ctr_filled, 1, __ATOMIC_RELEASE);
+				}
+				c->meta[slot].num_chunks = 0;
+			}
+			c->meta_dirty = 1;
+			pthread_mutex_unlock(&c->lock);
+		} else {
+			// only num_chunks tells a chunk starts there, the rest of
+			// the entries may stay
+			container_entry *zero = (container_entry *)calloc(n, sizeof(container_entry));
+
+			if (zero == NULL || pwrite(meta_fd, zero, n * sizeof(container_entry),
+						meta_offset(cid) + slot * sizeof(container_entry)) < 0)
+				fprintf(stderr, "Failed to discard container entries!\n");
+			free(zero);
+		}
+
+		chunk_idx += n;
+		num -= n;
+	}
+	pthread_mutex_unlock(&ctr_lock);
+}
+
+int read_container_meta(unsigned int cid, container_entry *entries) {
+	container *c;
+	ssize_t ret;
+
+	if (meta_fd < 0)
+		return -1;
+
+	c = find_container(cid);
+	if (c != NULL) {
+		memcpy(entries, c->meta, CONTAINER_META_SIZE);
+		pthread_mutex_unlock(&c->lock);
+		return 1;
+	}
+
+	ret = pread(meta_fd, entries, CONTAINER_META_SIZE, meta_offset(cid));
+	if (ret < 0) {
+		fprintf(stderr, "Error in reading container metadata!\n");
+		return -1;
+	}
+	memset((char *)entries + ret, 0, CONTAINER_META_SIZE - ret);
+	return 1;
+}
@@ -0,0 +1,78 @@
+#ifndef CHUNK_CONTAINER_H_
+#define CHUNK_CONTAINER_H_
+
+#include "fingerprint.h"
+
+// containers of the chunk store.  The store is cut into containers of
+// CONTAINER_CHUNKS chunks, the allocator hands a writing thread a whole
+// container at a time, so the new chunks a thread writes are appended to
+// a container of its own.  An open container gathers its chunks in
+// memory and is written with one sequential write when its last chunk
+// comes in, when the thread moves on to another one, or at flush, fsync
+// and release.  Readers of a chunk that is still in memory get it there.
+//
+// Every container has a small metadata section, the fingerprint and the
+// length of each chunk in it, in <store>.ctr next to the store.
+#define CONTAINER_CHUNKS 1024
+#define CONTAINER_NONE 0xFFFFFFFF
+
+#define CONTAINER_META_MAGIC "DDCTRMT"
+#define CONTAINER_META_VERSION 2
+#define CONTAINER_META_HDR_SIZE 4096
+
+// most containers open at once, each takes CONTAINER_CHUNKS chunks of
+// memory.  A write to another one when all are open closes the oldest,
+// it is written out with no other lock held
+#define CONTAINERS_OPEN 16
+
+#define container_id(chunk_idx) ((chunk_idx) / CONTAINER_CHUNKS)
+
+typedef struct container_meta_header {
+	char magic[8];
+	unsigned int version;
+	unsigned int container_chunks;
+} container_meta_header;
+
+// entry of a chunk in the metadata section, at the slot of its first
+// store chunk.  num_chunks is 0 for a slot no chunk starts at.  slot is
+// where its record is in the fingerprint index
+typedef struct container_entry {
+	unsigned int fp[FP_WORDS];
+	unsigned int num_chunks;
+	unsigned int slot;
+} container_entry;
+
+#define CONTAINER_META_SIZE (CONTAINER_CHUNKS * sizeof(container_entry))
+
+// open the metadata of the store at path, the chunks are written to
+// store_fd.  returns 1 on success
+int init_containers(const char *path, int store_fd);
+
+// write out the open containers and close the metadata
+int close_containers();
+
+// the chunk just added to the index with this fingerprint at slot, its
+// entry goes to the metadata of its container.  Called with no bucket
+// lock held, it may have to close a container
+void container_add(unsigned int chunk_idx, unsigned int num_chunks, const unsigned int *fp,
+		unsigned int slot);
+
+// keep the chunk in its open container.  returns 1 if it is kept, 0 if
+// no container could be opened and the caller writes it
+int container_write(unsigned int chunk_idx, const char *buf);
+
+// returns 1 with the chunk in buf if it is in an open container and not
+// written yet, 0 if it is to be read from the store.  With buf NULL it
+// only tells which
+int container_read(unsigned int chunk_idx, char *buf);
+
+// write out every open container, returns -1 if a write failed
+int sync_containers();
+
+// the num chunks from chunk_idx are freed, drop them and their entries
+void container_discard(unsigned int chunk_idx, unsigned int num);
+
+// the metadata section of container cid, the open one when it is open
+int read_container_meta(unsigned int cid, container_entry *entries);
+
+#endif
@@ -0,0 +1,265 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dedupe.h"
+#include "compress.h"
+#include "chunk_pack.h"
+
+static int pack_fd = -1;
+static int loc_fd = -1;
+static pack_header *pack_hdr = NULL;
+static unsigned long long *locs = NULL;
+static size_t loc_size = 0;
+
+// open name, made when create is set.  returns the fd, -1 with errno
+static int open_pack_file(const char *name, int create) {
+	return open(name, O_RDWR | (create ? O_CREAT : 0), S_IWUSR | S_IRUSR | S_IRGRP | S_IWGRP);
+}
+
+int init_chunk_pack(const char *path, int create) {
+	char name[PATH_MAX];
+	struct stat st;
+	char *base;
+
+	// one entry for every chunk id
+	loc_size = PACK_LOC_HDR_SIZE + (size_t)0x100000000ULL * sizeof(unsigned long long);
+
+	snprintf(name, PATH_MAX, "%s.loc", path);
+	loc_fd = open_pack_file(name, create);
+	if (loc_fd < 0 && errno == ENOENT && !create)
+		return 1;
+	if (loc_fd < 0 || fstat(loc_fd, &st) < 0) {
+		fprintf(stderr, "Failed to open pack entries!\n");
+		return -1;
+	}
+	if (st.st_size == 0 && ftruncate(loc_fd, loc_size) < 0) {
+		fprintf(stderr, "Failed to size pack entries!\n");
+		close_chunk_pack();
+		return -1;
+	}
+
+	snprintf(name, PATH_MAX, "%s.pack", path);
+	pack_fd = open_pack_file(name, 1);
+	if (pack_fd < 0) {
+		fprintf(stderr, "Failed to open chunk pack!\n");
+		close_chunk_pack();
+		return -1;
+	}
+
+	base = mmap(NULL, loc_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, loc_fd, 0);
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "Failed to map pack entries!\n");
+		close_chunk_pack();
+		return -1;
+	}
+	pack_hdr = (pack_header *)base;
+	locs = (unsigned long long *)(base + PACK_LOC_HDR_SIZE);
+
+	if (st.st_size == 0) {
+		memcpy(pack_hdr->magic, PACK_LOC_MAGIC, sizeof(pack_hdr->magic));
+		pack_hdr->version = PACK_LOC_VERSION;
+		pack_hdr->tail = 0;
+		pack_hdr->chunks = 0;
+		pack_hdr->bytes = 0;
+	} else if (memcmp(pack_hdr->magic, PACK_LOC_MAGIC, sizeof(pack_hdr->magic)) != 0
+			|| pack_hdr->version != PACK_LOC_VERSION
+			|| (size_t)st.st_size != loc_size) {
+		fprintf(stderr, "Pack entries %s.loc do not match this build!\n", path);
+		close_chunk_pack();
+		return -1;
+	}
+	return 1;
+}
+
+int close_chunk_pack() {
+	if (pack_hdr != NULL) {
+		msync(pack_hdr, loc_size, MS_SYNC);
+		munmap(pack_hdr, loc_size);
+	}
+	if (pack_fd >= 0)
+		close(pack_fd);
+	if (loc_fd >= 0)
+		close(loc_fd);
+	pack_hdr = NULL;
+	locs = NULL;
+	pack_fd = -1;
+	loc_fd = -1;
+	return 1;
+}
+
+unsigned long long pack_loc(unsigned int chunk_idx) {
+	if (locs == NULL)
+		return 0;
+	return __atomic_load_n(&locs[chunk_idx], __ATOMIC_ACQUIRE);
+}
+
+// punch the packed data of the entries, runs that follow each other in
+// the pack are punched at once
+static void punch_locs(unsigned long long *old, unsigned int num) {
+	unsigned long long start = 0, end = 0, bytes = 0, chunks = 0;
+	unsigned int i;
+
+	for (i = 0; i <= num; i ++) {
+		if (i < num && old[i] == 0)
+			continue;
+		if (i == num || loc_off(old[i]) != end) {
+			if (end > start && fallocate(pack_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+						start, end - start) < 0)
+				fprintf(stderr, "Failed to discard packed chunks!\n");
+			if (i == num)
+				break;
+			start = loc_off(old[i]);
+			end = start;
+		}
+		end += loc_len(old[i]);
+		bytes += loc_len(old[i]);
+		chunks ++;
+	}
+
+	__atomic_sub_fetch(&pack_hdr->chunks, chunks, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&pack_hdr->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+int pack_chunks(unsigned int *chunk_idx, const char **bufs, unsigned int num, char *packed) {
+	unsigned long long *old;
+	unsigned long long off, pos;
+	unsigned int *lens;
+	unsigned int i, num_packed = 0, num_old = 0;
+	size_t total = 0;
+	char *out;
+	int retval;
+
+	memset(packed, 0, num);
+	if (locs == NULL || comp_engine() == COMP_NONE)
+		return 0;
+
+	// compress them one after the other, as they go to the pack
+	out = (char *)malloc((size_t)num * CHUNK_SIZE);
+	lens = (unsigned int *)malloc(num * sizeof(unsigned int));
+	old = (unsigned long long *)malloc(num * sizeof(unsigned long long));
+	for (i = 0; i < num; i ++) {
+		lens[i] = compress_chunk(bufs[i], out + total);
+		total += lens[i];
+	}
+
+	retval = 0;
+	off = 0;
+	if (total > 0) {
+		off = __atomic_fetch_add(&pack_hdr->tail, total, __ATOMIC_RELAXED);
+		if (off + total > PACK_OFF_MAX) {
+			fprintf(stderr, "Chunk pack is full!\n");
+			total = 0;
+		} else if (pwrite(pack_fd, out, total, off) != (ssize_t)total) {
+			fprintf(stderr, "Error in writing chunk pack!\n");
+			retval = -1;
+		}
+	}
+
+	// a chunk written to its slot has no entry, an id freed while it
+	// was packed lost its entry then, this is for safety only
+	pos = off;
+	for (i = 0; i < num; i ++) {
+		if (retval == 0 && total > 0 && lens[i] > 0) {
+			old[num_old] = __atomic_exchange_n(&locs[chunk_idx[i]],
+					loc_make(pos, lens[i], comp_engine()), __ATOMIC_ACQ_REL);
+			pos += lens[i];
+			packed[i] = 1;
+			num_packed ++;
+		} else {
+			old[num_old] = __atomic_exchange_n(&locs[chunk_idx[i]], 0, __ATOMIC_ACQ_REL);
+		}
+		if (old[num_old] != 0)
+			num_old ++;
+	}
+	if (num_old > 0)
+		punch_locs(old, num_old);
+
+	if (num_packed > 0) {
+		__atomic_add_fetch(&pack_hdr->chunks, num_packed, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&pack_hdr->bytes, pos - off, __ATOMIC_RELAXED);
+	}
+
+	free(out);
+	free(lens);
+	free(old);
+	return retval < 0 ? -1 : (int)num_packed;
+}
+
+int unpack_chunks(unsigned int *chunk_idx, char **bufs, unsigned int num) {
+	unsigned long long *loc;
+	unsigned long long start, end;
+	unsigned int i, j, n;
+	size_t total = 0;
+	char *in, *p;
+	int retval = 1;
+
+	if (num == 0)
+		return 1;
+
+	loc = (unsigned long long *)malloc(num * sizeof(unsigned long long));
+	for (i = 0; i < num; i ++) {
+		loc[i] = pack_loc(chunk_idx[i]);
+		total += loc_len(loc[i]);
+	}
+	in = (char *)malloc(total);
+
+	p = in;
+	for (i = 0; i < num && retval == 1; i += n) {
+		start = loc_off(loc[i]);
+		end = start + loc_len(loc[i]);
+		for (n = 1; i + n < num && loc_off(loc[i + n]) == end; n ++)
+			end += loc_len(loc[i + n]);
+
+		if (pread(pack_fd, p, end - start, start) != (ssize_t)(end - start)) {
+			fprintf(stderr, "Error in reading chunk pack!\n");
+			retval = -1;
+			break;
+		}
+		for (j = i; j < i + n; j ++) {
+			if (decompress_chunk(loc_engine(loc[j]), p, loc_len(loc[j]), bufs[j]) < 0) {
+				retval = -1;
+				break;
+			}
+			p += loc_len(loc[j]);
+		}
+	}
+
+	free(loc);
+	free(in);
+	return retval;
+}
+
+void pack_discard(unsigned int chunk_idx, unsigned int num) {
+	unsigned long long *old;
+	unsigned int i, num_old = 0;
+
+	if (locs == NULL)
+		return;
+
+	old = (unsigned long long *)malloc(num * sizeof(unsigned long long));
+	for (i = 0; i < num; i ++) {
+		old[num_old] = __atomic_exchange_n(&locs[chunk_idx + i], 0, __ATOMIC_ACQ_REL);
+		if (old[num_old] != 0)
+			num_old ++;
+	}
+	if (num_old > 0)
+		punch_locs(old, num_old);
+	free(old);
+}
+
+void get_pack_stats(struct pack_stats *stats) {
+	memset(stats, 0, sizeof(*stats));
+	if (pack_hdr == NULL)
+		return;
+	stats->chunks = __atomic_load_n(&pack_hdr->chunks, __ATOMIC_RELAXED);
+	stats->bytes = __atomic_load_n(&pack_hdr->bytes, __ATOMIC_RELAXED);
+	stats->tail = __atomic_load_n(&pack_hdr->tail, __ATOMIC_RELAXED);
+}
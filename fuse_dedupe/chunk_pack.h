@@ -0,0 +1,66 @@
+#ifndef CHUNK_PACK_H_
+#define CHUNK_PACK_H_
+
+// compressed chunks of the store.  With -o compress= a chunk that
+// compresses does not go to its slot of the store, it is appended to a
+// pack file next to the store, <store>.pack, right after the chunk before
+// it.  Where each one is, its offset and length there and its engine, is
+// kept by chunk id in <store>.loc, mmap'ed like the chunk map.  A chunk
+// that does not compress goes to its slot as before and has no entry.
+//
+// The pack file only grows, the data of freed chunks is punched out of it
+// so it takes no disk space.
+#define PACK_LOC_MAGIC "DDPKLOC"
+#define PACK_LOC_VERSION 1
+#define PACK_LOC_HDR_SIZE 4096
+
+typedef struct pack_header {
+	char magic[8];
+	unsigned int version;
+	// where the next chunk is appended
+	unsigned long long tail;
+	// chunks in the pack and the bytes they take there
+	unsigned long long chunks;
+	unsigned long long bytes;
+} pack_header;
+
+// an entry is the offset in the pack (46 bits), the length (14 bits) and
+// the engine (4 bits), 0 for a chunk that is not packed
+#define PACK_OFF_MAX (1ULL << 46)
+#define loc_off(l) ((l) >> 18)
+#define loc_len(l) ((unsigned int)((l) >> 4) & 0x3FFF)
+#define loc_engine(l) ((int)((l) & 0xF))
+#define loc_make(off, len, engine) \
+	(((unsigned long long)(off) << 18) | ((unsigned long long)(len) << 4) | (engine))
+
+struct pack_stats {
+	unsigned long long chunks;	// chunks packed
+	unsigned long long bytes;	// bytes they take in the pack
+	unsigned long long tail;	// size of the pack file
+};
+
+// open the pack and the entries of the store at path, created if create
+// is set.  Otherwise a store that never had a chunk packed has none, and
+// every chunk is in its slot.  returns 1 on success
+int init_chunk_pack(const char *path, int create);
+
+int close_chunk_pack();
+
+// the entry of chunk_idx, 0 if the chunk is in its slot
+unsigned long long pack_loc(unsigned int chunk_idx);
+
+// compress num chunks with the engine of the mount, the ones that
+// compress are appended to the pack with one write and get their entry.
+// packed[i] is set for them.  returns the number packed, -1 on error
+int pack_chunks(unsigned int *chunk_idx, const char **bufs, unsigned int num, char *packed);
+
+// read num packed chunks into bufs[i].  Chunks that follow each other in
+// the pack are read with one pread
+int unpack_chunks(unsigned int *chunk_idx, char **bufs, unsigned int num);
+
+// the num chunks from chunk_idx are freed, punch out their packed data
+void pack_discard(unsigned int chunk_idx, unsigned int num);
+
+void get_pack_stats(struct pack_stats *stats);
+
+#endif
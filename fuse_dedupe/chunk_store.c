@@ -1,66 +1,640 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include "chunk_store.h"
+#include "chunk_uring.h"
+#include "chunk_alloc.h"
+#include "chunk_cache.h"
+#include "chunk_pack.h"
+#include "chunk_container.h"
+#include "compress.h"
+#include "op_stats.h"
+
+// store the current fd, to avoid frequently open the file
+// all the I/O on it is positional, so it is shared by every thread
+static int store_fd = -1;
+
+// all requests go through io_uring when this is set
+static int use_uring = 0;
+
+// new chunks are gathered in open containers when this is set
+static int use_containers = 0;
+
+// chunks that are in the fingerprint table but not in the store yet,
+// a reader of one of them waits until its writer is done.  The table
+// grows, its writer may hold a bucket lock and can't wait for room
+static unsigned int *pending = NULL;
+static unsigned int pending_num = 0, pending_max = 0;
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_cond = PTHREAD_COND_INITIALIZER;
+
+// the chunks of the last reply a thread handed fuse as ranges of the
+// store.  The sets are never freed, one left by a thread that exited is
+// taken by the next
+typedef struct pin_set {
+	unsigned int *start, *num;
+	unsigned int ranges, max;
+	int in_use;
+	pthread_mutex_t lock;
+	struct pin_set *next;
+} pin_set;
+
+static __thread pin_set *my_pins = NULL;
+static pin_set *pin_sets = NULL;
+static pthread_mutex_t pin_sets_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t pin_key;
+static pthread_once_t pin_key_once = PTHREAD_ONCE_INIT;
+
+static int find_pending(unsigned int chunk_idx) {
+	unsigned int i;
+
+	for (i = 0; i < pending_num; i ++) {
+		if (pending[i] == chunk_idx)
+			return i;
+	}
+	return -1;
+}
+
+int chunk_pending(unsigned int chunk_idx, unsigned int num) {
+	unsigned int *table, max, i;
+
+	pthread_mutex_lock(&pending_lock);
+	if (pending_num + num > pending_max) {
+		max = pending_max ? pending_max : MAX_PENDING_CHUNKS;
+		while (max < pending_num + num)
+			max *= 2;
+		table = (unsigned int *)realloc(pending, sizeof(unsigned int) * max);
+		if (table == NULL) {
+			pthread_mutex_unlock(&pending_lock);
+			fprintf(stderr, "Failed to grow the pending chunks!\n");
+			return -1;
+		}
+		pending = table;
+		pending_max = max;
+	}
+	for (i = 0; i < num; i ++)
+		pending[pending_num + i] = chunk_idx + i;
+	__atomic_store_n(&pending_num, pending_num + num, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&pending_lock);
+	return 1;
+}
+
+void chunk_pending_done(unsigned int chunk_idx) {
+	int i;
+
+	// nothing in flight is the common case, skip the lock then
+	if (__atomic_load_n(&pending_num, __ATOMIC_ACQUIRE) == 0)
+		return;
+
+	pthread_mutex_lock(&pending_lock);
+	i = find_pending(chunk_idx);
+	if (i >= 0) {
+		pending[i] = pending[pending_num - 1];
+		__atomic_store_n(&pending_num, pending_num - 1, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&pending_cond);
+	}
+	pthread_mutex_unlock(&pending_lock);
+}
+
+static void wait_pending(unsigned int chunk_idx) {
+	if (__atomic_load_n(&pending_num, __ATOMIC_ACQUIRE) == 0)
+		return;
+
+	pthread_mutex_lock(&pending_lock);
+	while (find_pending(chunk_idx) >= 0)
+		pthread_cond_wait(&pending_cond, &pending_lock);
+	pthread_mutex_unlock(&pending_lock);
+}
 
 int init_chunk_store(const char *path) {
-	store_fd = open(path, O_RDWR | O_APPEND | O_CREAT, S_IWUSR | S_IRUSR | S_IRGRP | S_IWGRP);
+	char map_path[PATH_MAX];
+
+	store_fd = open(path, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR | S_IRGRP | S_IWGRP);
 	if (store_fd < 0) {
 		fprintf(stderr, "Failed to initialize chunk store!\n");
 		return -1;
-	} else {
-		return 1;
 	}
+
+	// the free chunks of the store are kept in a bitmap next to it
+	snprintf(map_path, PATH_MAX, "%s.map", path);
+	if (init_chunk_alloc(map_path) < 0) {
+		close(store_fd);
+		store_fd = -1;
+		return -1;
+	}
+
+	// compressed chunks are in a pack next to it, made when a mount
+	// first compresses
+	if (init_chunk_pack(path, comp_engine() != COMP_NONE) < 0) {
+		close_chunk_alloc();
+		close(store_fd);
+		store_fd = -1;
+		return -1;
+	}
+
+	// new chunks are gathered in containers, their metadata is next to it
+	if (init_containers(path, store_fd) < 0) {
+		close_chunk_pack();
+		close_chunk_alloc();
+		close(store_fd);
+		store_fd = -1;
+		return -1;
+	}
+
+	// io_uring is used when the kernel has it
+	chunk_store_uring(1);
+	use_containers = 1;
+	return 1;
 }
 
 int close_chunk_store() {
+	close_containers();
+	use_containers = 0;
+	chunk_store_uring(0);
+	close_chunk_pack();
+	close_chunk_alloc();
 	close(store_fd);
+	store_fd = -1;
+	return 1;
 }
 
-int read_chunk(unsigned int chunk_idx, char *buf) {
-	unsigned int offset;
+static int read_chunk_io(unsigned int chunk_idx, char *buf) {
+	unsigned int ticket;
+	off_t offset;
 	int ret;
 
-	offset = chunk_idx * CHUNK_SIZE;
-	
+	offset = (off_t)chunk_idx * CHUNK_SIZE;
+
 	if (store_fd < 0) {
 		fprintf(stderr, "Chunk store not initilized!\n");
 		return -1;
 	}
-	
-	lseek(store_fd, offset, SEEK_SET);
 
-	ret = read(store_fd, buf, CHUNK_SIZE);
+	wait_pending(chunk_idx);
+	if (chunk_cache_get(chunk_idx, buf, &ticket))
+		return 1;
+
+	if (use_containers && container_read(chunk_idx, buf))
+		ret = CHUNK_SIZE;
+	else if (pack_loc(chunk_idx) != 0)
+		ret = unpack_chunks(&chunk_idx, &buf, 1) < 0 ? -1 : CHUNK_SIZE;
+	else
+		ret = pread(store_fd, buf, CHUNK_SIZE, offset);
 
 	if (ret != CHUNK_SIZE) {
 		fprintf(stderr, "Error in reading file!\n");
 		return -1;
 	}
 
+	chunk_cache_put(chunk_idx, buf, ticket);
 	return 1;
 }
 
-int write_chunk(unsigned int chunk_idx, const char *buf) {
-	unsigned int offset;
+int read_chunk(unsigned int chunk_idx, char *buf) {
+	unsigned long long start = op_start();
+	int ret;
+
+	ret = read_chunk_io(chunk_idx, buf);
+	op_done(OP_READ_CHUNK, start, CHUNK_SIZE);
+	return ret;
+}
+
+static int write_chunk_io(unsigned int chunk_idx, const char *buf) {
+	off_t offset;
+	char packed;
 	int ret;
 
-	offset = chunk_idx * CHUNK_SIZE;
-	
+	offset = (off_t)chunk_idx * CHUNK_SIZE;
+
 	if (store_fd < 0) {
 		fprintf(stderr, "Chunk store not initilized!\n");
 		return -1;
 	}
-	
-	lseek(store_fd, offset, SEEK_SET);
 
-	ret = write(store_fd, buf, CHUNK_SIZE);
+	ret = pack_chunks(&chunk_idx, &buf, 1, &packed);
+	if (ret < 0)
+		ret = -1;
+	else if (packed || (use_containers && container_write(chunk_idx, buf)))
+		ret = CHUNK_SIZE;
+	else
+		ret = pwrite(store_fd, buf, CHUNK_SIZE, offset);
+	// drop the old data before readers stop waiting for the new
+	chunk_cache_invalidate(chunk_idx, 1);
+	chunk_pending_done(chunk_idx);
 
 	if (ret != CHUNK_SIZE) {
-		fprintf(stderr, "Error in reading file!\n");
+		fprintf(stderr, "Error in writing file!\n");
+		return -1;
+	}
+
+	return 1;
+}
+
+int write_chunk(unsigned int chunk_idx, const char *buf) {
+	unsigned long long start = op_start();
+	int ret;
+
+	ret = write_chunk_io(chunk_idx, buf);
+	op_done(OP_WRITE_CHUNK, start, CHUNK_SIZE);
+	return ret;
+}
+
+// length of the run of consecutive chunk ids starting at chunk_idx[0],
+// such a run is one contiguous range of the store
+static unsigned int chunk_run(unsigned int *chunk_idx, unsigned int num) {
+	unsigned int n = 1;
+
+	while (n < num && n < MAX_CHUNKS_PER_IO && chunk_idx[n] == chunk_idx[0] + n)
+		n ++;
+	return n;
+}
+
+// split num chunks into store ranges, ios and iov need room for num entries
+static unsigned int chunk_ranges(unsigned int *chunk_idx, char **bufs, unsigned int num,
+		store_io *ios, struct iovec *iov) {
+	unsigned int i, j, n, num_ios = 0;
+
+	for (i = 0; i < num; i += n) {
+		n = chunk_run(&chunk_idx[i], num - i);
+
+		for (j = 0; j < n; j ++) {
+			iov[i + j].iov_base = bufs[i + j];
+			iov[i + j].iov_len = CHUNK_SIZE;
+		}
+
+		ios[num_ios].offset = (off_t)chunk_idx[i] * CHUNK_SIZE;
+		ios[num_ios].iov = &iov[i];
+		ios[num_ios].iovcnt = n;
+		num_ios ++;
+	}
+
+	return num_ios;
+}
+
+// move the ranges, all at once through io_uring when it is on,
+// one preadv/pwritev per range otherwise
+static int chunk_io(store_io *ios, unsigned int num_ios, int write) {
+	unsigned int i;
+	ssize_t ret;
+	int retval = 1;
+
+	if (use_uring) {
+		retval = uring_submit(ios, num_ios, write);
+		if (retval != 0)
+			return retval;
+		retval = 1;
+	}
+
+	for (i = 0; i < num_ios; i ++) {
+		if (write)
+			ret = pwritev(store_fd, ios[i].iov, ios[i].iovcnt, ios[i].offset);
+		else
+			ret = preadv(store_fd, ios[i].iov, ios[i].iovcnt, ios[i].offset);
+
+		if (ret != (ssize_t)ios[i].iovcnt * CHUNK_SIZE) {
+			fprintf(stderr, "Error in %s file!\n", write ? "writing" : "reading");
+			retval = -1;
+		}
+	}
+
+	return retval;
+}
+
+// read num chunks into bufs[i].  Cached chunks and the ones of open
+// containers are copied, packed ones are read from the pack, the others
+// with one request per run of consecutive chunks
+static int read_chunks_io(unsigned int *chunk_idx, char **bufs, unsigned int num) {
+	store_io *ios;
+	struct iovec *iov;
+	unsigned int *miss_idx, *tickets, *pack_idx, *pack_tickets;
+	char **miss_bufs, **pack_bufs;
+	unsigned int i, num_miss = 0, num_packed = 0, num_ios;
+	unsigned int ticket;
+	int retval = 1;
+
+	if (store_fd < 0) {
+		fprintf(stderr, "Chunk store not initilized!\n");
+		return -1;
+	}
+	if (num == 0)
+		return 1;
+
+	for (i = 0; i < num; i ++)
+		wait_pending(chunk_idx[i]);
+
+	miss_idx = (unsigned int *)malloc(num * 4 * sizeof(unsigned int));
+	tickets = miss_idx + num;
+	pack_idx = tickets + num;
+	pack_tickets = pack_idx + num;
+	miss_bufs = (char **)malloc(num * 2 * sizeof(char *));
+	pack_bufs = miss_bufs + num;
+
+	for (i = 0; i < num; i ++) {
+		if (chunk_cache_get(chunk_idx[i], bufs[i], &ticket))
+			continue;
+		if (use_containers && container_read(chunk_idx[i], bufs[i])) {
+			chunk_cache_put(chunk_idx[i], bufs[i], ticket);
+			continue;
+		}
+		if (pack_loc(chunk_idx[i]) != 0) {
+			pack_idx[num_packed] = chunk_idx[i];
+			pack_bufs[num_packed] = bufs[i];
+			pack_tickets[num_packed] = ticket;
+			num_packed ++;
+		} else {
+			miss_idx[num_miss] = chunk_idx[i];
+			miss_bufs[num_miss] = bufs[i];
+			tickets[num_miss] = ticket;
+			num_miss ++;
+		}
+	}
+
+	if (num_miss > 0) {
+		ios = (store_io *)malloc(num_miss * sizeof(store_io));
+		iov = (struct iovec *)malloc(num_miss * sizeof(struct iovec));
+
+		num_ios = chunk_ranges(miss_idx, miss_bufs, num_miss, ios, iov);
+		retval = chunk_io(ios, num_ios, 0);
+		if (retval == 1) {
+			for (i = 0; i < num_miss; i ++)
+				chunk_cache_put(miss_idx[i], miss_bufs[i], tickets[i]);
+		}
+
+		free(ios);
+		free(iov);
+	}
+
+	if (num_packed > 0 && retval == 1) {
+		retval = unpack_chunks(pack_idx, pack_bufs, num_packed);
+		if (retval == 1) {
+			for (i = 0; i < num_packed; i ++)
+				chunk_cache_put(pack_idx[i], pack_bufs[i], pack_tickets[i]);
+		}
+	}
+
+	free(miss_idx);
+	free(miss_bufs);
+	return retval;
+}
+
+int read_chunks(unsigned int *chunk_idx, char **bufs, unsigned int num) {
+	// an empty batch is not timed
+	unsigned long long start = num ? op_start() : 0;
+	int ret;
+
+	ret = read_chunks_io(chunk_idx, bufs, num);
+	op_done(OP_READ_CHUNK, start, (unsigned long long)num * CHUNK_SIZE);
+	return ret;
+}
+
+// write num chunks from bufs[i].  With compression on the ones that
+// compress go to the pack, the others go to their open container unless
+// they are in a run of DIRECT_RUN_CHUNKS.  What is left is written with
+// one request per run of consecutive chunks
+static int write_chunks_io(unsigned int *chunk_idx, const char **bufs, unsigned int num) {
+	store_io *ios;
+	struct iovec *iov;
+	unsigned int *raw_idx;
+	const char **raw_bufs;
+	unsigned int i, j, n, num_raw = 0, num_ios;
+	char *packed;
+	int retval = 1;
+
+	if (store_fd < 0) {
+		fprintf(stderr, "Chunk store not initilized!\n");
+		return -1;
+	}
+	if (num == 0)
+		return 1;
+
+	packed = (char *)malloc(num);
+	raw_idx = (unsigned int *)malloc(num * sizeof(unsigned int));
+	raw_bufs = (const char **)malloc(num * sizeof(char *));
+
+	if (pack_chunks(chunk_idx, bufs, num, packed) < 0)
+		retval = -1;
+	for (i = 0; i < num && retval == 1; i += n) {
+		n = 1;
+		if (packed[i])
+			continue;
+		while (i + n < num && !packed[i + n] && chunk_idx[i + n] == chunk_idx[i] + n)
+			n ++;
+
+		for (j = i; j < i + n; j ++) {
+			if (n < DIRECT_RUN_CHUNKS && use_containers && container_write(chunk_idx[j], bufs[j]))
+				continue;
+			raw_idx[num_raw] = chunk_idx[j];
+			raw_bufs[num_raw] = bufs[j];
+			num_raw ++;
+		}
+	}
+
+	if (num_raw > 0) {
+		ios = (store_io *)malloc(num_raw * sizeof(store_io));
+		iov = (struct iovec *)malloc(num_raw * sizeof(struct iovec));
+
+		num_ios = chunk_ranges(raw_idx, (char **)raw_bufs, num_raw, ios, iov);
+		retval = chunk_io(ios, num_ios, 1);
+
+		free(ios);
+		free(iov);
+	}
+
+	for (i = 0; i < num; i ++) {
+		chunk_cache_invalidate(chunk_idx[i], 1);
+		chunk_pending_done(chunk_idx[i]);
+	}
+
+	free(packed);
+	free(raw_idx);
+	free(raw_bufs);
+	return retval;
+}
+
+int write_chunks(unsigned int *chunk_idx, const char **bufs, unsigned int num) {
+	unsigned long long start = num ? op_start() : 0;
+	int ret;
+
+	ret = write_chunks_io(chunk_idx, bufs, num);
+	op_done(OP_WRITE_CHUNK, start, (unsigned long long)num * CHUNK_SIZE);
+	return ret;
+}
+
+int sync_chunk_store() {
+	if (store_fd < 0)
+		return 1;
+	return sync_containers();
+}
+
+int discard_chunks(unsigned int chunk_idx, unsigned int num) {
+	int ret;
+
+	// a chunk still in its container must not be written over the hole
+	container_discard(chunk_idx, num);
+	ret = fallocate(store_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			(off_t)chunk_idx * CHUNK_SIZE, (off_t)num * CHUNK_SIZE);
+	pack_discard(chunk_idx, num);
+	chunk_cache_invalidate(chunk_idx, num);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to discard chunks!\n");
 		return -1;
 	}
+	return 1;
+}
+
+// the store fd and where chunk_idx is in it, once the chunk is written.
+// -1 when the chunk is not in the store file as it is: still in its open
+// container, or packed
+int chunk_store_fd(unsigned int chunk_idx, off_t *offset) {
+	if (store_fd < 0)
+		return -1;
+
+	// a chunk on its way is read once it is written
+	wait_pending(chunk_idx);
+	if ((use_containers && container_read(chunk_idx, NULL)) || pack_loc(chunk_idx) != 0)
+		return -1;
+
+	*offset = (off_t)chunk_idx * CHUNK_SIZE;
+	return store_fd;
+}
+
+static void pin_exit(void *arg) {
+	pin_set *pins = (pin_set *)arg;
+
+	pthread_mutex_lock(&pins->lock);
+	pins->ranges = 0;
+	pthread_mutex_unlock(&pins->lock);
+	pthread_mutex_lock(&pin_sets_lock);
+	pins->in_use = 0;
+	pthread_mutex_unlock(&pin_sets_lock);
+}
+
+static void pin_key_init(void) {
+	pthread_key_create(&pin_key, pin_exit);
+}
+
+static pin_set *get_pins(void) {
+	pin_set *pins;
+
+	pthread_once(&pin_key_once, pin_key_init);
+	pthread_mutex_lock(&pin_sets_lock);
+	for (pins = pin_sets; pins != NULL && pins->in_use; pins = pins->next)
+		;
+	if (pins == NULL) {
+		pins = (pin_set *)calloc(1, sizeof(pin_set));
+		if (pins == NULL) {
+			pthread_mutex_unlock(&pin_sets_lock);
+			return NULL;
+		}
+		pthread_mutex_init(&pins->lock, NULL);
+		pins->next = pin_sets;
+		pin_sets = pins;
+	}
+	pins->in_use = 1;
+	pthread_mutex_unlock(&pin_sets_lock);
+
+	pthread_setspecific(pin_key, pins);
+	return pins;
+}
 
+int chunk_store_pin(unsigned int chunk_idx, unsigned int num) {
+	pin_set *pins = my_pins;
+	unsigned int *start, *len, max;
+
+	if (pins == NULL && (pins = my_pins = get_pins()) == NULL)
+		return -1;
+
+	pthread_mutex_lock(&pins->lock);
+	if (pins->ranges == pins->max) {
+		max = pins->max ? pins->max * 2 : 32;
+		start = (unsigned int *)realloc(pins->start, sizeof(unsigned int) * max);
+		if (start != NULL)
+			pins->start = start;
+		len = (unsigned int *)realloc(pins->num, sizeof(unsigned int) * max);
+		if (len != NULL)
+			pins->num = len;
+		if (start == NULL || len == NULL) {
+			pthread_mutex_unlock(&pins->lock);
+			return -1;
+		}
+		pins->max = max;
+	}
+	pins->start[pins->ranges] = chunk_idx;
+	pins->num[pins->ranges] = num;
+	pins->ranges ++;
+	pthread_mutex_unlock(&pins->lock);
 	return 1;
 }
+
+void chunk_store_unpin() {
+	pin_set *pins = my_pins;
+
+	if (pins == NULL || pins->ranges == 0)
+		return;
+	pthread_mutex_lock(&pins->lock);
+	pins->ranges = 0;
+	pthread_mutex_unlock(&pins->lock);
+}
+
+int chunk_store_pinned(unsigned int chunk_idx, unsigned int num) {
+	pin_set *pins;
+	unsigned int i;
+	int ret = 0;
+
+	pthread_mutex_lock(&pin_sets_lock);
+	for (pins = pin_sets; pins != NULL && !ret; pins = pins->next) {
+		pthread_mutex_lock(&pins->lock);
+		for (i = 0; i < pins->ranges; i ++) {
+			if (pins->start[i] < chunk_idx + num && chunk_idx < pins->start[i] + pins->num[i]) {
+				ret = 1;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&pins->lock);
+	}
+	pthread_mutex_unlock(&pin_sets_lock);
+	return ret;
+}
+
+// chunk buffers come from the registered io_uring buffer when they can
+char *alloc_chunk_buf(unsigned int num) {
+	char *buf = NULL;
+
+	if (use_uring)
+		buf = uring_get_buf(num);
+	if (buf == NULL)
+		buf = (char *)malloc((size_t)num * CHUNK_SIZE);
+	return buf;
+}
+
+void free_chunk_buf(char *buf) {
+	if (!uring_put_buf(buf))
+		free(buf);
+}
+
+// switch io_uring on or off, returns 1 if it is on afterwards
+int chunk_store_uring(int enable) {
+	if (enable && !use_uring && store_fd >= 0)
+		use_uring = (uring_init(store_fd) == 1);
+	else if (!enable && use_uring) {
+		uring_close();
+		use_uring = 0;
+	}
+	return use_uring;
+}
+
+// switch containers on or off, the open ones are written out first
+int chunk_store_containers(int enable) {
+	if (!enable && use_containers)
+		sync_containers();
+	use_containers = enable && store_fd >= 0;
+	return use_containers;
+}
@@ -1,22 +1,90 @@
 #ifndef CHUNK_STORE_H_
 #define CHUNK_STORE_H_
 
+#include <sys/types.h>
+
 #include "dedupe.h"
 
 #define MAX_CHUNKS_PER_FILE 8192
 #define BUF_SIZE 256;
 
-// store the current fd, to avoid frequently open the file
-static int store_fd = -1;
+// most chunks moved by one preadv/pwritev, IOV_MAX on Linux
+#define MAX_CHUNKS_PER_IO 1024
+
+// a run of at least this many new chunks with consecutive ids is written
+// from the caller's buffers as it is.  It is one sequential write already,
+// an open container would only copy it first
+#define DIRECT_RUN_CHUNKS 16
+
+// chunks the table of the ones waiting for their first write has room
+// for at first, it grows when more are
+#define MAX_PENDING_CHUNKS 1024
 
 // initialize the path to chunk store director
 int init_chunk_store(const char *path);
 
-// read a chunk with index chunk_idx
+// read a chunk with index chunk_idx, from the chunk cache when it is there
+// waits if the chunk was just added and its data is still on the way
 int read_chunk(unsigned int chunk_idx, char* buf);
 
 // write_chunk to index chunk_idx
+// also clears the pending state set by chunk_pending()
 int write_chunk(unsigned int chunk_idx, const char *buf);
 
+// batched versions, chunk i goes to/from bufs[i].
+// every run of consecutive chunk ids is one request, with io_uring all
+// requests are submitted together, otherwise one preadv/pwritev each
+int read_chunks(unsigned int *chunk_idx, char **bufs, unsigned int num);
+
+int write_chunks(unsigned int *chunk_idx, const char **bufs, unsigned int num);
+
+// new chunks wait in their open container (see chunk_container.h) for
+// the rest of it, this writes out every open container.  Called at flush,
+// fsync and release.  returns -1 if a write failed
+int sync_chunk_store();
+
+// the num chunks from chunk_idx are no longer used, give their space back
+// to the file system.  They read as zeros until they are written again
+int discard_chunks(unsigned int chunk_idx, unsigned int num);
+
+// a buffer for num chunks, taken from the registered io_uring buffer
+// of the calling thread when possible.  Release with free_chunk_buf()
+char *alloc_chunk_buf(unsigned int num);
+
+void free_chunk_buf(char *buf);
+
+// io_uring is switched on by init_chunk_store() when the kernel has it,
+// this switches it on or off, returns 1 if it is on afterwards
+int chunk_store_uring(int enable);
+
+// the store fd, with the offset of chunk_idx in it in *offset, when the
+// chunk is there as it is and a read may hand the range to fuse to copy
+// or splice.  Returns -1 if it is packed or still in its open container,
+// read_chunks() gets those.  The read pins the range before it lets go of
+// the file
+int chunk_store_fd(unsigned int chunk_idx, off_t *offset);
+
+// fuse copies a range it got from read_buf after read_buf returned.  The
+// calling thread pins the num chunks from chunk_idx for it, they are not
+// freed until the thread calls chunk_store_unpin(), at the start of its
+// next read, when the reply is surely out.  Returns -1 if out of memory
+int chunk_store_pin(unsigned int chunk_idx, unsigned int num);
+
+void chunk_store_unpin();
+
+// returns 1 if a thread pinned any of the num chunks from chunk_idx
+int chunk_store_pinned(unsigned int chunk_idx, unsigned int num);
+
+// containers are switched on by init_chunk_store(), this switches them
+// on or off, returns 1 if they are on afterwards
+int chunk_store_containers(int enable);
+
+// mark the num chunks from chunk_idx as added to the index but not
+// written yet.  Never waits, returns -1 if out of memory
+int chunk_pending(unsigned int chunk_idx, unsigned int num);
+
+// drop the pending state without writing, when the write is abandoned
+void chunk_pending_done(unsigned int chunk_idx);
+
 int close_chunk_store();
 #endif
@@ -0,0 +1,353 @@
+/* chunk_uring.c
+* fuse_dedupe project
+*
+* io_uring backend of the chunk store.  A request hands over all of its
+* store ranges at once, they are queued on the ring of the calling thread,
+* submitted with one io_uring_enter and reaped together.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk_uring.h"
+#include "dedupe.h"
+
+#ifdef HAVE_IO_URING
+
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+typedef struct uring {
+	int ring_fd;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+	// the registered buffer, NULL if registering failed
+	char *buf;
+	int buf_busy;
+} uring;
+
+static int uring_store_fd = -1;
+static pthread_key_t uring_key;
+static pthread_once_t uring_key_once = PTHREAD_ONCE_INIT;
+
+static void uring_free(uring *r) {
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_len);
+	if (r->cq_ptr && r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_len);
+	if (r->sq_ptr)
+		munmap(r->sq_ptr, r->sq_len);
+	if (r->ring_fd >= 0)
+		close(r->ring_fd);
+	free(r->buf);
+	free(r);
+}
+
+static void uring_thread_exit(void *arg) {
+	uring_free((uring *)arg);
+}
+
+static void uring_make_key() {
+	pthread_key_create(&uring_key, uring_thread_exit);
+}
+
+static uring *uring_setup() {
+	struct io_uring_params p;
+	struct iovec iov;
+	uring *r;
+	char *sq, *cq;
+
+	r = (uring *)calloc(1, sizeof(uring));
+	memset(&p, 0, sizeof(p));
+
+	r->ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (r->ring_fd < 0) {
+		free(r);
+		return NULL;
+	}
+
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_len > r->sq_len)
+			r->sq_len = r->cq_len;
+		r->cq_len = r->sq_len;
+	}
+
+	r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			r->ring_fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED) {
+		r->sq_ptr = NULL;
+		goto fail;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ptr = r->sq_ptr;
+	} else {
+		r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				r->ring_fd, IORING_OFF_CQ_RING);
+		if (r->cq_ptr == MAP_FAILED) {
+			r->cq_ptr = NULL;
+			goto fail;
+		}
+	}
+
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			r->ring_fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		goto fail;
+	}
+
+	sq = (char *)r->sq_ptr;
+	cq = (char *)r->cq_ptr;
+	r->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	// the store is fixed file 0 on every ring
+	if (syscall(__NR_io_uring_register, r->ring_fd, IORING_REGISTER_FILES, &uring_store_fd, 1) < 0)
+		goto fail;
+
+	// a registered buffer saves the page pinning on every request, it
+	// is optional since it counts against RLIMIT_MEMLOCK
+	if (posix_memalign((void **)&r->buf, 4096, URING_BUF_CHUNKS * CHUNK_SIZE) == 0) {
+		iov.iov_base = r->buf;
+		iov.iov_len = URING_BUF_CHUNKS * CHUNK_SIZE;
+		if (syscall(__NR_io_uring_register, r->ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0) {
+			free(r->buf);
+			r->buf = NULL;
+		}
+	} else {
+		r->buf = NULL;
+	}
+
+	return r;
+
+fail:
+	uring_free(r);
+	return NULL;
+}
+
+// the ring of the calling thread, set up on first use
+static uring *uring_get() {
+	uring *r;
+
+	if (uring_store_fd < 0)
+		return NULL;
+
+	pthread_once(&uring_key_once, uring_make_key);
+	r = (uring *)pthread_getspecific(uring_key);
+	if (r == NULL) {
+		r = uring_setup();
+		pthread_setspecific(uring_key, r);
+	}
+	return r;
+}
+
+int uring_init(int store_fd) {
+	uring_store_fd = store_fd;
+
+	if (uring_get() == NULL) {
+		fprintf(stderr, "io_uring is not available, using pread/pwrite\n");
+		uring_store_fd = -1;
+		return -1;
+	}
+	return 1;
+}
+
+void uring_close() {
+	uring *r;
+
+	if (uring_store_fd < 0)
+		return;
+
+	r = (uring *)pthread_getspecific(uring_key);
+	if (r != NULL) {
+		pthread_setspecific(uring_key, NULL);
+		uring_free(r);
+	}
+	uring_store_fd = -1;
+}
+
+char *uring_get_buf(unsigned int num) {
+	uring *r = uring_get();
+
+	if (r == NULL || r->buf == NULL || r->buf_busy || num > URING_BUF_CHUNKS)
+		return NULL;
+
+	r->buf_busy = 1;
+	return r->buf;
+}
+
+int uring_put_buf(char *buf) {
+	uring *r;
+
+	if (uring_store_fd < 0)
+		return 0;
+
+	r = (uring *)pthread_getspecific(uring_key);
+	if (r == NULL || buf != r->buf)
+		return 0;
+
+	r->buf_busy = 0;
+	return 1;
+}
+
+// a range that sits in one piece of the registered buffer can go
+// through READ_FIXED/WRITE_FIXED
+static int in_fixed_buf(uring *r, store_io *io) {
+	char *p;
+	int i;
+
+	if (r->buf == NULL)
+		return 0;
+
+	p = (char *)io->iov[0].iov_base;
+	for (i = 0; i < io->iovcnt; i ++) {
+		if ((char *)io->iov[i].iov_base != p)
+			return 0;
+		p += io->iov[i].iov_len;
+	}
+
+	return (char *)io->iov[0].iov_base >= r->buf && p <= r->buf + URING_BUF_CHUNKS * CHUNK_SIZE;
+}
+
+static void queue_io(uring *r, store_io *io, int write, unsigned int tag) {
+	unsigned int tail, idx, i, len;
+	struct io_uring_sqe *sqe;
+
+	tail = *r->sq_tail;
+	idx = tail & *r->sq_mask;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+
+	sqe->fd = 0;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->off = io->offset;
+	sqe->user_data = tag;
+
+	if (in_fixed_buf(r, io)) {
+		for (len = 0, i = 0; i < io->iovcnt; i ++)
+			len += io->iov[i].iov_len;
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->addr = (unsigned long)io->iov[0].iov_base;
+		sqe->len = len;
+		sqe->buf_index = 0;
+	} else {
+		sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->addr = (unsigned long)io->iov;
+		sqe->len = io->iovcnt;
+	}
+
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+int uring_submit(store_io *ios, unsigned int num, int write) {
+	unsigned int i, j, n, done, head, expect;
+	struct io_uring_cqe *cqe;
+	uring *r;
+	int ret = 0, k, retval = 1;
+
+	// no ring on this thread, the caller falls back to preadv/pwritev
+	r = uring_get();
+	if (r == NULL)
+		return 0;
+
+	// the ring holds URING_ENTRIES requests, larger batches go in waves
+	for (i = 0; i < num; i += n) {
+		n = num - i;
+		if (n > URING_ENTRIES)
+			n = URING_ENTRIES;
+
+		for (j = 0; j < n; j ++)
+			queue_io(r, &ios[i + j], write, i + j);
+
+		// the kernel may take fewer than asked, the rest go again
+		for (done = 0; done < n; done += ret) {
+			do {
+				ret = syscall(__NR_io_uring_enter, r->ring_fd, n - done, n - done,
+						IORING_ENTER_GETEVENTS, NULL, 0);
+			} while (ret < 0 && errno == EINTR);
+			if (ret <= 0)
+				break;
+		}
+		if (done < n) {
+			fprintf(stderr, "io_uring_enter failed: %s\n",
+					ret < 0 ? strerror(errno) : "nothing submitted");
+			// the requests left in the ring point at the caller's
+			// iovecs, they must not go with the next batch
+			__atomic_store_n(r->sq_tail, __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE),
+					__ATOMIC_RELEASE);
+			retval = -1;
+			// the ones submitted still have to be reaped
+			num = i + done;
+			n = done;
+		}
+
+		// reap them all
+		for (j = 0; j < n; ) {
+			head = *r->cq_head;
+			if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+				syscall(__NR_io_uring_enter, r->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+				continue;
+			}
+
+			cqe = &r->cqes[head & *r->cq_mask];
+			for (expect = 0, k = 0; k < ios[cqe->user_data].iovcnt; k ++)
+				expect += ios[cqe->user_data].iov[k].iov_len;
+			if (cqe->res < 0)
+				fprintf(stderr, "io_uring %s at %llu failed: %s\n", write ? "write" : "read",
+						(unsigned long long)ios[cqe->user_data].offset, strerror(-cqe->res));
+			if (cqe->res != (int)expect)
+				retval = -1;
+
+			__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+			j ++;
+		}
+	}
+
+	if (retval < 0)
+		fprintf(stderr, "Error in %s chunks!\n", write ? "writing" : "reading");
+
+	return retval;
+}
+
+#else
+
+int uring_init(int store_fd) {
+	return -1;
+}
+
+int uring_submit(store_io *ios, unsigned int num, int write) {
+	return 0;
+}
+
+char *uring_get_buf(unsigned int num) {
+	return NULL;
+}
+
+int uring_put_buf(char *buf) {
+	return 0;
+}
+
+void uring_close() {
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef CHUNK_URING_H_
+#define CHUNK_URING_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// io_uring backend of the chunk store, talks to the kernel directly so
+// there is no liburing dependency.  Every thread gets its own ring with
+// the store registered as fixed file 0 and a registered buffer of
+// URING_BUF_CHUNKS chunks.  Build with -DNO_IO_URING to leave it out.
+#if defined(__linux__) && !defined(NO_IO_URING) && __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+
+#define URING_ENTRIES 64
+#define URING_BUF_CHUNKS 64
+
+// one contiguous range of the store and the buffers it goes to/from
+typedef struct store_io {
+	off_t offset;
+	struct iovec *iov;
+	int iovcnt;
+} store_io;
+
+// check that io_uring works here, returns 1 if it does, -1 if the
+// caller has to stay on pread/pwrite
+int uring_init(int store_fd);
+
+// queue all ranges, submit them at once and reap all completions.
+// returns 0 if this thread has no ring and nothing was done
+int uring_submit(store_io *ios, unsigned int num, int write);
+
+// the registered buffer of this thread when num chunks fit in it and
+// it is not in use, NULL otherwise
+char *uring_get_buf(unsigned int num);
+
+// returns 1 if buf was the registered buffer and is free again
+int uring_put_buf(char *buf);
+
+void uring_close();
+
+#endif
@@ -0,0 +1,169 @@
+/* compress.c
+* fuse_dedupe project
+*
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "dedupe.h"
+#include "compress.h"
+
+static int engine = COMP_NONE;
+static int zstd_level = COMP_ZSTD_LEVEL;
+
+static const char *engine_names[] = { "none", "lz4", "zstd" };
+
+#ifdef HAVE_ZSTD
+// zstd contexts are made once per thread, like the OpenSSL ones
+static __thread ZSTD_CCtx *zstd_cctx = NULL;
+static __thread ZSTD_DCtx *zstd_dctx = NULL;
+#endif
+
+int comp_engine_id(const char *name) {
+	int i;
+
+	for (i = COMP_NONE; i <= COMP_ZSTD; i ++) {
+		if (strcmp(name, engine_names[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+const char *comp_engine_name(int id) {
+	if (id < COMP_NONE || id > COMP_ZSTD)
+		return "unknown";
+	return engine_names[id];
+}
+
+int comp_engine_init(int id, int level) {
+	switch (id) {
+		case COMP_NONE:
+			break;
+#ifdef HAVE_LZ4
+		case COMP_LZ4:
+			break;
+#endif
+#ifdef HAVE_ZSTD
+		case COMP_ZSTD:
+			if (level < 1 || level > ZSTD_maxCLevel()) {
+				fprintf(stderr, "Bad zstd level %d!\n", level);
+				return -1;
+			}
+			zstd_level = level;
+			break;
+#endif
+		default:
+			fprintf(stderr, "Compression engine %s is not built in!\n", comp_engine_name(id));
+			return -1;
+	}
+
+	engine = id;
+	if (id == COMP_ZSTD)
+		fprintf(stderr, "compression engine zstd level %d\n", zstd_level);
+	else
+		fprintf(stderr, "compression engine %s\n", comp_engine_name(id));
+	return 1;
+}
+
+int comp_engine() {
+	return engine;
+}
+
+// a look at a sample of the chunk before compressing it.  Random or
+// already compressed data spreads over the byte values about evenly: with
+// counts c[] of n sampled bytes, n^2 / sum(c^2) is about the number of
+// values in use, near 256 for random data and a few dozen for text.
+#define SAMPLE_RUN 32
+#define SAMPLE_STEP 256
+#define RANDOM_VALUES 128
+
+static int looks_random(const unsigned char *p) {
+	unsigned short count[256];
+	unsigned long long n = 0, sq = 0;
+	unsigned int i, j;
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < CHUNK_SIZE; i += SAMPLE_STEP) {
+		for (j = 0; j < SAMPLE_RUN; j ++)
+			count[p[i + j]] ++;
+		n += SAMPLE_RUN;
+	}
+	for (i = 0; i < 256; i ++)
+		sq += count[i] * count[i];
+
+	return n * n > RANDOM_VALUES * sq;
+}
+
+unsigned int compress_chunk(const char *src, char *dst) {
+#if defined(HAVE_LZ4) || defined(HAVE_ZSTD)
+	unsigned int cap = CHUNK_SIZE - CHUNK_SIZE / COMP_MIN_SAVING;
+#endif
+	size_t len = 0;
+
+	if (engine == COMP_NONE || looks_random((const unsigned char *)src))
+		return 0;
+
+	// a chunk that does not fit in cap is not worth it, the engines
+	// give up on it early
+	switch (engine) {
+#ifdef HAVE_LZ4
+		case COMP_LZ4:
+			len = LZ4_compress_default(src, dst, CHUNK_SIZE, cap);
+			break;
+#endif
+#ifdef HAVE_ZSTD
+		case COMP_ZSTD:
+			if (zstd_cctx == NULL)
+				zstd_cctx = ZSTD_createCCtx();
+			if (zstd_cctx == NULL)
+				return 0;
+			len = ZSTD_compressCCtx(zstd_cctx, dst, cap, src, CHUNK_SIZE, zstd_level);
+			if (ZSTD_isError(len))
+				len = 0;
+			break;
+#endif
+	}
+	return len;
+}
+
+int decompress_chunk(int id, const char *src, unsigned int len, char *dst) {
+	long long got = -1;
+#ifdef HAVE_ZSTD
+	size_t ret;
+#endif
+
+	switch (id) {
+#ifdef HAVE_LZ4
+		case COMP_LZ4:
+			got = LZ4_decompress_safe(src, dst, len, CHUNK_SIZE);
+			break;
+#endif
+#ifdef HAVE_ZSTD
+		case COMP_ZSTD:
+			if (zstd_dctx == NULL)
+				zstd_dctx = ZSTD_createDCtx();
+			if (zstd_dctx == NULL)
+				break;
+			ret = ZSTD_decompressDCtx(zstd_dctx, dst, CHUNK_SIZE, src, len);
+			got = ZSTD_isError(ret) ? -1 : (long long)ret;
+			break;
+#endif
+		default:
+			fprintf(stderr, "Chunk compressed with %s, which is not built in!\n", comp_engine_name(id));
+			return -1;
+	}
+
+	if (got != CHUNK_SIZE) {
+		fprintf(stderr, "Failed to decompress chunk!\n");
+		return -1;
+	}
+	return 1;
+}
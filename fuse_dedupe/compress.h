@@ -0,0 +1,46 @@
+/* compress.h
+* fuse_dedupe project
+*
+*/
+
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+// compression engines for the new chunks of the store, picked per mount
+// with -o compress=.  lz4 (-DHAVE_LZ4, -llz4) and zstd (-DHAVE_ZSTD,
+// -lzstd) are built in when the libraries are there.  Every chunk keeps
+// the engine it was compressed with, so the engine can change between
+// mounts.
+#define COMP_NONE 0
+#define COMP_LZ4 1
+#define COMP_ZSTD 2
+
+// zstd level when -o compress_level= is not given
+#define COMP_ZSTD_LEVEL 3
+
+// a chunk is kept raw unless it shrinks by CHUNK_SIZE / COMP_MIN_SAVING
+#define COMP_MIN_SAVING 8
+
+// engine of a -o compress= name, -1 if unknown
+int comp_engine_id(const char *name);
+
+const char *comp_engine_name(int engine);
+
+// select the engine new chunks are compressed with, level is for zstd.
+// returns -1 if it is not built in
+int comp_engine_init(int engine, int level);
+
+// the engine new chunks are compressed with, COMP_NONE for none
+int comp_engine();
+
+// compress the CHUNK_SIZE bytes of src into dst, which has room for
+// CHUNK_SIZE bytes.  returns the compressed length, or 0 if the chunk is
+// to be kept raw: it looks random from a sample, or it did not shrink
+// enough
+unsigned int compress_chunk(const char *src, char *dst);
+
+// decompress the len bytes of src, compressed with engine, into the
+// CHUNK_SIZE bytes of dst.  returns 1, -1 on error
+int decompress_chunk(int engine, const char *src, unsigned int len, char *dst);
+
+#endif
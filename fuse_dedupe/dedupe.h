@@ -12,6 +12,15 @@
 
 #define CHUNK_SIZE 4096
 
+// number of CHUNK_SIZE store chunks that len bytes take
+#define chunk_count(len) (((len) + CHUNK_SIZE - 1) / CHUNK_SIZE)
+
+// how files are cut into chunks, set per mount with -o chunking=
+// fixed: CHUNK_SIZE chunks at fixed offsets
+// cdc:   content-defined chunks (see cdc.h) stored in CHUNK_SIZE units
+#define CHUNK_FIXED 1
+#define CHUNK_CDC 2
+
 struct table{
 char* key;
 long value;
@@ -22,12 +31,12 @@ char sha1(char data[]);
 
 // find the match out in the table
 // if successful the match value returned, else -1 returned
-long findmatch(table pagetable, char* in);
+long findmatch(struct table pagetable, char* in);
 
 // find the available block address
 long findblank();
 
 // insert the sha1 value to the table
-void insert(table pagetable, char* in, long out);
+void insert(struct table pagetable, char* in, long out);
 
 #endif
@@ -0,0 +1,405 @@
+/* fingerprint.c
+* fuse_dedupe project
+*
+* the fingerprint engines behind calc_hash().  Every engine fills
+* FP_WORDS words, longer digests are cut and the words are big endian,
+* so a sha1 fingerprint prints like sha1sum does.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+
+#ifdef HAVE_BLAKE3
+#include <blake3.h>
+#endif
+#ifdef HAVE_XXHASH
+#include <xxhash.h>
+#endif
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_ZERO_AVX2
+#endif
+
+#include "fingerprint.h"
+#include "op_stats.h"
+
+typedef int (*hash_fn)(const char *, int, unsigned int *);
+
+static hash_fn engine_hash = NULL;
+static int engine = 0;
+
+static const char *engine_names[] = { "auto", "sha1", "sha256", "blake3", "xxh3" };
+
+// OpenSSL digests, fetched once and hashed with a context per thread,
+// the context goes when its thread exits
+static EVP_MD *evp_md = NULL;
+static __thread EVP_MD_CTX *evp_ctx = NULL;
+static pthread_key_t evp_key;
+static pthread_once_t evp_key_once = PTHREAD_ONCE_INIT;
+
+static void evp_thread_exit(void *arg) {
+	EVP_MD_CTX_free((EVP_MD_CTX *)arg);
+}
+
+static void evp_make_key() {
+	pthread_key_create(&evp_key, evp_thread_exit);
+}
+
+static void digest_words(const unsigned char *digest, unsigned int *result) {
+	int i;
+
+	memcpy(result, digest, FP_WORDS * sizeof(unsigned int));
+	for (i = 0; i < FP_WORDS; i ++)
+		result[i] = be32toh(result[i]);
+}
+
+static int hash_evp(const char *data, int len, unsigned int *result) {
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_len;
+
+	if (evp_ctx == NULL) {
+		pthread_once(&evp_key_once, evp_make_key);
+		evp_ctx = EVP_MD_CTX_new();
+		pthread_setspecific(evp_key, evp_ctx);
+	}
+
+	if (evp_ctx == NULL || !EVP_DigestInit_ex2(evp_ctx, evp_md, NULL)
+			|| !EVP_DigestUpdate(evp_ctx, data, len)
+			|| !EVP_DigestFinal_ex(evp_ctx, digest, &digest_len)) {
+		fprintf(stderr, "hash error!\n");
+		return -1;
+	}
+	digest_words(digest, result);
+	return 1;
+}
+
+#ifdef HAVE_BLAKE3
+static int hash_blake3(const char *data, int len, unsigned int *result) {
+	unsigned char digest[FP_WORDS * sizeof(unsigned int)];
+	blake3_hasher hasher;
+
+	blake3_hasher_init(&hasher);
+	blake3_hasher_update(&hasher, data, len);
+	blake3_hasher_finalize(&hasher, digest, sizeof(digest));
+	digest_words(digest, result);
+	return 1;
+}
+#endif
+
+#ifdef HAVE_XXHASH
+// 128 bits of hash and the length
+static int hash_xxh3(const char *data, int len, unsigned int *result) {
+	XXH128_hash_t h = XXH3_128bits(data, len);
+
+	result[0] = h.high64 >> 32;
+	result[1] = h.high64;
+	result[2] = h.low64 >> 32;
+	result[3] = h.low64;
+	result[4] = len;
+	return 1;
+}
+#endif
+
+int fp_engine_id(const char *name) {
+	int i;
+
+	for (i = 0; i < sizeof(engine_names) / sizeof(engine_names[0]); i ++) {
+		if (strcmp(name, engine_names[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+const char *fp_engine_name(int id) {
+	if (id < 0 || id > FP_XXH3)
+		return "unknown";
+	return engine_names[id];
+}
+
+// SHA1 in hardware beats everything but xxh3, without it BLAKE3 is the
+// fastest when it is there
+static int cpu_has_sha() {
+#if defined(__aarch64__)
+	return (getauxval(AT_HWCAP) & HWCAP_SHA1) != 0;
+#elif defined(__x86_64__) || defined(__i386__)
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return (ebx >> 29) & 1;
+#else
+	return 0;
+#endif
+}
+
+int fp_engine_auto() {
+#ifdef HAVE_BLAKE3
+	if (!cpu_has_sha())
+		return FP_BLAKE3;
+#endif
+	return FP_SHA1;
+}
+
+int fp_engine_init(int id) {
+	const char *md_name = NULL;
+
+	zero_use_simd(1);
+
+	switch (id) {
+		case FP_SHA1:
+			md_name = "SHA1";
+			break;
+		case FP_SHA256:
+			md_name = "SHA256";
+			break;
+#ifdef HAVE_BLAKE3
+		case FP_BLAKE3:
+			engine_hash = hash_blake3;
+			break;
+#endif
+#ifdef HAVE_XXHASH
+		case FP_XXH3:
+			engine_hash = hash_xxh3;
+			break;
+#endif
+		default:
+			fprintf(stderr, "Fingerprint engine %s is not built in!\n", fp_engine_name(id));
+			return -1;
+	}
+
+	if (md_name != NULL) {
+		EVP_MD_free(evp_md);
+		evp_md = EVP_MD_fetch(NULL, md_name, NULL);
+		if (evp_md == NULL) {
+			fprintf(stderr, "OpenSSL has no %s!\n", md_name);
+			return -1;
+		}
+		engine_hash = hash_evp;
+	}
+
+	engine = id;
+	fprintf(stderr, "fingerprint engine %s%s\n", fp_engine_name(id),
+			md_name != NULL && cpu_has_sha() ? " (sha instructions)" : "");
+	return 1;
+}
+
+int fp_engine_weak() {
+	return engine == FP_XXH3;
+}
+
+// every chunk hashed is timed, by the thread that hashed it
+static int hash_timed(const char *data, int len, unsigned int *result) {
+	unsigned long long start = op_start();
+	int ret;
+
+	ret = engine_hash(data, len, result);
+	op_done(OP_CALC_HASH, start, len);
+	return ret;
+}
+
+int calc_hash(char *data, int len, unsigned int *result) {
+	return hash_timed(data, len, result);
+}
+
+/*
+* zero chunks.  Most chunks that are not zero fail on their first block,
+* a zero one is read to the end, so the check ORs a block of loads
+* together and tests the block once.  The plain C kernel does 64 bytes a
+* block, the AVX2 one 128 bytes.
+*/
+typedef int (*zero_fn)(const char *, unsigned int);
+
+static int zero_c(const char *data, unsigned int len) {
+	unsigned long long w, acc;
+	unsigned int i, j;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		acc = 0;
+		for (j = 0; j < 64; j += sizeof(w)) {
+			memcpy(&w, data + i + j, sizeof(w));
+			acc |= w;
+		}
+		if (acc != 0)
+			return 0;
+	}
+	for (; i < len; i ++) {
+		if (data[i] != 0)
+			return 0;
+	}
+	return 1;
+}
+
+#ifdef HAVE_ZERO_AVX2
+__attribute__((target("avx2")))
+static int zero_avx2(const char *data, unsigned int len) {
+	__m256i acc;
+	unsigned int i;
+
+	for (i = 0; i + 128 <= len; i += 128) {
+		acc = _mm256_or_si256(
+			_mm256_or_si256(_mm256_loadu_si256((const __m256i *)(data + i)),
+				_mm256_loadu_si256((const __m256i *)(data + i + 32))),
+			_mm256_or_si256(_mm256_loadu_si256((const __m256i *)(data + i + 64)),
+				_mm256_loadu_si256((const __m256i *)(data + i + 96))));
+		if (!_mm256_testz_si256(acc, acc))
+			return 0;
+	}
+	return zero_c(data + i, len - i);
+}
+#endif
+
+static zero_fn zero_check = zero_c;
+
+int zero_use_simd(int enable) {
+	zero_check = zero_c;
+#ifdef HAVE_ZERO_AVX2
+	if (enable && __builtin_cpu_supports("avx2")) {
+		zero_check = zero_avx2;
+		return 1;
+	}
+#endif
+	return 0;
+}
+
+int is_zero(const char *data, unsigned int len) {
+	return zero_check(data, len);
+}
+
+/*
+* the hashing pool.  calc_hashes() queues the chunks of a request as one
+* job, the workers and the caller take chunks from the jobs in the queue
+* one at a time, so a big write is spread over every core and the writes
+* of other threads are not starved by it.
+*/
+struct hash_job {
+	const char **data;
+	const unsigned int *len;
+	unsigned int *result;
+	unsigned int num;
+	unsigned int next;	// next chunk to take
+	unsigned int done;	// chunks hashed
+	int failed;		// set when a chunk could not be hashed
+	struct hash_job *next_job;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static struct hash_job *job_head = NULL, *job_tail = NULL;
+static int pool_threads = 0;
+
+// take the next chunk of job, the job leaves the queue with its last chunk.
+// called with pool_lock held
+static unsigned int take_chunk(struct hash_job *job) {
+	unsigned int i = job->next ++;
+	struct hash_job **p, *prev = NULL;
+
+	if (job->next == job->num) {
+		// the caller may finish its job while others are queued before it
+		for (p = &job_head; *p != job; p = &(*p)->next_job)
+			prev = *p;
+		*p = job->next_job;
+		if (job_tail == job)
+			job_tail = prev;
+	}
+	return i;
+}
+
+// hash chunk i of job, called and returns with pool_lock held
+static void hash_chunk(struct hash_job *job, unsigned int i) {
+	int ret;
+
+	pthread_mutex_unlock(&pool_lock);
+	ret = hash_timed(job->data[i], job->len[i], &job->result[i * FP_WORDS]);
+	pthread_mutex_lock(&pool_lock);
+
+	if (ret < 0)
+		job->failed = 1;
+
+	if (++ job->done == job->num)
+		pthread_cond_broadcast(&pool_done);
+}
+
+static void *hash_worker(void *arg) {
+	struct hash_job *job;
+
+	pthread_mutex_lock(&pool_lock);
+	while (1) {
+		while (job_head == NULL)
+			pthread_cond_wait(&pool_work, &pool_lock);
+		job = job_head;
+		hash_chunk(job, take_chunk(job));
+	}
+	return NULL;
+}
+
+int fp_pool_init(int threads) {
+	pthread_t tid;
+	int i;
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > FP_POOL_MAX)
+		threads = FP_POOL_MAX;
+
+	// the caller hashes too, one thread is no pool at all
+	for (i = 1; i < threads; i ++) {
+		if (pthread_create(&tid, NULL, hash_worker, NULL) != 0) {
+			fprintf(stderr, "Failed to start hashing thread!\n");
+			break;
+		}
+		pthread_detach(tid);
+	}
+	pool_threads = i - 1;
+	return pool_threads;
+}
+
+int calc_hashes(const char **data, const unsigned int *len, unsigned int *result,
+		unsigned int num) {
+	struct hash_job job;
+	unsigned int i;
+	int ret = 1;
+
+	if (pool_threads == 0 || num < 2) {
+		for (i = 0; i < num; i ++) {
+			if (hash_timed(data[i], len[i], &result[i * FP_WORDS]) < 0)
+				ret = -1;
+		}
+		return ret;
+	}
+
+	job.data = data;
+	job.len = len;
+	job.result = result;
+	job.num = num;
+	job.next = 0;
+	job.done = 0;
+	job.failed = 0;
+	job.next_job = NULL;
+
+	pthread_mutex_lock(&pool_lock);
+	if (job_tail != NULL)
+		job_tail->next_job = &job;
+	else
+		job_head = &job;
+	job_tail = &job;
+	pthread_cond_broadcast(&pool_work);
+
+	// help with our own job, then wait for the chunks others took
+	while (job.next < job.num)
+		hash_chunk(&job, take_chunk(&job));
+	while (job.done < job.num)
+		pthread_cond_wait(&pool_done, &pool_lock);
+	pthread_mutex_unlock(&pool_lock);
+
+	return job.failed ? -1 : 1;
+}
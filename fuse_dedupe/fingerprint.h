@@ -0,0 +1,62 @@
+/* fingerprint.h
+* fuse_dedupe project
+*
+*/
+
+#ifndef FINGERPRINT_H_
+#define FINGERPRINT_H_
+
+// a fingerprint is FP_WORDS words, whatever engine made it
+#define FP_WORDS 5
+
+// fingerprint engines, the index is keyed by one of them.
+// sha1 and sha256 come from OpenSSL, which uses SHA-NI or the ARMv8 SHA
+// instructions when the CPU has them.  blake3 (-DHAVE_BLAKE3, -lblake3)
+// and xxh3 (-DHAVE_XXHASH, -lxxhash) are built in when the libraries are
+// there.  xxh3 is not collision resistant, chunks it finds are compared
+// byte by byte before they are shared.
+#define FP_SHA1 1
+#define FP_SHA256 2
+#define FP_BLAKE3 3
+#define FP_XXH3 4
+
+// engine of a -o fingerprint= name, 0 for "auto", -1 if unknown
+int fp_engine_id(const char *name);
+
+const char *fp_engine_name(int engine);
+
+// the fastest collision resistant engine on this CPU
+int fp_engine_auto();
+
+// select the engine calc_hash() uses, -1 if it is not built in
+int fp_engine_init(int engine);
+
+// 1 if equal fingerprints do not prove equal data
+int fp_engine_weak();
+
+// fingerprint of len bytes of data, returns -1 if it could not be made
+int calc_hash(char *data, int len, unsigned int *result);
+
+// 1 if the len bytes of data are all zero.  Such a chunk is not hashed,
+// looked up or stored, its record is a hole
+int is_zero(const char *data, unsigned int len);
+
+// the check is vectorized with AVX2 when the CPU has it, fp_engine_init()
+// turns that on.  returns 1 if AVX2 is used
+int zero_use_simd(int enable);
+
+// most hashing threads we start
+#define FP_POOL_MAX 16
+
+// start the hashing pool, threads is the number of cores to hash on, 0
+// for all of them.  returns the number of threads started, the caller of
+// calc_hashes() is the last one
+int fp_pool_init(int threads);
+
+// fingerprints of num chunks into result, FP_WORDS words each.  The
+// chunks are hashed in parallel by the pool.  returns -1 if any of them
+// could not be hashed, none of the fingerprints may be used then
+int calc_hashes(const char **data, const unsigned int *len, unsigned int *result,
+		unsigned int num);
+
+#endif
@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+// the vector load of a block races with the ORs of fp_bloom_add() on
+// purpose, a bit set a moment late is one for a fingerprint of another
+// bucket.  TSan can not tell, it gets the C kernel
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(__SANITIZE_THREAD__)
+#include <immintrin.h>
+#define HAVE_BLOOM_AVX2
+#endif
+
+#include "fp_bloom.h"
+
+#define BLOCK_BYTES (FP_BLOOM_BLOCK_WORDS * sizeof(unsigned int))
+#define STAT_SHARDS 64
+
+typedef struct fp_bloom_header {
+	char magic[8];
+	unsigned int version;
+	unsigned int block_words;
+	unsigned long long blocks;
+	// 0 while mounted, a filter found at 0 may have lost adds
+	unsigned int clean;
+	// fingerprints added since it was filled, and freed since
+	unsigned long long keys;
+	unsigned long long removed;
+} fp_bloom_header;
+
+// counters of the checks, by block so threads do not share a line
+typedef struct bloom_stat_shard {
+	unsigned long long checks, negatives;
+} __attribute__((aligned(64))) bloom_stat_shard;
+
+static int bloom_fd = -1;
+static fp_bloom_header *bloom_hdr = NULL;
+static unsigned int *bloom_bits = NULL;
+static size_t bloom_len = 0;
+static unsigned long long block_mask = 0;
+static bloom_stat_shard stat_shards[STAT_SHARDS];
+static unsigned long long false_positives = 0;
+
+// odd multipliers, one for each word of a block.  The top 5 bits of the
+// product pick the bit in the word
+static const unsigned int bloom_salt[FP_BLOOM_BLOCK_WORDS] __attribute__((aligned(32))) = {
+	0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+	0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+// the block by one word of the fingerprint, the bits by another.  The
+// index takes its bucket and line from fp[4] and fp[0]
+static unsigned long long block_of(const unsigned int *fp) {
+	return fp[3] & block_mask;
+}
+
+static unsigned int hash_of(const unsigned int *fp) {
+	return fp[1];
+}
+
+typedef int (*check_fn)(const unsigned int *, unsigned int);
+
+static int check_c(const unsigned int *block, unsigned int h) {
+	unsigned int i;
+
+	for (i = 0; i < FP_BLOOM_BLOCK_WORDS; i ++) {
+		if (!(__atomic_load_n(&block[i], __ATOMIC_RELAXED) & (1u << ((h * bloom_salt[i]) >> 27))))
+			return 0;
+	}
+	return 1;
+}
+
+#ifdef HAVE_BLOOM_AVX2
+__attribute__((target("avx2")))
+static int check_avx2(const unsigned int *block, unsigned int h) {
+	__m256i bits;
+
+	bits = _mm256_mullo_epi32(_mm256_set1_epi32(h), _mm256_load_si256((const __m256i *)bloom_salt));
+	bits = _mm256_sllv_epi32(_mm256_set1_epi32(1), _mm256_srli_epi32(bits, 27));
+	// every bit of bits is set in the block
+	return _mm256_testc_si256(_mm256_load_si256((const __m256i *)block), bits);
+}
+#endif
+
+static check_fn block_check = check_c;
+
+int fp_bloom_use_simd(int enable) {
+	block_check = check_c;
+#ifdef HAVE_BLOOM_AVX2
+	if (enable && __builtin_cpu_supports("avx2")) {
+		block_check = check_avx2;
+		return 1;
+	}
+#endif
+	return 0;
+}
+
+int init_fp_bloom(const char *path, unsigned int size_mb) {
+	unsigned long long blocks;
+	struct stat st;
+	char *base;
+	int fresh = 0, fill = 0;
+
+	if (size_mb == 0)
+		return 1;
+
+	// a power of two blocks, as many as fit in size_mb
+	for (blocks = 1; blocks * 2 * BLOCK_BYTES <= ((unsigned long long)size_mb << 20); blocks *= 2)
+		;
+	bloom_len = FP_BLOOM_HDR_SIZE + blocks * BLOCK_BYTES;
+
+	bloom_fd = open(path, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR | S_IRGRP | S_IWGRP);
+	if (bloom_fd < 0) {
+		fprintf(stderr, "Failed to open fingerprint filter!\n");
+		return -1;
+	}
+
+	if (fstat(bloom_fd, &st) < 0) {
+		fprintf(stderr, "Failed to stat fingerprint filter!\n");
+		goto fail;
+	}
+
+	// a new filter or one of another size starts over, sparse
+	if ((size_t)st.st_size != bloom_len) {
+		if (ftruncate(bloom_fd, 0) < 0 || ftruncate(bloom_fd, bloom_len) < 0) {
+			fprintf(stderr, "Failed to size fingerprint filter!\n");
+			goto fail;
+		}
+		fresh = 1;
+	}
+
+	base = mmap(NULL, bloom_len, PROT_READ | PROT_WRITE, MAP_SHARED, bloom_fd, 0);
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "Failed to map fingerprint filter!\n");
+		goto fail;
+	}
+	bloom_hdr = (fp_bloom_header *)base;
+	bloom_bits = (unsigned int *)(base + FP_BLOOM_HDR_SIZE);
+	block_mask = blocks - 1;
+
+	if (fresh || memcmp(bloom_hdr->magic, FP_BLOOM_MAGIC, sizeof(bloom_hdr->magic)) != 0
+			|| bloom_hdr->version != FP_BLOOM_VERSION
+			|| bloom_hdr->block_words != FP_BLOOM_BLOCK_WORDS
+			|| bloom_hdr->blocks != blocks) {
+		memcpy(bloom_hdr->magic, FP_BLOOM_MAGIC, sizeof(bloom_hdr->magic));
+		bloom_hdr->version = FP_BLOOM_VERSION;
+		bloom_hdr->block_words = FP_BLOOM_BLOCK_WORDS;
+		bloom_hdr->blocks = blocks;
+		fill = 1;
+	} else if (!bloom_hdr->clean || bloom_hdr->removed > bloom_hdr->keys / 2) {
+		fill = 1;
+	}
+
+	if (fill) {
+		if (!fresh)
+			memset(bloom_bits, 0, blocks * BLOCK_BYTES);
+		bloom_hdr->keys = 0;
+		bloom_hdr->removed = 0;
+	}
+
+	// a crash from here on leaves a filter that is filled again
+	bloom_hdr->clean = 0;
+	msync(bloom_hdr, FP_BLOOM_HDR_SIZE, MS_SYNC);
+
+	memset(stat_shards, 0, sizeof(stat_shards));
+	false_positives = 0;
+	fp_bloom_use_simd(1);
+	return fill ? 0 : 1;
+
+fail:
+	close(bloom_fd);
+	bloom_fd = -1;
+	return -1;
+}
+
+int close_fp_bloom() {
+	if (bloom_hdr == NULL)
+		return 0;
+
+	// the bits go first, the filter is clean once they are on disk
+	msync(bloom_hdr, bloom_len, MS_SYNC);
+	bloom_hdr->clean = 1;
+	msync(bloom_hdr, FP_BLOOM_HDR_SIZE, MS_SYNC);
+	munmap(bloom_hdr, bloom_len);
+	close(bloom_fd);
+	bloom_hdr = NULL;
+	bloom_bits = NULL;
+	bloom_fd = -1;
+
+	return 1;
+}
+
+int fp_bloom_check(const unsigned int *fp) {
+	unsigned long long block;
+	bloom_stat_shard *s;
+
+	if (bloom_hdr == NULL)
+		return 1;
+
+	block = block_of(fp);
+	s = &stat_shards[block % STAT_SHARDS];
+	__atomic_add_fetch(&s->checks, 1, __ATOMIC_RELAXED);
+	if (block_check(bloom_bits + block * FP_BLOOM_BLOCK_WORDS, hash_of(fp)))
+		return 1;
+	__atomic_add_fetch(&s->negatives, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+void fp_bloom_add(const unsigned int *fp) {
+	unsigned int *block, h, i;
+
+	if (bloom_hdr == NULL)
+		return;
+
+	block = bloom_bits + block_of(fp) * FP_BLOOM_BLOCK_WORDS;
+	h = hash_of(fp);
+	for (i = 0; i < FP_BLOOM_BLOCK_WORDS; i ++)
+		__atomic_fetch_or(&block[i], 1u << ((h * bloom_salt[i]) >> 27), __ATOMIC_RELAXED);
+	__atomic_add_fetch(&bloom_hdr->keys, 1, __ATOMIC_RELAXED);
+}
+
+void fp_bloom_false_positive() {
+	if (bloom_hdr != NULL)
+		__atomic_add_fetch(&false_positives, 1, __ATOMIC_RELAXED);
+}
+
+void fp_bloom_removed() {
+	if (bloom_hdr != NULL)
+		__atomic_add_fetch(&bloom_hdr->removed, 1, __ATOMIC_RELAXED);
+}
+
+void get_fp_bloom_stats(struct fp_bloom_stats *stats) {
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	if (bloom_hdr == NULL)
+		return;
+
+	for (i = 0; i < STAT_SHARDS; i ++) {
+		stats->checks += __atomic_load_n(&stat_shards[i].checks, __ATOMIC_RELAXED);
+		stats->negatives += __atomic_load_n(&stat_shards[i].negatives, __ATOMIC_RELAXED);
+	}
+	stats->false_positives = __atomic_load_n(&false_positives, __ATOMIC_RELAXED);
+	stats->keys = __atomic_load_n(&bloom_hdr->keys, __ATOMIC_RELAXED);
+	stats->bytes = (block_mask + 1) * BLOCK_BYTES;
+}
@@ -0,0 +1,63 @@
+#ifndef FP_BLOOM_H_
+#define FP_BLOOM_H_
+
+#include "fingerprint.h"
+
+// summary of the fingerprints in the index, a blocked Bloom filter kept
+// in memory in front of it.  A fingerprint the filter has never seen is
+// not in the index, search_fp() then only looks for a free slot and does
+// not compare a single fingerprint on the way.
+//
+// The filter is cut into blocks of FP_BLOOM_BLOCK_WORDS 32-bit words, a
+// cache line at most.  A fingerprint picks one block and one bit in every
+// word of it, so a check is one load of the block and one compare, 8
+// lanes wide with AVX2.
+//
+// It is mapped from <index>.bloom and goes to disk with the index.  A
+// filter that was not closed, or whose size changed, is filled again from
+// the index at mount.  Freed fingerprints can not be taken out of it, once
+// half of what it holds was freed it is filled again too.
+#define FP_BLOOM_BLOCK_WORDS 8
+#define FP_BLOOM_MAGIC "DDBLOOM"
+#define FP_BLOOM_VERSION 1
+#define FP_BLOOM_HDR_SIZE 4096
+
+// default size in MB, about 8 bits for every slot of the index.
+// -o bloom= changes it and 0 turns it off
+#define FP_BLOOM_MB 64
+
+struct fp_bloom_stats {
+	unsigned long long checks;
+	unsigned long long negatives;		// lookups that skipped the index
+	unsigned long long false_positives;	// passed the filter, not in the index
+	unsigned long long keys;		// fingerprints in the filter
+	unsigned long long bytes;
+};
+
+// map the filter at path, size_mb MB of it.  returns 1 if it holds every
+// fingerprint of the index, 0 if it is empty and the index is to be added
+// to it again, -1 on error
+int init_fp_bloom(const char *path, unsigned int size_mb);
+
+// write the filter out and mark it clean
+int close_fp_bloom();
+
+// 0 if fp is surely not in the index, 1 if it may be
+int fp_bloom_check(const unsigned int *fp);
+
+// fp was added to the index
+void fp_bloom_add(const unsigned int *fp);
+
+// fp passed the filter and was not in the index
+void fp_bloom_false_positive();
+
+// a fingerprint was freed from the index
+void fp_bloom_removed();
+
+// the check is vectorized with AVX2 when the CPU has it, init_fp_bloom()
+// turns that on.  returns 1 if AVX2 is used
+int fp_bloom_use_simd(int enable);
+
+void get_fp_bloom_stats(struct fp_bloom_stats *stats);
+
+#endif
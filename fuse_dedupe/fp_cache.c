@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "dedupe.h"
+#include "fp_cache.h"
+#include "chunk_container.h"
+
+typedef struct fp_cache_entry {
+	unsigned int fp[FP_WORDS];
+	unsigned int slot;
+	unsigned int chunk_idx;
+	// 0 for an empty entry
+	unsigned int num_chunks;
+} fp_cache_entry;
+
+typedef struct fp_cache_shard {
+	pthread_mutex_t lock;
+	unsigned long long hits, misses, stale;
+} fp_cache_shard;
+
+static fp_cache_entry *entries = NULL;
+// the way of each set that is replaced next
+static unsigned char *next_way = NULL;
+static unsigned int set_mask = 0;
+static fp_cache_shard shards[FP_CACHE_SHARDS];
+
+// ring of the containers fetched lately
+static unsigned int recent[FP_CACHE_RECENT];
+static unsigned int recent_next = 0;
+static pthread_mutex_t recent_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long prefetches = 0, prefetched = 0;
+
+// sets are picked by another word of the fingerprint than the buckets
+// of the index, the shard by the set
+static unsigned int set_of(const unsigned int *fp) {
+	return fp[2] & set_mask;
+}
+
+static fp_cache_shard *shard_of(unsigned int set) {
+	return &shards[set % FP_CACHE_SHARDS];
+}
+
+static fp_cache_entry *find_way(unsigned int set, const unsigned int *fp) {
+	fp_cache_entry *e = &entries[(size_t)set * FP_CACHE_WAYS];
+	int i;
+
+	for (i = 0; i < FP_CACHE_WAYS; i ++) {
+		if (e[i].num_chunks != 0 && memcmp(e[i].fp, fp, sizeof(e[i].fp)) == 0)
+			return &e[i];
+	}
+	return NULL;
+}
+
+int init_fp_cache(unsigned int size_mb) {
+	unsigned long long sets;
+	int i;
+
+	if (size_mb == 0)
+		return 1;
+
+	// a power of two sets, as many as fit in size_mb
+	sets = ((unsigned long long)size_mb << 20) / (FP_CACHE_WAYS * sizeof(fp_cache_entry));
+	for (set_mask = 1; (unsigned long long)set_mask * 2 <= sets; set_mask *= 2)
+		;
+	entries = (fp_cache_entry *)calloc((size_t)set_mask * FP_CACHE_WAYS, sizeof(fp_cache_entry));
+	next_way = (unsigned char *)calloc(set_mask, 1);
+	if (entries == NULL || next_way == NULL) {
+		fprintf(stderr, "Failed to allocate fingerprint cache!\n");
+		free(entries);
+		free(next_way);
+		entries = NULL;
+		next_way = NULL;
+		return -1;
+	}
+	set_mask --;
+
+	for (i = 0; i < FP_CACHE_SHARDS; i ++) {
+		pthread_mutex_init(&shards[i].lock, NULL);
+		shards[i].hits = shards[i].misses = shards[i].stale = 0;
+	}
+	for (i = 0; i < FP_CACHE_RECENT; i ++)
+		recent[i] = CONTAINER_NONE;
+	prefetches = prefetched = 0;
+	return 1;
+}
+
+void close_fp_cache() {
+	free(entries);
+	free(next_way);
+	entries = NULL;
+	next_way = NULL;
+}
+
+int fp_cache_get(const unsigned int *fp, unsigned int *slot, unsigned int *chunk_idx) {
+	unsigned int set;
+	fp_cache_shard *s;
+	fp_cache_entry *e;
+
+	if (entries == NULL)
+		return 0;
+
+	set = set_of(fp);
+	s = shard_of(set);
+	pthread_mutex_lock(&s->lock);
+	e = find_way(set, fp);
+	if (e != NULL) {
+		*slot = e->slot;
+		*chunk_idx = e->chunk_idx;
+		s->hits ++;
+	} else {
+		s->misses ++;
+	}
+	pthread_mutex_unlock(&s->lock);
+	return e != NULL;
+}
+
+void fp_cache_drop(const unsigned int *fp) {
+	unsigned int set;
+	fp_cache_shard *s;
+	fp_cache_entry *e;
+
+	if (entries == NULL)
+		return;
+
+	set = set_of(fp);
+	s = shard_of(set);
+	pthread_mutex_lock(&s->lock);
+	e = find_way(set, fp);
+	if (e != NULL)
+		e->num_chunks = 0;
+	s->hits --;
+	s->stale ++;
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void put_entry(const container_entry *ce, unsigned int chunk_idx) {
+	unsigned int set;
+	fp_cache_shard *s;
+	fp_cache_entry *e;
+
+	set = set_of(ce->fp);
+	s = shard_of(set);
+	pthread_mutex_lock(&s->lock);
+	e = find_way(set, ce->fp);
+	if (e == NULL) {
+		e = &entries[(size_t)set * FP_CACHE_WAYS + next_way[set]];
+		next_way[set] = (next_way[set] + 1) % FP_CACHE_WAYS;
+	}
+	memcpy(e->fp, ce->fp, sizeof(e->fp));
+	e->slot = ce->slot;
+	e->chunk_idx = chunk_idx;
+	e->num_chunks = ce->num_chunks;
+	pthread_mutex_unlock(&s->lock);
+}
+
+void fp_cache_prefetch(unsigned int chunk_idx) {
+	unsigned int cid = container_id(chunk_idx);
+	container_entry *ce;
+	unsigned int i, n = 0;
+
+	if (entries == NULL)
+		return;
+
+	pthread_mutex_lock(&recent_lock);
+	for (i = 0; i < FP_CACHE_RECENT; i ++) {
+		if (recent[i] == cid)
+			break;
+	}
+	if (i < FP_CACHE_RECENT) {
+		pthread_mutex_unlock(&recent_lock);
+		return;
+	}
+	recent[recent_next] = cid;
+	recent_next = (recent_next + 1) % FP_CACHE_RECENT;
+	prefetches ++;
+	pthread_mutex_unlock(&recent_lock);
+
+	ce = (container_entry *)malloc(CONTAINER_META_SIZE);
+	if (ce == NULL || read_container_meta(cid, ce) < 0) {
+		free(ce);
+		return;
+	}
+	for (i = 0; i < CONTAINER_CHUNKS; i ++) {
+		if (ce[i].num_chunks == 0)
+			continue;
+		put_entry(&ce[i], cid * CONTAINER_CHUNKS + i);
+		n ++;
+	}
+	free(ce);
+
+	__atomic_add_fetch(&prefetched, n, __ATOMIC_RELAXED);
+}
+
+void get_fp_cache_stats(struct fp_cache_stats *stats) {
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	if (entries == NULL)
+		return;
+
+	for (i = 0; i < FP_CACHE_SHARDS; i ++) {
+		pthread_mutex_lock(&shards[i].lock);
+		stats->hits += shards[i].hits;
+		stats->misses += shards[i].misses;
+		stats->stale += shards[i].stale;
+		pthread_mutex_unlock(&shards[i].lock);
+	}
+	pthread_mutex_lock(&recent_lock);
+	stats->prefetches = prefetches;
+	pthread_mutex_unlock(&recent_lock);
+	stats->entries = __atomic_load_n(&prefetched, __ATOMIC_RELAXED);
+}
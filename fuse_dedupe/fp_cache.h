@@ -0,0 +1,50 @@
+#ifndef FP_CACHE_H_
+#define FP_CACHE_H_
+
+#include "fingerprint.h"
+
+// fingerprints kept in memory in front of the index, with the index slot
+// and the chunk of each.  When search_fp() finds a chunk in the index,
+// the fingerprints of every chunk of its container are read from the
+// container metadata and cached: a stream written again finds the chunks
+// after it here, and goes to their slot in the index directly instead of
+// probing for them.
+//
+// The cache is set associative, FP_CACHE_WAYS entries a set, split in
+// FP_CACHE_SHARDS shards with a lock each.  An entry only says where to
+// look, the slot is checked before it is used, so a chunk freed since
+// costs a probe and no wrong answer.
+#define FP_CACHE_WAYS 8
+#define FP_CACHE_SHARDS 64
+
+// default size in MB, -o fp_cache= changes it and 0 turns it off
+#define FP_CACHE_MB 16
+
+// containers fetched lately are not fetched again on the next hit
+#define FP_CACHE_RECENT 64
+
+struct fp_cache_stats {
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long stale;	// hits whose slot had changed
+	unsigned long long prefetches;	// containers fetched
+	unsigned long long entries;	// fingerprints they brought in
+};
+
+// allocate size_mb MB of entries, returns 1 on success
+int init_fp_cache(unsigned int size_mb);
+
+void close_fp_cache();
+
+// returns 1 with the index slot and the chunk of fp if it is cached
+int fp_cache_get(const unsigned int *fp, unsigned int *slot, unsigned int *chunk_idx);
+
+// the slot of a cached fp did not hold it, drop the entry
+void fp_cache_drop(const unsigned int *fp);
+
+// chunk_idx was found in the index, cache the fingerprints of its container
+void fp_cache_prefetch(unsigned int chunk_idx);
+
+void get_fp_cache_stats(struct fp_cache_stats *stats);
+
+#endif
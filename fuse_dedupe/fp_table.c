@@ -1,98 +1,771 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include "fp_table.h"
+#include "chunk_store.h"
+#include "chunk_alloc.h"
+#include "chunk_pack.h"
+#include "fp_cache.h"
+#include "fp_bloom.h"
+#include "sparse_index.h"
 #include "log.h"
+#include "op_stats.h"
 // fingerprint store
-// divided into buckets
+// divided into buckets, each bucket is a fixed region of the mapped index
 fp_bucket fp_table[BUCKET_NUM];
 
-/* for test only */
-static unsigned int next_chunk_id = 0;
-unsigned int get_chunk_id(){
-	unsigned int chunk_idx = next_chunk_id;
-	next_chunk_id += 1;
-	return chunk_idx;
+static int index_fd = -1;
+static fp_index_header *index_hdr = NULL;
+static size_t index_len = 0;
+
+// the buckets start right after the header
+_Static_assert(sizeof(fp_index_header) <= FP_INDEX_HDR_SIZE,
+		"fp_index_header does not fit in FP_INDEX_HDR_SIZE");
+
+// records whose ref_count dropped to 0, the collector frees them from
+// here instead of scanning the index.  A record that came back to life or
+// was queued twice is skipped then
+typedef struct dead_slot {
+	unsigned int bucket;
+	fp_slot *slot;
+} dead_slot;
+
+static dead_slot *dead_queue = NULL;
+static unsigned int dead_queued = 0, dead_max = 0;
+static pthread_mutex_t dead_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// gc progress, dead_num is in the index header.  gc_lock keeps one
+// collector at a time.  Dead records of an index that was not closed are
+// in no queue, a scan of all buckets finds them
+static pthread_mutex_t gc_lock = PTHREAD_MUTEX_INITIALIZER;
+static int gc_need_scan = 0;
+
+// the collector thread sleeps on gc_wake, close_fp_table() stops it
+static pthread_mutex_t gc_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gc_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t gc_tid;
+static int gc_running = 0, gc_stop = 0;
+static unsigned long long gc_passes = 0, gc_freed_records = 0, gc_freed_bytes = 0;
+
+// count the store chunks of the live records again, before any lookup
+static void count_chunks() {
+	unsigned int b, i, j, seen;
+	fp_bucket *bucket;
+	fp_record *rec;
+
+	index_hdr->stored_chunks = 0;
+	index_hdr->ref_chunks = 0;
+	for (b = 0; b < BUCKET_NUM; b ++) {
+		bucket = &fp_table[b];
+		seen = 0;
+		for (i = 0; i < FP_BUCKET_LINES && seen < *bucket->rec_num; i ++) {
+			for (j = 0; j < FP_LINE_SLOTS; j ++) {
+				if (!(bucket->lines[i].tag[j] & 1))
+					continue;
+				rec = &bucket->lines[i].slot[j].rec;
+				index_hdr->stored_chunks += rec->num_chunks;
+				index_hdr->ref_chunks += (unsigned long long)rec->ref_count * rec->num_chunks;
+				seen ++;
+			}
+		}
+	}
 }
-/* test end */
 
 // initialize the fingerprint store
-int init_fp_table() {
-	int i, ret;
+// an existing index is mapped as it is, a new one is created sparse
+int init_fp_table(const char *path) {
+	int i;
+	struct stat st;
+	char *base;
 
-	//fp_table = (fp_bucket *)malloc(BUCKET_NUM * sizeof(fp_bucket));
+	index_len = FP_INDEX_HDR_SIZE + (size_t)BUCKET_NUM * FP_BUCKET_LINES * sizeof(fp_line);
+
+	index_fd = open(path, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR | S_IRGRP | S_IWGRP);
+	if (index_fd < 0) {
+		fprintf(stderr, "Failed to open fingerprint index!\n");
+		return -1;
+	}
+
+	if (fstat(index_fd, &st) < 0) {
+		fprintf(stderr, "Failed to stat fingerprint index!\n");
+		goto fail;
+	}
+
+	if (st.st_size == 0 && ftruncate(index_fd, index_len) < 0) {
+		fprintf(stderr, "Failed to size fingerprint index!\n");
+		goto fail;
+	}
+
+	base = mmap(NULL, index_len, PROT_READ | PROT_WRITE, MAP_SHARED, index_fd, 0);
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "Failed to map fingerprint index!\n");
+		goto fail;
+	}
+	index_hdr = (fp_index_header *)base;
+
+	if (st.st_size == 0) {
+		memcpy(index_hdr->magic, FP_INDEX_MAGIC, sizeof(index_hdr->magic));
+		index_hdr->version = FP_INDEX_VERSION;
+		index_hdr->bucket_num = BUCKET_NUM;
+		index_hdr->bucket_size = BUCKET_SIZE;
+		index_hdr->chunking = 0;
+		index_hdr->fingerprint = 0;
+		index_hdr->dead_num = 0;
+		index_hdr->counted = 1;
+		memset(index_hdr->spill, 0, sizeof(index_hdr->spill));
+	} else if (memcmp(index_hdr->magic, FP_INDEX_MAGIC, sizeof(index_hdr->magic)) != 0
+			|| index_hdr->version != FP_INDEX_VERSION
+			|| index_hdr->bucket_num != BUCKET_NUM
+			|| index_hdr->bucket_size != BUCKET_SIZE
+			|| (size_t)st.st_size != index_len) {
+		fprintf(stderr, "Fingerprint index %s does not match this build!\n", path);
+		munmap(base, index_len);
+		index_hdr = NULL;
+		goto fail;
+	}
 
 	for (i = 0; i < BUCKET_NUM; i ++) {
-		fp_table[i].hashtable = (htab *)calloc(BUCKET_SIZE, sizeof(htab));
+		fp_table[i].lines = (fp_line *)(base + FP_INDEX_HDR_SIZE) + (size_t)i * FP_BUCKET_LINES;
+		fp_table[i].rec_num = &index_hdr->rec_num[i];
+		pthread_mutex_init(&fp_table[i].lock, NULL);
+	}
 
-		ret = hcreate_r(BUCKET_SIZE, fp_table[i].hashtable);
+	dead_queued = 0;
+	gc_need_scan = index_hdr->dead_num > 0;
 
-		if (ret == 0) {
-			fprintf(stderr, "Cannot create hashtable!\n");
-			return -1;
+	// the counts of an index that was not closed may be off
+	if (!index_hdr->counted)
+		count_chunks();
+	index_hdr->counted = 0;
+	msync(index_hdr, FP_INDEX_HDR_SIZE, MS_SYNC);
+	return 1;
+
+fail:
+	close(index_fd);
+	index_fd = -1;
+	return -1;
+}
+
+// add the live records of every bucket to the fingerprint filter
+static unsigned int fill_bloom() {
+	unsigned int b, i, j, seen, added = 0;
+	fp_bucket *bucket;
+	fp_line *line;
+
+	for (b = 0; b < BUCKET_NUM; b ++) {
+		bucket = &fp_table[b];
+		pthread_mutex_lock(&bucket->lock);
+		seen = 0;
+		for (i = 0; i < FP_BUCKET_LINES && seen < *bucket->rec_num; i ++) {
+			line = &bucket->lines[i];
+
+			for (j = 0; j < FP_LINE_SLOTS; j ++) {
+				if (line->tag[j] & 1) {
+					fp_bloom_add(line->slot[j].fp);
+					seen ++;
+				}
+			}
 		}
+		pthread_mutex_unlock(&bucket->lock);
+		added += seen;
+	}
+	return added;
+}
+
+int init_fp_summary(const char *path, unsigned int size_mb) {
+	int ret;
 
-		fp_table[i].rec_num = 0;
+	ret = init_fp_bloom(path, size_mb);
+	if (ret == 0)
+		log_info("fingerprint filter: %u records added from the index\n", fill_bloom());
+	return ret < 0 ? -1 : 1;
+}
+
+int index_fingerprint() {
+	return index_hdr->fingerprint;
+}
+
+int check_index_format(unsigned int chunking, unsigned int fingerprint) {
+	if (index_hdr->chunking == 0) {
+		index_hdr->chunking = chunking;
+	} else if (index_hdr->chunking != chunking) {
+		fprintf(stderr, "Fingerprint index was built with %s chunking!\n",
+				index_hdr->chunking == CHUNK_CDC ? "content-defined" : "fixed");
+		return -1;
+	}
+
+	if (index_hdr->fingerprint == 0) {
+		index_hdr->fingerprint = fingerprint;
+	} else if (index_hdr->fingerprint != fingerprint) {
+		fprintf(stderr, "Fingerprint index was built with %s fingerprints!\n",
+				fp_engine_name(index_hdr->fingerprint));
+		return -1;
 	}
+	return 1;
+}
+
+static void stop_gc();
+
+int close_fp_table() {
+	if (index_hdr == NULL)
+		return -1;
+
+	stop_gc();
+	// free what is dead now, the queue does not outlive the mount
+	gc_fp_table(~0u);
+	close_fp_bloom();
+	msync(index_hdr, index_len, MS_SYNC);
+	index_hdr->counted = 1;
+	msync(index_hdr, FP_INDEX_HDR_SIZE, MS_SYNC);
+	munmap(index_hdr, index_len);
+	close(index_fd);
+	index_hdr = NULL;
+	index_fd = -1;
 
 	return 1;
 }
 
+enum search_stat search_fp(unsigned int *fp, fp_record *rec) {
+	return search_fp_chunks(fp, 1, rec);
+}
+
+// record found, take a reference for the caller.  a dead record comes
+// back to life.  Called with the bucket lock held
+static void take_ref(fp_slot *slot, fp_record *rec) {
+	if (slot->rec.ref_count == 0)
+		__sync_fetch_and_sub(&index_hdr->dead_num, 1);
+	if (slot->rec.ref_count < FP_REF_MAX) {
+		slot->rec.ref_count ++;
+		__atomic_add_fetch(&index_hdr->ref_chunks, slot->rec.num_chunks, __ATOMIC_RELAXED);
+	}
+	*rec = slot->rec;
+}
+
+// number of a slot in the index, kept in the container metadata
+static unsigned int slot_number(unsigned int bucket_idx, fp_bucket *bucket, fp_line *line, unsigned int j) {
+	return bucket_idx * BUCKET_SIZE + (unsigned int)(line - bucket->lines) * FP_LINE_SLOTS + j;
+}
+
+// how many buckets after home hold records of it
+static unsigned int spill_of(unsigned int home) {
+	return __atomic_load_n(&index_hdr->spill[home], __ATOMIC_ACQUIRE);
+}
+
+// a record of home went to the bucket d after it.  Called with the lock of
+// that bucket held, so a lookup that sees the new spill finds the record
+static void set_spill(unsigned int home, unsigned int d) {
+	unsigned char old = __atomic_load_n(&index_hdr->spill[home], __ATOMIC_RELAXED);
+
+	while (old < d && !__atomic_compare_exchange_n(&index_hdr->spill[home], &old, (unsigned char)d,
+				0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+}
+
+// linear probing over the cache lines of the bucket, an empty slot ends
+// the chain.  returns the slot of fp, or NULL with *room at the first slot
+// a new record may take (NULL if there is none).  Without maybe fp is not
+// looked for, the probe stops at *room.  Called with the bucket lock held
+static fp_slot *probe_bucket(fp_bucket *bucket, unsigned int *fp, unsigned int tag, int maybe, fp_slot **room) {
+	unsigned int line_idx, i, j;
+	fp_line *line;
+
+	*room = NULL;
+	line_idx = fp[0] % FP_BUCKET_LINES;
+	for (i = 0; i < FP_BUCKET_LINES; i ++) {
+		line = &bucket->lines[line_idx];
+
+		for (j = 0; j < FP_LINE_SLOTS; j ++) {
+			if (line->tag[j] == 0) {
+				if (*room == NULL)
+					*room = &line->slot[j];
+				return NULL;
+			}
+
+			// the first freed slot is where a new record goes
+			if (line->tag[j] == FP_TAG_FREED) {
+				if (*room == NULL)
+					*room = &line->slot[j];
+				if (!maybe)
+					return NULL;
+				continue;
+			}
+
+			if (maybe && line->tag[j] == tag && memcmp(line->slot[j].fp, fp, sizeof(line->slot[j].fp)) == 0)
+				return &line->slot[j];
+		}
+
+		line_idx = (line_idx + 1) % FP_BUCKET_LINES;
+	}
+	return NULL;
+}
+
+// fp is in slot, take a reference for the caller and unlock the bucket
+static enum search_stat found_record(fp_bucket *bucket, fp_slot *slot, unsigned int *fp, fp_record *rec) {
+	take_ref(slot, rec);
+	pthread_mutex_unlock(&bucket->lock);
+	// the chunks stored next to it are likely next
+	fp_cache_prefetch(rec->chunk_idx);
+	sparse_hook(fp, rec->chunk_idx);
+	return REC_FOUND;
+}
+
 // search fingerprint
-// return the pointer to the record
-enum search_stat search_fp(unsigned int *fp, fp_record **rec) {
-	ENTRY e, *retval;
-	unsigned int bucket_idx;
-	fp_bucket bucket;
-	fp_record *fp_rec;
-	htab *ht;
-
-	e.key = (char *)malloc(41 * sizeof(char));
-
-	sprintf(e.key, "%08X%08X%08X%08X%08X",
-			fp[0],
-			fp[1],
-			fp[2],
-			fp[3],
-			fp[4]);
+// copy the record to rec, nothing is allocated on the way
+static enum search_stat lookup_fp(unsigned int *fp, unsigned int num_chunks, fp_record *rec) {
+	unsigned int home, bucket_idx, tag, chunk_idx, slot_no, spill, room_d, d, j;
+	fp_bucket *bucket;
+	fp_line *line;
+	fp_slot *slot, *room;
+	int maybe, sparse;
 
 	// locate the bucket
-	bucket_idx = fp[4] % BUCKET_NUM;
-	bucket = fp_table[bucket_idx];
-	ht = fp_table[bucket_idx].hashtable;
-
-	if (hsearch_r(e, FIND, &retval, ht) == 0) {
-		//fprintf(stderr, "Cannot find the fingerprint!\n");
-		// add this fingerprint to this bucket
-		if (bucket.rec_num < BUCKET_SIZE) {
-			// add this record to the hashtable
-			fp_rec = (fp_record *)calloc(1, sizeof(fp_record));
-			fp_rec->chunk_idx = get_chunk_id();
-			fp_rec->ref_count = 1;
-			e.data = (void *)fp_rec;
-
-			if(hsearch_r(e, ENTER, &retval, ht) == 0) {
-				//fprintf(stderr, "Cannot add record to bucket[%d]\n", bucket_idx);
-				return REC_ERROR;
-			} else {
-				fp_rec = (fp_record *)retval->data;
-				fprintf(stderr, "Record Added to Bucket[%d]: [%u, %u]!\n", bucket_idx, fp_rec->chunk_idx, fp_rec->ref_count);
-				log_msg(stderr, "Record Added to Bucket[%d]: [%u, %u] [%s]\n", bucket_idx, fp_rec->chunk_idx, fp_rec->ref_count, e.key);
-
-				*rec = (fp_record *)(retval->data);
-				//fprintf(stderr, "Record Added: [%u, %u]!\n", (*rec)->chunk_idx, (*rec)->ref_count);
-
-				bucket.rec_num += 1;
-				return REC_ADDED;
+	home = fp[4] % BUCKET_NUM;
+
+	// tag 0 means empty, so force a bit on
+	tag = fp[1] | 1;
+
+	// a fingerprint the filter has not seen is new, the probe below only
+	// looks for the first slot it can take.  A sparse index is not
+	// searched past the fingerprint cache, what is not there is new
+	sparse = sparse_index_enabled();
+	maybe = sparse || fp_bloom_check(fp);
+
+	// a chunk near one found lately is in the fingerprint cache with its
+	// slot, the slot still has to hold it
+	if (maybe && fp_cache_get(fp, &slot_no, &chunk_idx)) {
+		bucket_idx = slot_no / BUCKET_SIZE;
+		if ((bucket_idx + BUCKET_NUM - home) % BUCKET_NUM <= spill_of(home)) {
+			bucket = &fp_table[bucket_idx];
+			pthread_mutex_lock(&bucket->lock);
+			line = &bucket->lines[(slot_no % BUCKET_SIZE) / FP_LINE_SLOTS];
+			j = slot_no % FP_LINE_SLOTS;
+			if (line->tag[j] == tag && memcmp(line->slot[j].fp, fp, sizeof(line->slot[j].fp)) == 0
+					&& line->slot[j].rec.chunk_idx == chunk_idx) {
+				take_ref(&line->slot[j], rec);
+				pthread_mutex_unlock(&bucket->lock);
+				sparse_hook(fp, rec->chunk_idx);
+				return REC_FOUND;
 			}
-		} else {
-			// TODO: table is full, needs to evict a entry
-			// for now, provision enough space for hash table
+			pthread_mutex_unlock(&bucket->lock);
+		}
+		fp_cache_drop(fp);
+	}
+	if (sparse)
+		maybe = 0;
+
+	// the bucket of fp, then the ones its records spilled to.  The lock of
+	// the last one is kept when the new record can go there
+search:
+	spill = maybe ? spill_of(home) : 0;
+	room_d = FP_SPILL_MAX + 1;
+	for (d = 0; d <= spill; d ++) {
+		bucket = &fp_table[(home + d) % BUCKET_NUM];
+		pthread_mutex_lock(&bucket->lock);
+		slot = probe_bucket(bucket, fp, tag, maybe, &room);
+		if (slot != NULL)
+			return found_record(bucket, slot, fp, rec);
+		if (room != NULL && *bucket->rec_num < BUCKET_SIZE && room_d > FP_SPILL_MAX) {
+			room_d = d;
+			if (d == spill)
+				break;
+		}
+		pthread_mutex_unlock(&bucket->lock);
+	}
+
+	if (maybe && !sparse)
+		fp_bloom_false_positive();
+
+	// a full bucket spills to the ones after it, the record goes to the
+	// first with room.  fp is probed again, it may have come in meanwhile
+	if (d > spill) {
+		for (d = room_d <= FP_SPILL_MAX ? room_d : spill + 1; d <= FP_SPILL_MAX; d ++) {
+			bucket = &fp_table[(home + d) % BUCKET_NUM];
+			pthread_mutex_lock(&bucket->lock);
+			slot = probe_bucket(bucket, fp, tag, maybe, &room);
+			if (slot != NULL)
+				return found_record(bucket, slot, fp, rec);
+			if (room != NULL && *bucket->rec_num < BUCKET_SIZE)
+				break;
+			pthread_mutex_unlock(&bucket->lock);
+		}
+		if (d > FP_SPILL_MAX) {
+			log_error("Fingerprint index is full at bucket %u!\n", home);
 			return REC_ERROR;
 		}
-	}	else {
-		// record found, return the record
-		// TODO: increment reference count
-		*rec = (fp_record *)(retval->data);
-		return REC_FOUND;
 	}
+	bucket_idx = (home + d) % BUCKET_NUM;
+	slot = room;
+
+	// the filter was checked before any lock.  A thread that added fp
+	// since then did it under the lock of the bucket it goes to, which
+	// we hold now, so the filter tells if fp has to be looked for
+	if (!maybe && !sparse && fp_bloom_check(fp)) {
+		pthread_mutex_unlock(&bucket->lock);
+		maybe = 1;
+		goto search;
+	}
+
+	chunk_idx = alloc_chunks(num_chunks);
+	if (chunk_idx == CHUNK_ALLOC_FAIL) {
+		pthread_mutex_unlock(&bucket->lock);
+		return REC_ERROR;
+	}
+	// whoever finds this record from now on may read the chunk,
+	// hold those readers off until the data is in the store
+	if (chunk_pending(chunk_idx, num_chunks) < 0) {
+		free_chunks(chunk_idx, num_chunks);
+		pthread_mutex_unlock(&bucket->lock);
+		return REC_ERROR;
+	}
+
+	// add this record to the empty slot
+	memcpy(slot->fp, fp, sizeof(slot->fp));
+	slot->rec.chunk_idx = chunk_idx;
+	slot->rec.ref_count = 1;
+	slot->rec.num_chunks = num_chunks;
+	// the tag goes with the slot, slots and tags are in the same order
+	line = (fp_line *)((unsigned long)slot & ~(unsigned long)(FP_LINE_SIZE - 1));
+	line->tag[slot - line->slot] = tag;
+	*bucket->rec_num += 1;
+	if (d > 0)
+		set_spill(home, d);
+	__atomic_add_fetch(&index_hdr->stored_chunks, num_chunks, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&index_hdr->ref_chunks, num_chunks, __ATOMIC_RELAXED);
+	fp_bloom_add(fp);
+
+	slot_no = slot_number(bucket_idx, bucket, line, slot - line->slot);
+	*rec = slot->rec;
+	pthread_mutex_unlock(&bucket->lock);
+	// its entry in the metadata of the container it is appended to.  The
+	// reference of the caller keeps the record, opening the container
+	// may write out another one
+	container_add(rec->chunk_idx, num_chunks, fp, slot_no);
+	sparse_hook(fp, rec->chunk_idx);
+
+	log_msg("Record Added to Bucket[%d]: [%u, %u] [%08X%08X%08X%08X%08X]\n", bucket_idx, rec->chunk_idx, rec->ref_count,
+			fp[0], fp[1], fp[2], fp[3], fp[4]);
+
+	return REC_ADDED;
+}
+
+enum search_stat search_fp_chunks(unsigned int *fp, unsigned int num_chunks, fp_record *rec) {
+	unsigned long long start = op_start();
+	enum search_stat ret;
+
+	ret = lookup_fp(fp, num_chunks, rec);
+	op_done(OP_SEARCH_FP, start, 0);
+	return ret;
+}
+
+static void queue_dead(unsigned int bucket_idx, fp_slot *slot) {
+	dead_slot *queue;
+
+	pthread_mutex_lock(&dead_lock);
+	if (dead_queued == dead_max) {
+		queue = (dead_slot *)realloc(dead_queue, sizeof(dead_slot) * (dead_max ? dead_max * 2 : 1024));
+		if (queue == NULL) {
+			// left for a scan
+			__atomic_store_n(&gc_need_scan, 1, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&dead_lock);
+			return;
+		}
+		dead_queue = queue;
+		dead_max = dead_max ? dead_max * 2 : 1024;
+	}
+	dead_queue[dead_queued].bucket = bucket_idx;
+	dead_queue[dead_queued].slot = slot;
+	dead_queued ++;
+	pthread_mutex_unlock(&dead_lock);
+}
+
+int release_fp(unsigned int *fp, unsigned int chunk_idx) {
+	unsigned int home, bucket_idx, line_idx, tag, spill, d, i, j;
+	fp_bucket *bucket;
+	fp_line *line;
+	fp_record *rec;
+	int left;
+
+	home = fp[4] % BUCKET_NUM;
+	tag = fp[1] | 1;
+	// the record is in the bucket of fp or in one its records spilled to
+	spill = spill_of(home);
+	for (d = 0; d <= spill; d ++) {
+		bucket_idx = (home + d) % BUCKET_NUM;
+		bucket = &fp_table[bucket_idx];
+		pthread_mutex_lock(&bucket->lock);
+
+		line_idx = fp[0] % FP_BUCKET_LINES;
+		for (i = 0; i < FP_BUCKET_LINES; i ++) {
+			line = &bucket->lines[line_idx];
+
+			for (j = 0; j < FP_LINE_SLOTS; j ++) {
+				if (line->tag[j] == 0)
+					goto next;
+
+				// a sparse index may hold a fingerprint more than once
+				if (line->tag[j] == tag && line->slot[j].rec.chunk_idx == chunk_idx
+						&& memcmp(line->slot[j].fp, fp, sizeof(line->slot[j].fp)) == 0) {
+					rec = &line->slot[j].rec;
+					if (rec->ref_count == 0) {
+						pthread_mutex_unlock(&bucket->lock);
+						log_error("Released a dead fingerprint record!\n");
+						return -1;
+					}
+					if (rec->ref_count < FP_REF_MAX) {
+						rec->ref_count --;
+						__atomic_sub_fetch(&index_hdr->ref_chunks, rec->num_chunks, __ATOMIC_RELAXED);
+						if (rec->ref_count == 0) {
+							__sync_fetch_and_add(&index_hdr->dead_num, 1);
+							queue_dead(bucket_idx, &line->slot[j]);
+						}
+					}
+					left = rec->ref_count;
+					pthread_mutex_unlock(&bucket->lock);
+					return left;
+				}
+			}
+
+			line_idx = (line_idx + 1) % FP_BUCKET_LINES;
+		}
+next:
+		pthread_mutex_unlock(&bucket->lock);
+	}
+
+	return -1;
+}
+
+// disk bytes of the num chunks from chunk_idx, a packed chunk takes its
+// length in the pack
+static unsigned long long stored_bytes(unsigned int chunk_idx, unsigned int num) {
+	unsigned long long loc, bytes = 0;
+	unsigned int i;
+
+	for (i = 0; i < num; i ++) {
+		loc = pack_loc(chunk_idx + i);
+		bytes += loc != 0 ? loc_len(loc) : CHUNK_SIZE;
+	}
+	return bytes;
+}
+
+// free slot j of line if its record is dead, called with the bucket lock
+// and gc_lock held.  Returns -1 if it is dead but a reply that is not out
+// yet still reads its chunks, it is tried again later
+static int free_slot(fp_bucket *bucket, fp_line *line, unsigned int j) {
+	fp_record *rec = &line->slot[j].rec;
+
+	if (!(line->tag[j] & 1) || rec->ref_count != 0)
+		return 0;
+	if (chunk_store_pinned(rec->chunk_idx, rec->num_chunks))
+		return -1;
+
+	// punch the chunks out before their ids can be taken again, the
+	// pack entries are gone after that
+	gc_freed_bytes += stored_bytes(rec->chunk_idx, rec->num_chunks);
+	discard_chunks(rec->chunk_idx, rec->num_chunks);
+	free_chunks(rec->chunk_idx, rec->num_chunks);
+
+	line->tag[j] = FP_TAG_FREED;
+	*bucket->rec_num -= 1;
+	__atomic_sub_fetch(&index_hdr->stored_chunks, rec->num_chunks, __ATOMIC_RELAXED);
+	fp_bloom_removed();
+	__sync_fetch_and_sub(&index_hdr->dead_num, 1);
+	return 1;
+}
+
+// free the dead records of one bucket, for dead records that are in no queue
+static unsigned int gc_scan_bucket(fp_bucket *bucket) {
+	unsigned int i, j, records, seen = 0, freed = 0;
+	fp_line *line;
+	int ret;
+
+	pthread_mutex_lock(&bucket->lock);
+	// free_slot() counts the bucket down, the scan is done when it saw as
+	// many records as there were at the start
+	records = *bucket->rec_num;
+	for (i = 0; i < FP_BUCKET_LINES && seen < records; i ++) {
+		line = &bucket->lines[i];
+
+		for (j = 0; j < FP_LINE_SLOTS; j ++) {
+			if (line->tag[j] & 1)
+				seen ++;
+			ret = free_slot(bucket, line, j);
+			if (ret > 0)
+				freed ++;
+			else if (ret < 0)
+				queue_dead(bucket - fp_table, &line->slot[j]);
+		}
+	}
+	pthread_mutex_unlock(&bucket->lock);
+
+	return freed;
+}
+
+int gc_fp_table(unsigned int max_records) {
+	unsigned int freed = 0, kept = 0, kept_max = 0, i;
+	dead_slot dead, *keep = NULL, *more;
+	fp_bucket *bucket;
+	fp_line *line;
+	int ret;
+
+	pthread_mutex_lock(&gc_lock);
+	while (freed < max_records) {
+		pthread_mutex_lock(&dead_lock);
+		if (dead_queued == 0) {
+			pthread_mutex_unlock(&dead_lock);
+			break;
+		}
+		dead = dead_queue[-- dead_queued];
+		pthread_mutex_unlock(&dead_lock);
+
+		bucket = &fp_table[dead.bucket];
+		line = (fp_line *)((unsigned long)dead.slot & ~(unsigned long)(FP_LINE_SIZE - 1));
+		pthread_mutex_lock(&bucket->lock);
+		ret = free_slot(bucket, line, dead.slot - line->slot);
+		pthread_mutex_unlock(&bucket->lock);
+		if (ret > 0) {
+			freed ++;
+			continue;
+		}
+		if (ret == 0)
+			continue;
+
+		// pinned ones go back to the queue when the pass is done
+		if (kept == kept_max) {
+			more = (dead_slot *)realloc(keep, sizeof(dead_slot) * (kept_max ? kept_max * 2 : 64));
+			if (more == NULL) {
+				__atomic_store_n(&gc_need_scan, 1, __ATOMIC_RELAXED);
+				continue;
+			}
+			keep = more;
+			kept_max = kept_max ? kept_max * 2 : 64;
+		}
+		keep[kept ++] = dead;
+	}
+	for (i = 0; i < kept; i ++)
+		queue_dead(keep[i].bucket, keep[i].slot);
+	free(keep);
+	gc_freed_records += freed;
+	if (freed > 0)
+		gc_passes ++;
+	pthread_mutex_unlock(&gc_lock);
+
+	return freed;
+}
+
+int gc_scan_fp_table() {
+	unsigned int i, freed = 0;
+
+	pthread_mutex_lock(&gc_lock);
+	for (i = 0; i < BUCKET_NUM; i ++)
+		freed += gc_scan_bucket(&fp_table[i]);
+	gc_freed_records += freed;
+	gc_passes ++;
+	__atomic_store_n(&gc_need_scan, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&gc_lock);
+
+	return freed;
+}
+
+// records freed at a time by the collector thread
+#define GC_STEP_RECORDS 1024
+
+static void *gc_thread(void *arg) {
+	unsigned int interval = *(unsigned int *)arg;
+	unsigned int freed, step;
+	struct gc_stats stats;
+	struct timespec ts;
+	int stop;
+
+	free(arg);
+	while (1) {
+		pthread_mutex_lock(&gc_thread_lock);
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += interval;
+		while (!gc_stop && pthread_cond_timedwait(&gc_wake, &gc_thread_lock, &ts) == 0)
+			;
+		stop = gc_stop;
+		pthread_mutex_unlock(&gc_thread_lock);
+
+		if (stop)
+			break;
+		if (__atomic_load_n(&index_hdr->dead_num, __ATOMIC_RELAXED) == 0)
+			continue;
+
+		if (__atomic_load_n(&gc_need_scan, __ATOMIC_RELAXED)) {
+			freed = gc_scan_fp_table();
+			log_info("gc: index scanned, %u records freed\n", freed);
+		}
+
+		freed = 0;
+		do {
+			step = gc_fp_table(GC_STEP_RECORDS);
+			freed += step;
+			log_msg("gc: %u records freed, %u dead left\n", freed,
+					__atomic_load_n(&index_hdr->dead_num, __ATOMIC_RELAXED));
+		} while (step == GC_STEP_RECORDS);
+		get_gc_stats(&stats);
+		log_info("gc: pass %llu done, %llu records %llu bytes freed since mount\n",
+				stats.passes, stats.freed_records, stats.freed_bytes);
+	}
+	return NULL;
+}
+
+int start_gc(unsigned int interval) {
+	unsigned int *arg;
+
+	if (interval == 0)
+		return 0;
+
+	arg = (unsigned int *)malloc(sizeof(unsigned int));
+	*arg = interval;
+	gc_stop = 0;
+	if (pthread_create(&gc_tid, NULL, gc_thread, arg) != 0) {
+		fprintf(stderr, "Failed to start garbage collector!\n");
+		free(arg);
+		return -1;
+	}
+	gc_running = 1;
+	return 1;
+}
+
+// called by close_fp_table(), the index goes away after this
+static void stop_gc() {
+	if (!gc_running)
+		return;
+
+	pthread_mutex_lock(&gc_thread_lock);
+	gc_stop = 1;
+	pthread_cond_signal(&gc_wake);
+	pthread_mutex_unlock(&gc_thread_lock);
+
+	pthread_join(gc_tid, NULL);
+	gc_running = 0;
+}
+
+void get_gc_stats(struct gc_stats *stats) {
+	pthread_mutex_lock(&gc_lock);
+	stats->dead_records = __atomic_load_n(&index_hdr->dead_num, __ATOMIC_RELAXED);
+	stats->passes = gc_passes;
+	stats->freed_records = gc_freed_records;
+	stats->freed_bytes = gc_freed_bytes;
+	pthread_mutex_unlock(&gc_lock);
+}
+
+void get_index_stats(struct index_stats *stats) {
+	unsigned int b;
+
+	stats->records = 0;
+	for (b = 0; b < BUCKET_NUM; b ++) {
+		pthread_mutex_lock(&fp_table[b].lock);
+		stats->records += *fp_table[b].rec_num;
+		pthread_mutex_unlock(&fp_table[b].lock);
+	}
+	stats->stored_chunks = __atomic_load_n(&index_hdr->stored_chunks, __ATOMIC_RELAXED);
+	stats->ref_chunks = __atomic_load_n(&index_hdr->ref_chunks, __ATOMIC_RELAXED);
+	stats->bytes = index_len;
 }
@@ -1,24 +1,87 @@
 #ifndef FP_TABLE_H_
 #define FP_TABLE_H_
 
-#define __USE_GNU
-#include <search.h>
+#include <pthread.h>
+
+#include "dedupe.h"
+#include "fingerprint.h"
 
 #define BUCKET_NUM 1024
 #define BUCKET_SIZE 65536
 
-// fingerprint store which contains 
-typedef struct hsearch_data htab;
+// on-disk fingerprint index
+// the file is a header followed by BUCKET_NUM * BUCKET_SIZE slots packed
+// into cache lines, it is mmap'ed as a whole, so reloading after a remount
+// is just a mmap
+#define FP_INDEX_MAGIC "DDFPIDX"
+#define FP_INDEX_VERSION 7
+#define FP_INDEX_HDR_SIZE 8192
+
+// a record whose bucket is full goes to one of the FP_SPILL_MAX buckets
+// after it.  spill[] in the header says how far the records of a bucket
+// went, lookups and releases search that far
+#define FP_SPILL_MAX 8
 
 // Structure of the record in a fingerprint table
+// ref_count is the number of meta records that point at the chunk, a
+// record at FP_REF_MAX is never released again.  A record at 0 is dead,
+// it still dedupes until the garbage collector frees its chunks
+#define FP_REF_MAX 0xFFFFFF
+
 typedef struct fp_record {
   unsigned int chunk_idx;
-	unsigned int ref_count;
+	unsigned int ref_count : 24;
+	// store chunks of the chunk, from chunk_idx on
+	unsigned int num_chunks : 8;
 } fp_record;
 
+// a slot of the index, keyed by the FP_WORDS words from calc_hash
+typedef struct fp_slot {
+	unsigned int fp[FP_WORDS];
+	fp_record rec;
+} fp_slot;
+
+// slots are grouped into cache lines, the probe only touches the tags
+// until one matches, a zero tag marks an empty slot.  Live tags are odd,
+// FP_TAG_FREED marks a slot the garbage collector emptied, the probe goes
+// on past it and a new record may take it
+#define FP_TAG_FREED 2
+#define FP_LINE_SIZE 64
+#define FP_LINE_SLOTS 2
+#define FP_BUCKET_LINES (BUCKET_SIZE / FP_LINE_SLOTS)
+
+typedef struct fp_line {
+	unsigned int tag[FP_LINE_SLOTS];
+	fp_slot slot[FP_LINE_SLOTS];
+} __attribute__((aligned(FP_LINE_SIZE))) fp_line;
+
+typedef struct fp_index_header {
+	char magic[8];
+	unsigned int version;
+	unsigned int bucket_num;
+	unsigned int bucket_size;
+	// CHUNK_FIXED or CHUNK_CDC, 0 until the first mount sets it
+	unsigned int chunking;
+	// FP_SHA1 ... FP_XXH3, 0 until the first mount sets it
+	unsigned int fingerprint;
+	// records at ref_count 0 the garbage collector has not freed yet
+	unsigned int dead_num;
+	unsigned int rec_num[BUCKET_NUM];
+	// store chunks the records hold, once and by reference.  counted is
+	// 1 after a clean close, an index found at 0 is counted again
+	unsigned int counted;
+	unsigned long long stored_chunks;
+	unsigned long long ref_chunks;
+	// buckets after each bucket that hold records of it
+	unsigned char spill[BUCKET_NUM];
+} fp_index_header;
+
+// a bucket is also the unit of locking, so concurrent lookups
+// only contend when they hash to the same bucket
 typedef struct fp_bucket {
-	htab *hashtable;
-	unsigned int rec_num;
+	fp_line *lines;
+	unsigned int *rec_num;
+	pthread_mutex_t lock;
 } fp_bucket;
 
 enum search_stat {
@@ -27,7 +90,67 @@ enum search_stat {
 	REC_ERROR
 };
 
-int init_fp_table();
-enum search_stat search_fp(unsigned int *fp, fp_record **rec);
+// open (or create) the index file at path and map it
+int init_fp_table(const char *path);
+// map the fingerprint filter of the index from path, size_mb MB of it or
+// none for 0.  A filter that does not hold the index is filled from it
+int init_fp_summary(const char *path, unsigned int size_mb);
+// the meta files are read according to the chunking they were written
+// with and fingerprints of two engines never match, so an index keeps the
+// chunking and the engine of the mount that created it
+int check_index_format(unsigned int chunking, unsigned int fingerprint);
+// engine the index was built with, 0 for a new one
+int index_fingerprint();
+// flush the index to disk and unmap it
+int close_fp_table();
+// find the fingerprint or add it with a new chunk id, the record is
+// copied out since the slot may change as soon as the bucket is unlocked.
+// a REC_ADDED chunk is marked pending in the chunk store until the caller
+// has written it with write_chunk()
+enum search_stat search_fp(unsigned int *fp, fp_record *rec);
+// the same for a chunk that spans num_chunks store chunks, a new record
+// gets that many consecutive chunk ids.  Both take a reference on the
+// record, found or added, for the meta record that will point at it
+enum search_stat search_fp_chunks(unsigned int *fp, unsigned int num_chunks, fp_record *rec);
+// drop a reference taken by search_fp on the record of fp at chunk_idx,
+// once the meta record that held it is gone.  returns the references
+// left, -1 if fp is not in the index
+int release_fp(unsigned int *fp, unsigned int chunk_idx);
+
+// garbage collection: the chunks of dead records are given back to the
+// chunk allocator and punched out of the store.
+// gc_fp_table() frees up to max_records of the records that died since
+// the mount, gc_scan_fp_table() scans the whole index for the ones an
+// unclean unmount left.  Both return the number of records freed
+int gc_fp_table(unsigned int max_records);
+
+int gc_scan_fp_table();
+
+// the collector runs in its own thread every interval seconds, a pass
+// frees a few records at a time so lookups are not held up
+#define GC_INTERVAL 30
+
+int start_gc(unsigned int interval);
+
+struct gc_stats {
+	unsigned int dead_records;
+	unsigned long long passes;
+	unsigned long long freed_records;
+	// what the freed chunks took on disk, packed ones their packed length
+	unsigned long long freed_bytes;
+};
+
+void get_gc_stats(struct gc_stats *stats);
+
+// the chunks of the index, stored_chunks once and ref_chunks once for
+// every reference to them.  Their ratio is the dedupe ratio
+struct index_stats {
+	unsigned long long records;
+	unsigned long long stored_chunks;
+	unsigned long long ref_chunks;
+	unsigned long long bytes;	// size of the index file
+};
+
+void get_index_stats(struct index_stats *stats);
 
 #endif
@@ -13,9 +13,12 @@
 #include "params.h"
 
 #include <fuse.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/types.h>
@@ -23,6 +26,39 @@
 
 #include "log.h"
 
+int log_level = LOG_INFO;
+
+// the log of the mount, log_open() sets it so threads without a fuse
+// context can write to it
+static FILE *log_file = NULL;
+
+// ring of one thread.  Only the thread moves head and only the writer
+// moves tail, so neither takes a lock
+struct log_ring {
+    char lines[LOG_RING_LINES][LOG_LINE_MAX];
+    unsigned int len[LOG_RING_LINES];
+    unsigned long long head;
+    unsigned long long tail;
+    unsigned long long dropped;
+    unsigned long long dropped_seen;
+    // the thread is gone, the writer frees the ring once it is drained
+    int dead;
+    struct log_ring *next;
+};
+
+static __thread struct log_ring *my_ring = NULL;
+static struct log_ring *rings = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+// rings guards the list of rings and the writes that go to the file
+// directly
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t writer_tid;
+static int writer_running = 0, writer_stop = 0;
+
 FILE *log_open()
 {
     FILE *logfile;
@@ -38,22 +74,181 @@ FILE *log_open()
     // set logfile to line buffering
     setvbuf(logfile, NULL, _IOLBF, 0);
 
+    log_file = logfile;
     return logfile;
 }
 
-void log_msg(const char *format, ...)
+static void ring_exit(void *arg)
+{
+    struct log_ring *ring = (struct log_ring *)arg;
+
+    __atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void ring_key_init(void)
+{
+    pthread_key_create(&ring_key, ring_exit);
+}
+
+// the ring of this thread, made on its first message
+static struct log_ring *get_ring(void)
 {
+    struct log_ring *ring = my_ring;
+
+    if (ring != NULL)
+	return ring;
+
+    ring = (struct log_ring *)calloc(1, sizeof(struct log_ring));
+    if (ring == NULL)
+	return NULL;
+    pthread_once(&ring_key_once, ring_key_init);
+    pthread_setspecific(ring_key, ring);
+
+    pthread_mutex_lock(&log_lock);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&log_lock);
+
+    my_ring = ring;
+    return ring;
+}
+
+void log_write(int level, const char *format, ...)
+{
+    struct log_ring *ring = NULL;
+    unsigned long long head;
+    unsigned int slot;
     va_list ap;
+    int n;
+
+    if (log_file == NULL)
+	return;
+
+    if (__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE))
+	ring = get_ring();
+
     va_start(ap, format);
+    if (ring == NULL) {
+	pthread_mutex_lock(&log_lock);
+	vfprintf(log_file, format, ap);
+	pthread_mutex_unlock(&log_lock);
+	va_end(ap);
+	return;
+    }
+
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_LINES) {
+	__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+	va_end(ap);
+	return;
+    }
+
+    slot = head % LOG_RING_LINES;
+    n = vsnprintf(ring->lines[slot], LOG_LINE_MAX, format, ap);
+    va_end(ap);
+    if (n < 0)
+	return;
+    // a line too long is cut, it still ends the line
+    if (n >= LOG_LINE_MAX) {
+	n = LOG_LINE_MAX - 1;
+	ring->lines[slot][n - 1] = '\n';
+    }
+    ring->len[slot] = n;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// write what the rings hold to the log, the rings of threads that are
+// gone are freed
+static void drain_rings(void)
+{
+    struct log_ring **p, *ring;
+    unsigned long long head, tail, dropped;
+
+    pthread_mutex_lock(&log_lock);
+    for (p = &rings; *p != NULL; ) {
+	ring = *p;
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	for (tail = ring->tail; tail < head; tail ++)
+	    fwrite(ring->lines[tail % LOG_RING_LINES], 1, ring->len[tail % LOG_RING_LINES], log_file);
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+	dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	if (dropped != ring->dropped_seen) {
+	    fprintf(log_file, "log: %llu messages dropped\n", dropped - ring->dropped_seen);
+	    ring->dropped_seen = dropped;
+	}
+
+	// a thread that is gone wrote its last line before it was marked
+	if (__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE)
+		&& tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+	    *p = ring->next;
+	    free(ring);
+	} else {
+	    p = &ring->next;
+	}
+    }
+    fflush(log_file);
+    pthread_mutex_unlock(&log_lock);
+}
+
+static void *writer_thread(void *arg)
+{
+    struct timespec ts;
+    int stop;
+
+    while (1) {
+	pthread_mutex_lock(&writer_lock);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += LOG_FLUSH_MS * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+	    ts.tv_sec += 1;
+	    ts.tv_nsec -= 1000000000L;
+	}
+	if (!writer_stop)
+	    pthread_cond_timedwait(&writer_wake, &writer_lock, &ts);
+	stop = writer_stop;
+	pthread_mutex_unlock(&writer_lock);
+
+	drain_rings();
+	if (stop)
+	    break;
+    }
+    return NULL;
+}
+
+int log_start(void)
+{
+    if (log_file == NULL || writer_running)
+	return 1;
+
+    writer_stop = 0;
+    if (pthread_create(&writer_tid, NULL, writer_thread, NULL) != 0) {
+	fprintf(stderr, "Failed to start log writer!\n");
+	return -1;
+    }
+    __atomic_store_n(&writer_running, 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+void log_stop(void)
+{
+    if (!writer_running)
+	return;
 
-    vfprintf(BB_DATA->logfile, format, ap);
+    // messages from now on are written right away
+    __atomic_store_n(&writer_running, 0, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&writer_lock);
+    writer_stop = 1;
+    pthread_cond_signal(&writer_wake);
+    pthread_mutex_unlock(&writer_lock);
+    pthread_join(writer_tid, NULL);
 }
     
 // struct fuse_file_info keeps information about files (surprise!).
 // This dumps all the information in a struct fuse_file_info.  The struct
 // definition, and comments, come from /usr/include/fuse/fuse_common.h
 // Duplicated here for convenience.
-void log_fi (struct fuse_file_info *fi)
+void log_fi_fields(struct fuse_file_info *fi)
 {
     /** Open flags.  Available in open() and release() */
     //	int flags;
@@ -93,7 +288,7 @@ void log_fi (struct fuse_file_info *fi)
 
 // This dumps the info from a struct stat.  The struct is defined in
 // <bits/stat.h>; this is indirectly included from <fcntl.h>
-void log_stat(struct stat *si)
+void log_stat_fields(struct stat *si)
 {
     //  dev_t     st_dev;     /* ID of device containing file */
 	log_struct(si, st_dev, %lld, );
@@ -136,7 +331,7 @@ void log_stat(struct stat *si)
 	
 }
 
-void log_statvfs(struct statvfs *sv)
+void log_statvfs_fields(struct statvfs *sv)
 {
     //  unsigned long  f_bsize;    /* file system block size */
 	log_struct(sv, f_bsize, %ld, );
@@ -173,7 +368,7 @@ void log_statvfs(struct statvfs *sv)
 	
 }
 
-void log_utime(struct utimbuf *buf)
+void log_utime_fields(struct utimbuf *buf)
 {
 	//    time_t actime;
 	log_struct(buf, actime, 0x%08lx, );
@@ -9,15 +9,61 @@
 #define _LOG_H_
 #include <stdio.h>
 
+// log levels.  A message goes to the log when its level is at most the
+// level of the mount, -o log_level=N, LOG_INFO if not given.  Messages
+// above LOG_LEVEL_MAX are compiled out, build with
+//	make LOG_FLAGS=-DLOG_LEVEL_MAX=3
+// to have the debug trace of every operation.
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_INFO
+#endif
+
+extern int log_level;
+
+#define log_enabled(level) ((level) <= LOG_LEVEL_MAX && (level) <= log_level)
+#define log_at(level, ...) \
+  do { if (log_enabled(level)) log_write(level, __VA_ARGS__); } while (0)
+
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LOG_INFO, __VA_ARGS__)
+// the trace of the operations is debug
+#define log_msg(...) log_at(LOG_DEBUG, __VA_ARGS__)
+
+// the struct dumps are debug too, nothing of them runs otherwise
+#define log_fi(fi) do { if (log_enabled(LOG_DEBUG)) log_fi_fields(fi); } while (0)
+#define log_stat(si) do { if (log_enabled(LOG_DEBUG)) log_stat_fields(si); } while (0)
+#define log_statvfs(sv) do { if (log_enabled(LOG_DEBUG)) log_statvfs_fields(sv); } while (0)
+#define log_utime(buf) do { if (log_enabled(LOG_DEBUG)) log_utime_fields(buf); } while (0)
+
+// a thread writes its messages to a ring of its own, LOG_RING_LINES
+// lines of up to LOG_LINE_MAX bytes.  A writer thread drains the rings
+// to the log every LOG_FLUSH_MS ms.  A message that finds its ring full
+// is dropped and counted, a thread is never held up by the log.  Before
+// log_start() and after log_stop() messages are written right away
+#define LOG_RING_LINES 256
+#define LOG_LINE_MAX 512
+#define LOG_FLUSH_MS 100
+
 //  macro to log fields in structs.
 #define log_struct(st, field, format, typecast) \
   log_msg("    " #field " = " #format "\n", typecast st->field)
 
 FILE *log_open(void);
-void log_fi (struct fuse_file_info *fi);
-void log_stat(struct stat *si);
-void log_statvfs(struct statvfs *sv);
-void log_utime(struct utimbuf *buf);
+void log_fi_fields(struct fuse_file_info *fi);
+void log_stat_fields(struct stat *si);
+void log_statvfs_fields(struct statvfs *sv);
+void log_utime_fields(struct utimbuf *buf);
 
-void log_msg(const char *format, ...);
+// start the writer thread, after fuse_main has forked.  returns 1 on
+// success
+int log_start(void);
+// write out what is left and stop the writer
+void log_stop(void);
+void log_write(int level, const char *format, ...);
 #endif
@@ -4,16 +4,494 @@
 */
 
 #include "metafile.h"
+#include "dedupe.h"
 #include "log.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
 
-// read the struct information from the meta file,according to the 
+static pthread_rwlock_t meta_locks[META_LOCK_NUM] = {
+	[0 ... META_LOCK_NUM - 1] = PTHREAD_RWLOCK_INITIALIZER
+};
+
+// what the META_XATTR of a meta file holds
+typedef struct meta_attr {
+	unsigned long long num;
+	unsigned long long blocks;
+} meta_attr;
+
+// the in-memory records of a file, md is NULL when the file is too big
+// and its opens go to the file.  Since the last write back the records
+// from dirty_lo up to dirty_hi changed and the file was cut to trunc_num
+// records at the least, disk_num records are in the file.  attr_dirty is
+// set when the xattr is out of date.
+// The records are guarded by the meta lock of the file like the file is
+typedef struct meta_recipe {
+	dev_t dev;
+	ino_t ino;
+	int refs;
+	int fd;		// our own open of the file, read-write when possible
+	struct meta_data *md;
+	unsigned int num, cap;
+	unsigned int dirty_lo, dirty_hi;
+	unsigned int trunc_num, disk_num;
+	unsigned long long blocks;
+	int attr_dirty;
+	struct meta_wb wb;
+	struct meta_recipe *next;
+} meta_recipe;
+
+// recipes by inode, and the recipe of every fd given to meta_open()
+static pthread_mutex_t recipe_lock = PTHREAD_MUTEX_INITIALIZER;
+static meta_recipe *recipes[META_LOCK_NUM];
+static meta_recipe *fd_recipes[META_FD_MAX];
+
+// 512 byte blocks of the store chunks md uses
+static unsigned long long record_blocks(struct meta_data *md)
+{
+	if (meta_is_hole(md))
+		return 0;
+	return chunk_count(md->size) * (CHUNK_SIZE / 512);
+}
+
+// where record index is in the file
+static off_t record_pos(unsigned int index)
+{
+	return META_HDR_SIZE + (off_t)index * sizeof(struct meta_data);
+}
+
+// records in a meta file of size bytes
+static unsigned int size_records(off_t size)
+{
+	return size > META_HDR_SIZE ? (size - META_HDR_SIZE) / sizeof(struct meta_data) : 0;
+}
+
+// check the header of the meta file fd of size bytes, an empty file has
+// none yet.  returns 1 if it matches, -1 with errno set otherwise
+static int check_header(int fd, off_t size)
+{
+	meta_header hdr;
+
+	if (size == 0)
+		return 1;
+	if (size < META_HDR_SIZE || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+			|| memcmp(hdr.magic, META_MAGIC, sizeof(META_MAGIC)) != 0
+			|| hdr.version != META_VERSION
+			|| hdr.record_size != sizeof(struct meta_data)) {
+		log_error("\nmeta data of %d does not match this build!\n", fd);
+		errno = EIO;
+		return -1;
+	}
+	return 1;
+}
+
+// write the header of the meta file fd if it is still empty, before its
+// first records go in
+static int write_header(int fd)
+{
+	char buf[META_HDR_SIZE];
+	meta_header *hdr = (meta_header *)buf;
+	struct stat st;
+
+	if (fstat(fd, &st) < 0)
+		return -1;
+	if (st.st_size >= META_HDR_SIZE)
+		return 1;
+
+	memset(buf, 0, sizeof(buf));
+	memcpy(hdr->magic, META_MAGIC, sizeof(META_MAGIC));
+	hdr->version = META_VERSION;
+	hdr->record_size = sizeof(struct meta_data);
+	if (pwrite(fd, buf, sizeof(buf), 0) != sizeof(buf))
+		return -1;
+	return 1;
+}
+
+// blocks of the num records in the file fd, read in batches
+#define META_SCAN_BATCH 1024
+
+static int scan_blocks(int fd, unsigned int num, unsigned long long *blocks)
+{
+	struct meta_data md[META_SCAN_BATCH];
+	unsigned int index, n, i;
+	ssize_t got;
+
+	*blocks = 0;
+	for (index = 0; index < num; index += n) {
+		n = num - index < META_SCAN_BATCH ? num - index : META_SCAN_BATCH;
+		got = pread(fd, md, n * sizeof(struct meta_data), record_pos(index));
+		if (got != (ssize_t)(n * sizeof(struct meta_data)))
+			return -1;
+		for (i = 0; i < n; i ++)
+			*blocks += record_blocks(&md[i]);
+	}
+	return 1;
+}
+
+// keep num and blocks in the xattr, a file system without user xattrs
+// just makes getattr count the blocks every time
+static void write_attr(int fd, unsigned long long num, unsigned long long blocks)
+{
+	meta_attr attr;
+
+	attr.num = num;
+	attr.blocks = blocks;
+	if (fsetxattr(fd, META_XATTR, &attr, sizeof(attr), 0) < 0 && errno != ENOTSUP)
+		log_error("\nmeta data xattr write failed for %d\n", fd);
+}
+
+// the recipe of fd, NULL if fd was not given to meta_open()
+static meta_recipe *fd_recipe(unsigned int fd)
+{
+	if (fd >= META_FD_MAX)
+		return NULL;
+	return __atomic_load_n(&fd_recipes[fd], __ATOMIC_ACQUIRE);
+}
+
+// the records of a file too big for memory are changed in the file, its
+// xattr goes until the blocks are counted again at write back.  A getattr
+// in between may put it back, so it goes with every change
+static void attr_stale(unsigned int fd)
+{
+	meta_recipe *r = fd_recipe(fd);
+
+	if (r != NULL) {
+		fremovexattr(r->fd, META_XATTR);
+		r->attr_dirty = 1;
+	}
+}
+
+// the in-memory recipe of fd, NULL if its records are in the file only
+static meta_recipe *recipe_of(unsigned int fd)
+{
+	meta_recipe *r = fd_recipe(fd);
+
+	return r != NULL && r->md != NULL ? r : NULL;
+}
+
+// room for num records, the new ones read as zeros like a hole in the file
+static int recipe_grow(meta_recipe *r, unsigned int num)
+{
+	struct meta_data *md;
+	unsigned int cap;
+
+	if (num <= r->num)
+		return 1;
+
+	if (num > r->cap) {
+		for (cap = r->cap ? r->cap : 16; cap < num; cap *= 2)
+			;
+		md = (struct meta_data *)realloc(r->md, (size_t)cap * sizeof(struct meta_data));
+		if (md == NULL)
+			return -1;
+		r->md = md;
+		r->cap = cap;
+	}
+
+	memset(&r->md[r->num], 0, (size_t)(num - r->num) * sizeof(struct meta_data));
+	r->num = num;
+	return 1;
+}
+
+static void recipe_dirty(meta_recipe *r, unsigned int from, unsigned int to)
+{
+	if (r->dirty_lo >= r->dirty_hi) {
+		r->dirty_lo = from;
+		r->dirty_hi = to;
+		return;
+	}
+	if (from < r->dirty_lo)
+		r->dirty_lo = from;
+	if (to > r->dirty_hi)
+		r->dirty_hi = to;
+}
+
+// write the changed records back, the caller holds the meta lock
+static int recipe_sync(meta_recipe *r)
+{
+	unsigned long long blocks;
+	struct stat st;
+	size_t len;
+	int retval = 1;
+
+	if (r->md == NULL) {
+		if (r->attr_dirty && fstat(r->fd, &st) == 0
+				&& scan_blocks(r->fd, size_records(st.st_size), &blocks) == 1) {
+			write_attr(r->fd, size_records(st.st_size), blocks);
+			r->attr_dirty = 0;
+		}
+		return 1;
+	}
+
+	// records cut off and grown again read as zeros, like in the file
+	if (r->trunc_num < r->disk_num
+			&& ftruncate(r->fd, record_pos(r->trunc_num)) < 0)
+		retval = -1;
+
+	if (r->dirty_hi > r->num)
+		r->dirty_hi = r->num;
+	if (retval == 1 && r->dirty_lo < r->dirty_hi) {
+		len = (size_t)(r->dirty_hi - r->dirty_lo) * sizeof(struct meta_data);
+		if (write_header(r->fd) < 0
+				|| pwrite(r->fd, &r->md[r->dirty_lo], len, record_pos(r->dirty_lo)) != (ssize_t)len)
+			retval = -1;
+	}
+
+	if (retval < 0) {
+		log_error("\nmeta data write back failed for %d\n", r->fd);
+		return -1;
+	}
+
+	r->disk_num = r->num;
+	r->trunc_num = UINT_MAX;
+	r->dirty_lo = r->dirty_hi = 0;
+
+	// after the records, so a crash leaves an xattr that does not match
+	if (r->attr_dirty) {
+		write_attr(r->fd, r->num, r->blocks);
+		r->attr_dirty = 0;
+	}
+	return 1;
+}
+
+// read the records of a new recipe from its file
+static int recipe_load(meta_recipe *r)
+{
+	struct stat st;
+	unsigned int i;
+	size_t len;
+
+	if (fstat(r->fd, &st) < 0 || check_header(r->fd, st.st_size) < 0)
+		return -1;
+
+	r->disk_num = size_records(st.st_size);
+	r->trunc_num = UINT_MAX;
+	if (r->disk_num > META_RECIPE_MAX)
+		return 1;
+
+	if (recipe_grow(r, r->disk_num > 0 ? r->disk_num : 1) < 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+	r->num = r->disk_num;
+
+	len = (size_t)r->num * sizeof(struct meta_data);
+	if (len > 0 && pread(r->fd, r->md, len, META_HDR_SIZE) != (ssize_t)len) {
+		errno = EIO;
+		return -1;
+	}
+
+	for (i = 0; i < r->num; i ++)
+		r->blocks += record_blocks(&r->md[i]);
+	return 1;
+}
+
+int meta_open(unsigned int fd, const char *fpath)
+{
+	meta_recipe *r;
+	struct stat st;
+	int bucket;
+
+	if (fd >= META_FD_MAX) {
+		errno = EMFILE;
+		return -1;
+	}
+	if (fstat(fd, &st) < 0)
+		return -1;
+
+	bucket = st.st_ino % META_LOCK_NUM;
+	pthread_mutex_lock(&recipe_lock);
+	for (r = recipes[bucket]; r != NULL; r = r->next) {
+		if (r->dev == st.st_dev && r->ino == st.st_ino)
+			break;
+	}
+
+	if (r == NULL) {
+		r = (meta_recipe *)calloc(1, sizeof(meta_recipe));
+		if (r == NULL) {
+			pthread_mutex_unlock(&recipe_lock);
+			errno = ENOMEM;
+			return -1;
+		}
+		r->dev = st.st_dev;
+		r->ino = st.st_ino;
+
+		// fd may be write or read only, the recipe needs both
+		r->fd = open(fpath, O_RDWR);
+		if (r->fd < 0)
+			r->fd = dup(fd);
+		if (r->fd < 0 || recipe_load(r) < 0) {
+			log_error("\nmeta data load failed for %s\n", fpath);
+			if (r->fd >= 0)
+				close(r->fd);
+			free(r->md);
+			free(r);
+			pthread_mutex_unlock(&recipe_lock);
+			return -1;
+		}
+
+		r->next = recipes[bucket];
+		recipes[bucket] = r;
+	}
+
+	r->refs ++;
+	__atomic_store_n(&fd_recipes[fd], r, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&recipe_lock);
+
+	return 1;
+}
+
+struct meta_wb *meta_wb(unsigned int fd)
+{
+	meta_recipe *r = fd_recipe(fd);
+
+	return r != NULL ? &r->wb : NULL;
+}
+
+int meta_sync(unsigned int fd)
+{
+	meta_recipe *r = fd_recipe(fd);
+	int lock, retval;
+
+	if (r == NULL)
+		return 1;
+
+	lock = meta_lock(fd, 1);
+	retval = recipe_sync(r);
+	meta_unlock(lock);
+
+	return retval;
+}
+
+// drop a reference on r, the last one frees it
+static void recipe_put(meta_recipe *r)
+{
+	meta_recipe **p;
+
+	pthread_mutex_lock(&recipe_lock);
+	if (-- r->refs == 0) {
+		for (p = &recipes[r->ino % META_LOCK_NUM]; *p != r; p = &(*p)->next)
+			;
+		*p = r->next;
+		close(r->fd);
+		free(r->md);
+		free(r);
+	}
+	pthread_mutex_unlock(&recipe_lock);
+}
+
+int meta_close(unsigned int fd)
+{
+	meta_recipe *r = fd_recipe(fd);
+	int lock, retval;
+
+	if (r == NULL)
+		return 1;
+
+	// every open writes back what it changed before it lets go, so the
+	// last one leaves nothing behind
+	lock = meta_lock(fd, 1);
+	retval = recipe_sync(r);
+	meta_unlock(lock);
+
+	__atomic_store_n(&fd_recipes[fd], NULL, __ATOMIC_RELEASE);
+	recipe_put(r);
+
+	return retval;
+}
+
+int meta_stat(const char *fpath, struct stat *st)
+{
+	meta_recipe *r;
+	struct meta_data last;
+	meta_attr attr;
+	unsigned long long num, blocks;
+	struct stat fst;
+	int stripe = st->st_ino % META_LOCK_NUM;
+	int fd, retval = 1;
+
+	// an open file has its records in memory, written back or not
+	pthread_mutex_lock(&recipe_lock);
+	for (r = recipes[stripe]; r != NULL; r = r->next) {
+		if (r->dev == st->st_dev && r->ino == st->st_ino)
+			break;
+	}
+	if (r != NULL)
+		r->refs ++;
+	pthread_mutex_unlock(&recipe_lock);
+
+	if (r != NULL && r->md != NULL) {
+		pthread_rwlock_rdlock(&meta_locks[stripe]);
+		st->st_size = r->num > 0 ? r->md[r->num - 1].offset + r->md[r->num - 1].size : 0;
+		if (r->wb.end > st->st_size)
+			st->st_size = r->wb.end;
+		st->st_blocks = r->blocks;
+		pthread_rwlock_unlock(&meta_locks[stripe]);
+		recipe_put(r);
+		return 1;
+	}
+
+	fd = open(fpath, O_RDONLY);
+	if (fd < 0) {
+		retval = -1;
+		goto put;
+	}
+
+	pthread_rwlock_rdlock(&meta_locks[stripe]);
+	if (fstat(fd, &fst) < 0 || check_header(fd, fst.st_size) < 0) {
+		retval = -1;
+		goto out;
+	}
+	num = size_records(fst.st_size);
+
+	st->st_size = 0;
+	if (num > 0) {
+		if (pread(fd, &last, sizeof(last), record_pos(num - 1)) != sizeof(last)) {
+			retval = -1;
+			goto out;
+		}
+		st->st_size = last.offset + last.size;
+	}
+	if (r != NULL && r->wb.end > st->st_size)
+		st->st_size = r->wb.end;
+
+	if (fgetxattr(fd, META_XATTR, &attr, sizeof(attr)) == sizeof(attr) && attr.num == num) {
+		blocks = attr.blocks;
+	} else if (scan_blocks(fd, num, &blocks) == 1) {
+		write_attr(fd, num, blocks);
+	} else {
+		retval = -1;
+		goto out;
+	}
+	st->st_blocks = blocks;
+
+out:
+	pthread_rwlock_unlock(&meta_locks[stripe]);
+	close(fd);
+put:
+	if (r != NULL)
+		recipe_put(r);
+	return retval;
+}
+
+// read the struct information from the meta file,according to the
 int meta_read(unsigned int index, unsigned int fd, struct meta_data *metadata)
 {
-	lseek(fd, index*sizeof(struct meta_data), SEEK_SET);
+	meta_recipe *r = recipe_of(fd);
 	int res;
-	res = read(fd, metadata, sizeof(struct meta_data));
+
+	if (r != NULL) {
+		if (index >= r->num)
+			return 0;
+		*metadata = r->md[index];
+		return sizeof(struct meta_data);
+	}
+
+	res = pread(fd, metadata, sizeof(struct meta_data), record_pos(index));
 	/*if (res == EOF)
 		return 0;
 	else
@@ -22,25 +500,176 @@ int meta_read(unsigned int index, unsigned int fd, struct meta_data *metadata)
 	return res;
 }
 
+// read up to num records starting at index with one pread
+// returns the number of whole records read, -1 on error
+int meta_read_range(unsigned int index, unsigned int num, unsigned int fd, struct meta_data *metadata)
+{
+	meta_recipe *r = recipe_of(fd);
+	ssize_t res;
+
+	if (r != NULL) {
+		if (index >= r->num)
+			return 0;
+		if (num > r->num - index)
+			num = r->num - index;
+		memcpy(metadata, &r->md[index], (size_t)num * sizeof(struct meta_data));
+		return num;
+	}
+
+	res = pread(fd, metadata, num*sizeof(struct meta_data), record_pos(index));
+	if (res < 0) {
+		log_error("\nmeta data read failed for %d at %d\n", fd, index);
+		return -1;
+	}
+
+	return res / sizeof(struct meta_data);
+}
+
 
 int meta_write(unsigned int index, unsigned int fd, struct meta_data *metadata)
 {
-	lseek(fd, index*sizeof(struct meta_data), SEEK_SET);
 	int res=0;
-	res = write(fd, metadata, sizeof(struct meta_data));
+
+	if (recipe_of(fd) != NULL)
+		return meta_write_range(index, 1, fd, metadata) < 0 ? -1 : (int)sizeof(struct meta_data);
+	attr_stale(fd);
+
+	if (write_header(fd) < 0)
+		res = -1;
+	else
+		res = pwrite(fd, metadata, sizeof(struct meta_data), record_pos(index));
 	if (res == -1)
-		log_msg("\nmeta data write failed for %d at %d\n", fd, index);
+		log_error("\nmeta data write failed for %d at %d\n", fd, index);
 
 	return res;
 }
 
+// write num records starting at index with one pwrite
+int meta_write_range(unsigned int index, unsigned int num, unsigned int fd, struct meta_data *metadata)
+{
+	meta_recipe *r = recipe_of(fd);
+	unsigned int i;
+	ssize_t res;
+
+	if (r != NULL) {
+		if (recipe_grow(r, index + num) < 0) {
+			log_error("\nmeta data write failed for %d at %d\n", fd, index);
+			return -1;
+		}
+		for (i = 0; i < num; i ++) {
+			r->blocks -= record_blocks(&r->md[index + i]);
+			r->blocks += record_blocks(&metadata[i]);
+		}
+		memcpy(&r->md[index], metadata, (size_t)num * sizeof(struct meta_data));
+		recipe_dirty(r, index, index + num);
+		r->attr_dirty = 1;
+		return num;
+	}
+	attr_stale(fd);
+
+	if (write_header(fd) < 0)
+		res = -1;
+	else
+		res = pwrite(fd, metadata, num*sizeof(struct meta_data), record_pos(index));
+	if (res != num*sizeof(struct meta_data)) {
+		log_error("\nmeta data write failed for %d at %d\n", fd, index);
+		return -1;
+	}
+
+	return num;
+}
+
+// drop the record at index and every record after it
 int meta_del(unsigned int index, unsigned int fd)
 {
-	lseek(fd, index*sizeof(struct meta_data), SEEK_SET);
+	meta_recipe *r = recipe_of(fd);
+	unsigned int num, i;
 	int res=0;
-	res = write(fd, EOF, sizeof(int));
+
+	if (r != NULL) {
+		// like ftruncate, a del past the end adds zero records
+		num = r->num;
+		if (recipe_grow(r, index) < 0) {
+			log_error("\nmeta data delete failed for %d at %d\n", fd, index);
+			return -1;
+		}
+		if (index > num)
+			recipe_dirty(r, num, index);
+		else if (index < r->trunc_num)
+			r->trunc_num = index;
+		for (i = index; i < num; i ++)
+			r->blocks -= record_blocks(&r->md[i]);
+		r->num = index;
+		r->attr_dirty = 1;
+		return 0;
+	}
+	attr_stale(fd);
+
+	res = ftruncate(fd, index > 0 ? record_pos(index) : 0);
 	if (res == -1)
-		log_msg("\nmeta data write failed for %d at %d\n", fd, index);
+		log_error("\nmeta data delete failed for %d at %d\n", fd, index);
 
 	return res;
 }
+
+int meta_find(off_t pos, unsigned int num, unsigned int fd)
+{
+	struct meta_data metadata;
+	unsigned int lo = 0, hi = num, mid;
+
+	if (num == 0)
+		return -1;
+
+	// the last record that starts at or before pos
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (meta_read(mid, fd, &metadata) != sizeof(metadata)) {
+			log_error("\nmeta data find failed for %d at %d\n", fd, mid);
+			return -1;
+		}
+		if (metadata.offset <= pos)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+// number of records in the meta file
+int meta_count(unsigned int fd)
+{
+	meta_recipe *r = recipe_of(fd);
+	struct stat st;
+
+	if (r != NULL)
+		return r->num;
+
+	if (fstat(fd, &st) < 0)
+		return -1;
+
+	return size_records(st.st_size);
+}
+
+int meta_lock(unsigned int fd, int exclusive)
+{
+	struct stat st;
+	int stripe;
+
+	if (fstat(fd, &st) < 0)
+		return -1;
+
+	stripe = st.st_ino % META_LOCK_NUM;
+	if (exclusive)
+		pthread_rwlock_wrlock(&meta_locks[stripe]);
+	else
+		pthread_rwlock_rdlock(&meta_locks[stripe]);
+
+	return stripe;
+}
+
+void meta_unlock(int stripe)
+{
+	if (stripe >= 0)
+		pthread_rwlock_unlock(&meta_locks[stripe]);
+}
@@ -11,18 +11,114 @@
 #include <fcntl.h>
 #include <string.h>
 #include <dirent.h>
+#include <sys/stat.h>
 
+// one record per chunk of the file, size is the length of the chunk's data.
+// with fixed chunking record i covers the file from i * CHUNK_SIZE, with
+// content-defined chunking the records are variable length and follow
+// each other, a chunk of size bytes takes chunk_count(size) consecutive
+// chunks of the store starting at chunk_id
 typedef struct meta_data{
 	unsigned int fp[5];
 	unsigned int chunk_id;
 	unsigned int size;
+	// where the chunk starts in the file
+	long long offset;
 } meta_data;
 
+// a meta file that is not empty starts with a header of META_HDR_SIZE
+// bytes and the records follow it, record i at META_HDR_SIZE + i * the
+// record size.  A new file is empty and gets its header with its first
+// records, a file whose header does not match is not opened
+#define META_MAGIC "DDMETA"
+#define META_VERSION 1
+#define META_HDR_SIZE 64
+
+typedef struct meta_header {
+	char magic[8];
+	unsigned int version;
+	unsigned int record_size;
+} meta_header;
+
+// a record that points at no chunk, it reads as zeros.
+// records that were never written (a write past the end of the file)
+// read back as all zero, size 0, and count as holes too
+#define META_HOLE 0xFFFFFFFF
+#define meta_is_hole(md) ((md)->size == 0 || (md)->chunk_id == META_HOLE)
+
+// the records of an open file are kept in memory, in a recipe shared by
+// every open of the file (by inode).  The meta_* calls below work on the
+// recipe of an fd given to meta_open() and on the file for other fds.
+// Changed records are written back in one pwrite by meta_sync() and by
+// the meta_close() of every open.  Files of more than META_RECIPE_MAX
+// records are not kept in memory, all their opens go to the file.
+#define META_RECIPE_MAX (1 << 20)
+
+// fds a recipe can be looked up for, meta_open() fails above
+#define META_FD_MAX 65536
+
+// attach fd, an open of the meta file at fpath, to the recipe of the
+// file, loading it first if it is the first open.  returns 1 on success,
+// -1 with errno set on error
+int meta_open(unsigned int fd, const char *fpath);
+
+// write the changed records back and detach fd, the recipe goes with
+// the last open.  Takes the meta lock itself
+int meta_close(unsigned int fd);
+
+// write the changed records of the recipe back to the file.  Takes the
+// meta lock itself
+int meta_sync(unsigned int fd);
+
+// data written to a file that is not in its records yet, held by the
+// writer with the recipe so every open of the file sees it.  data is the
+// writer's, end is where the data ends in the file (0 when there is none)
+// and getattr reports it as the size when it is past the last record.
+// Guarded by the meta lock of the file like the records
+struct meta_wb {
+	void *data;
+	off_t end;
+};
+
+// the buffer of the file fd was given to meta_open() for, NULL otherwise
+struct meta_wb *meta_wb(unsigned int fd);
+
+// size and blocks of a file for getattr, without reading its records:
+// the size is where the last record ends and the blocks are kept in the
+// META_XATTR extended attribute of the meta file, with the number of
+// records they were counted for.  When that does not match (a crash, a
+// copy without xattrs) the blocks are counted again and the xattr fixed.
+// st is the lstat of the meta file at fpath, st_size and st_blocks are
+// replaced.  returns 1, -1 if the meta file can't be read
+#define META_XATTR "user.dedupe"
+
+int meta_stat(const char *fpath, struct stat *st);
+
 // index = line num in the file
 int meta_read(unsigned int index, unsigned int fd, struct meta_data* );
 
+int meta_read_range(unsigned int index, unsigned int num, unsigned int fd, struct meta_data*);
+
 int meta_write(unsigned int index, unsigned int fd, struct meta_data*);
 
+int meta_write_range(unsigned int index, unsigned int num, unsigned int fd, struct meta_data*);
+
+// index of the record that holds byte pos of the file, num is the number
+// of records.  Records are kept in offset order, so this is a binary search
+int meta_find(off_t pos, unsigned int num, unsigned int fd);
+
+// drop the records from index to the end of the file
 int meta_del(unsigned int index, unsigned int fd);
 
+int meta_count(unsigned int fd);
+
+// per-inode locking of a meta file, striped over META_LOCK_NUM rwlocks.
+// every open of a file has its own fd, so the stripe is picked by inode.
+// returns the stripe to hand to meta_unlock(), -1 on error
+#define META_LOCK_NUM 1024
+
+int meta_lock(unsigned int fd, int exclusive);
+
+void meta_unlock(int stripe);
+
 #endif
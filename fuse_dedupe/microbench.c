@@ -0,0 +1,1663 @@
+/* microbench.c
+* fuse_dedupe project
+*
+* micro benchmarks for the dedupe building blocks, they run without a mount
+*
+*   microbench fp [n] [index_path]
+*       n unique fingerprints inserted and then looked up again, in the
+*       binary-keyed fp_table and in the old hsearch_r table with hex keys
+*
+*   microbench prefetch [n] [cache_mb]
+*       a stream of n new chunks added to the index, then looked up again
+*       in the same order the way a second backup of it would, without the
+*       fingerprint cache and with a cache of cache_mb MB.  A hit in the
+*       index prefetches the rest of its container
+*
+*   microbench bloom [n] [bloom_mb]
+*       n new chunks added to the index, looked up again, freed and
+*       collected, then n other new chunks added over the freed slots.
+*       Without the fingerprint filter and with a filter of bloom_mb MB, a
+*       new chunk then stops at the first free slot.  BLOOM_THREADS threads
+*       then add the same n new chunks at once, each has to be stored
+*       once.  Then the filter alone
+*       is checked for n fingerprints it does not hold, with the C and the
+*       AVX2 kernel, and the share that passes is the false positive rate
+*
+*   microbench sparse [n] [hooks_mb] [sample_bits]
+*       SPARSE_VERSIONS backups of a stream of n chunks, each a copy of the
+*       one before with 2% of its chunks changed and 1% inserted, written
+*       in segments of SEGMENT_CHUNKS chunks.  With the full index and with
+*       a sparse index of hooks_mb MB that samples one chunk in
+*       2^sample_bits, the dedupe ratio lost to sampling and the memory of
+*       each are compared
+*
+*   microbench store [n] [store_path]
+*       a store of n chunks read back in requests of STORE_REQ_CHUNKS
+*       chunks, sequential and random, with pread/pwrite and with io_uring.
+*       The page cache of the store is dropped before every phase
+*
+*   microbench cdc [mb]
+*       mb MB of random data cut into content-defined chunks with the C and
+*       the AVX-512 hash kernel.  Then one byte is inserted at the front and
+*       the share of the data that still dedupes is counted, for fixed and
+*       for content-defined chunks
+*
+*   microbench hash [mb] [threads]
+*       mb MB of random data fingerprinted in CHUNK_SIZE chunks with every
+*       engine that is built in, and checked for zeros with the C and the
+*       AVX2 kernel (a zero chunk is read to the end, the worst case).
+*       Then with sha1 in writes of HASH_REQ_CHUNKS chunks through
+*       calc_hashes(), on one thread and on a pool of threads (0 for one
+*       per core)
+*
+*   microbench container [n] [threads]
+*       threads streams write n new chunks each at the same time, in
+*       requests of WRITE_REQ_CHUNKS chunks like the kernel sends them, with
+*       ids from the allocator.  Directly to the store and through open
+*       containers, then every stream is read back in order from the device
+*
+*   microbench compress [mb]
+*       mb MB of text-like and of random data compressed in CHUNK_SIZE
+*       chunks with every engine that is built in, and the text decompressed
+*       again.  The ratio counts the chunks kept raw at their full size, on
+*       random data nearly all of them are turned down by the sample check
+*
+*   microbench cache [n] [cache_mb]
+*       the store of n chunks read in requests of STORE_REQ_CHUNKS chunks,
+*       9 of 10 chunks from a hot set of n / 16, then once all of it in
+*       order, then the hot set again.  Without the chunk cache and with a
+*       cache of cache_mb MB, the hit ratio shows the scan did not push the
+*       hot chunks out
+*
+*   microbench alloc [n] [threads]
+*       threads threads take n single chunks each from the chunk allocator
+*       at the same time, and then from one shared counter like the store
+*       did before.  The average number of chunks a thread got in a row
+*       tells how sequential the files of concurrent writers stay
+*
+*   microbench gc [n]
+*       n records added to one bucket of the index, then 3 of every 4 of
+*       them released and the index scanned for the dead ones the way a
+*       mount after an unclean unmount does.  Checks that the scan freed
+*       every dead record and left the live ones
+*
+*   microbench spill [n]
+*       n records added to one bucket of the index, more than it holds, so
+*       the rest spill to the buckets after it.  All of them are looked up
+*       again, released and collected.  Checks that every one was found
+*       with its chunk and freed
+*
+*   microbench stats [n] [threads]
+*       threads threads time n empty operations each into the per-thread
+*       histograms of op_stats, with the clock on and off, for the cost
+*       an operation pays for its stats.  Then the histogram of the
+*       timed ones is summed and its percentiles printed
+*/
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <search.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cdc.h"
+#include "chunk_store.h"
+#include "chunk_alloc.h"
+#include "chunk_cache.h"
+#include "fp_table.h"
+#include "fingerprint.h"
+#include "compress.h"
+#include "fp_cache.h"
+#include "fp_bloom.h"
+#include "sparse_index.h"
+#include "op_stats.h"
+
+// the fingerprint table logs through bbfs, there is no mount here
+int log_level = 0;
+
+void log_write(int level, const char *format, ...)
+{
+}
+
+static double now_sec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, const char *phase, unsigned int n, double sec)
+{
+	printf("%-10s %-8s %10u ops %8.3f s %10.1f ns/op %10.0f ops/s\n",
+			name, phase, n, sec, sec * 1e9 / n, n / sec);
+}
+
+/*
+* the fingerprint table as it was before the on-disk index:
+* 1024 hsearch_r tables keyed by the hex string of the SHA1
+*/
+static struct hsearch_data legacy_table[BUCKET_NUM];
+static unsigned int legacy_rec_num[BUCKET_NUM];
+static unsigned int legacy_next_chunk_id = 0;
+
+static int legacy_init()
+{
+	int i;
+
+	for (i = 0; i < BUCKET_NUM; i ++) {
+		if (hcreate_r(BUCKET_SIZE, &legacy_table[i]) == 0) {
+			fprintf(stderr, "Cannot create hashtable!\n");
+			return -1;
+		}
+	}
+	return 1;
+}
+
+static enum search_stat legacy_search_fp(unsigned int *fp, fp_record *rec)
+{
+	ENTRY e, *retval;
+	unsigned int bucket_idx;
+	fp_record *fp_rec;
+
+	e.key = (char *)malloc(41 * sizeof(char));
+	sprintf(e.key, "%08X%08X%08X%08X%08X", fp[0], fp[1], fp[2], fp[3], fp[4]);
+
+	bucket_idx = fp[4] % BUCKET_NUM;
+	if (hsearch_r(e, FIND, &retval, &legacy_table[bucket_idx]) != 0) {
+		*rec = *(fp_record *)retval->data;
+		return REC_FOUND;
+	}
+
+	if (legacy_rec_num[bucket_idx] >= BUCKET_SIZE)
+		return REC_ERROR;
+
+	fp_rec = (fp_record *)calloc(1, sizeof(fp_record));
+	fp_rec->chunk_idx = legacy_next_chunk_id ++;
+	fp_rec->ref_count = 1;
+	e.data = (void *)fp_rec;
+	if (hsearch_r(e, ENTER, &retval, &legacy_table[bucket_idx]) == 0)
+		return REC_ERROR;
+
+	legacy_rec_num[bucket_idx] += 1;
+	*rec = *fp_rec;
+	return REC_ADDED;
+}
+
+static int run_fp_phase(const char *name, enum search_stat (*search)(unsigned int *, fp_record *),
+		unsigned int *fps, unsigned int n)
+{
+	unsigned int i;
+	double t;
+	fp_record rec;
+
+	t = now_sec();
+	for (i = 0; i < n; i ++) {
+		if (search(&fps[i * 5], &rec) != REC_ADDED) {
+			fprintf(stderr, "%s: insert %u failed\n", name, i);
+			return -1;
+		}
+		// there is no store behind the table here
+		chunk_pending_done(rec.chunk_idx);
+	}
+	report(name, "insert", n, now_sec() - t);
+
+	t = now_sec();
+	for (i = 0; i < n; i ++) {
+		if (search(&fps[i * 5], &rec) != REC_FOUND || rec.ref_count < 1) {
+			fprintf(stderr, "%s: lookup %u failed\n", name, i);
+			return -1;
+		}
+	}
+	report(name, "lookup", n, now_sec() - t);
+
+	return 1;
+}
+
+static int bench_fp(int argc, char *argv[])
+{
+	unsigned int n = 1000000;
+	const char *path = "microbench_fp_index";
+	char map_path[PATH_MAX];
+	unsigned int *fps;
+	unsigned int i;
+	int ret = 0;
+
+	if (argc > 0)
+		n = strtoul(argv[0], NULL, 0);
+	if (argc > 1)
+		path = argv[1];
+	snprintf(map_path, PATH_MAX, "%s.map", path);
+
+	// real SHA1 values, so the bucket spread is the one we get in bbfs
+	if (fp_engine_init(FP_SHA1) != 1)
+		return 1;
+	fps = (unsigned int *)malloc((size_t)n * 5 * sizeof(unsigned int));
+	for (i = 0; i < n; i ++)
+		calc_hash((char *)&i, sizeof(i), &fps[i * 5]);
+
+	unlink(path);
+	unlink(map_path);
+	if (init_chunk_alloc(map_path) != 1 || init_fp_table(path) != 1 || legacy_init() != 1)
+		return 1;
+
+	if (run_fp_phase("fp_table", search_fp, fps, n) != 1
+			|| run_fp_phase("hsearch_r", legacy_search_fp, fps, n) != 1)
+		ret = 1;
+
+	close_fp_table();
+	close_chunk_alloc();
+	unlink(path);
+	unlink(map_path);
+	free(fps);
+	return ret;
+}
+
+// chunks per read request in the store benchmark, a 128KB read
+#define STORE_REQ_CHUNKS 32
+#define STORE_REQS 2000
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report_lat(const char *name, const char *phase, double *lat, unsigned int n)
+{
+	double sum = 0;
+	unsigned int i;
+
+	for (i = 0; i < n; i ++)
+		sum += lat[i];
+	qsort(lat, n, sizeof(double), cmp_double);
+
+	printf("%-10s %-8s %10u reqs avg %8.1f us p50 %8.1f us p99 %8.1f us %8.1f MB/s\n",
+			name, phase, n, sum * 1e6 / n, lat[n / 2] * 1e6, lat[n * 99 / 100] * 1e6,
+			(double)n * STORE_REQ_CHUNKS * CHUNK_SIZE / sum / 1e6);
+}
+
+static int run_prefetch_phase(const char *phase, unsigned int *fps, unsigned int n, unsigned int cache_mb)
+{
+	struct fp_cache_stats fs;
+	fp_record rec;
+	unsigned int i;
+	double t;
+
+	if (init_fp_cache(cache_mb) != 1)
+		return -1;
+
+	t = now_sec();
+	for (i = 0; i < n; i ++) {
+		if (search_fp(&fps[i * FP_WORDS], &rec) != REC_FOUND) {
+			fprintf(stderr, "prefetch: lookup %u failed\n", i);
+			close_fp_cache();
+			return -1;
+		}
+	}
+	t = now_sec() - t;
+
+	get_fp_cache_stats(&fs);
+	printf("%-10s %-8s %10u ops %8.1f ns/op %6.1f%% from cache %8llu containers\n",
+			"prefetch", phase, n, t * 1e9 / n,
+			fs.hits + fs.misses ? 100.0 * fs.hits / (fs.hits + fs.misses) : 0.0, fs.prefetches);
+	close_fp_cache();
+	return 1;
+}
+
+static int bench_prefetch(int argc, char *argv[])
+{
+	const char *path = "microbench_chunk_store";
+	const char *index_path = "microbench_fp_index";
+	char map_path[PATH_MAX], ctr_path[PATH_MAX];
+	unsigned int n = 1000000, cache_mb = FP_CACHE_MB;
+	unsigned int *fps;
+	fp_record rec;
+	unsigned int i;
+	int ret = 0;
+
+	if (argc > 0)
+		n = strtoul(argv[0], NULL, 0);
+	if (argc > 1)
+		cache_mb = strtoul(argv[1], NULL, 0);
+	snprintf(map_path, PATH_MAX, "%s.map", path);
+	snprintf(ctr_path, PATH_MAX, "%s.ctr", path);
+
+	if (fp_engine_init(FP_SHA1) != 1)
+		return 1;
+	fps = (unsigned int *)malloc((size_t)n * FP_WORDS * sizeof(unsigned int));
+	for (i = 0; i < n; i ++)
+		calc_hash((char *)&i, sizeof(i), &fps[i * FP_WORDS]);
+
+	unlink(path);
+	unlink(map_path);
+	unlink(ctr_path);
+	unlink(index_path);
+	if (init_chunk_store(path) != 1 || init_fp_table(index_path) != 1)
+		return 1;
+
+	// the first backup, its chunks go to containers in order
+	for (i = 0; i < n; i ++) {
+		if (search_fp(&fps[i * FP_WORDS], &rec) != REC_ADDED) {
+			fprintf(stderr, "prefetch: insert %u failed\n", i);
+			ret = 1;
+			goto out;
+		}
+		// there is no data behind the chunks here
+		chunk_pending_done(rec.chunk_idx);
+	}
+	sync_chunk_store();
+
+	if (run_prefetch_phase("index", fps, n, 0) != 1
+			|| run_prefetch_phase("cached", fps, n, cache_mb) != 1)
+		ret = 1;
+
+out:
+	close_fp_table();
+	close_chunk_store();
+	unlink(path);
+	unlink(map_path);
+	unlink(ctr_path);
+	unlink(index_path);
+	free(fps);
+	return ret;
+}
+
+// threads that add the same chunks at once
+#define BLOOM_THREADS 4
+
+struct bloom_arg {
+	unsigned int *fps;
+	unsigned int n;
+	unsigned int added;
+};
+
+static void *bloom_thread(void *arg)
+{
+	struct bloom_arg *a = (struct bloom_arg *)arg;
+	fp_record rec;
+	unsigned int i;
+
+	for (i = 0; i < a->n; i ++) {
+		if (search_fp(&a->fps[i * FP_WORDS], &rec) == REC_ADDED) {
+			chunk_pending_done(rec.chunk_idx);
+			a->added ++;
+		}
+	}
+	return NULL;
+}
+
+static int run_bloom_phase(const char *name, unsigned int *fps, unsigned int n, unsigned int bloom_mb)
+{
+	const char *path = "microbench_chunk_store";
+	const char *index_path = "microbench_fp_index";
+	const char *bloom_path = "microbench_fp_index.bloom";
+	char map_path[PATH_MAX], ctr_path[PATH_MAX];
+	struct fp_bloom_stats bs;
+	struct bloom_arg args[BLOOM_THREADS];
+	pthread_t tids[BLOOM_THREADS];
+	fp_record rec;
+	unsigned int *chunk_ids;
+	unsigned int i, added;
+	double t;
+	int ret = 1;
+
+	snprintf(map_path, PATH_MAX, "%s.map", path);
+	snprintf(ctr_path, PATH_MAX, "%s.ctr", path);
+	unlink(path);
+	unlink(map_path);
+	unlink(ctr_path);
+	unlink(index_path);
+	unlink(bloom_path);
+	if (init_chunk_store(path) != 1 || init_fp_table(index_path) != 1
+			|| init_fp_summary(bloom_path, bloom_mb) != 1)
+		return -1;
+	chunk_ids = (unsigned int *)malloc(sizeof(unsigned int) * n);
+
+	t = now_sec();
+	for (i = 0; i < n; i ++) {
+		if (search_fp(&fps[i * FP_WORDS], &rec) != REC_ADDED) {
+			fprintf(stderr, "bloom: insert %u failed\n", i);
+			ret = -1;
+			goto out;
+		}
+		// there is no data behind the chunks here
+		chunk_pending_done(rec.chunk_idx);
+		chunk_ids[i] = rec.chunk_idx;
+	}
+	report(name, "insert", n, now_sec() - t);
+
+	t = now_sec();
+	for (i = 0; i < n; i ++) {
+		if (search_fp(&fps[i * FP_WORDS], &rec) != REC_FOUND) {
+			fprintf(stderr, "bloom: lookup %u failed\n", i);
+			ret = -1;
+			goto out;
+		}
+	}
+	report(name, "lookup", n, now_sec() - t);
+
+	// both references go, the collector leaves freed slots behind
+	for (i = 0; i < n; i ++) {
+		release_fp(&fps[i * FP_WORDS], chunk_ids[i]);
+		release_fp(&fps[i * FP_WORDS], chunk_ids[i]);
+	}
+	sync_chunk_store();
+	gc_fp_table(~0u);
+
+	t = now_sec();
+	for (i = n; i < 2 * n; i ++) {
+		if (search_fp(&fps[i * FP_WORDS], &rec) != REC_ADDED) {
+			fprintf(stderr, "bloom: reinsert %u failed\n", i);
+			ret = -1;
+			goto out;
+		}
+		chunk_pending_done(rec.chunk_idx);
+	}
+	report(name, "reinsert", n, now_sec() - t);
+
+	// the filter is checked before the bucket is locked, a chunk new to
+	// all of the threads is still stored only once
+	t = now_sec();
+	for (i = 0; i < BLOOM_THREADS; i ++) {
+		args[i].fps = fps + (size_t)2 * n * FP_WORDS;
+		args[i].n = n;
+		args[i].added = 0;
+		pthread_create(&tids[i], NULL, bloom_thread, &args[i]);
+	}
+	for (added = 0, i = 0; i < BLOOM_THREADS; i ++) {
+		pthread_join(tids[i], NULL);
+		added += args[i].added;
+	}
+	report(name, "shared", BLOOM_THREADS * n, now_sec() - t);
+	if (added != n) {
+		fprintf(stderr, "bloom: %u of %u shared chunks stored\n", added, n);
+		ret = -1;
+	}
+
+	get_fp_bloom_stats(&bs);
+	if (bs.checks > 0)
+		printf("%-10s %-8s %10llu checks %10llu skipped %8llu false positives\n",
+				name, "filter", bs.checks, bs.negatives, bs.false_positives);
+
+out:
+	free(chunk_ids);
+	close_fp_table();
+	close_chunk_store();
+	unlink(path);
+	unlink(map_path);
+	unlink(ctr_path);
+	unlink(index_path);
+	unlink(bloom_path);
+	return ret;
+}
+
+static int run_bloom_check(const char *phase, unsigned int *fps, unsigned int n)
+{
+	unsigned int i, passed = 0;
+	double t;
+
+	t = now_sec();
+	for (i = n; i < 2 * n; i ++)
+		passed += fp_bloom_check(&fps[i * FP_WORDS]);
+	t = now_sec() - t;
+
+	printf("%-10s %-8s %10u ops %8.1f ns/op %8.4f%% false positives\n",
+			"check", phase, n, t * 1e9 / n, 100.0 * passed / n);
+	return 1;
+}
+
+static int bench_bloom(int argc, char *argv[])
+{
+	const char *bloom_path = "microbench_fp_index.bloom";
+	unsigned int n = 1000000, bloom_mb = FP_BLOOM_MB;
+	unsigned int *fps;
+	unsigned int i;
+
+	if (argc > 0)
+		n = strtoul(argv[0], NULL, 0);
+	if (argc > 1)
+		bloom_mb = strtoul(argv[1], NULL, 0);
+
+	if (fp_engine_init(FP_SHA1) != 1)
+		return 1;
+	fps = (unsigned int *)malloc((size_t)n * 3 * FP_WORDS * sizeof(unsigned int));
+	for (i = 0; i < 3 * n; i ++)
+		calc_hash((char *)&i, sizeof(i), &fps[i * FP_WORDS]);
+
+	if (run_bloom_phase("index", fps, n, 0) != 1
+			|| run_bloom_phase("bloom", fps, n, bloom_mb) != 1) {
+		free(fps);
+		return 1;
+	}
+
+	// the filter alone, holding the first n
+	unlink(bloom_path);
+	if (bloom_mb > 0 && init_fp_bloom(bloom_path, bloom_mb) >= 0) {
+		for (i = 0; i < n; i ++)
+			fp_bloom_add(&fps[i * FP_WORDS]);
+		fp_bloom_use_simd(0);
+		run_bloom_check("c", fps, n);
+		if (fp_bloom_use_simd(1))
+			run_bloom_check("avx2", fps, n);
+		close_fp_bloom();
+	}
+	unlink(bloom_path);
+
+	free(fps);
+	return 0;
+}
+
+// backups in the sparse index benchmark, and chunks of a write
+#define SPARSE_VERSIONS 4
+#define SEGMENT_CHUNKS 32
+
+// write every version in segments, returns the chunks stored or 0 on error
+static unsigned long long run_sparse_phase(const char *name, unsigned int **versions,
+		unsigned int *lens, unsigned int hooks_mb, unsigned int sample_bits)
+{
+	const char *path = "microbench_chunk_store";
+	const char *index_path = "microbench_fp_index";
+	const char *hooks_path = "microbench_fp_index.hooks";
+	char map_path[PATH_MAX], ctr_path[PATH_MAX];
+	unsigned int fps[SEGMENT_CHUNKS * FP_WORDS];
+	unsigned long long logical = 0, stored = 0;
+	struct sparse_stats ss;
+	fp_record rec;
+	unsigned int v, i, j, seg;
+	double t;
+
+	snprintf(map_path, PATH_MAX, "%s.map", path);
+	snprintf(ctr_path, PATH_MAX, "%s.ctr", path);
+	unlink(path);
+	unlink(map_path);
+	unlink(ctr_path);
+	unlink(index_path);
+	unlink(hooks_path);
+	if (init_chunk_store(path) != 1 || init_fp_table(index_path) != 1
+			|| init_fp_cache(FP_CACHE_MB) != 1
+			|| (hooks_mb > 0 && init_sparse_index(hooks_path, hooks_mb, sample_bits) != 1))
+		return 0;
+
+	t = now_sec();
+	for (v = 0; v < SPARSE_VERSIONS; v ++) {
+		for (i = 0; i < lens[v]; i += seg) {
+			seg = lens[v] - i < SEGMENT_CHUNKS ? lens[v] - i : SEGMENT_CHUNKS;
+			for (j = 0; j < seg; j ++)
+				calc_hash((char *)&versions[v][i + j], sizeof(unsigned int), &fps[j * FP_WORDS]);
+			sparse_segment(fps, seg);
+
+			for (j = 0; j < seg; j ++) {
+				switch (search_fp(&fps[j * FP_WORDS], &rec)) {
+				case REC_ADDED:
+					// there is no data behind the chunks here
+					chunk_pending_done(rec.chunk_idx);
+					stored ++;
+					break;
+				case REC_FOUND:
+					break;
+				default:
+					fprintf(stderr, "sparse: lookup failed\n");
+					stored = 0;
+					goto out;
+				}
+				logical ++;
+			}
+		}
+		sync_chunk_store();
+	}
+	t = now_sec() - t;
+
+	get_sparse_stats(&ss);
+	printf("%-10s %10llu chunks %10llu stored %6.2fx dedupe %8.1f ns/chunk",
+			name, logical, stored, (double)logical / stored, t * 1e9 / logical);
+	if (hooks_mb > 0)
+		printf(" %8llu hooks %8.1f MB, %llu champions\n",
+				ss.hooks, ss.hooks * 16.0 / (1 << 20), ss.champions);
+	else
+		printf(" %8llu records %8.1f MB\n",
+				stored, stored * (double)sizeof(fp_slot) / (1 << 20));
+
+out:
+	close_fp_table();
+	close_sparse_index();
+	close_fp_cache();
+	close_chunk_store();
+	unlink(path);
+	unlink(map_path);
+	unlink(ctr_path);
+	unlink(index_path);
+	unlink(hooks_path);
+	return stored;
+}
+
+static int bench_sparse(int argc, char *argv[])
+{
+	unsigned int n = 200000, hooks_mb = SPARSE_HOOKS_MB, sample_bits = SPARSE_SAMPLE_BITS;
+	unsigned int *versions[SPARSE_VERSIONS], lens[SPARSE_VERSIONS];
+	unsigned int next_id, seed = 1, v, i, r;
+	unsigned long long full, sparse;
+	int ret = 0;
+
+	if (argc > 0)
+		n = strtoul(argv[0], NULL, 0);
+	if (argc > 1)
+		hooks_mb = strtoul(argv[1], NULL, 0);
+	if (argc > 2)
+		sample_bits = strtoul(argv[2], NULL, 0);
+
+	if (fp_engine_init(FP_SHA1) != 1)
+		return 1;
+
+	// a chunk is its id, the next version changes 2% and inserts 1%
+	versions[0] = (unsigned int *)malloc(sizeof(unsigned int) * n);
+	for (i = 0; i < n; i ++)
+		versions[0][i] = i;
+	lens[0] = n;
+	next_id = n;
+	for (v = 1; v < SPARSE_VERSIONS; v ++) {
+		versions[v] = (unsigned int *)malloc(sizeof(unsigned int) * lens[v - 1] * 2);
+		lens[v] = 0;
+		for (i = 0; i < lens[v - 1]; i ++) {
+			r = rand_r(&seed) % 100;
+			versions[v][lens[v] ++] = r < 2 ? next_id ++ : versions[v - 1][i];
+			if (r == 2)
+				versions[v][lens[v] ++] = next_id ++;
+		}
+	}
+
+	full = run_sparse_phase("full", versions, lens, 0, 0);
+	sparse = run_sparse_phase("sparse", versions, lens, hooks_mb, sample_bits);
+	if (full == 0 || sparse == 0)
+		ret = 1;
+	else
+		printf("sparse index stores %.2f%% more chunks than the full index\n",
+				100.0 * (sparse - full) / full);
+
+	for (v = 0; v < SPARSE_VERSIONS; v ++)
+		free(versions[v]);
+	return ret;
+}
+
+// write the store back and drop it from the page cache, so the reads
+// below go to the device
+static void drop_cache(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		return;
+	fdatasync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+static int run_store_phase(const char *name, const char *path, unsigned int n, int rand_order)
+{
+	unsigned int idx[STORE_REQ_CHUNKS];
+	char *bufs[STORE_REQ_CHUNKS];
+	double lat[STORE_REQS];
+	unsigned int i, j;
+	char *buf;
+	double t;
+
+	drop_cache(path);
+	srandom(1);
+
+	for (i = 0; i < STORE_REQS; i ++) {
+		// the buffer is taken per request, the way bb_read does it
+		t = now_sec();
+		buf = alloc_chunk_buf(STORE_REQ_CHUNKS);
+		for (j = 0; j < STORE_REQ_CHUNKS; j ++) {
+			if (rand_order)
+				idx[j] = random() % n;
+			else
+				idx[j] = (i * STORE_REQ_CHUNKS + j) % n;
+			bufs[j] = buf + j * CHUNK_SIZE;
+		}
+
+		if (read_chunks(idx, bufs, STORE_REQ_CHUNKS) != 1) {
+			fprintf(stderr, "%s: read %u failed\n", name, i);
+			free_chunk_buf(buf);
+			return -1;
+		}
+		free_chunk_buf(buf);
+		lat[i] = now_sec() - t;
+	}
+
+	report_lat(name, rand_order ? "random" : "seq", lat, STORE_REQS);
+	return 1;
+}
+
+static int bench_store(int argc, char *argv[])
+{
+	unsigned int n = 65536;
+	const char *path = "microbench_chunk_store";
+	unsigned int idx[STORE_REQ_CHUNKS];
+	const char *bufs[STORE_REQ_CHUNKS];
+	char map_path[PATH_MAX];
+	char *data;
+	unsigned int i, j;
+	int ret = 0;
+
+	if (argc > 0)
+		n = strtoul(argv[0], NULL, 0);
+	if (argc > 1)
+		path = argv[1];
+	if (n < STORE_REQ_CHUNKS)
+		n = STORE_REQ_CHUNKS;
+	snprintf(map_path, PATH_MAX, "%s.map", path);
+
+	unlink(path);
+	unlink(map_path);
+	if (init_chunk_store(path) != 1)
+		return 1;
+
+	data = (char *)malloc(STORE_REQ_CHUNKS * CHUNK_SIZE);
+	for (i = 0; i < STORE_REQ_CHUNKS * CHUNK_SIZE; i ++)
+		data[i] = (char)i;
+
+	for (i = 0; i < n; i += STORE_REQ_CHUNKS) {
+		for (j = 0; j < STORE_REQ_CHUNKS; j ++) {
+			idx[j] = i + j;
+			bufs[j] = data + j * CHUNK_SIZE;
+		}
+		if (write_chunks(idx, bufs, STORE_REQ_CHUNKS) != 1) {
+			ret = 1;
+			goto out;
+		}
+	}
+
+	chunk_store_uring(0);
+	if (run_store_phase("pread", path, n, 0) != 1 || run_store_phase("pread", path, n, 1) != 1)
+		ret = 1;
+
+	if (chunk_store_uring(1) != 1) {
+		fprintf(stderr, "io_uring is not available, skipped\n");
+	} else if (run_store_phase("io_uring", path, n, 0) != 1
+			|| run_store_phase("io_uring", path, n, 1) != 1) {
+		ret = 1;
+	}
+
+out:
+	close_chunk_store();
+	unlink(path);
+	unlink(map_path);
+	free(data);
+	return ret;
+}
+
+// chunks of the hot set are 1 in CACHE_HOT_SHARE of the store
+#define CACHE_HOT_SHARE 16
+
+static int run_cache_phase(const char *name, const char *phase, const char *path,
+		unsigned int n, int scan)
+{
+	unsigned int idx[STORE_REQ_CHUNKS];
+	char *bufs[STORE_REQ_CHUNKS];
+	struct cache_stats before, after;
+	unsigned int i, j, reqs, bad = 0;
+	double t;
+	char *buf;
+
+	drop_cache(path);
+	srandom(1);
+	reqs = scan ? n / STORE_REQ_CHUNKS : STORE_REQS * 4;
+	buf = alloc_chunk_buf(STORE_REQ_CHUNKS);
+	get_cache_stats(&before);
+
+	t = now_sec();
+	for (i = 0; i < reqs; i ++) {
+		for (j = 0; j < STORE_REQ_CHUNKS; j ++) {
+			if (scan)
+				idx[j] = i * STORE_REQ_CHUNKS + j;
+			else if (random() % 10 != 0)
+				idx[j] = random() % (n / CACHE_HOT_SHARE);
+			else
+				idx[j] = random() % n;
+			bufs[j] = buf + j * CHUNK_SIZE;
+		}
+		if (read_chunks(idx, bufs, STORE_REQ_CHUNKS) != 1)
+			bad ++;
+		for (j = 0; j < STORE_REQ_CHUNKS; j ++)
+			bad += memcmp(bufs[j], &idx[j], sizeof(idx[j])) != 0;
+	}
+	t = now_sec() - t;
+
+	get_cache_stats(&after);
+	free_chunk_buf(buf);
+	printf("%-10s %-8s %10u reqs avg %8.1f us %8.1f MB/s hits %5.1f%%\n",
+			name, phase, reqs, t * 1e6 / reqs,
+			(double)reqs * STORE_REQ_CHUNKS * CHUNK_SIZE / t / 1e6,
+			after.hits + after.misses == before.hits + before.misses ? 0.0 :
+			100.0 * (after.hits - before.hits)
+			/ (after.hits + after.misses - before.hits - before.misses));
+
+	if (bad > 0) {
+		fprintf(stderr, "%s: %u chunks read wrong\n", name, bad);
+		return -1;
+	}
+	return 1;
+}
+
+static int bench_cache(int argc, char *argv[])
+{
+	unsigned int n = 32768, cache_mb = 16;
+	const char *path = "microbench_chunk_store";
+	unsigned int idx[STORE_REQ_CHUNKS];
+	const char *bufs[STORE_REQ_CHUNKS];
+	char map_path[PATH_MAX];
+	const char *name;
+	char *data;
+	unsigned int i, j;
+	int pass, ret = 0;
+
+	if (argc > 0)
+		n = strtoul(argv[0], NULL, 0);
+	if (argc > 1)
+		cache_mb = strtoul(argv[1], NULL, 0);
+	if (n < STORE_REQ_CHUNKS * CACHE_HOT_SHARE)
+		n = STORE_REQ_CHUNKS * CACHE_HOT_SHARE;
+	n -= n % STORE_REQ_CHUNKS;
+	snprintf(map_path, PATH_MAX, "%s.map", path);
+
+	unlink(path);
+	unlink(map_path);
+	if (init_chunk_store(path) != 1)
+		return 1;
+
+	// every chunk different, the first word is its id
+	data = (char *)malloc(STORE_REQ_CHUNKS * CHUNK_SIZE);
+	memset(data, 0, STORE_REQ_CHUNKS * CHUNK_SIZE);
+	for (i = 0; i < n; i += STORE_REQ_CHUNKS) {
+		for (j = 0; j < STORE_REQ_CHUNKS; j ++) {
+			idx[j] = i + j;
+			bufs[j] = data + j * CHUNK_SIZE;
+			memcpy(data + j * CHUNK_SIZE, &idx[j], sizeof(idx[j]));
+		}
+		if (write_chunks(idx, bufs, STORE_REQ_CHUNKS) != 1) {
+			ret = 1;
+			goto out;
+		}
+	}
+
+	for (pass = 0; pass < 2; pass ++) {
+		if (pass == 1 && init_chunk_cache(cache_mb) != 1) {
+			ret = 1;
+			goto out;
+		}
+		name = pass == 0 ? "no-cache" : "cache";
+		if (run_cache_phase(name, "hot", path, n, 0) != 1
+				|| run_cache_phase(name, "scan", path, n, 1) != 1
+				|| run_cache_phase(name, "hot", path, n, 0) != 1)
+			ret = 1;
+	}
+	close_chunk_cache();
+
+out:
+	close_chunk_store();
+	unlink(path);
+	unlink(map_path);
+	free(data);
+	return ret;
+}
+
+// cut data into chunks, fixed size ones when fixed is set.  lens gets the
+// chunk lengths, returns how many there are
+static unsigned int cut_chunks(const char *data, unsigned int len, int fixed, unsigned int *lens)
+{
+	unsigned int pos, num = 0;
+
+	for (pos = 0; pos < len; pos += lens[num ++]) {
+		if (fixed)
+			lens[num] = len - pos < CHUNK_SIZE ? len - pos : CHUNK_SIZE;
+		else
+			lens[num] = cdc_next(data + pos, len - pos);
+	}
+	return num;
+}
+
+static int cmp_fp(const void *a, const void *b)
+{
+	return memcmp(a, b, 5 * sizeof(unsigned int));
+}
+
+// the share of the bytes of b that are in a chunk that a has too
+static double shared(const char *a, const char *b, unsigned int len, int fixed)
+{
+	unsigned int *lens = (unsigned int *)malloc(sizeof(unsigned int) * (len / 64 + 2));
+	unsigned int *fps = (unsigned int *)malloc(sizeof(unsigned int) * 5 * (len / 64 + 2));
+	unsigned int fp[5];
+	unsigned int i, num, num_a, pos;
+	size_t same = 0;
+
+	num_a = cut_chunks(a, len, fixed, lens);
+	for (pos = 0, i = 0; i < num_a; pos += lens[i ++])
+		calc_hash((char *)a + pos, lens[i], &fps[i * 5]);
+	qsort(fps, num_a, 5 * sizeof(unsigned int), cmp_fp);
+
+	len += 1;
+	num = cut_chunks(b, len, fixed, lens);
+	for (pos = 0, i = 0; i < num; pos += lens[i ++]) {
+		calc_hash((char *)b + pos, lens[i], fp);
+		if (bsearch(fp, fps, num_a, 5 * sizeof(unsigned int), cmp_fp) != NULL)
+			same += lens[i];
+	}
+
+	free(lens);
+	free(fps);
+	return (double)same / len;
+}
+
+static int bench_cdc(int argc, char *argv[])
+{
+	unsigned int len = 64 << 20;
+	unsigned int *lens, *lens_c;
+	unsigned int i, num, num_c;
+	char *data;
+	double t;
+	int simd;
+
+	if (argc > 0)
+		len = strtoul(argv[0], NULL, 0) << 20;
+
+	if (cdc_init(CDC_MIN_SIZE, CDC_AVG_SIZE, CDC_MAX_SIZE) != 1
+			|| fp_engine_init(FP_SHA1) != 1)
+		return 1;
+
+	// one spare byte in front for the insert
+	data = (char *)malloc(len + 1);
+	srandom(1);
+	for (i = 0; i <= len; i ++)
+		data[i] = (char)random();
+	lens = (unsigned int *)malloc(sizeof(unsigned int) * (len / 64 + 2));
+	lens_c = (unsigned int *)malloc(sizeof(unsigned int) * (len / 64 + 2));
+
+	cdc_use_simd(0);
+	t = now_sec();
+	num_c = cut_chunks(data + 1, len, 0, lens_c);
+	t = now_sec() - t;
+	printf("%-10s %-8s %10u chunks avg %6u bytes %8.1f MB/s\n",
+			"gear", "c", num_c, len / num_c, len / t / 1e6);
+
+	simd = cdc_use_simd(1);
+	if (simd) {
+		t = now_sec();
+		num = cut_chunks(data + 1, len, 0, lens);
+		t = now_sec() - t;
+		printf("%-10s %-8s %10u chunks avg %6u bytes %8.1f MB/s\n",
+				"gear", "avx512", num, len / num, len / t / 1e6);
+
+		if (num != num_c || memcmp(lens, lens_c, num * sizeof(unsigned int)) != 0) {
+			fprintf(stderr, "avx512 and c kernels cut differently!\n");
+			return 1;
+		}
+	}
+
+	// data + 1 with one more byte in front is data
+	printf("%-10s %-8s %5.1f%% of the data still dedupes after a 1 byte insert\n",
+			"fixed", "shift", 100 * shared(data + 1, data, len, 1));
+	printf("%-10s %-8s %5.1f%% of the data still dedupes after a 1 byte insert\n",
+			"cdc", "shift", 100 * shared(data + 1, data, len, 0));
+
+	free(data);
+	free(lens);
+	free(lens_c);
+	return 0;
+}
+
+// chunks per write in the hash benchmark, a 128KB write
+#define HASH_REQ_CHUNKS 32
+
+static void run_hash_reqs(const char *phase, char *data, unsigned int n)
+{
+	const char *bufs[HASH_REQ_CHUNKS];
+	unsigned int lens[HASH_REQ_CHUNKS];
+	unsigned int fps[HASH_REQ_CHUNKS * FP_WORDS];
+	unsigned int i, j;
+	double t;
+
+	t = now_sec();
+	for (i = 0; i + HASH_REQ_CHUNKS <= n; i += HASH_REQ_CHUNKS) {
+		for (j = 0; j < HASH_REQ_CHUNKS; j ++) {
+			bufs[j] = data + (size_t)(i + j) * CHUNK_SIZE;
+			lens[j] = CHUNK_SIZE;
+		}
+		calc_hashes(bufs, lens, fps, HASH_REQ_CHUNKS);
+	}
+	t = now_sec() - t;
+	printf("%-10s %-8s %10u chunks %8.1f ns/chunk %8.1f MB/s\n",
+			"hashes", phase, i, t * 1e9 / i, (double)i * CHUNK_SIZE / t / 1e6);
+}
+
+static int bench_hash(int argc, char *argv[])
+{
+	unsigned int len = 256 << 20;
+	unsigned int fp[FP_WORDS];
+	unsigned int i, n, zeros = 0;
+	char *data, *zero;
+	char phase[32];
+	double t;
+	int engine, simd, threads = 0;
+
+	if (argc > 0)
+		len = strtoul(argv[0], NULL, 0) << 20;
+	if (argc > 1)
+		threads = atoi(argv[1]);
+	n = len / CHUNK_SIZE;
+
+	data = (char *)malloc(len);
+	srandom(1);
+	for (i = 0; i < len; i ++)
+		data[i] = (char)random();
+
+	for (engine = FP_SHA1; engine <= FP_XXH3; engine ++) {
+		if (fp_engine_init(engine) != 1)
+			continue;
+
+		t = now_sec();
+		for (i = 0; i < n; i ++)
+			calc_hash(data + (size_t)i * CHUNK_SIZE, CHUNK_SIZE, fp);
+		t = now_sec() - t;
+		printf("%-10s %-8s %10u chunks %8.1f ns/chunk %8.1f MB/s\n",
+				"hash", fp_engine_name(engine), n, t * 1e9 / n, len / t / 1e6);
+	}
+
+	// touched before the clock starts
+	zero = (char *)malloc(len);
+	memset(zero, 0, len);
+	for (simd = 0; simd < 2; simd ++) {
+		if (zero_use_simd(simd) != simd)
+			continue;
+		t = now_sec();
+		for (i = 0; i < n; i ++)
+			zeros += is_zero(zero + (size_t)i * CHUNK_SIZE, CHUNK_SIZE);
+		t = now_sec() - t;
+		printf("%-10s %-8s %10u chunks %8.1f ns/chunk %8.1f MB/s\n",
+				"zero", simd ? "avx2" : "c", zeros, t * 1e9 / n, len / t / 1e6);
+		zeros = 0;
+	}
+	free(zero);
+
+	if (fp_engine_init(FP_SHA1) != 1)
+		return 1;
+	run_hash_reqs("serial", data, n);
+	snprintf(phase, sizeof(phase), "pool-%d", fp_pool_init(threads) + 1);
+	run_hash_reqs(phase, data, n);
+
+	free(data);
+	return 0;
+}
+
+// words of a small vocabulary with spaces and digits, about what logs and
+// source files look like to a compressor
+static void fill_text(char *data, unsigned int len)
+{
+	static const char *words[] = { "the", "chunk", "store", "index", "of", "file",
+		"write", "read", "error", "and", "to", "fingerprint", "record", "in" };
+	unsigned int i = 0, w;
+	int k;
+
+	while (i < len) {
+		w = random() % (sizeof(words) / sizeof(words[0]));
+		for (k = 0; words[w][k] != '\0' && i < len; k ++)
+			data[i ++] = words[w][k];
+		if (i < len)
+			data[i ++] = (random() % 8 == 0) ? '0' + random() % 10 : ' ';
+	}
+}
+
+static void run_compress(const char *phase, int engine, const char *data, unsigned int n)
+{
+	char out[CHUNK_SIZE], back[CHUNK_SIZE];
+	unsigned long long bytes = 0;
+	unsigned int i, len, raw = 0;
+	double t, dt = 0;
+
+	t = now_sec();
+	for (i = 0; i < n; i ++) {
+		len = compress_chunk(data + (size_t)i * CHUNK_SIZE, out);
+		if (len == 0) {
+			raw ++;
+			len = CHUNK_SIZE;
+		}
+		bytes += len;
+	}
+	t = now_sec() - t;
+
+	// decompress a copy of every chunk that was packed
+	for (i = 0; i < n; i ++) {
+		len = compress_chunk(data + (size_t)i * CHUNK_SIZE, out);
+		if (len == 0)
+			continue;
+		dt -= now_sec();
+		if (decompress_chunk(engine, out, len, back) != 1
+				|| memcmp(back, data + (size_t)i * CHUNK_SIZE, CHUNK_SIZE) != 0)
+			printf("chunk %u does not decompress\n", i);
+		dt += now_sec();
+	}
+
+	printf("%-10s %-8s %10u chunks %8.1f MB/s %8.1f MB/s back %6.2f ratio %6u raw\n",
+			comp_engine_name(engine), phase, n, (double)n * CHUNK_SIZE / t / 1e6,
+			raw < n ? (double)(n - raw) * CHUNK_SIZE / dt / 1e6 : 0.0,
+			(double)n * CHUNK_SIZE / bytes, raw);
+}
+
+static int bench_compress(int argc, char *argv[])
+{
+	unsigned int len = 64 << 20;
+	unsigned int i, n;
+	char *text, *rnd;
+	int engine;
+
+	if (argc > 0)
+		len = strtoul(argv[0], NULL, 0) << 20;
+	n = len / CHUNK_SIZE;
+
+	srandom(1);
+	text = (char *)malloc(len);
+	fill_text(text, len);
+	rnd = (char *)malloc(len);
+	for (i = 0; i < len; i ++)
+		rnd[i] = (char)random();
+
+	for (engine = COMP_LZ4; engine <= COMP_ZSTD; engine ++) {
+		if (comp_engine_init(engine, COMP_ZSTD_LEVEL) != 1)
+			continue;
+		run_compress("text", engine, text, n);
+		run_compress("random", engine, rnd, n);
+	}
+
+	free(text);
+	free(rnd);
+	return 0;
+}
+
+#define WRITE_REQ_CHUNKS 2
+#define STREAMS_MAX 64
+
+struct stream_arg {
+	unsigned int n;
+	unsigned int *ids;	// ids the chunks got, in the order they were written
+	const char *data;
+	int failed;
+};
+
+static void *stream_thread(void *arg)
+{
+	struct stream_arg *a = (struct stream_arg *)arg;
+	unsigned int idx[WRITE_REQ_CHUNKS];
+	const char *bufs[WRITE_REQ_CHUNKS];
+	unsigned int i, j;
+
+	a->failed = 0;
+	for (i = 0; i < a->n; i += WRITE_REQ_CHUNKS) {
+		for (j = 0; j < WRITE_REQ_CHUNKS; j ++) {
+			idx[j] = alloc_chunks(1);
+			a->ids[i + j] = idx[j];
+			bufs[j] = a->data;
+		}
+		if (write_chunks(idx, bufs, WRITE_REQ_CHUNKS) != 1)
+			a->failed = 1;
+	}
+	return NULL;
+}
+
+static int run_container_phase(const char *phase, const char *path, unsigned int n, int threads, int containers)
+{
+	struct stream_arg args[STREAMS_MAX];
+	pthread_t tids[STREAMS_MAX];
+	unsigned int idx[STORE_REQ_CHUNKS];
+	char *bufs[STORE_REQ_CHUNKS];
+	char map_path[PATH_MAX], ctr_path[PATH_MAX];
+	char *data, *buf;
+	unsigned int i, j;
+	double t, rt;
+	int k, ret = 1;
+
+	snprintf(map_path, PATH_MAX, "%s.map", path);
+	snprintf(ctr_path, PATH_MAX, "%s.ctr", path);
+	unlink(path);
+	unlink(map_path);
+	unlink(ctr_path);
+	if (init_chunk_store(path) != 1)
+		return -1;
+	chunk_store_containers(containers);
+
+	data = (char *)malloc(CHUNK_SIZE);
+	memset(data, 'c', CHUNK_SIZE);
+	t = now_sec();
+	for (k = 0; k < threads; k ++) {
+		args[k].n = n;
+		args[k].data = data;
+		args[k].ids = (unsigned int *)malloc(n * sizeof(unsigned int));
+		pthread_create(&tids[k], NULL, stream_thread, &args[k]);
+	}
+	for (k = 0; k < threads; k ++) {
+		pthread_join(tids[k], NULL);
+		if (args[k].failed)
+			ret = -1;
+	}
+	sync_chunk_store();
+	drop_cache(path);
+	t = now_sec() - t;
+
+	// stream 0 is read back in the order it was written
+	buf = (char *)malloc(STORE_REQ_CHUNKS * CHUNK_SIZE);
+	rt = now_sec();
+	for (i = 0; i < n && ret == 1; i += STORE_REQ_CHUNKS) {
+		for (j = 0; j < STORE_REQ_CHUNKS; j ++) {
+			idx[j] = args[0].ids[i + j];
+			bufs[j] = buf + j * CHUNK_SIZE;
+		}
+		if (read_chunks(idx, bufs, STORE_REQ_CHUNKS) != 1 || memcmp(buf, data, CHUNK_SIZE) != 0)
+			ret = -1;
+	}
+	rt = now_sec() - rt;
+
+	printf("%-10s %-8s %10u chunks %8.1f MB/s write %8.1f MB/s read\n",
+			"container", phase, n * threads, (double)n * threads * CHUNK_SIZE / t / 1e6,
+			(double)n * CHUNK_SIZE / rt / 1e6);
+
+	close_chunk_store();
+	unlink(path);
+	unlink(map_path);
+	unlink(ctr_path);
+	for (k = 0; k < threads; k ++)
+		free(args[k].ids);
+	free(data);
+	free(buf);
+	return ret;
+}
+
+static int bench_container(int argc, char *argv[])
+{
+	const char *path = "microbench_chunk_store";
+	unsigned int n = 16384;
+	int threads = 4;
+
+	if (argc > 0)
+		n = strtoul(argv[0], NULL, 0);
+	if (argc > 1)
+		threads = atoi(argv[1]);
+	if (threads < 1 || threads > STREAMS_MAX)
+		threads = 4;
+	n = n / STORE_REQ_CHUNKS * STORE_REQ_CHUNKS;
+	if (n == 0)
+		n = STORE_REQ_CHUNKS;
+
+	if (run_container_phase("direct", path, n, threads, 0) != 1
+			|| run_container_phase("buffered", path, n, threads, 1) != 1)
+		return 1;
+	return 0;
+}
+
+#define ALLOC_THREADS_MAX 64
+
+struct alloc_arg {
+	unsigned int n;
+	int counter;		// take ids from alloc_counter, not the allocator
+	unsigned int runs;	// times the next id did not follow the last one
+	double sec;
+};
+
+static unsigned int alloc_counter = 0;
+
+static void *alloc_thread(void *arg)
+{
+	struct alloc_arg *a = (struct alloc_arg *)arg;
+	unsigned int i, id, last = CHUNK_ALLOC_FAIL - 1;
+	double t;
+
+	a->runs = 0;
+	t = now_sec();
+	for (i = 0; i < a->n; i ++) {
+		if (a->counter)
+			id = __sync_fetch_and_add(&alloc_counter, 1);
+		else
+			id = alloc_chunks(1);
+		if (id != last + 1)
+			a->runs ++;
+		last = id;
+		// a writer blocks on the store after every request
+		if (i % STORE_REQ_CHUNKS == STORE_REQ_CHUNKS - 1)
+			sched_yield();
+	}
+	a->sec = now_sec() - t;
+	return NULL;
+}
+
+static void run_alloc_phase(const char *phase, int counter, unsigned int n, int threads)
+{
+	struct alloc_arg args[ALLOC_THREADS_MAX];
+	pthread_t tids[ALLOC_THREADS_MAX];
+	unsigned int runs = 0;
+	double sec = 0;
+	int i;
+
+	for (i = 0; i < threads; i ++) {
+		args[i].n = n;
+		args[i].counter = counter;
+		pthread_create(&tids[i], NULL, alloc_thread, &args[i]);
+	}
+	for (i = 0; i < threads; i ++) {
+		pthread_join(tids[i], NULL);
+		runs += args[i].runs;
+		sec += args[i].sec;
+	}
+
+	printf("%-10s %-8s %10u chunks %8.1f ns/chunk %8.1f chunks in a row\n",
+			"alloc", phase, n * threads, sec * 1e9 / ((double)n * threads),
+			(double)n * threads / runs);
+}
+
+static int bench_alloc(int argc, char *argv[])
+{
+	const char *path = "microbench_chunk_map";
+	unsigned int n = 1000000;
+	int threads = 4;
+
+	if (argc > 0)
+		n = strtoul(argv[0], NULL, 0);
+	if (argc > 1)
+		threads = atoi(argv[1]);
+	if (threads < 1 || threads > ALLOC_THREADS_MAX)
+		threads = 4;
+
+	unlink(path);
+	if (init_chunk_alloc(path) != 1)
+		return 1;
+	run_alloc_phase("bitmap", 0, n, threads);
+	close_chunk_alloc();
+	unlink(path);
+
+	run_alloc_phase("counter", 1, n, threads);
+	return 0;
+}
+
+static int bench_gc(int argc, char *argv[])
+{
+	const char *path = "microbench_chunk_store";
+	const char *index_path = "microbench_fp_index";
+	char map_path[PATH_MAX], ctr_path[PATH_MAX];
+	unsigned int n = 4096, i, dead = 0, freed;
+	unsigned int *fps, *chunk_ids;
+	struct index_stats is;
+	struct gc_stats gs;
+	fp_record rec;
+	double t;
+	int ret = 1;
+
+	if (argc > 0)
+		n = strtoul(argv[0], NULL, 0);
+	if (n == 0 || n > BUCKET_SIZE)
+		n = 4096;
+
+	snprintf(map_path, PATH_MAX, "%s.map", path);
+	snprintf(ctr_path, PATH_MAX, "%s.ctr", path);
+	unlink(path);
+	unlink(map_path);
+	unlink(ctr_path);
+	unlink(index_path);
+	if (fp_engine_init(FP_SHA1) != 1 || init_chunk_store(path) != 1
+			|| init_fp_table(index_path) != 1)
+		return 1;
+
+	// the last word picks the bucket, all of them land in bucket 0
+	fps = (unsigned int *)malloc(sizeof(unsigned int) * FP_WORDS * n);
+	chunk_ids = (unsigned int *)malloc(sizeof(unsigned int) * n);
+	for (i = 0; i < n; i ++) {
+		calc_hash((char *)&i, sizeof(i), &fps[i * FP_WORDS]);
+		fps[i * FP_WORDS + 4] = i * BUCKET_NUM;
+		if (search_fp(&fps[i * FP_WORDS], &rec) != REC_ADDED) {
+			fprintf(stderr, "gc: insert %u failed\n", i);
+			ret = -1;
+			goto out;
+		}
+		// there is no data behind the chunks here
+		chunk_pending_done(rec.chunk_idx);
+		chunk_ids[i] = rec.chunk_idx;
+	}
+
+	t = now_sec();
+	for (i = 0; i < n; i ++) {
+		if (i % 4 == 0)
+			continue;
+		release_fp(&fps[i * FP_WORDS], chunk_ids[i]);
+		dead ++;
+	}
+	report("gc", "release", dead, now_sec() - t);
+
+	// the scan alone, the dead queue is not used
+	t = now_sec();
+	freed = gc_scan_fp_table();
+	report("gc", "scan", n, now_sec() - t);
+
+	get_gc_stats(&gs);
+	get_index_stats(&is);
+	printf("%-10s %-8s %10u dead %10u freed %10u left dead %10llu records\n",
+			"gc", "check", dead, freed, gs.dead_records, is.records);
+	if (freed != dead || gs.dead_records != 0 || is.records != n - dead) {
+		fprintf(stderr, "gc: the scan left dead records behind\n");
+		ret = -1;
+	}
+
+out:
+	free(fps);
+	free(chunk_ids);
+	close_fp_table();
+	close_chunk_store();
+	unlink(path);
+	unlink(map_path);
+	unlink(ctr_path);
+	unlink(index_path);
+	return ret == 1 ? 0 : 1;
+}
+
+static int bench_spill(int argc, char *argv[])
+{
+	const char *path = "microbench_chunk_store";
+	const char *index_path = "microbench_fp_index";
+	char map_path[PATH_MAX], ctr_path[PATH_MAX];
+	unsigned int n = BUCKET_SIZE + BUCKET_SIZE / 4, i, found = 0, released = 0, freed;
+	unsigned int *fps, *chunk_ids;
+	struct index_stats is;
+	fp_record rec;
+	double t;
+	int ret = 1;
+
+	if (argc > 0)
+		n = strtoul(argv[0], NULL, 0);
+	if (n == 0 || n > (FP_SPILL_MAX + 1) * BUCKET_SIZE)
+		n = BUCKET_SIZE + BUCKET_SIZE / 4;
+
+	snprintf(map_path, PATH_MAX, "%s.map", path);
+	snprintf(ctr_path, PATH_MAX, "%s.ctr", path);
+	unlink(path);
+	unlink(map_path);
+	unlink(ctr_path);
+	unlink(index_path);
+	if (fp_engine_init(FP_SHA1) != 1 || init_chunk_store(path) != 1
+			|| init_fp_table(index_path) != 1)
+		return 1;
+
+	// the last word picks the bucket, all of them belong to bucket 0
+	fps = (unsigned int *)malloc(sizeof(unsigned int) * FP_WORDS * n);
+	chunk_ids = (unsigned int *)malloc(sizeof(unsigned int) * n);
+	t = now_sec();
+	for (i = 0; i < n; i ++) {
+		calc_hash((char *)&i, sizeof(i), &fps[i * FP_WORDS]);
+		fps[i * FP_WORDS + 4] = i * BUCKET_NUM;
+		if (search_fp(&fps[i * FP_WORDS], &rec) != REC_ADDED) {
+			fprintf(stderr, "spill: insert %u failed\n", i);
+			ret = -1;
+			goto out;
+		}
+		// there is no data behind the chunks here
+		chunk_pending_done(rec.chunk_idx);
+		chunk_ids[i] = rec.chunk_idx;
+	}
+	report("spill", "insert", n, now_sec() - t);
+
+	t = now_sec();
+	for (i = 0; i < n; i ++) {
+		if (search_fp(&fps[i * FP_WORDS], &rec) == REC_FOUND && rec.chunk_idx == chunk_ids[i])
+			found ++;
+	}
+	report("spill", "lookup", n, now_sec() - t);
+
+	// the insert and the lookup each took a reference
+	for (i = 0; i < n; i ++) {
+		if (release_fp(&fps[i * FP_WORDS], chunk_ids[i]) == 1
+				&& release_fp(&fps[i * FP_WORDS], chunk_ids[i]) == 0)
+			released ++;
+	}
+	freed = gc_fp_table(~0u);
+
+	get_index_stats(&is);
+	printf("%-10s %-8s %10u spilled %10u found %10u released %10u freed %10llu records\n",
+			"spill", "check", n > BUCKET_SIZE ? n - BUCKET_SIZE : 0, found, released, freed, is.records);
+	if (found != n || released != n || freed != n || is.records != 0) {
+		fprintf(stderr, "spill: records past the bucket were lost\n");
+		ret = -1;
+	}
+
+out:
+	free(fps);
+	free(chunk_ids);
+	close_fp_table();
+	close_chunk_store();
+	unlink(path);
+	unlink(map_path);
+	unlink(ctr_path);
+	unlink(index_path);
+	return ret == 1 ? 0 : 1;
+}
+
+#define STATS_THREADS_MAX 64
+
+struct stats_arg {
+	unsigned int n;
+	double sec;
+};
+
+static void *stats_thread(void *arg)
+{
+	struct stats_arg *a = (struct stats_arg *)arg;
+	unsigned int i;
+	double t;
+
+	t = now_sec();
+	for (i = 0; i < a->n; i ++)
+		op_done(OP_SEARCH_FP, op_start(), 0);
+	a->sec = now_sec() - t;
+	return NULL;
+}
+
+static void run_stats_phase(const char *phase, int enable, unsigned int n, int threads)
+{
+	struct stats_arg args[STATS_THREADS_MAX];
+	pthread_t tids[STATS_THREADS_MAX];
+	double sec = 0;
+	int i;
+
+	op_stats_enable(enable);
+	for (i = 0; i < threads; i ++) {
+		args[i].n = n;
+		pthread_create(&tids[i], NULL, stats_thread, &args[i]);
+	}
+	for (i = 0; i < threads; i ++) {
+		pthread_join(tids[i], NULL);
+		sec += args[i].sec;
+	}
+
+	printf("%-10s %-8s %10u ops %8.1f ns/op\n",
+			"stats", phase, n * threads, sec * 1e9 / ((double)n * threads));
+}
+
+static int bench_stats(int argc, char *argv[])
+{
+	struct op_summary s;
+	unsigned int n = 10000000;
+	int threads = 4;
+
+	if (argc > 0)
+		n = strtoul(argv[0], NULL, 0);
+	if (argc > 1)
+		threads = atoi(argv[1]);
+	if (threads < 1 || threads > STATS_THREADS_MAX)
+		threads = 4;
+
+	run_stats_phase("on", 1, n, threads);
+	run_stats_phase("off", 0, n, threads);
+
+	get_op_summary(OP_SEARCH_FP, &s);
+	printf("%-10s %llu ops, mean %llu p50 %llu p90 %llu p99 %llu p99.9 %llu max %llu ns\n",
+			op_name(OP_SEARCH_FP), s.count, s.count ? s.total_ns / s.count : 0,
+			s.p50, s.p90, s.p99, s.p999, s.max_ns);
+	return 0;
+}
+
+static void usage()
+{
+	fprintf(stderr, "usage:  microbench fp [n] [index_path]\n"
+			"        microbench prefetch [n] [cache_mb]\n"
+			"        microbench bloom [n] [bloom_mb]\n"
+			"        microbench sparse [n] [hooks_mb] [sample_bits]\n"
+			"        microbench store [n] [store_path]\n"
+			"        microbench cdc [mb]\n"
+			"        microbench hash [mb] [threads]\n"
+			"        microbench container [n] [threads]\n"
+			"        microbench compress [mb]\n"
+			"        microbench cache [n] [cache_mb]\n"
+			"        microbench alloc [n] [threads]\n"
+			"        microbench gc [n]\n"
+			"        microbench spill [n]\n"
+			"        microbench stats [n] [threads]\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2)
+		usage();
+
+	if (strcmp(argv[1], "fp") == 0)
+		return bench_fp(argc - 2, argv + 2);
+	if (strcmp(argv[1], "prefetch") == 0)
+		return bench_prefetch(argc - 2, argv + 2);
+	if (strcmp(argv[1], "bloom") == 0)
+		return bench_bloom(argc - 2, argv + 2);
+	if (strcmp(argv[1], "sparse") == 0)
+		return bench_sparse(argc - 2, argv + 2);
+	if (strcmp(argv[1], "store") == 0)
+		return bench_store(argc - 2, argv + 2);
+	if (strcmp(argv[1], "cdc") == 0)
+		return bench_cdc(argc - 2, argv + 2);
+	if (strcmp(argv[1], "hash") == 0)
+		return bench_hash(argc - 2, argv + 2);
+	if (strcmp(argv[1], "container") == 0)
+		return bench_container(argc - 2, argv + 2);
+	if (strcmp(argv[1], "compress") == 0)
+		return bench_compress(argc - 2, argv + 2);
+	if (strcmp(argv[1], "cache") == 0)
+		return bench_cache(argc - 2, argv + 2);
+	if (strcmp(argv[1], "alloc") == 0)
+		return bench_alloc(argc - 2, argv + 2);
+	if (strcmp(argv[1], "gc") == 0)
+		return bench_gc(argc - 2, argv + 2);
+	if (strcmp(argv[1], "spill") == 0)
+		return bench_spill(argc - 2, argv + 2);
+	if (strcmp(argv[1], "stats") == 0)
+		return bench_stats(argc - 2, argv + 2);
+
+	usage();
+	return 1;
+}
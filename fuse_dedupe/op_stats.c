@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "op_stats.h"
+
+struct op_counter {
+	unsigned long long count;
+	unsigned long long bytes;
+	unsigned long long total_ns;
+	unsigned long long max_ns;
+	unsigned long long hist[OP_HIST_BUCKETS];
+};
+
+// the counters of one thread.  Only the thread writes them, with relaxed
+// stores the reader may load at any time
+struct op_slab {
+	struct op_counter ops[OP_NUM];
+	int in_use;
+	struct op_slab *next;
+};
+
+static const char *op_names[OP_NUM] = {
+	"read", "write", "getattr", "search_fp", "calc_hash", "read_chunk", "write_chunk"
+};
+
+static int timing = 1;
+static __thread struct op_slab *my_slab = NULL;
+static struct op_slab *slabs = NULL;
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t slab_key;
+static pthread_once_t slab_key_once = PTHREAD_ONCE_INIT;
+
+void op_stats_enable(int enable) {
+	timing = enable;
+}
+
+const char *op_name(int op) {
+	return op >= 0 && op < OP_NUM ? op_names[op] : "unknown";
+}
+
+static void slab_exit(void *arg) {
+	struct op_slab *slab = (struct op_slab *)arg;
+
+	pthread_mutex_lock(&slab_lock);
+	slab->in_use = 0;
+	pthread_mutex_unlock(&slab_lock);
+}
+
+static void slab_key_init(void) {
+	pthread_key_create(&slab_key, slab_exit);
+}
+
+// the slab of this thread, one left by a thread that exited or a new one
+static struct op_slab *get_slab(void) {
+	struct op_slab *slab;
+
+	pthread_once(&slab_key_once, slab_key_init);
+	pthread_mutex_lock(&slab_lock);
+	for (slab = slabs; slab != NULL && slab->in_use; slab = slab->next)
+		;
+	if (slab == NULL) {
+		slab = (struct op_slab *)calloc(1, sizeof(struct op_slab));
+		if (slab == NULL) {
+			pthread_mutex_unlock(&slab_lock);
+			return NULL;
+		}
+		slab->next = slabs;
+		slabs = slab;
+	}
+	slab->in_use = 1;
+	pthread_mutex_unlock(&slab_lock);
+
+	pthread_setspecific(slab_key, slab);
+	my_slab = slab;
+	return slab;
+}
+
+// bucket of a latency, values below 2 * OP_HIST_SUB have one each
+static unsigned int hist_bucket(unsigned long long ns) {
+	unsigned int e;
+
+	if (ns < OP_HIST_SUB)
+		return ns;
+	e = 63 - __builtin_clzll(ns);
+	if (e >= OP_HIST_MAX_BITS)
+		return OP_HIST_BUCKETS - 1;
+	return (e - OP_HIST_SUB_BITS + 1) * OP_HIST_SUB + ((ns >> (e - OP_HIST_SUB_BITS)) & (OP_HIST_SUB - 1));
+}
+
+// highest latency that falls in bucket b
+static unsigned long long hist_value(unsigned int b) {
+	unsigned int e;
+
+	if (b < 2 * OP_HIST_SUB)
+		return b;
+	e = b / OP_HIST_SUB + OP_HIST_SUB_BITS - 1;
+	return ((unsigned long long)(OP_HIST_SUB + b % OP_HIST_SUB + 1) << (e - OP_HIST_SUB_BITS)) - 1;
+}
+
+unsigned long long op_start(void) {
+	struct timespec ts;
+
+	if (!timing)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#define BUMP(x, n) __atomic_store_n(&(x), (x) + (n), __ATOMIC_RELAXED)
+
+void op_done(int op, unsigned long long start, unsigned long long bytes) {
+	struct op_slab *slab = my_slab;
+	struct op_counter *c;
+	unsigned long long ns;
+
+	if (start == 0)
+		return;
+	ns = op_start() - start;
+	if (slab == NULL && (slab = get_slab()) == NULL)
+		return;
+
+	c = &slab->ops[op];
+	BUMP(c->count, 1);
+	BUMP(c->bytes, bytes);
+	BUMP(c->total_ns, ns);
+	if (ns > c->max_ns)
+		__atomic_store_n(&c->max_ns, ns, __ATOMIC_RELAXED);
+	BUMP(c->hist[hist_bucket(ns)], 1);
+}
+
+// the latency below which per_mille of the seen ones are, no more than max
+static unsigned long long hist_percentile(const unsigned long long *hist, unsigned long long seen,
+		unsigned int per_mille, unsigned long long max) {
+	unsigned long long below = 0;
+	unsigned int b;
+
+	for (b = 0; b < OP_HIST_BUCKETS && seen > 0; b ++) {
+		below += hist[b];
+		if (below * 1000 >= seen * per_mille)
+			return hist_value(b) < max ? hist_value(b) : max;
+	}
+	return 0;
+}
+
+// the histogram of op summed over the slabs, and its summary
+static void merge_op(int op, unsigned long long *hist, struct op_summary *s) {
+	unsigned long long seen = 0, max;
+	struct op_slab *slab;
+	struct op_counter *c;
+	unsigned int b;
+
+	memset(s, 0, sizeof(*s));
+	memset(hist, 0, sizeof(unsigned long long) * OP_HIST_BUCKETS);
+	pthread_mutex_lock(&slab_lock);
+	for (slab = slabs; slab != NULL; slab = slab->next) {
+		c = &slab->ops[op];
+		s->count += __atomic_load_n(&c->count, __ATOMIC_RELAXED);
+		s->bytes += __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+		s->total_ns += __atomic_load_n(&c->total_ns, __ATOMIC_RELAXED);
+		max = __atomic_load_n(&c->max_ns, __ATOMIC_RELAXED);
+		if (max > s->max_ns)
+			s->max_ns = max;
+		for (b = 0; b < OP_HIST_BUCKETS; b ++)
+			hist[b] += __atomic_load_n(&c->hist[b], __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&slab_lock);
+
+	// the counts are loaded one by one, the percentiles go by the
+	// histogram and not by count
+	for (b = 0; b < OP_HIST_BUCKETS; b ++)
+		seen += hist[b];
+	s->p50 = hist_percentile(hist, seen, 500, s->max_ns);
+	s->p90 = hist_percentile(hist, seen, 900, s->max_ns);
+	s->p99 = hist_percentile(hist, seen, 990, s->max_ns);
+	s->p999 = hist_percentile(hist, seen, 999, s->max_ns);
+}
+
+void get_op_summary(int op, struct op_summary *s) {
+	unsigned long long hist[OP_HIST_BUCKETS];
+
+	merge_op(op, hist, s);
+}
+
+static void out_printf(struct stats_out *out, const char *format, ...) {
+	va_list ap;
+	size_t size;
+	char *buf;
+	int n;
+
+	if (out->failed)
+		return;
+	while (1) {
+		va_start(ap, format);
+		n = vsnprintf(out->buf + out->len, out->size - out->len, format, ap);
+		va_end(ap);
+		if (n < 0) {
+			out->failed = 1;
+			return;
+		}
+		if (out->len + n < out->size)
+			break;
+
+		size = out->size ? out->size * 2 : 4096;
+		while (size <= out->len + n)
+			size *= 2;
+		buf = (char *)realloc(out->buf, size);
+		if (buf == NULL) {
+			out->failed = 1;
+			return;
+		}
+		out->buf = buf;
+		out->size = size;
+	}
+	out->len += n;
+}
+
+void stats_begin(struct stats_out *out, int json) {
+	memset(out, 0, sizeof(*out));
+	out->json = json;
+	out->buf = (char *)malloc(4096);
+	if (out->buf == NULL) {
+		out->failed = 1;
+		return;
+	}
+	out->size = 4096;
+	out->buf[0] = 0;
+	if (json)
+		out_printf(out, "{");
+}
+
+void stats_section(struct stats_out *out, const char *name) {
+	if (out->json)
+		out_printf(out, "%s\n  \"%s\": {", out->sections ? "}," : "", name);
+	out->section = name;
+	out->sections ++;
+	out->fields = 0;
+}
+
+// the key of a field, the value goes after it
+static void out_key(struct stats_out *out, const char *key) {
+	if (out->json)
+		out_printf(out, "%s\"%s\": ", out->fields ? ", " : "", key);
+	else
+		out_printf(out, "%s.%s ", out->section, key);
+	out->fields ++;
+}
+
+void stats_u64(struct stats_out *out, const char *key, unsigned long long value) {
+	out_key(out, key);
+	out_printf(out, out->json ? "%llu" : "%llu\n", value);
+}
+
+void stats_double(struct stats_out *out, const char *key, double value) {
+	out_key(out, key);
+	out_printf(out, out->json ? "%.4f" : "%.4f\n", value);
+}
+
+char *stats_finish(struct stats_out *out, size_t *len) {
+	if (out->json)
+		out_printf(out, "%s\n}\n", out->sections ? "}" : "");
+	if (out->failed) {
+		free(out->buf);
+		out->buf = NULL;
+		return NULL;
+	}
+	*len = out->len;
+	return out->buf;
+}
+
+void op_stats_report(struct stats_out *out) {
+	unsigned long long hist[OP_HIST_BUCKETS];
+	struct op_summary s;
+	unsigned int b, n;
+	int op;
+
+	for (op = 0; op < OP_NUM; op ++) {
+		merge_op(op, hist, &s);
+		stats_section(out, op_names[op]);
+		stats_u64(out, "count", s.count);
+		stats_u64(out, "bytes", s.bytes);
+		stats_u64(out, "mean_ns", s.count ? s.total_ns / s.count : 0);
+		stats_u64(out, "p50_ns", s.p50);
+		stats_u64(out, "p90_ns", s.p90);
+		stats_u64(out, "p99_ns", s.p99);
+		stats_u64(out, "p999_ns", s.p999);
+		stats_u64(out, "max_ns", s.max_ns);
+		if (!out->json)
+			continue;
+
+		// the buckets that are not empty, as [highest ns, count]
+		out_key(out, "histogram");
+		out_printf(out, "[");
+		for (b = 0, n = 0; b < OP_HIST_BUCKETS; b ++) {
+			if (hist[b] == 0)
+				continue;
+			out_printf(out, "%s[%llu, %llu]", n ? ", " : "", hist_value(b), hist[b]);
+			n ++;
+		}
+		out_printf(out, "]");
+	}
+}
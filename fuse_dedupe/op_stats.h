@@ -0,0 +1,78 @@
+#ifndef OP_STATS_H_
+#define OP_STATS_H_
+
+#include <stddef.h>
+
+// counters and latency histograms of the operations of the mount.  A
+// thread counts into a slab of its own, so an operation shares no line
+// with other threads, and the slabs are summed when the stats are read.
+// The slab of a thread that exited is taken by the next one, its counts
+// stay in the sums.
+//
+// The histograms are log-linear like HdrHistogram: OP_HIST_SUB buckets
+// for every power of two of ns, a percentile is off by 1/OP_HIST_SUB of
+// the latency at most.  Latencies of 2^OP_HIST_MAX_BITS ns and more are
+// in the last bucket
+#define OP_HIST_SUB_BITS 4
+#define OP_HIST_SUB (1 << OP_HIST_SUB_BITS)
+#define OP_HIST_MAX_BITS 36
+#define OP_HIST_BUCKETS ((OP_HIST_MAX_BITS - OP_HIST_SUB_BITS + 1) * OP_HIST_SUB)
+
+enum op_id {
+	OP_READ,		// bb_read() and bb_read_buf()
+	OP_WRITE,		// bb_write_dedupe() and bb_write_buf()
+	OP_GETATTR,		// bb_getattr() and bb_fgetattr_dedupe()
+	OP_SEARCH_FP,
+	OP_CALC_HASH,		// one for every chunk hashed
+	OP_READ_CHUNK,		// read_chunk() and read_chunks()
+	OP_WRITE_CHUNK,		// write_chunk() and write_chunks()
+	OP_NUM
+};
+
+struct op_summary {
+	unsigned long long count;
+	unsigned long long bytes;
+	unsigned long long total_ns;
+	unsigned long long max_ns;
+	unsigned long long p50, p90, p99, p999;
+};
+
+// on by default, -o stats=0 turns the clock off.  op_start() then returns
+// 0 and op_done() counts nothing
+void op_stats_enable(int enable);
+
+// the monotonic clock in ns at the start of an operation
+unsigned long long op_start(void);
+
+// the operation op that started at start is done, it moved bytes
+void op_done(int op, unsigned long long start, unsigned long long bytes);
+
+const char *op_name(int op);
+
+// the sums of all threads for op
+void get_op_summary(int op, struct op_summary *s);
+
+// the stats file, as text lines of "section.key value" or as one JSON
+// object with an object for every section.  stats_finish() returns the
+// text, the caller frees it, or NULL if memory ran out
+struct stats_out {
+	char *buf;
+	size_t len;
+	size_t size;
+	int json;
+	int sections;
+	int fields;
+	const char *section;
+	int failed;
+};
+
+void stats_begin(struct stats_out *out, int json);
+void stats_section(struct stats_out *out, const char *name);
+void stats_u64(struct stats_out *out, const char *key, unsigned long long value);
+void stats_double(struct stats_out *out, const char *key, double value);
+char *stats_finish(struct stats_out *out, size_t *len);
+
+// a section for every operation, with its histogram in JSON
+void op_stats_report(struct stats_out *out);
+
+#endif
@@ -26,6 +26,14 @@
 struct bb_state {
     FILE *logfile;
     char *rootdir;
+    // CHUNK_FIXED or CHUNK_CDC, from -o chunking=
+    int chunking;
+    // hashing threads to start in bb_init, from -o hash_threads=
+    int hash_threads;
+    // seconds between garbage collection passes, from -o gc_interval=
+    unsigned int gc_interval;
+    // read_buf hands out ranges of the store, from -o splice=
+    int splice;
 };
 #define BB_DATA ((struct bb_state *) fuse_get_context()->private_data)
 
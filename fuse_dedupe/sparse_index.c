@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sparse_index.h"
+#include "chunk_container.h"
+#include "fp_cache.h"
+
+typedef struct sparse_header {
+	char magic[8];
+	unsigned int version;
+	unsigned int sample_bits;
+	unsigned long long sets;
+} sparse_header;
+
+// a hook, key[0] is 0 for an empty entry.  cid[0] is the container it
+// was seen in last
+typedef struct sparse_entry {
+	unsigned int key[2];
+	unsigned int cid[SPARSE_HOOK_CIDS];
+} sparse_entry;
+
+typedef struct sparse_shard {
+	pthread_mutex_t lock;
+	unsigned long long lookups, hits, hooks;
+} sparse_shard;
+
+static int hooks_fd = -1;
+static sparse_header *hooks_hdr = NULL;
+static sparse_entry *entries = NULL;
+static size_t hooks_len = 0;
+static unsigned long long set_mask = 0;
+static unsigned int sample_shift = 32;
+static sparse_shard shards[SPARSE_SHARDS];
+static unsigned long long segments = 0, champions = 0;
+
+// hooks are picked by the top bits of fp[0], the index takes its line
+// from the low ones.  The set by fp[1], the key from fp[2] and fp[3]
+static int is_hook(const unsigned int *fp) {
+	return sample_shift >= 32 || (fp[0] >> sample_shift) == 0;
+}
+
+static unsigned long long set_of(const unsigned int *fp) {
+	return fp[1] & set_mask;
+}
+
+static sparse_shard *shard_of(unsigned long long set) {
+	return &shards[set % SPARSE_SHARDS];
+}
+
+static sparse_entry *find_hook(unsigned long long set, const unsigned int *fp) {
+	sparse_entry *e = &entries[set * SPARSE_WAYS];
+	int i;
+
+	for (i = 0; i < SPARSE_WAYS; i ++) {
+		if (e[i].key[0] == (fp[2] | 1) && e[i].key[1] == fp[3])
+			return &e[i];
+	}
+	return NULL;
+}
+
+int init_sparse_index(const char *path, unsigned int hooks_mb, unsigned int sample_bits) {
+	unsigned long long sets;
+	struct stat st;
+	char *base;
+	int i;
+
+	if (hooks_mb == 0 || sample_bits >= 32) {
+		fprintf(stderr, "Sparse index needs hooks and a sample below 32 bits!\n");
+		return -1;
+	}
+
+	// a power of two sets, as many as fit in hooks_mb
+	for (sets = 1; sets * 2 * SPARSE_WAYS * sizeof(sparse_entry) <= ((unsigned long long)hooks_mb << 20); sets *= 2)
+		;
+	hooks_len = SPARSE_HDR_SIZE + sets * SPARSE_WAYS * sizeof(sparse_entry);
+
+	hooks_fd = open(path, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR | S_IRGRP | S_IWGRP);
+	if (hooks_fd < 0) {
+		fprintf(stderr, "Failed to open sparse index!\n");
+		return -1;
+	}
+
+	if (fstat(hooks_fd, &st) < 0) {
+		fprintf(stderr, "Failed to stat sparse index!\n");
+		goto fail;
+	}
+
+	// a table of another size starts over empty
+	if ((size_t)st.st_size != hooks_len
+			&& (ftruncate(hooks_fd, 0) < 0 || ftruncate(hooks_fd, hooks_len) < 0)) {
+		fprintf(stderr, "Failed to size sparse index!\n");
+		goto fail;
+	}
+
+	base = mmap(NULL, hooks_len, PROT_READ | PROT_WRITE, MAP_SHARED, hooks_fd, 0);
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "Failed to map sparse index!\n");
+		goto fail;
+	}
+	hooks_hdr = (sparse_header *)base;
+	entries = (sparse_entry *)(base + SPARSE_HDR_SIZE);
+	set_mask = sets - 1;
+	sample_shift = 32 - sample_bits;
+
+	// hooks of another sample rate are of no use
+	if (memcmp(hooks_hdr->magic, SPARSE_MAGIC, sizeof(hooks_hdr->magic)) != 0
+			|| hooks_hdr->version != SPARSE_VERSION
+			|| hooks_hdr->sample_bits != sample_bits
+			|| hooks_hdr->sets != sets) {
+		if ((size_t)st.st_size == hooks_len)
+			memset(entries, 0, sets * SPARSE_WAYS * sizeof(sparse_entry));
+		memcpy(hooks_hdr->magic, SPARSE_MAGIC, sizeof(hooks_hdr->magic));
+		hooks_hdr->version = SPARSE_VERSION;
+		hooks_hdr->sample_bits = sample_bits;
+		hooks_hdr->sets = sets;
+	}
+
+	for (i = 0; i < SPARSE_SHARDS; i ++) {
+		pthread_mutex_init(&shards[i].lock, NULL);
+		shards[i].lookups = shards[i].hits = shards[i].hooks = 0;
+	}
+	segments = champions = 0;
+	return 1;
+
+fail:
+	close(hooks_fd);
+	hooks_fd = -1;
+	return -1;
+}
+
+void close_sparse_index() {
+	if (hooks_hdr == NULL)
+		return;
+
+	msync(hooks_hdr, hooks_len, MS_SYNC);
+	munmap(hooks_hdr, hooks_len);
+	close(hooks_fd);
+	hooks_hdr = NULL;
+	entries = NULL;
+	hooks_fd = -1;
+}
+
+int sparse_index_enabled() {
+	return hooks_hdr != NULL;
+}
+
+// a container a hook of the segment points at, and its votes
+struct candidate {
+	unsigned int cid;
+	unsigned int votes;
+};
+
+static void vote(struct candidate *c, unsigned int *num, unsigned int cid) {
+	unsigned int i;
+
+	for (i = 0; i < *num; i ++) {
+		if (c[i].cid == cid) {
+			c[i].votes ++;
+			return;
+		}
+	}
+	c[*num].cid = cid;
+	c[*num].votes = 1;
+	*num += 1;
+}
+
+void sparse_segment(const unsigned int *fps, unsigned int n) {
+	struct candidate c[SPARSE_SEGMENT_HOOKS * SPARSE_HOOK_CIDS], t;
+	unsigned int i, j, num = 0, looked = 0, best;
+	unsigned long long set;
+	sparse_shard *s;
+	sparse_entry *e;
+
+	if (hooks_hdr == NULL)
+		return;
+
+	__atomic_add_fetch(&segments, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < n && looked < SPARSE_SEGMENT_HOOKS; i ++) {
+		if (!is_hook(&fps[i * FP_WORDS]))
+			continue;
+		looked ++;
+
+		set = set_of(&fps[i * FP_WORDS]);
+		s = shard_of(set);
+		pthread_mutex_lock(&s->lock);
+		s->lookups ++;
+		e = find_hook(set, &fps[i * FP_WORDS]);
+		if (e != NULL) {
+			s->hits ++;
+			for (j = 0; j < SPARSE_HOOK_CIDS; j ++) {
+				if (e->cid[j] != CONTAINER_NONE)
+					vote(c, &num, e->cid[j]);
+			}
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	// the containers with the most votes are the champions, their
+	// fingerprints go to the cache
+	for (i = 0; i < SPARSE_CHAMPIONS && i < num; i ++) {
+		best = i;
+		for (j = i + 1; j < num; j ++) {
+			if (c[j].votes > c[best].votes)
+				best = j;
+		}
+		if (best != i) {
+			t = c[i];
+			c[i] = c[best];
+			c[best] = t;
+		}
+		fp_cache_prefetch(c[i].cid * CONTAINER_CHUNKS);
+		__atomic_add_fetch(&champions, 1, __ATOMIC_RELAXED);
+	}
+}
+
+void sparse_hook(const unsigned int *fp, unsigned int chunk_idx) {
+	unsigned int cid = container_id(chunk_idx);
+	unsigned long long set;
+	sparse_shard *s;
+	sparse_entry *e;
+	int i;
+
+	if (hooks_hdr == NULL || !is_hook(fp))
+		return;
+
+	set = set_of(fp);
+	s = shard_of(set);
+	pthread_mutex_lock(&s->lock);
+	e = find_hook(set, fp);
+	if (e == NULL) {
+		// an empty way, or one picked by the fingerprint
+		e = &entries[set * SPARSE_WAYS];
+		for (i = 0; i < SPARSE_WAYS && e[i].key[0] != 0; i ++)
+			;
+		e = &e[i < SPARSE_WAYS ? i : fp[4] % SPARSE_WAYS];
+		e->key[0] = fp[2] | 1;
+		e->key[1] = fp[3];
+		e->cid[0] = cid;
+		for (i = 1; i < SPARSE_HOOK_CIDS; i ++)
+			e->cid[i] = CONTAINER_NONE;
+		s->hooks ++;
+	} else if (e->cid[0] != cid) {
+		for (i = SPARSE_HOOK_CIDS - 1; i > 0; i --)
+			e->cid[i] = e->cid[i - 1];
+		e->cid[0] = cid;
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+void get_sparse_stats(struct sparse_stats *stats) {
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	if (hooks_hdr == NULL)
+		return;
+
+	for (i = 0; i < SPARSE_SHARDS; i ++) {
+		pthread_mutex_lock(&shards[i].lock);
+		stats->lookups += shards[i].lookups;
+		stats->hits += shards[i].hits;
+		stats->hooks += shards[i].hooks;
+		pthread_mutex_unlock(&shards[i].lock);
+	}
+	stats->segments = __atomic_load_n(&segments, __ATOMIC_RELAXED);
+	stats->champions = __atomic_load_n(&champions, __ATOMIC_RELAXED);
+	stats->bytes = (set_mask + 1) * SPARSE_WAYS * sizeof(sparse_entry);
+}
@@ -0,0 +1,65 @@
+#ifndef SPARSE_INDEX_H_
+#define SPARSE_INDEX_H_
+
+#include "fingerprint.h"
+
+// sparse indexing, for stores whose fingerprints do not fit in memory.
+// Only sampled fingerprints, the hooks, are kept, each with the last
+// containers it was stored or found in.  The container metadata sections
+// are the segment manifests.
+//
+// The chunks of a write are a segment.  Its hooks vote for the containers
+// they point at, the SPARSE_CHAMPIONS containers with the most votes are
+// loaded into the fingerprint cache, and the chunks of the segment are
+// only looked up there.  A chunk that is in no champion, or in none the
+// cache still holds, is stored again even if the index has it: the index
+// keeps the reference counts of every chunk but is not searched.
+//
+// A fingerprint is a hook when its top sample_bits bits are 0, one in
+// 2^sample_bits chunks.  The hooks are kept in a set associative table of
+// hooks_mb MB mapped from <index>.hooks, a full set drops a hook.  The
+// table is only a hint, a lost or stale hook costs dedupe and nothing else
+#define SPARSE_MAGIC "DDHOOKS"
+#define SPARSE_VERSION 1
+#define SPARSE_HDR_SIZE 4096
+
+#define SPARSE_HOOK_CIDS 2
+#define SPARSE_WAYS 4
+#define SPARSE_SHARDS 64
+#define SPARSE_CHAMPIONS 4
+// hooks of a segment that are looked up, the rest are only stored
+#define SPARSE_SEGMENT_HOOKS 64
+
+// defaults for -o hooks= and -o sample=.  At 4 KB chunks 1 TB stored
+// has 4M hooks, 64 MB at 16 bytes a hook
+#define SPARSE_HOOKS_MB 64
+#define SPARSE_SAMPLE_BITS 6
+
+struct sparse_stats {
+	unsigned long long segments;
+	unsigned long long lookups;	// hooks of the segments
+	unsigned long long hits;	// hooks that were in the table
+	unsigned long long champions;	// containers loaded for segments
+	unsigned long long hooks;	// hooks stored
+	unsigned long long bytes;
+};
+
+// map the hook table at path and turn sparse indexing on, returns 1 on
+// success
+int init_sparse_index(const char *path, unsigned int hooks_mb, unsigned int sample_bits);
+
+void close_sparse_index();
+
+// 1 if the index is sparse, search_fp() then only searches the
+// fingerprint cache
+int sparse_index_enabled();
+
+// the n fingerprints of a segment are looked up next, load its champions
+void sparse_segment(const unsigned int *fps, unsigned int n);
+
+// fp was found or stored at chunk_idx, a hook keeps its container
+void sparse_hook(const unsigned int *fp, unsigned int chunk_idx);
+
+void get_sparse_stats(struct sparse_stats *stats);
+
+#endif